@@ -1,13 +1,58 @@
+#include <algorithm>
+#include <list>
+#include <set>
+#include <pthread.h>
+#include <unistd.h>
 #include "globalconfig.h"
 #include "core.h"
+#include "corebatchcheck.h"
 #include "dbcomm.h"
 #include "runinfo.h"
 #include "error.h"
+#include "coreerror.h"
 #include "common.h"
 #include "decode.h"
 
 extern GlobalConfig* gPtrConfig; // 配置文件
 
+//死锁重试统计
+static CCore::RetryStat s_retryStat = {0, 0, 0, 0};
+static pthread_mutex_t s_retryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//提交后处理出错次数和批量写统计，受s_retryMutex保护
+static LONG s_lAfterCommitFail = 0;
+static CCorePipeline::Stat s_pipeStat = {0, 0};
+
+//MySQL服务端错误号，同mysqld_error.h的ER_LOCK_WAIT_TIMEOUT、ER_LOCK_DEADLOCK
+static const int MYSQL_LOCK_WAIT_TIMEOUT = 1205;
+static const int MYSQL_LOCK_DEADLOCK = 1213;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+//账户币种缓存：币种开户后不变，每个分区的账户每个进程只查一次，超过上限整体清空
+static map<pair<CCoreDBPool*, LONG>, string> s_mapAcctCur;
+static pthread_rwlock_t s_acctCurLock = PTHREAD_RWLOCK_INITIALIZER;
+static const size_t MAX_ACCT_CUR = 1000000;
+
+//锁冲突重试前退避：指数退避加随机抖动，错开冲突双方
+static void retryBackoff(const int iRetry)
+{
+    static __thread unsigned int t_iSeed = 0;
+    if(0 == t_iSeed) t_iSeed = getpid() ^ (unsigned int)pthread_self();
+
+    int iBackoff = (5000 << iRetry);
+    usleep(iBackoff / 2 + rand_r(&t_iSeed) % iBackoff);
+}
+
+int CCore::m_iMaxRetry = 3;
+bool CCoreFlow::m_bCompact = false;
+bool CCorePipeline::m_bBatch = true;
+
 /*****************
  * 核心对外接口类 *
 ******************/
@@ -15,7 +60,9 @@ extern GlobalConfig* gPtrConfig; // 配置文件
 // 构造函数
 CCore::CCore()
 {  
-    m_ptrSql = getCoreDBHandle();
+    m_ptrSql = getCoreLeaseHandle();
+    m_iReqType = 0;
+    m_iFromType = 0;
 }
 
 //析构函数
@@ -25,17 +72,15 @@ CCore::~CCore()
 }
 
 //比较凭证的关键参数
-void CCore::checkProof(CCoreProof& proof)
+void CCore::checkProof(const string& strReqSign, const int req_type)
 {   
-    //生成行签名
-    proof.genProofSign();
     //比较签名
-    if(m_proof.Fproof_sign != proof.Fproof_sign)
+    if(m_proof.Fproof_sign != strReqSign)
     {
         throw CException(ERR_PARARM_DIFFER, "core proof: reentry but params differ", __FILE__, __LINE__);
     }
     //流转凭证状态
-    checkProofState(proof.Ftype);
+    checkProofState(req_type);
 }
 
 //流转凭证状态
@@ -46,15 +91,29 @@ void CCore::checkProofState(const int req_type)
     {
         if(req_type == CCoreProof::TYPE_suc_unfreeze || req_type == CCoreProof::TYPE_fail_unfreeze)
         {
-            m_proof.Ftype = req_type;
-            m_proof.Fstate = CCoreProof::STATE_before; //将凭证置为使用前
-            m_proof.reset();
+            //状态流转放到记账事务内完成，不再单独重置凭证
+            m_iFromType = CCoreProof::TYPE_freeze;
         }
         else
         {
             throw CException(ERR_BAD_BRANCH, "core proof is in freeze state", __FILE__, __LINE__);
         }
     }  
+    //分次解冻已解冻完：子凭证存在为重入，否则已无冻结金额
+    else if(m_proof.Fstate == CCoreProof::STATE_after && m_proof.Fsub_seq > 0)
+    {
+        int iSubType = 0;
+        LONG lSubAmount = 0;
+        if(!m_proof.querySub(iSubType, lSubAmount))
+        {
+            throw CException(ERR_LACK_CON, "core proof: nothing left to unfreeze", __FILE__, __LINE__);
+        }
+        if(iSubType != req_type || lSubAmount != m_proof.Fsub_amount)
+        {
+            throw CException(ERR_PARARM_DIFFER, "core proof: reentry but sub proof differ", __FILE__, __LINE__);
+        }
+        throw CException(ERR_ALREADY_SUCCESS, "core sub proof already success", __FILE__, __LINE__);
+    }
     //记账完成、解冻完成的凭证不能再继续操作
     else if(m_proof.Fstate == CCoreProof::STATE_after)
     {
@@ -68,109 +127,168 @@ void CCore::checkProofState(const int req_type)
 
 }
 
-//根据凭证类型记账
-void CCore::dealProof()
+//获取死锁重试统计
+void CCore::getRetryStat(RetryStat& stat)
 {
-    if(m_proof.Ftype == CCoreProof::TYPE_direct)
-    {
-        dealDirect();
-    }
-    else if(m_proof.Ftype == CCoreProof::TYPE_freeze)
-    {
-        dealFreeze();
-    }
-    else if(m_proof.Ftype == CCoreProof::TYPE_suc_unfreeze)
+    pthread_mutex_lock(&s_retryMutex);
+    stat = s_retryStat;
+    pthread_mutex_unlock(&s_retryMutex);
+}
+
+//是否锁冲突，CMySQL查询失败时以mysql_errno()作为异常错误码
+bool CCore::isLockConflict(const CException& e, RetryStat& stat)
+{
+    if(e.error() == MYSQL_LOCK_DEADLOCK)
     {
-        dealSucUnfreeze();
+        stat.lDeadlock++;
+        return true;
     }
-    else if(m_proof.Ftype == CCoreProof::TYPE_fail_unfreeze)
+    if(e.error() == MYSQL_LOCK_WAIT_TIMEOUT)
     {
-        dealFailUnfreeze();
+        stat.lLockTimeout++;
+        return true;
     }
-    else
+    return false;
+}
+
+//记账，死锁或锁超时时整体重试
+void CCore::dealProof()
+{
+    for(int iRetry = 0; ; ++iRetry)
     {
-        throw CException(ERR_BAD_BRANCH, "core proof: wrong type", __FILE__, __LINE__);
+        try
+        {
+            dealByType();
+            return;
+        }
+        catch(CException& e)
+        {
+            RetryStat stat = {0, 0, 0, 0};
+            bool bConflict = isLockConflict(e, stat);
+
+            pthread_mutex_lock(&s_retryMutex);
+            s_retryStat.lDeadlock += stat.lDeadlock;
+            s_retryStat.lLockTimeout += stat.lLockTimeout;
+            if(bConflict && iRetry < m_iMaxRetry) s_retryStat.lRetry++;
+            if(bConflict && iRetry >= m_iMaxRetry) s_retryStat.lGiveUp++;
+            pthread_mutex_unlock(&s_retryMutex);
+
+            if(!bConflict || iRetry >= m_iMaxRetry) throw;
+        }
+
+        retryBackoff(iRetry);
     }
 }
 
-//直接处理余额
-void CCore::dealDirect()
+//执行一条记账分录
+template <int OP1, int OP2> void CCore::postLeg(CCoreAcct& acct, const CCoreAcct& counter, const LONG lAmount)
 {
-    //初始化账户
-    CCoreAcct debit(m_proof.Fdebit_uid);
-    CCoreAcct debit_gl(m_proof.Fdebit_gl_uid);
-    
-    CCoreAcct credit(m_proof.Fcredit_uid);
-    CCoreAcct credit_gl(m_proof.Fcredit_gl_uid);
+    acct.setCounter(counter.Fuid, counter.Fuin);
+    acct.setProofInfo(m_proof);
+    acct.post<OP1>(lAmount);
+    acct.post<OP2>(lAmount);
+}
+
+//取本事务内uid对应的账户对象，同一uid的多个位置共用一个，变动依次累加
+static CCoreAcct& sharedAcct(list<CCoreAcct>& lstAcct, map<LONG, CCoreAcct*>& mapAcct,
+    const LONG uid, CCorePipeline* ptrPipe, const bool bGL)
+{
+    map<LONG, CCoreAcct*>::iterator it = mapAcct.find(uid);
+    if(it != mapAcct.end()) return *it->second;
 
-    CCoreAcct debit_ex(m_proof.Fdebit_ex_uid);
-    CCoreAcct debit_exgl(m_proof.Fdebit_exgl_uid);
+    lstAcct.push_back(CCoreAcct(uid, ptrPipe));
+    lstAcct.back().setGL(bGL);
+    mapAcct[uid] = &lstAcct.back();
+    return lstAcct.back();
+}
+
+//按凭证记账规则处理
+template <int TYPE> void CCore::dealPosting()
+{
+    typedef CPostRule<TYPE> RULE;
 
-    CCoreAcct credit_ex(m_proof.Fcredit_ex_uid);
-    CCoreAcct credit_exgl(m_proof.Fcredit_exgl_uid);
+    CCorePipeline pipe;
+    list<CCoreAcct> lstAcct; //本事务的账户，元素地址不变
+    map<LONG, CCoreAcct*> mapAcct;
     
     try
     {
         m_ptrSql->Begin();
 
         //锁单
-        m_proof.queryProof(true);
+        lockProof();
 
-        //锁账户表
-        debit.queryAcctInfo(true);
-        credit.queryAcctInfo(true);
-        debit_gl.queryAcctInfo(true);
-        credit_gl.queryAcctInfo(true);
+        //处理附加账户
+        bool bDebitEx = RULE::EXTEND && m_proof.Fdebit_ex_amount != 0;
+        bool bCreditEx = RULE::EXTEND && m_proof.Fcredit_ex_amount != 0;
+
+        //初始化账户，附加总账与总账、借贷双方总账可能是同一账户，必须共用对象，否则各自从同一余额起算，后写的覆盖先写的
+        CCoreAcct& debit = sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_uid, &pipe, false);
+        CCoreAcct& credit = sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_uid, &pipe, false);
+        CCoreAcct& debit_gl = sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_gl_uid, &pipe, true);
+        CCoreAcct& credit_gl = sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_gl_uid, &pipe, true);
+        CCoreAcct* ptrDebitEx = NULL;
+        CCoreAcct* ptrDebitExGL = NULL;
+        CCoreAcct* ptrCreditEx = NULL;
+        CCoreAcct* ptrCreditExGL = NULL;
+        if(bDebitEx)
+        {
+            ptrDebitEx = &sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_ex_uid, &pipe, false);
+            ptrDebitExGL = &sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_exgl_uid, &pipe, true);
+        }
+        if(bCreditEx)
+        {
+            ptrCreditEx = &sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_ex_uid, &pipe, false);
+            ptrCreditExGL = &sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_exgl_uid, &pipe, true);
+        }
+
+        //锁账户表，按uid顺序加锁
+        CCoreLockMgr locker;
+        for(list<CCoreAcct>::iterator it = lstAcct.begin(); it != lstAcct.end(); ++it)
+        {
+            locker.add(*it);
+        }
+        LONG lLockUs = nowUs();
+        locker.lock(m_proof.Fcur_type);
+
+        //锁等待计入热点识别
+        CCoreHotAcct* ptrHot = CCoreHotAcct::instance();
+        if(ptrHot->enabled())
+        {
+            lLockUs = nowUs() - lLockUs;
+            ptrHot->addWait(m_proof.Fdebit_uid, lLockUs);
+            ptrHot->addWait(m_proof.Fcredit_uid, lLockUs);
+        }
 
         //借方
-        debit.setCounter(credit.Fuid, credit.Fuin);
-        debit.setProofInfo(m_proof);
-        debit.debit(m_proof.Fdebit_amount);
+        postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(debit, credit, m_proof.Fdebit_amount);
         //贷方
-        credit.setCounter(debit.Fuid, debit.Fuin);
-        credit.setProofInfo(m_proof);
-        credit.credit(m_proof.Fcredit_amount);
+        postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(credit, debit, m_proof.Fcredit_amount);
         //借方总账
-        debit_gl.setCounter(credit_gl.Fuid, credit_gl.Fuin);
-        debit_gl.setProofInfo(m_proof);
-        debit_gl.debit(m_proof.Fdebit_amount);
+        postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(debit_gl, credit_gl, m_proof.Fdebit_amount);
         //贷方总账
-        credit_gl.setCounter(debit_gl.Fuid, debit_gl.Fuin);
-        credit_gl.setProofInfo(m_proof);
-        credit_gl.credit(m_proof.Fcredit_amount);
+        postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(credit_gl, debit_gl, m_proof.Fcredit_amount);
 
-        //处理附加账户
-        if(m_proof.Fdebit_ex_amount != 0)
+        if(bDebitEx)
         {
-            debit_ex.queryAcctInfo(true);
-            debit_exgl.queryAcctInfo(true);
-
-            //借方
-            debit_ex.setCounter(credit.Fuid, credit.Fuin);
-            debit_ex.setProofInfo(m_proof);
-            debit_ex.debit(m_proof.Fdebit_ex_amount);
-            //借方总账
-            debit_exgl.setCounter(credit_gl.Fuid, credit_gl.Fuin);
-            debit_exgl.setProofInfo(m_proof);
-            debit_exgl.debit(m_proof.Fdebit_ex_amount);
+            //附加借方
+            postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(*ptrDebitEx, credit, m_proof.Fdebit_ex_amount);
+            //附加借方总账
+            postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(*ptrDebitExGL, credit_gl, m_proof.Fdebit_ex_amount);
         }
 
-        if(m_proof.Fcredit_ex_amount != 0)
+        if(bCreditEx)
         {
-            credit_ex.queryAcctInfo(true);
-            credit_exgl.queryAcctInfo(true);
-
-            //贷方
-            credit_ex.setCounter(debit.Fuid, debit.Fuin);
-            credit_ex.setProofInfo(m_proof);
-            credit_ex.credit(m_proof.Fcredit_ex_amount);
-            //贷方总账
-            credit_exgl.setCounter(debit_gl.Fuid, debit_gl.Fuin);
-            credit_exgl.setProofInfo(m_proof);
-            credit_exgl.credit(m_proof.Fcredit_ex_amount);
+            //附加贷方
+            postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(*ptrCreditEx, debit, m_proof.Fcredit_ex_amount);
+            //附加贷方总账
+            postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(*ptrCreditExGL, debit_gl, m_proof.Fcredit_ex_amount);
         }
+
+        //批量写入账户和流水
+        pipe.flush();
         //凭证修改为已使用
-        m_proof.complete();
+        completeProof();
         
         m_ptrSql->Commit();
     }
@@ -179,50 +297,78 @@ void CCore::dealDirect()
         m_ptrSql->Rollback();
         throw;
     }
+
+    //提交后处理
+    pipe.afterCommit();
 }
 
-//处理冻结
-void CCore::dealFreeze()
+//按凭证记账规则分次解冻，只操作主账户和总账，一个事务内完成
+template <int TYPE> void CCore::dealPartUnfreeze()
 {
-    //初始化账户
-    CCoreAcct debit(m_proof.Fdebit_uid);
-    CCoreAcct debit_gl(m_proof.Fdebit_gl_uid);
-    
-    CCoreAcct credit(m_proof.Fcredit_uid);
-    CCoreAcct credit_gl(m_proof.Fcredit_gl_uid);
-    
+    typedef CPostRule<TYPE> RULE;
+
+    CCorePipeline pipe;
+    list<CCoreAcct> lstAcct;
+    map<LONG, CCoreAcct*> mapAcct;
+
     try
     {
         m_ptrSql->Begin();
 
         //锁单
-        m_proof.queryProof(true);
+        lockProof();
+
+        //同一笔分次解冻重入
+        int iSubType = 0;
+        LONG lSubAmount = 0;
+        if(m_proof.querySub(iSubType, lSubAmount))
+        {
+            if(iSubType != TYPE || lSubAmount != m_proof.Fsub_amount)
+            {
+                throw CException(ERR_PARARM_DIFFER, "core proof: reentry but sub proof differ", __FILE__, __LINE__);
+            }
+            throw CException(ERR_ALREADY_SUCCESS, "core sub proof already success", __FILE__, __LINE__);
+        }
+
+        //借贷双方冻结金额一致才能按同一金额分次解冻
+        if(m_proof.Fdebit_amount != m_proof.Fcredit_amount)
+        {
+            throw CException(ERR_PARARM_DIFFER, "core proof: partial unfreeze needs equal amounts", __FILE__, __LINE__);
+        }
+        if(m_proof.Fsub_amount <= 0 || m_proof.Fsub_amount > m_proof.Fcon_remain)
+        {
+            throw CException(ERR_LACK_CON, "core proof: not enough freeze amount left", __FILE__, __LINE__);
+        }
 
-        //锁账户表
-        debit.queryAcctInfo(true);
-        credit.queryAcctInfo(true);
-        debit_gl.queryAcctInfo(true);
-        credit_gl.queryAcctInfo(true);
+        m_proof.saveSub();
+
+        //初始化账户，同一uid共用对象
+        CCoreAcct& debit = sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_uid, &pipe, false);
+        CCoreAcct& credit = sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_uid, &pipe, false);
+        CCoreAcct& debit_gl = sharedAcct(lstAcct, mapAcct, m_proof.Fdebit_gl_uid, &pipe, true);
+        CCoreAcct& credit_gl = sharedAcct(lstAcct, mapAcct, m_proof.Fcredit_gl_uid, &pipe, true);
+
+        //锁账户表，按uid顺序加锁
+        CCoreLockMgr locker;
+        for(list<CCoreAcct>::iterator it = lstAcct.begin(); it != lstAcct.end(); ++it)
+        {
+            locker.add(*it);
+        }
+        locker.lock(m_proof.Fcur_type);
 
         //借方
-        debit.setCounter(credit.Fuid, credit.Fuin);
-        debit.setProofInfo(m_proof);
-        debit.freeze(m_proof.Fdebit_amount);
+        postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(debit, credit, m_proof.Fsub_amount);
         //贷方
-        credit.setCounter(debit.Fuid, debit.Fuin);
-        credit.setProofInfo(m_proof);
-        credit.freeze(m_proof.Fcredit_amount);
+        postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(credit, debit, m_proof.Fsub_amount);
         //借方总账
-        debit_gl.setCounter(credit_gl.Fuid, credit_gl.Fuin);
-        debit_gl.setProofInfo(m_proof);
-        debit_gl.freeze(m_proof.Fdebit_amount);
+        postLeg<RULE::DEBIT_OP1, RULE::DEBIT_OP2>(debit_gl, credit_gl, m_proof.Fsub_amount);
         //贷方总账
-        credit_gl.setCounter(debit_gl.Fuid, debit_gl.Fuin);
-        credit_gl.setProofInfo(m_proof);
-        credit_gl.freeze(m_proof.Fcredit_amount);
+        postLeg<RULE::CREDIT_OP1, RULE::CREDIT_OP2>(credit_gl, debit_gl, m_proof.Fsub_amount);
 
-        //凭证修改为已使用
-        m_proof.complete();
+        //批量写入账户和流水
+        pipe.flush();
+        //扣减剩余冻结金额
+        m_proof.unfreezePart(m_proof.Fsub_amount);
 
         m_ptrSql->Commit();
     }
@@ -231,54 +377,116 @@ void CCore::dealFreeze()
         m_ptrSql->Rollback();
         throw;
     }
+
+    //提交后处理
+    pipe.afterCommit();
 }
 
-//处理成功解冻（解冻并操作可用余额）
-void CCore::dealSucUnfreeze()
+//多方凭证记账：一次锁定全部账户，同一账户同方向的分录合并后一次记账
+void CCore::dealMultiLeg()
 {
-    //初始化账户
-    CCoreAcct debit(m_proof.Fdebit_uid);
-    CCoreAcct debit_gl(m_proof.Fdebit_gl_uid);
-    
-    CCoreAcct credit(m_proof.Fcredit_uid);
-    CCoreAcct credit_gl(m_proof.Fcredit_gl_uid);
-    
+    CCorePipeline pipe;
+    vector<CCoreAcct> vecAcct;
+    map<LONG, size_t> mapAcct;
+    vector<MergedLeg> vecMerged;
+    map<pair<size_t, int>, size_t> mapMerged;
+
     try
     {
         m_ptrSql->Begin();
 
-        //锁单
-        m_proof.queryProof(true);
+        //锁单，分录以锁定后的凭证为准
+        lockProof();
 
-        //锁账户表
-        debit.queryAcctInfo(true);
-        credit.queryAcctInfo(true);
-        debit_gl.queryAcctInfo(true);
-        credit_gl.queryAcctInfo(true);
+        const vector<CCoreProofLeg>& vecLeg = m_proof.Flegs;
 
-        //借方
-        debit.setCounter(credit.Fuid, credit.Fuin);
-        debit.setProofInfo(m_proof);
-        debit.unfreeze(m_proof.Fdebit_amount);
-        debit.debit(m_proof.Fdebit_amount);
-        //贷方
-        credit.setCounter(debit.Fuid, debit.Fuin);
-        credit.setProofInfo(m_proof);
-        credit.unfreeze(m_proof.Fcredit_amount);
-        credit.credit(m_proof.Fcredit_amount);
-        //借方总账
-        debit_gl.setCounter(credit_gl.Fuid, credit_gl.Fuin);
-        debit_gl.setProofInfo(m_proof);
-        debit_gl.unfreeze(m_proof.Fdebit_amount);
-        debit_gl.debit(m_proof.Fdebit_amount);
-        //贷方总账
-        credit_gl.setCounter(debit_gl.Fuid, debit_gl.Fuin);
-        credit_gl.setProofInfo(m_proof);
-        credit_gl.unfreeze(m_proof.Fcredit_amount);
-        credit_gl.credit(m_proof.Fcredit_amount);
+        //借贷平衡校验，对手方取第一条反方向分录
+        m_proof.checkLegs();
+        const CCoreProofLeg* ptrFirstDebit = NULL;
+        const CCoreProofLeg* ptrFirstCredit = NULL;
+        for(size_t i = 0; i < vecLeg.size(); ++i)
+        {
+            const CCoreProofLeg*& ptrFirst = (vecLeg[i].Fdirection == OP_debit)? ptrFirstDebit: ptrFirstCredit;
+            if(NULL == ptrFirst) ptrFirst = &vecLeg[i];
+        }
+
+        //账户去重，预留容量保证元素地址不变
+        vecAcct.reserve(vecLeg.size() * 2);
+        for(size_t i = 0; i < vecLeg.size() * 2; ++i)
+        {
+            LONG uid = (i % 2 == 0)? vecLeg[i / 2].Fuid: vecLeg[i / 2].Fgl_uid;
+            if(mapAcct.find(uid) != mapAcct.end()) continue;
+            mapAcct[uid] = vecAcct.size();
+            vecAcct.push_back(CCoreAcct(uid, &pipe));
+            vecAcct.back().setGL(i % 2 == 1);
+        }
+
+        //同一账户同方向合并，保持分录出现顺序
+        for(size_t i = 0; i < vecLeg.size(); ++i)
+        {
+            const CCoreProofLeg& leg = vecLeg[i];
+            const CCoreProofLeg* ptrCounter = leg.Fdirection == OP_debit? ptrFirstCredit: ptrFirstDebit;
+
+            for(int j = 0; j < 2; ++j)
+            {
+                size_t iAcct = mapAcct[j == 0? leg.Fuid: leg.Fgl_uid];
+                pair<size_t, int> key(iAcct, leg.Fdirection);
+                map<pair<size_t, int>, size_t>::iterator it = mapMerged.find(key);
+                if(it == mapMerged.end())
+                {
+                    MergedLeg merged;
+                    merged.iAcct = iAcct;
+                    merged.iCounter = mapAcct[j == 0? ptrCounter->Fuid: ptrCounter->Fgl_uid];
+                    merged.iOp = leg.Fdirection;
+                    merged.lAmount = 0;
+                    it = mapMerged.insert(make_pair(key, vecMerged.size())).first;
+                    vecMerged.push_back(merged);
+                }
+                vecMerged[it->second].lAmount += leg.Famount;
+            }
+        }
 
+        //锁账户表，按uid顺序加锁
+        CCoreLockMgr locker;
+        for(size_t i = 0; i < vecAcct.size(); ++i)
+        {
+            locker.add(vecAcct[i]);
+        }
+        locker.lock(m_proof.Fcur_type);
+
+        //整批预校验，余额不足时不再逐笔生成流水
+        CCoreBatchCheck batchCheck;
+        for(size_t i = 0; i < vecAcct.size(); ++i)
+        {
+            batchCheck.addAcct(vecAcct[i]);
+        }
+        for(size_t i = 0; i < vecMerged.size(); ++i)
+        {
+            batchCheck.addLeg(vecMerged[i].iAcct, vecMerged[i].iOp, vecMerged[i].lAmount);
+        }
+        int iBad = batchCheck.check();
+        if(iBad >= 0)
+        {
+            throw CException(batchCheck.error(iBad), vecAcct[vecMerged[iBad].iAcct].Fuin + " not enough balance", __FILE__, __LINE__);
+        }
+
+        for(size_t i = 0; i < vecMerged.size(); ++i)
+        {
+            const MergedLeg& merged = vecMerged[i];
+            if(merged.iOp == OP_debit)
+            {
+                postLeg<OP_debit, OP_none>(vecAcct[merged.iAcct], vecAcct[merged.iCounter], merged.lAmount);
+            }
+            else
+            {
+                postLeg<OP_credit, OP_none>(vecAcct[merged.iAcct], vecAcct[merged.iCounter], merged.lAmount);
+            }
+        }
+
+        //批量写入账户和流水
+        pipe.flush();
         //凭证修改为已使用
-        m_proof.complete();
+        completeProof();
 
         m_ptrSql->Commit();
     }
@@ -287,50 +495,565 @@ void CCore::dealSucUnfreeze()
         m_ptrSql->Rollback();
         throw;
     }
+
+    //提交后处理
+    pipe.afterCommit();
 }
 
-//处理失败解冻（仅解冻）
-void CCore::dealFailUnfreeze()
+//锁单并复核状态流转，流转检查在锁外做过一次，这里防并发
+void CCore::lockProof()
 {
-    //初始化账户
-    CCoreAcct debit(m_proof.Fdebit_uid);
-    CCoreAcct debit_gl(m_proof.Fdebit_gl_uid);
-    
-    CCoreAcct credit(m_proof.Fcredit_uid);
-    CCoreAcct credit_gl(m_proof.Fcredit_gl_uid);
-    
+    m_proof.queryProof(true);
+
+    if(0 == m_iFromType) return;
+
+    if(m_proof.Ftype != m_iFromType || m_proof.Fstate != CCoreProof::STATE_after)
+    {
+        if(m_proof.Ftype == m_iReqType && m_proof.Fstate == CCoreProof::STATE_after)
+        {
+            throw CException(ERR_ALREADY_SUCCESS, "core proof already success", __FILE__, __LINE__);
+        }
+        throw CException(ERR_PARARM_DIFFER, "core proof: state changed by others", __FILE__, __LINE__);
+    }
+
+    //已分次解冻过的凭证只能继续分次解冻
+    if(0 == m_proof.Fsub_seq && m_proof.Fcon_remain != m_proof.Fdebit_amount)
+    {
+        throw CException(ERR_PARARM_DIFFER, "core proof: partially unfrozen, continue by installments", __FILE__, __LINE__);
+    }
+
+    m_proof.Ftype = m_iReqType;
+}
+
+//凭证置为已使用
+void CCore::completeProof()
+{
+    if(m_iFromType != 0)
+    {
+        m_proof.transit(m_iReqType);
+    }
+    else
+    {
+        m_proof.complete();
+    }
+}
+
+//根据凭证类型记账，按类型查表分派到对应的规则实例
+void CCore::dealByType()
+{
+    typedef void (CCore::*DealFunc)();
+    static const DealFunc s_dealFunc[] =
+    {
+        NULL,
+        &CCore::dealPosting<CCoreProof::TYPE_direct>,
+        &CCore::dealPosting<CCoreProof::TYPE_freeze>,
+        &CCore::dealPosting<CCoreProof::TYPE_suc_unfreeze>,
+        &CCore::dealPosting<CCoreProof::TYPE_fail_unfreeze>
+    };
+    static const DealFunc s_partFunc[] =
+    {
+        NULL,
+        NULL,
+        NULL,
+        &CCore::dealPartUnfreeze<CCoreProof::TYPE_suc_unfreeze>,
+        &CCore::dealPartUnfreeze<CCoreProof::TYPE_fail_unfreeze>
+    };
+    static const int s_iFuncNum = sizeof(s_dealFunc) / sizeof(s_dealFunc[0]);
+
+    //跨分片凭证
+    if(CCoreShardRouter::instance()->enabled())
+    {
+        vector<ShardLeg> vecLeg;
+        vector<int> vecShard;
+        if(splitShard(vecLeg, vecShard) > 1)
+        {
+            dealCrossShard(vecLeg, vecShard);
+            return;
+        }
+    }
+
+    //涉及热点账户的直接记账进入该账户的队列合并记账
+    LONG lHot = hotAcct();
+    if(lHot != 0)
+    {
+        CCoreHotAcct::instance()->submit(lHot, m_proof.Flistid, *this);
+        return;
+    }
+
+    //多方凭证
+    if(m_proof.Fleg_num > 0)
+    {
+        if(m_iReqType != CCoreProof::TYPE_direct)
+        {
+            throw CException(ERR_BAD_BRANCH, "core proof: multi-leg supports direct only", __FILE__, __LINE__);
+        }
+        dealMultiLeg();
+        return;
+    }
+
+    const DealFunc* ptrFunc = m_proof.Fsub_seq > 0? s_partFunc: s_dealFunc;
+    if(m_iReqType <= 0 || m_iReqType >= s_iFuncNum || NULL == ptrFunc[m_iReqType])
+    {
+        throw CException(ERR_BAD_BRANCH, "core proof: wrong type", __FILE__, __LINE__);
+    }
+
+    (this->*ptrFunc[m_iReqType])();
+}
+
+//凭证涉及的热点账户，优先入账方
+LONG CCore::hotAcct()
+{
+    CCoreHotAcct* ptrHot = CCoreHotAcct::instance();
+    if(!ptrHot->enabled()) return 0;
+
+    //只合并普通直接记账，流转、分次解冻和多方凭证照常处理
+    if(m_iReqType != CCoreProof::TYPE_direct || m_iFromType != 0 || m_proof.Fsub_seq > 0 || m_proof.Fleg_num > 0)
+    {
+        return 0;
+    }
+
+    const LONG arrUid[] =
+    {
+        m_proof.Fcredit_uid,
+        m_proof.Fdebit_uid,
+        m_proof.Fcredit_ex_amount != 0? m_proof.Fcredit_ex_uid: 0,
+        m_proof.Fdebit_ex_amount != 0? m_proof.Fdebit_ex_uid: 0
+    };
+
+    LONG lHot = 0;
+    for(size_t i = 0; i < sizeof(arrUid) / sizeof(arrUid[0]); ++i)
+    {
+        if(arrUid[i] != 0 && ptrHot->touch(arrUid[i]) && 0 == lHot) lHot = arrUid[i];
+    }
+    return lHot;
+}
+
+//合并记账，死锁或锁超时时整批重试
+void CCore::dealHotBatch(const vector<CCoreHotJob*>& vecJob)
+{
+    //各凭证改用本连接，处理完换回
+    vector<CMySQL*> vecSql(vecJob.size());
+    for(size_t i = 0; i < vecJob.size(); ++i)
+    {
+        CCore& core = *vecJob[i]->ptrCore;
+        vecSql[i] = core.m_ptrSql;
+        core.m_ptrSql = m_ptrSql;
+        core.m_proof.setDBHandle(m_ptrSql);
+    }
+
+    for(int iRetry = 0; ; ++iRetry)
+    {
+        try
+        {
+            runHotBatch(vecJob);
+            break;
+        }
+        catch(CException& e)
+        {
+            RetryStat stat = {0, 0, 0, 0};
+            if(!isLockConflict(e, stat) || iRetry >= m_iMaxRetry)
+            {
+                //整批失败，锁冲突原样交给各凭证自己的重试
+                for(size_t i = 0; i < vecJob.size(); ++i)
+                {
+                    vecJob[i]->iError = e.error();
+                    vecJob[i]->strMsg = e.what();
+                }
+                break;
+            }
+        }
+
+        retryBackoff(iRetry);
+    }
+
+    for(size_t i = 0; i < vecJob.size(); ++i)
+    {
+        CCore& core = *vecJob[i]->ptrCore;
+        core.m_ptrSql = vecSql[i];
+        core.m_proof.setDBHandle(vecSql[i]);
+    }
+}
+
+/*
+ * 一批热点凭证一个事务：先依次锁单，再把全部账户按uid排序一次加锁，
+ * 各凭证在共用的账户对象上记账，同一账户的多次变动由批量写合并为一次UPDATE，
+ * 单张凭证的业务错误只回退它自己的内存变动，不影响同批其他凭证
+ */
+void CCore::runHotBatch(const vector<CCoreHotJob*>& vecJob)
+{
+    CCorePipeline pipe;
+    list<CCoreAcct> lstAcct; //批内账户，元素地址不变
+    map<LONG, CCoreAcct*> mapAcct;
+    vector<vector<ShardLeg> > vecLegs(vecJob.size());
+    vector<size_t> vecDone;
+
+    for(size_t i = 0; i < vecJob.size(); ++i)
+    {
+        vecJob[i]->iError = 0;
+        vecJob[i]->strMsg.clear();
+    }
+
     try
     {
         m_ptrSql->Begin();
 
         //锁单
-        m_proof.queryProof(true);
+        for(size_t i = 0; i < vecJob.size(); ++i)
+        {
+            CCore& core = *vecJob[i]->ptrCore;
+            try
+            {
+                core.lockProof();
+                if(core.m_proof.Fstate == CCoreProof::STATE_after)
+                {
+                    throw CException(ERR_ALREADY_SUCCESS, "core proof already success", __FILE__, __LINE__);
+                }
+            }
+            catch(CException& e)
+            {
+                if(!isJobError(e.error())) throw;
+                vecJob[i]->iError = e.error();
+                vecJob[i]->strMsg = e.what();
+                continue;
+            }
+
+            core.directLegs(vecLegs[i]);
+            for(size_t j = 0; j < vecLegs[i].size(); ++j)
+            {
+                sharedAcct(lstAcct, mapAcct, vecLegs[i][j].lUid, &pipe, vecLegs[i][j].bGL);
+            }
+        }
 
-        //锁账户表
-        debit.queryAcctInfo(true);
-        credit.queryAcctInfo(true);
-        debit_gl.queryAcctInfo(true);
-        credit_gl.queryAcctInfo(true);
+        //锁账户表，整批按uid顺序（mapAcct有序）加锁一次，币种逐张检查；
+        //账户不存在等只属于某张凭证的错误记下，只让涉及该账户的凭证失败
+        map<LONG, pair<int, string> > mapBad;
+        for(map<LONG, CCoreAcct*>::iterator it = mapAcct.begin(); it != mapAcct.end(); ++it)
+        {
+            try
+            {
+                it->second->queryAcctInfo(true);
+            }
+            catch(CException& e)
+            {
+                if(!isJobError(e.error())) throw;
+                mapBad[it->first] = make_pair(e.error(), string(e.what()));
+            }
+        }
 
-        //借方
-        debit.setCounter(credit.Fuid, credit.Fuin);
-        debit.setProofInfo(m_proof);
-        debit.unfreeze(m_proof.Fdebit_amount);
-        //贷方
-        credit.setCounter(debit.Fuid, debit.Fuin);
-        credit.setProofInfo(m_proof);
-        credit.unfreeze(m_proof.Fcredit_amount);
-        //借方总账
-        debit_gl.setCounter(credit_gl.Fuid, credit_gl.Fuin);
-        debit_gl.setProofInfo(m_proof);
-        debit_gl.unfreeze(m_proof.Fdebit_amount);
-        //贷方总账
-        credit_gl.setCounter(debit_gl.Fuid, debit_gl.Fuin);
-        credit_gl.setProofInfo(m_proof);
-        credit_gl.unfreeze(m_proof.Fcredit_amount);
+        for(size_t i = 0; i < vecJob.size(); ++i)
+        {
+            if(vecJob[i]->iError != 0) continue;
+
+            for(size_t j = 0; j < vecLegs[i].size() && !mapBad.empty(); ++j)
+            {
+                map<LONG, pair<int, string> >::iterator itBad = mapBad.find(vecLegs[i][j].lUid);
+                if(itBad == mapBad.end()) continue;
+                vecJob[i]->iError = itBad->second.first;
+                vecJob[i]->strMsg = itBad->second.second;
+                break;
+            }
+            if(vecJob[i]->iError != 0) continue;
+
+            CCorePipeline::Mark mark;
+            map<LONG, CCoreAcct> mapSaved;
+            pipe.mark(mark);
+
+            try
+            {
+                vecJob[i]->ptrCore->postHot(vecLegs[i], mapAcct, mapSaved);
+                vecDone.push_back(i);
+            }
+            catch(CException& e)
+            {
+                if(!isJobError(e.error())) throw;
+
+                pipe.rollback(mark);
+                for(map<LONG, CCoreAcct>::iterator it = mapSaved.begin(); it != mapSaved.end(); ++it)
+                {
+                    *mapAcct[it->first] = it->second;
+                }
+                vecJob[i]->iError = e.error();
+                vecJob[i]->strMsg = e.what();
+            }
+        }
 
+        //批量写入账户和流水
+        pipe.flush();
         //凭证修改为已使用
-        m_proof.complete();
+        for(size_t i = 0; i < vecDone.size(); ++i)
+        {
+            vecJob[vecDone[i]]->ptrCore->completeProof();
+        }
+
+        m_ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        m_ptrSql->Rollback();
+        throw;
+    }
+
+    //提交后处理
+    pipe.afterCommit();
+}
+
+//在批内账户上执行本凭证的分录
+void CCore::postHot(const vector<ShardLeg>& vecLeg, map<LONG, CCoreAcct*>& mapAcct, map<LONG, CCoreAcct>& mapSaved)
+{
+    //任何账户变动前检查币种并留底
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        CCoreAcct& acct = *mapAcct[vecLeg[i].lUid];
+        if(acct.Fcur_type != m_proof.Fcur_type)
+        {
+            throw CException(ERR_CORE_CROSS_CUR, acct.Fuin + " currency not match proof", __FILE__, __LINE__);
+        }
+        mapSaved.insert(make_pair(acct.Fuid, acct));
+    }
+
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        CCoreAcct& acct = *mapAcct[vecLeg[i].lUid];
+        acct.setCounter(vecLeg[i].lCounterUid, vecLeg[i].strCounterUin);
+        acct.setProofInfo(m_proof);
+        if(vecLeg[i].iOp == OP_debit)
+        {
+            acct.post<OP_debit>(vecLeg[i].lAmount);
+        }
+        else
+        {
+            acct.post<OP_credit>(vecLeg[i].lAmount);
+        }
+    }
+}
+
+//是否只影响单张凭证的业务错误，其余（SQL错误、锁冲突）整批处理
+bool CCore::isJobError(const int iError)
+{
+    switch(iError)
+    {
+        case ERR_ALREADY_SUCCESS:
+        case ERR_PARARM_DIFFER:
+        case ERR_BAD_BRANCH:
+        case ERR_LACK_BALANCE:
+        case ERR_LACK_CON:
+        case ERR_DB_NONE_ROW:
+        case ERR_CORE_CROSS_CUR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//凭证所在分片或币种的连接池
+CCoreDBPool* CCore::routePool()
+{
+    CCoreShardRouter* ptrRouter = CCoreShardRouter::instance();
+    if(ptrRouter->enabled())
+    {
+        LONG lHome = m_proof.Flegs.empty()? m_proof.Fdebit_uid: m_proof.Flegs[0].Fuid;
+        return ptrRouter->pool(ptrRouter->shardOf(lHome));
+    }
+
+    return CCoreCurRouter::instance()->route(m_proof.Fcur_type);
+}
+
+//准入控制用的账户和总账uid
+void CCore::admitKeys(vector<LONG>& vecAcct, vector<LONG>& vecGL)
+{
+    if(!CCoreAdmission::instance()->enabled()) return;
+
+    const LONG arrAcct[] = {m_proof.Fdebit_uid, m_proof.Fcredit_uid, m_proof.Fdebit_ex_uid, m_proof.Fcredit_ex_uid};
+    const LONG arrGL[] = {m_proof.Fdebit_gl_uid, m_proof.Fcredit_gl_uid, m_proof.Fdebit_exgl_uid, m_proof.Fcredit_exgl_uid};
+
+    //热点账户由热点队列串行处理，不再按账户限并发
+    CCoreHotAcct* ptrHot = CCoreHotAcct::instance();
+    bool bHot = ptrHot->enabled() && m_proof.Fleg_num == 0;
+
+    for(size_t i = 0; i < sizeof(arrAcct) / sizeof(arrAcct[0]); ++i)
+    {
+        if(arrAcct[i] != 0 && !(bHot && ptrHot->isHot(arrAcct[i]))) vecAcct.push_back(arrAcct[i]);
+        if(arrGL[i] != 0) vecGL.push_back(arrGL[i]);
+    }
+
+    for(size_t i = 0; i < m_proof.Flegs.size(); ++i)
+    {
+        vecAcct.push_back(m_proof.Flegs[i].Fuid);
+        vecGL.push_back(m_proof.Flegs[i].Fgl_uid);
+    }
+}
+
+//凭证涉及的账户币种须与凭证一致，账户币种按分区缓存，热路径上不再逐个查库
+void CCore::checkCurrency()
+{
+    //分片时账户未必在本分片上，由加锁和checkShardPart校验
+    if(CCoreShardRouter::instance()->enabled()) return;
+
+    const LONG arrUid[] = {m_proof.Fdebit_uid, m_proof.Fcredit_uid, m_proof.Fdebit_ex_uid, m_proof.Fcredit_ex_uid,
+        m_proof.Fdebit_gl_uid, m_proof.Fcredit_gl_uid, m_proof.Fdebit_exgl_uid, m_proof.Fcredit_exgl_uid};
+
+    set<LONG> setUid;
+    for(size_t i = 0; i < sizeof(arrUid) / sizeof(arrUid[0]); ++i)
+    {
+        if(arrUid[i] != 0) setUid.insert(arrUid[i]);
+    }
+    for(size_t i = 0; i < m_proof.Flegs.size(); ++i)
+    {
+        setUid.insert(m_proof.Flegs[i].Fuid);
+        setUid.insert(m_proof.Flegs[i].Fgl_uid);
+    }
+
+    CCoreDBPool* ptrPool = getCoreLeasePool();
+    for(set<LONG>::const_iterator it = setUid.begin(); it != setUid.end(); ++it)
+    {
+        pair<CCoreDBPool*, LONG> key(ptrPool, *it);
+        string strCur;
+        bool bHit = false;
+
+        pthread_rwlock_rdlock(&s_acctCurLock);
+        map<pair<CCoreDBPool*, LONG>, string>::const_iterator itCur = s_mapAcctCur.find(key);
+        if(itCur != s_mapAcctCur.end())
+        {
+            strCur = itCur->second;
+            bHit = true;
+        }
+        pthread_rwlock_unlock(&s_acctCurLock);
+
+        //未缓存的才查库，币种不会变，非加锁读即可；不存在的账户不缓存
+        if(!bHit)
+        {
+            CCoreAcct acct(*it);
+            if(!acct.queryAcctInfo(false))
+            {
+                throw CException(ERR_DB_NONE_ROW, "core proof: account not found in partition", __FILE__, __LINE__);
+            }
+            strCur = acct.Fcur_type;
+
+            pthread_rwlock_wrlock(&s_acctCurLock);
+            if(s_mapAcctCur.size() >= MAX_ACCT_CUR) s_mapAcctCur.clear();
+            s_mapAcctCur[key] = strCur;
+            pthread_rwlock_unlock(&s_acctCurLock);
+        }
+
+        if(strCur != m_proof.Fcur_type)
+        {
+            char szMsg[MAX_MSG_LEN] = {0};
+            snprintf(szMsg, sizeof(szMsg) - 1, "account %lld currency not match proof", *it);
+            throw CException(ERR_CORE_CROSS_CUR, szMsg, __FILE__, __LINE__);
+        }
+    }
+}
+
+//是否过载信号
+bool CCore::isOverload(const CException& e)
+{
+    RetryStat stat = {0, 0, 0, 0};
+    return e.error() == ERR_CORE_BUSY || isLockConflict(e, stat);
+}
+
+//按分片拆分凭证
+size_t CCore::splitShard(vector<ShardLeg>& vecLeg, vector<int>& vecShard)
+{
+    CCoreShardRouter* ptrRouter = CCoreShardRouter::instance();
+    vecLeg.clear();
+    vecShard.clear();
+
+    //多方凭证只检查是否落在同一分片
+    if(m_proof.Fleg_num > 0 || !m_proof.Flegs.empty())
+    {
+        for(size_t i = 0; i < m_proof.Flegs.size(); ++i)
+        {
+            const CCoreProofLeg& leg = m_proof.Flegs[i];
+            int iShard = ptrRouter->shardOf(leg.Fuid);
+            int iGLShard = ptrRouter->shardOf(leg.Fgl_uid, true);
+            if(find(vecShard.begin(), vecShard.end(), iShard) == vecShard.end()) vecShard.push_back(iShard);
+            if(find(vecShard.begin(), vecShard.end(), iGLShard) == vecShard.end()) vecShard.push_back(iGLShard);
+        }
+        if(vecShard.size() > 1)
+        {
+            throw CException(ERR_BAD_BRANCH, "core proof: multi-leg across shards not supported", __FILE__, __LINE__);
+        }
+        return vecShard.size();
+    }
+
+    //借方账户所在分片为协调分片，排第一
+    vecShard.push_back(ptrRouter->shardOf(m_proof.Fdebit_uid));
+
+    directLegs(vecLeg);
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        vecLeg[i].iShard = ptrRouter->shardOf(vecLeg[i].lUid, vecLeg[i].bGL);
+        if(find(vecShard.begin(), vecShard.end(), vecLeg[i].iShard) == vecShard.end())
+        {
+            vecShard.push_back(vecLeg[i].iShard);
+        }
+    }
+
+    return vecShard.size();
+}
+
+//直接记账凭证的各条分录
+void CCore::directLegs(vector<ShardLeg>& vecLeg)
+{
+    const CCoreProof& p = m_proof;
+    const ShardLeg arrLeg[] =
+    {
+        {0, p.Fdebit_uid, false, OP_debit, p.Fcredit_uid, p.Fcredit_uin, p.Fdebit_amount},
+        {0, p.Fcredit_uid, false, OP_credit, p.Fdebit_uid, p.Fdebit_uin, p.Fcredit_amount},
+        {0, p.Fdebit_gl_uid, true, OP_debit, p.Fcredit_gl_uid, p.Fcredit_gl_uin, p.Fdebit_amount},
+        {0, p.Fcredit_gl_uid, true, OP_credit, p.Fdebit_gl_uid, p.Fdebit_gl_uin, p.Fcredit_amount},
+        {0, p.Fdebit_ex_uid, false, OP_debit, p.Fcredit_uid, p.Fcredit_uin, p.Fdebit_ex_amount},
+        {0, p.Fdebit_exgl_uid, true, OP_debit, p.Fcredit_gl_uid, p.Fcredit_gl_uin, p.Fdebit_ex_amount},
+        {0, p.Fcredit_ex_uid, false, OP_credit, p.Fdebit_uid, p.Fdebit_uin, p.Fcredit_ex_amount},
+        {0, p.Fcredit_exgl_uid, true, OP_credit, p.Fdebit_gl_uid, p.Fdebit_gl_uin, p.Fcredit_ex_amount}
+    };
+
+    for(size_t i = 0; i < sizeof(arrLeg) / sizeof(arrLeg[0]); ++i)
+    {
+        //附加账户只在有发生额时记账
+        if(i >= 4 && arrLeg[i].lAmount == 0) continue;
+
+        vecLeg.push_back(arrLeg[i]);
+    }
+}
+
+/*
+ * 跨分片记账
+ * 凭证本身是协调记录：STATE_before表示在途，全部分片完成后才置为STATE_after
+ * 各分片在本地事务内记账并写执行标记isp_os_core.t_proof_part(Flistid, Fshard)，重复执行时跳过
+ * 协调分片（借方账户所在分片）先执行，它失败则整单未生效；
+ * 协调分片提交后只能由CCoreShardRecovery向前推进，不回滚，所以后续分片上的分录必须不会失败：
+ * 任何分片提交前先由checkShardPart确认后续分片的每条分录都落在共有类账户上，或是非负的入款，
+ * 否则整单拒绝（ERR_CORE_SHARD_UNSAFE），不做任何变动
+ */
+void CCore::dealCrossShard(const vector<ShardLeg>& vecLeg, const vector<int>& vecShard)
+{
+    if(m_iReqType != CCoreProof::TYPE_direct || m_proof.Fsub_seq > 0)
+    {
+        throw CException(ERR_BAD_BRANCH, "core proof: cross-shard supports direct only", __FILE__, __LINE__);
+    }
+
+    for(size_t i = 1; i < vecShard.size(); ++i)
+    {
+        checkShardPart(vecShard[i], vecLeg);
+    }
+
+    for(size_t i = 0; i < vecShard.size(); ++i)
+    {
+        dealShardPart(vecShard[i], vecLeg);
+    }
+
+    //全部分片完成，凭证置为已使用
+    try
+    {
+        m_ptrSql->Begin();
+
+        lockProof();
+        if(m_proof.Fstate == CCoreProof::STATE_after)
+        {
+            throw CException(ERR_ALREADY_SUCCESS, "core proof already success", __FILE__, __LINE__);
+        }
+        completeProof();
 
         m_ptrSql->Commit();
     }
@@ -341,6 +1064,235 @@ void CCore::dealFailUnfreeze()
     }
 }
 
+/*
+ * 校验后续分片上的分录不会失败
+ * 账户类别、余额方向、币种不随记账变化，不必持锁：
+ * 共有类账户不校验余额；非共有类账户可用余额恒不为负，非负的入款也不会让它变负；
+ * 出款、负数入款（冲销）、账户不存在、币种不符都可能在协调分片提交后才失败，一律拒绝
+ */
+void CCore::checkShardPart(const int iShard, const vector<ShardLeg>& vecLeg)
+{
+    CCoreDBLease lease(CCoreShardRouter::instance()->pool(iShard), true);
+
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        const ShardLeg& leg = vecLeg[i];
+        if(leg.iShard != iShard) continue;
+
+        CCoreAcct acct(leg.lUid, NULL);
+        if(!acct.queryAcctInfo(false))
+        {
+            throw CException(ERR_DB_NONE_ROW, "core proof: cross-shard account not found", __FILE__, __LINE__);
+        }
+        if(acct.Fcur_type != m_proof.Fcur_type)
+        {
+            throw CException(ERR_CORE_CROSS_CUR, acct.Fuin + " currency not match proof", __FILE__, __LINE__);
+        }
+        if(acct.Fsymbol == CCoreAcct::SYMBOL_common) continue;
+
+        //记账动作与余额方向同向为入款
+        bool bIn = (leg.iOp == OP_credit) == (acct.Fbalance_type == CCoreAcct::BAlANCE_credit);
+        if(!bIn || leg.lAmount < 0)
+        {
+            throw CException(ERR_CORE_SHARD_UNSAFE, acct.Fuin + " may fail on a later shard", __FILE__, __LINE__);
+        }
+    }
+}
+
+//执行一个分片上的记账
+bool CCore::dealShardPart(const int iShard, const vector<ShardLeg>& vecLeg)
+{
+    //切到分片连接，本分片的账户和流水都走这个连接
+    CCoreDBLease lease(CCoreShardRouter::instance()->pool(iShard), true);
+    CMySQL* ptrSql = lease.handle();
+
+    CCorePipeline pipe;
+    list<CCoreAcct> lstAcct;
+    map<LONG, CCoreAcct*> mapAcct;
+    vector<const ShardLeg*> vecPart;
+
+    //同一uid的分录共用账户对象
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        if(vecLeg[i].iShard != iShard) continue;
+
+        sharedAcct(lstAcct, mapAcct, vecLeg[i].lUid, &pipe, vecLeg[i].bGL);
+        vecPart.push_back(&vecLeg[i]);
+    }
+
+    char szSql[MAX_SQL_LEN] = {0};
+
+    try
+    {
+        ptrSql->Begin();
+
+        //执行标记与记账同一事务，并发或重复执行时只有一个能插入
+        int iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "INSERT IGNORE INTO isp_os_core.t_proof_part (Flistid,Fshard,Fcreate_time) "
+            "VALUES ('%s',%d,now())",
+            ptrSql->EscapeStr(m_proof.Flistid).c_str(), iShard);
+        ptrSql->Query(szSql, iLen);
+
+        if(0 == ptrSql->AffectedRows())
+        {
+            ptrSql->Rollback();
+            return false;
+        }
+
+        CCoreLockMgr locker;
+        for(list<CCoreAcct>::iterator it = lstAcct.begin(); it != lstAcct.end(); ++it)
+        {
+            locker.add(*it);
+        }
+        locker.lock(m_proof.Fcur_type);
+
+        for(size_t i = 0; i < vecPart.size(); ++i)
+        {
+            CCoreAcct& acct = *mapAcct[vecPart[i]->lUid];
+            acct.setCounter(vecPart[i]->lCounterUid, vecPart[i]->strCounterUin);
+            acct.setProofInfo(m_proof);
+            if(vecPart[i]->iOp == OP_debit)
+            {
+                acct.post<OP_debit>(vecPart[i]->lAmount);
+            }
+            else
+            {
+                acct.post<OP_credit>(vecPart[i]->lAmount);
+            }
+        }
+
+        pipe.flush();
+
+        ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        ptrSql->Rollback();
+        throw;
+    }
+
+    pipe.afterCommit();
+    return true;
+}
+
+//分片是否已执行，查协调分片
+bool CCore::queryShardPart(const int iShard)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "SELECT 1 FROM isp_os_core.t_proof_part "
+        "WHERE Flistid = '%s' AND Fshard = %d",
+        m_ptrSql->EscapeStr(m_proof.Flistid).c_str(), iShard);
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    bool bExist = mysql_num_rows(pRes) > 0;
+    mysql_free_result(pRes);
+
+    return bExist;
+}
+
+//是否在途的跨分片凭证
+bool CCore::shardInFlight()
+{
+    if(!CCoreShardRouter::instance()->enabled()) return false;
+
+    try
+    {
+        vector<ShardLeg> vecLeg;
+        vector<int> vecShard;
+        return splitShard(vecLeg, vecShard) > 1 && queryShardPart(vecShard[0]);
+    }
+    catch(CException& e)
+    {
+        //查不清时不记失败，不在途的凭证恢复任务推进时也会跳过
+        return true;
+    }
+}
+
+//推进在途的跨分片凭证
+bool CCore::recoverProof(const CCoreProof& proof)
+{
+    m_proof = proof;
+
+    CCoreDBLease lease(routePool());
+    m_ptrSql = lease.handle();
+    lease.bind(m_ptrSql);
+    m_proof.setDBHandle(lease);
+    m_iReqType = m_proof.Ftype;
+    m_iFromType = 0;
+
+    //协调分片未提交的凭证整单未生效，不在途
+    vector<ShardLeg> vecLeg;
+    vector<int> vecShard;
+    if(splitShard(vecLeg, vecShard) < 2 || !queryShardPart(vecShard[0]))
+    {
+        return false;
+    }
+
+    redriveProof(proof);
+    return true;
+}
+
+//按已保存的凭证重走记账
+void CCore::redriveProof(const CCoreProof& proof)
+{
+    m_proof = proof;
+
+    //嵌套调用时复用外层连接
+    CCoreDBLease lease(routePool());
+    m_ptrSql = lease.handle();
+    lease.bind(m_ptrSql);
+    m_proof.setDBHandle(lease);
+    m_iReqType = m_proof.Ftype;
+    m_iFromType = 0;
+
+    try
+    {
+        dealProof();
+    }
+    catch(CException& e)
+    {
+        if(e.error() != ERR_ALREADY_SUCCESS) throw;
+    }
+}
+
+/*****************
+ * 核心账户加锁器 *
+******************/
+
+//按uid排序
+static bool lessAcctUid(const CCoreAcct* ptrLeft, const CCoreAcct* ptrRight)
+{
+    return ptrLeft->Fuid < ptrRight->Fuid;
+}
+
+//登记待加锁账户
+void CCoreLockMgr::add(CCoreAcct& acct)
+{
+    m_vecAcct.push_back(&acct);
+}
+
+//按uid顺序加锁
+void CCoreLockMgr::lock(const string& strCur)
+{
+    stable_sort(m_vecAcct.begin(), m_vecAcct.end(), lessAcctUid);
+
+    for(size_t i = 0; i < m_vecAcct.size(); ++i)
+    {
+        m_vecAcct[i]->queryAcctInfo(true);
+
+        //跨币种凭证在任何账户变动前拒绝
+        if(!strCur.empty() && m_vecAcct[i]->Fcur_type != strCur)
+        {
+            throw CException(ERR_CORE_CROSS_CUR, m_vecAcct[i]->Fuin + " currency not match proof", __FILE__, __LINE__);
+        }
+    }
+}
+
 /*****************
  * 核心账户类 *
 ******************/
@@ -352,11 +1304,12 @@ CCoreAcct::CCoreAcct()
 }
 
 // 构造函数
-CCoreAcct::CCoreAcct(const LONG uid)
+CCoreAcct::CCoreAcct(const LONG uid, CCorePipeline* ptrPipe)
 {  
     init();
     //设置uid
     Fuid = uid;
+    m_ptrPipe = ptrPipe;
 }
 
 //析构函数
@@ -382,13 +1335,80 @@ void CCoreAcct::init()
     Ftimestamp_us = 0;
     Frecord_mode = 0;
 
-    //私有变量初始化
-    m_ptrSql = getCoreDBHandle();
-    bSync = false;
+    //私有变量初始化
+    m_ptrSql = getCoreLeaseHandle();
+    m_ptrPipe = NULL;
+    m_bGL = false;
+    bSync = false;
+}
+
+//SELECT字段列表，与parseRow一一对应
+const char* CCoreAcct::sqlSelect()
+{
+    return "Fuid,Fsymbol,Fcur_type,Fledger_type,Fbalance_type,Fbalance,Fcon,Ftransit,Facct_state,"
+        "Fuin,Fname,Fip,Fmemo,Fmodify_time,Fcreate_time,Fbalance_time,Ftimestamp,Ftimestamp_us,"
+        "Frecord_mode,Facct_sign,Fproof_id";
+}
+
+//解析查询结果行
+void CCoreAcct::parseRow(MYSQL_ROW row)
+{
+    Fuid = row[0]? atoll(row[0]): 0;
+    Fsymbol = row[1]? atoi(row[1]): 0;
+    Fcur_type = row[2]? row[2]: "";
+    Fledger_type = row[3]? atoi(row[3]): 0;
+    Fbalance_type = row[4]? atoi(row[4]): 0;
+    Fbalance = row[5]? atoll(row[5]): 0;
+    Fcon = row[6]? atoll(row[6]): 0;
+    Ftransit = row[7]? atoll(row[7]): 0;
+    Facct_state = row[8]? atoi(row[8]): 0;
+    Fuin = row[9]? row[9]: "";
+    Fname = row[10]? row[10]: "";
+    Fip = row[11]? row[11]: "";
+    Fmemo = row[12]? row[12]: "";
+    Fmodify_time = row[13]? row[13]: "";
+    Fcreate_time = row[14]? row[14]: "";
+    Fbalance_time = row[15]? row[15]: "";
+    Ftimestamp = row[16]? atoi(row[16]): 0;
+    Ftimestamp_us = row[17]? atoi(row[17]): 0;
+    Frecord_mode = row[18]? atoi(row[18]): 0;
+    Facct_sign = row[19]? row[19]: "";
+    Fproof_id = row[20]? row[20]: "";
+}
+
+//获取账户信息，bLock：是否加锁
+bool CCoreAcct::queryAcctInfo(bool bLock)
+{
+    //非加锁读先走从库，从库没有（刚开的户）时回主库
+    CCoreReplicaRouter* ptrRouter = CCoreReplicaRouter::instance();
+    if(!bLock && ptrRouter->enabled())
+    {
+        CCoreReadLease read(m_ptrSql);
+        if(read.handle())
+        {
+            bool bHit = false;
+            try
+            {
+                bHit = selectAcct(read.handle(), false);
+            }
+            catch(CException& e)
+            {
+                read.setSuspect();
+            }
+            ptrRouter->count(true, !bHit);
+            if(bHit) return true;
+        }
+        else
+        {
+            ptrRouter->count(false, false);
+        }
+    }
+
+    return selectAcct(m_ptrSql, bLock);
 }
 
-//获取账户信息，bLock：是否加锁
-bool CCoreAcct::queryAcctInfo(bool bLock)
+//在指定连接上查询账户
+bool CCoreAcct::selectAcct(CMySQL* ptrSql, bool bLock)
 {
     char szSql[MAX_SQL_LEN] = {0};
     MYSQL_RES* pRes = NULL;
@@ -396,15 +1416,13 @@ bool CCoreAcct::queryAcctInfo(bool bLock)
     try
     {
         int iLen = snprintf(szSql, sizeof(szSql),
-            "SELECT Fuid,Fsymbol,Fcur_type,Fledger_type,Fbalance_type,Fbalance,Fcon,Ftransit,Facct_state,"
-            "Fuin,Fname,Fip,Fmemo,Fmodify_time,Fcreate_time,Fbalance_time,Ftimestamp,Ftimestamp_us,"
-            "Frecord_mode,Facct_sign,Fproof_id "
+            "SELECT %s "
             "FROM isp_os_core.t_account "
             "WHERE Fuid = %lld %s",
-            Fuid, bLock? "FOR UPDATE": "");
+            sqlSelect(), Fuid, bLock? "FOR UPDATE": "");
 
-        m_ptrSql->Query(szSql, iLen);
-        pRes = m_ptrSql->FetchResult();
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
         int iRow = mysql_num_rows(pRes);
 
         if(0 == iRow)
@@ -424,27 +1442,7 @@ bool CCoreAcct::queryAcctInfo(bool bLock)
 
         MYSQL_ROW row = mysql_fetch_row(pRes);
 
-        Fuid = row[0]? atoll(row[0]): 0;
-        Fsymbol = row[1]? atoi(row[1]): 0;
-        Fcur_type = row[2]? row[2]: "";
-        Fledger_type = row[3]? atoi(row[3]): 0;
-        Fbalance_type = row[4]? atoi(row[4]): 0;
-        Fbalance = row[5]? atoll(row[5]): 0;
-        Fcon = row[6]? atoll(row[6]): 0;
-        Ftransit = row[7]? atoll(row[7]): 0;
-        Facct_state = row[8]? atoi(row[8]): 0;
-        Fuin = row[9]? row[9]: "";
-        Fname = row[10]? row[10]: "";
-        Fip = row[11]? row[11]: "";
-        Fmemo = row[12]? row[12]: "";
-        Fmodify_time = row[13]? row[13]: "";
-        Fcreate_time = row[14]? row[14]: "";
-        Fbalance_time = row[15]? row[15]: "";
-        Ftimestamp = row[16]? atoi(row[16]): 0;
-        Ftimestamp_us = row[17]? atoi(row[17]): 0;
-        Frecord_mode = row[18]? atoi(row[18]): 0;
-        Facct_sign = row[19]? row[19]: "";
-        Fproof_id = row[20]? row[20]: "";
+        parseRow(row);
         
         //验证行签名
         if(Facct_sign != genAcctSign())
@@ -466,92 +1464,107 @@ bool CCoreAcct::queryAcctInfo(bool bLock)
     }
 }
 
-//记借方
-void CCoreAcct::debit(const LONG lAmount)
+/*
+ * 记账动作 × 余额方向 → 流水类型
+ */
+template <int OP, int BALANCE> struct CLegFlowType;
+template <> struct CLegFlowType<OP_debit, CCoreAcct::BAlANCE_debit> { enum { TYPE = CCoreFlow::TYPE_in }; };
+template <> struct CLegFlowType<OP_debit, CCoreAcct::BAlANCE_credit> { enum { TYPE = CCoreFlow::TYPE_out }; };
+template <> struct CLegFlowType<OP_credit, CCoreAcct::BAlANCE_debit> { enum { TYPE = CCoreFlow::TYPE_out }; };
+template <> struct CLegFlowType<OP_credit, CCoreAcct::BAlANCE_credit> { enum { TYPE = CCoreFlow::TYPE_in }; };
+template <int BALANCE> struct CLegFlowType<OP_freeze, BALANCE> { enum { TYPE = CCoreFlow::TYPE_freeze }; };
+template <int BALANCE> struct CLegFlowType<OP_unfreeze, BALANCE> { enum { TYPE = CCoreFlow::TYPE_unfreeze }; };
+
+//按记账动作变动余额
+template <int OP> void CCoreAcct::post(const LONG lAmount)
 {
+    //冻结类金额为负（冲销时）不操作账户直接返回成功
+    if(CLegOp<OP>::FROZEN && lAmount < 0) return;
+
     //发生额
-    m_flow.Fpaynum = lAmount;
-    m_flow.Fconnum = 0;
+    m_flow.Fpaynum = CLegOp<OP>::FROZEN? 0: lAmount;
+    m_flow.Fconnum = CLegOp<OP>::FROZEN? lAmount: 0;
 
-    //借方余额
-    if(Fbalance_type == CCoreAcct::BAlANCE_debit)
+    //余额方向只在这里分派一次，冻结类与余额方向无关
+    if(CLegOp<OP>::FROZEN || Fbalance_type == CCoreAcct::BAlANCE_debit)
     {
-        m_flow.Ftype = CCoreFlow::TYPE_in;
+        process<CLegFlowType<OP, CCoreAcct::BAlANCE_debit>::TYPE>();
     }
-    //贷方余额
     else if(Fbalance_type == CCoreAcct::BAlANCE_credit)
     {
-        m_flow.Ftype = CCoreFlow::TYPE_out;   
+        process<CLegFlowType<OP, CCoreAcct::BAlANCE_credit>::TYPE>();
+    }
+    else
+    {
+        throw CException(ERR_BAD_BRANCH, "core acct: wrong balance type", __FILE__, __LINE__);
     }
+}
+
+template void CCoreAcct::post<OP_debit>(const LONG lAmount);
+template void CCoreAcct::post<OP_credit>(const LONG lAmount);
+template void CCoreAcct::post<OP_freeze>(const LONG lAmount);
+template void CCoreAcct::post<OP_unfreeze>(const LONG lAmount);
 
-    process();
+//记借方
+void CCoreAcct::debit(const LONG lAmount)
+{
+    post<OP_debit>(lAmount);
 }
 
 //记贷方
 void CCoreAcct::credit(const LONG lAmount)
 {
-    //发生额
-    m_flow.Fpaynum = lAmount;
-    m_flow.Fconnum = 0;
-
-    //借方余额
-    if(Fbalance_type == CCoreAcct::BAlANCE_debit)
-    {
-        m_flow.Ftype = CCoreFlow::TYPE_out;
-    }
-    //贷方余额
-    else if(Fbalance_type == CCoreAcct::BAlANCE_credit)
-    {
-        m_flow.Ftype = CCoreFlow::TYPE_in;
-    }
-
-    process();
+    post<OP_credit>(lAmount);
 }
 
-
 //冻结
 void CCoreAcct::freeze(const LONG lAmount)
 {
-    //金额为负（冲销时）不操作账户直接返回成功
-    if(lAmount < 0) return;
-
-    //冻结金额
-    m_flow.Fpaynum = 0;
-    m_flow.Fconnum = lAmount;
-    m_flow.Ftype = CCoreFlow::TYPE_freeze;
-
-    process();
+    post<OP_freeze>(lAmount);
 }
 
 //解冻
 void CCoreAcct::unfreeze(const LONG lAmount)
 {
-    //金额为负（冲销时）不操作账户直接返回成功
-    if(lAmount < 0) return;
-
-    //冻结金额
-    m_flow.Fpaynum = 0;
-    m_flow.Fconnum = lAmount;
-    m_flow.Ftype = CCoreFlow::TYPE_unfreeze;
-
-    process();
+    post<OP_unfreeze>(lAmount);
 }
 
 //对账户余额进行变动
-void CCoreAcct::process()
+template <int FLOW> void CCoreAcct::process()
 {
+    m_flow.Ftype = FLOW;
+
     //校验金额
-    checkAmount();
+    checkAmount<FLOW>();
     //准备更新
-    prepareUpdate();
-    //更新账户余额
-    updateAcct();
-    //记录流水
-    createFlow();
+    prepareUpdate<FLOW>();
+
+    if(m_ptrPipe)
+    {
+        //登记到批量写，提交前统一写入
+        fillFlow();
+        m_ptrPipe->addAcct(*this);
+        if(m_bGL && CCoreGLFlow::instance()->enabled())
+        {
+            CCoreStamp stamp = {Ftimestamp, Ftimestamp_us};
+            m_ptrPipe->addGLFlow(m_flow, stamp);
+        }
+        else
+        {
+            m_ptrPipe->addFlow(m_flow);
+        }
+    }
+    else
+    {
+        //更新账户余额
+        updateAcct();
+        //记录流水
+        createFlow();
+    }
 }
 
-//检查金额
-void CCoreAcct::checkAmount()
+//检查金额，FLOW为常量，分支在编译期消去
+template <int FLOW> void CCoreAcct::checkAmount()
 {
     //账户信息未同步或者传入金额小于0
     //为了兼容冲销，余额发生额可以为负，冻结发生额还是不允许为负
@@ -564,7 +1577,7 @@ void CCoreAcct::checkAmount()
     if(Fsymbol != SYMBOL_common)
     {
         //出款校验可用余额
-        if(m_flow.Ftype == CCoreFlow::TYPE_out)
+        if(FLOW == CCoreFlow::TYPE_out)
         {
             if(Fbalance - Fcon - m_flow.Fpaynum < 0)
             {
@@ -573,7 +1586,7 @@ void CCoreAcct::checkAmount()
         }
 
         //入款也要校验可用余额（冲销时）
-        if(m_flow.Ftype == CCoreFlow::TYPE_in)
+        if(FLOW == CCoreFlow::TYPE_in)
         {
             if(Fbalance - Fcon + m_flow.Fpaynum < 0)
             {
@@ -582,7 +1595,7 @@ void CCoreAcct::checkAmount()
         }
 
         //冻结校验可用余额
-        if(m_flow.Ftype == CCoreFlow::TYPE_freeze)
+        if(FLOW == CCoreFlow::TYPE_freeze)
         {
             if(Fbalance - Fcon - m_flow.Fconnum < 0)
             {
@@ -592,7 +1605,7 @@ void CCoreAcct::checkAmount()
     }
 
     //解冻校验冻结金额
-    if(m_flow.Ftype == CCoreFlow::TYPE_unfreeze)
+    if(FLOW == CCoreFlow::TYPE_unfreeze)
     {
         if(Fcon - m_flow.Fconnum < 0)
         {
@@ -602,31 +1615,47 @@ void CCoreAcct::checkAmount()
 }
 
 //准备更新
-void CCoreAcct::prepareUpdate()
+template <int FLOW> void CCoreAcct::prepareUpdate()
 {
     //余额和冻结余额
-    if(m_flow.Ftype == CCoreFlow::TYPE_in)
+    if(FLOW == CCoreFlow::TYPE_in)
     {
         Fbalance += m_flow.Fpaynum;
     }
-    else if(m_flow.Ftype == CCoreFlow::TYPE_out)
+    else if(FLOW == CCoreFlow::TYPE_out)
     {
         Fbalance -= m_flow.Fpaynum;
     }
-    else if(m_flow.Ftype == CCoreFlow::TYPE_freeze)
+    else if(FLOW == CCoreFlow::TYPE_freeze)
     {
         Fcon += m_flow.Fconnum;
     }
-    else if(m_flow.Ftype == CCoreFlow::TYPE_unfreeze)
+    else if(FLOW == CCoreFlow::TYPE_unfreeze)
     {
         Fcon -= m_flow.Fconnum;
     }
 
-    //更新时间戳, 生成行签名, 更新时间用DB时间
-    MicroTimeStamp tStamp;
-    getMicroTimeStamp(tStamp);
-    Ftimestamp = tStamp.iTimeStamp;
-    Ftimestamp_us = tStamp.iTimeStampUs;
+    //更新时间戳（取自CCoreClock，不用DB时间）, 生成行签名；Fmodify_time、Fbalance_time仍由updateAcct写DB的now()
+    //时间戳取本事务统一的时间，且晚于账户上次更新，同一账户严格递增
+    CCoreStamp stamp;
+    if(m_ptrPipe)
+    {
+        stamp = m_ptrPipe->stamp();
+    }
+    else
+    {
+        CCoreClock::now(stamp);
+    }
+
+    CCoreStamp last = {Ftimestamp, Ftimestamp_us};
+    if(!(last < stamp))
+    {
+        stamp = last;
+        CCoreClock::next(stamp);
+        CCoreClock::observe(stamp);
+    }
+    Ftimestamp = stamp.iSec;
+    Ftimestamp_us = stamp.iUs;
     Facct_sign = genAcctSign();
     //Fmodify_time = getSysTime();
     //Fbalance_time = Fmodify_time;
@@ -658,8 +1687,8 @@ void CCoreAcct::updateAcct()
 
 }
 
-//记录流水
-void CCoreAcct::createFlow()
+//填充流水
+void CCoreAcct::fillFlow()
 {
     m_flow.Fcur_type = Fcur_type;
     m_flow.Fuid = Fuid;
@@ -667,116 +1696,526 @@ void CCoreAcct::createFlow()
     m_flow.Fbalance = Fbalance;
     m_flow.Fcon = Fcon;
     m_flow.Fip = HOST_IP;
-    m_flow.Fcreate_time = getSysTime();
+    //流水时间与账户本次更新的时间戳一致，同一秒只格式化一次
+    m_flow.Ftimestamp = Ftimestamp;
+    m_flow.Fcreate_time = CCoreClock::format(Ftimestamp);
     m_flow.Fmodify_time = m_flow.Fcreate_time;
-    m_flow.Ftimestamp = genCurTimeStamp();
     m_flow.Flabel = m_flow.Fpaynum < 0 ? 2 : 0;
+}
+
+//记录流水
+void CCoreAcct::createFlow()
+{
+    fillFlow();
+    //保存流水
+    m_flow.saveFlow();
+}
+
+
+//设置对手方账户
+void CCoreAcct::setCounter(const LONG uid, const string uin)
+{
+    m_flow.Fcounter_uid = uid;
+    m_flow.Fcounter_uin = uin;
+}
+
+//设置凭证参数
+void CCoreAcct::setProofInfo(const CCoreProof& proof)
+{
+    Fproof_id = proof.Flistid;
+    m_flow.Flistid = proof.Flistid;
+    m_flow.Fsubject = proof.Fsubject;
+
+    //精简流水不写备注，变更日志开启时仍要带给下游
+    if(!CCoreFlow::compact() || CCoreChangeLog::instance()->enabled())
+    {
+        m_flow.Fmemo = proof.Fmemo;
+        m_flow.Ftrade_memo = proof.Ftrade_memo;
+    }
+}
+
+ //创建账户
+void CCoreAcct::createAcct()
+{
+    if(Facct_sign.empty()) Facct_sign = genAcctSign();
+
+    string strSql = sqlInsert() + sqlValues();
+
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+}
+
+//INSERT语句头
+const char* CCoreAcct::sqlInsert()
+{
+    return "INSERT INTO isp_os_core.t_account "
+        "(Fuid,Fsymbol,Fcur_type,Fledger_type,Fbalance_type,Fbalance,Fcon,Ftransit,Facct_state,Fuin,"
+        "Fname,Fip,Fmemo,Fmodify_time,Fcreate_time,Fbalance_time,Frecord_mode,Facct_sign,Fproof_id) "
+        "VALUES ";
+}
+
+//账户VALUES子句
+string CCoreAcct::sqlValues()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    snprintf(szSql, sizeof(szSql) - 1,
+        "(%lld,%d,'%s',%d,%d,%lld,%lld,%lld,%d,'%s','%s','%s','%s','%s','%s','%s',%d,'%s','%s')", 
+        Fuid, Fsymbol, Fcur_type.c_str(), Fledger_type, Fbalance_type, Fbalance, Fcon, Ftransit, Facct_state, 
+        Fuin.c_str(), m_ptrSql->EscapeStr(Fname).c_str(), Fip.c_str(), m_ptrSql->EscapeStr(Fmemo).c_str(), 
+        Fmodify_time.c_str(), Fcreate_time.c_str(), Fbalance_time.c_str(), Frecord_mode, Facct_sign.c_str(), 
+        Fproof_id.c_str());
+
+    return szSql;
+}
+
+//生成行签名
+string CCoreAcct::genAcctSign(bool bCreAcct)
+{
+    char szSrc[MAX_MSG_LEN] = {0};
+    snprintf(szSrc, sizeof(szSrc), 
+        "%lld:%s:%d:%s:%d:%d:%lld:%lld|acct",
+        Fuid, Fuin.c_str(), Fsymbol, Fcur_type.c_str(), Fledger_type, Fbalance_type,
+        bCreAcct? 0: Fbalance,
+        bCreAcct? 0: Fcon);
+
+    return GenerateDigest(szSrc);
+}
+
+
+/*****************
+ * 核心流水类 *
+******************/
+
+// 构造函数
+CCoreFlow::CCoreFlow()
+{  
+    //DB参数初始化
+    Fuid = 0;
+    Ftype = 0;
+    Faction_type = 0;
+    Fsubject = 0;
+    Fcounter_uid = 0;
+    Fbalance = 0;
+    Fcon = 0;
+    Fpaynum = 0;
+    Fconnum = 0;
+    Flabel = 0;
+    Ftimestamp = 0;
+
+    //私有变量初始化
+    m_ptrSql = getCoreLeaseHandle();
+}
+
+//析构函数
+CCoreFlow::~CCoreFlow()
+{
+    m_ptrSql = NULL;
+}
+
+//保存流水
+void CCoreFlow::saveFlow()
+{
+    string strSql = sqlInsert() + sqlValues();
+
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+}
+
+//INSERT语句头
+const char* CCoreFlow::sqlInsert()
+{
+    //精简模式省去Faction_type、备注、修改/冲正时间、说明，读取时由CCoreFlowReader补齐
+    if(m_bCompact)
+    {
+        return "INSERT INTO isp_os_core.t_flow "
+            "(Fcur_type,Flistid,Fuid,Fuin,Flist_source,Ftype,Fsubject,"
+            "Fcounter_uid,Fcounter_uin,Fbalance,Fcon,Fpaynum,Fconnum,Fip,"
+            "Fcreate_time,Flabel,Ftimestamp) "
+            "VALUES ";
+    }
+
+    return "INSERT INTO isp_os_core.t_flow "
+        "(Fcur_type,Flistid,Fuid,Fuin,Flist_source,Ftype,Faction_type,Fsubject,"
+        "Fcounter_uid,Fcounter_uin,Fbalance,Fcon,Fpaynum,Fconnum,Fip,Fmemo,Ftrade_memo,"
+        "Fmodify_time,Fcreate_time,Frollback_time,Fexplain,Flabel,Ftimestamp) "
+        "VALUES ";
+}
+
+//流水VALUES子句
+string CCoreFlow::sqlValues()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    //精简模式只有数值列和定长标识，不必逐条转义
+    if(m_bCompact)
+    {
+        snprintf(szSql, sizeof(szSql) - 1,
+            "('%s','%s',%lld,'%s','%s',%d,%d,%lld,'%s',%lld,%lld,%lld,%lld,'%s','%s',%d,%d)",
+            Fcur_type.c_str(), Flistid.c_str(), Fuid, Fuin.c_str(), Flist_source.c_str(),
+            Ftype, Fsubject, Fcounter_uid, Fcounter_uin.c_str(), Fbalance, Fcon, Fpaynum,
+            Fconnum, Fip.c_str(), Fcreate_time.c_str(), Flabel, Ftimestamp);
+
+        return szSql;
+    }
+
+    snprintf(szSql, sizeof(szSql) - 1,
+        "('%s','%s',%lld,'%s','%s',%d,%d,%d,%lld,'%s',%lld,%lld,%lld,%lld,"
+        "'%s','%s','%s','%s','%s','%s','%s',%d,%d)",
+        Fcur_type.c_str(), Flistid.c_str(), Fuid, Fuin.c_str(), Flist_source.c_str(),
+        Ftype, Faction_type, Fsubject, Fcounter_uid, Fcounter_uin.c_str(), Fbalance, 
+        Fcon, Fpaynum, Fconnum, Fip.c_str(), m_ptrSql->EscapeStr(Fmemo).c_str(), 
+        m_ptrSql->EscapeStr(Ftrade_memo).c_str(), Fmodify_time.c_str(), Fcreate_time.c_str(), 
+        Frollback_time.c_str(), Fexplain.c_str(), Flabel, Ftimestamp);
+
+    return szSql;
+}
+
+
+/*****************
+ * 核心记账批量写 *
+******************/
+
+// 构造函数
+CCorePipeline::CCorePipeline()
+{
+    m_ptrSql = getCoreLeaseHandle();
+    m_iFlow = 0;
+    m_iStmt = 0;
+    m_lChange = -1;
+    m_stamp.iSec = 0;
+    m_stamp.iUs = 0;
+}
+
+//析构函数
+CCorePipeline::~CCorePipeline()
+{
+    //事务没有提交，作废领取的变更日志序号
+    if(m_lChange >= 0)
+    {
+        CCoreChangeLog::instance()->cancel(m_lChange);
+    }
+    m_ptrSql = NULL;
+}
+
+//登记账户更新
+void CCorePipeline::addAcct(const CCoreAcct& acct)
+{
+    map<LONG, size_t>::iterator it = m_mapAcct.find(acct.Fuid);
+    if(it == m_mapAcct.end())
+    {
+        it = m_mapAcct.insert(make_pair(acct.Fuid, m_vecAcct.size())).first;
+        m_vecAcct.push_back(AcctUpdate());
+    }
+
+    AcctUpdate& update = m_vecAcct[it->second];
+    update.Fuid = acct.Fuid;
+    update.Fbalance = acct.Fbalance;
+    update.Fcon = acct.Fcon;
+    update.Facct_sign = acct.Facct_sign;
+    update.Fproof_id = acct.Fproof_id;
+    update.Ftimestamp = acct.Ftimestamp;
+    update.Ftimestamp_us = acct.Ftimestamp_us;
+}
+
+//登记流水
+void CCorePipeline::addFlow(CCoreFlow& flow)
+{
+    if(m_iFlow > 0) m_strFlow += ",";
+    m_vecFlowPos.push_back(m_strFlow.length());
+    m_strFlow += flow.sqlValues();
+    m_iFlow++;
+
+    addStat(flow);
+
+    if(CCoreChangeLog::instance()->enabled())
+    {
+        CCoreChangeFlow change;
+        change.Fcur_type = flow.Fcur_type;
+        change.Flistid = flow.Flistid;
+        change.Fuid = flow.Fuid;
+        change.Fuin = flow.Fuin;
+        change.Ftype = flow.Ftype;
+        change.Faction_type = flow.Faction_type;
+        change.Fsubject = flow.Fsubject;
+        change.Fcounter_uid = flow.Fcounter_uid;
+        change.Fcounter_uin = flow.Fcounter_uin;
+        change.Fbalance = flow.Fbalance;
+        change.Fcon = flow.Fcon;
+        change.Fpaynum = flow.Fpaynum;
+        change.Fconnum = flow.Fconnum;
+        change.Fmemo = flow.Fmemo;
+        change.Ftrade_memo = flow.Ftrade_memo;
+        change.Fcreate_time = flow.Fcreate_time;
+        change.Ftimestamp = flow.Ftimestamp;
+        m_vecChangeFlow.push_back(change);
+    }
+}
+
+//登记总账流水
+void CCorePipeline::addGLFlow(const CCoreFlow& flow, const CCoreStamp& stamp)
+{
+    m_vecGLFlow.push_back(flow);
+    m_vecGLStamp.push_back(stamp);
+    addStat(flow);
+}
+
+//登记日汇总增量
+void CCorePipeline::addStat(const CCoreFlow& flow)
+{
+    if(!CCoreFlowStat::instance()->enabled()) return;
+
+    m_vecStat.push_back(CCoreFlowStat::Delta());
+    CCoreFlowStat::toDelta(flow, m_vecStat.back());
+}
+
+//本事务的时间戳
+const CCoreStamp& CCorePipeline::stamp()
+{
+    if(0 == m_stamp.iSec)
+    {
+        CCoreClock::now(m_stamp);
+    }
+    return m_stamp;
+}
+
+//记录回退点
+void CCorePipeline::mark(Mark& mark) const
+{
+    mark.vecAcct = m_vecAcct;
+    mark.mapAcct = m_mapAcct;
+    mark.iFlowLen = m_strFlow.length();
+    mark.iFlow = m_iFlow;
+    mark.iGLFlow = m_vecGLFlow.size();
+    mark.iChangeFlow = m_vecChangeFlow.size();
+    mark.iStat = m_vecStat.size();
+}
+
+//回退到回退点
+void CCorePipeline::rollback(const Mark& mark)
+{
+    m_vecAcct = mark.vecAcct;
+    m_mapAcct = mark.mapAcct;
+    m_strFlow.resize(mark.iFlowLen);
+    m_iFlow = mark.iFlow;
+    m_vecFlowPos.resize(mark.iFlow);
+    m_vecGLFlow.erase(m_vecGLFlow.begin() + mark.iGLFlow, m_vecGLFlow.end());
+    m_vecGLStamp.erase(m_vecGLStamp.begin() + mark.iGLFlow, m_vecGLStamp.end());
+    m_vecChangeFlow.erase(m_vecChangeFlow.begin() + mark.iChangeFlow, m_vecChangeFlow.end());
+    m_vecStat.erase(m_vecStat.begin() + mark.iStat, m_vecStat.end());
+}
+
+//批量写入
+void CCorePipeline::flush()
+{
+    //flushAcct会清空m_vecAcct，先留一份给变更日志
+    CCoreChangeLog* ptrLog = CCoreChangeLog::instance();
+    if(ptrLog->enabled())
+    {
+        m_vecChangeAcct.insert(m_vecChangeAcct.end(), m_vecAcct.begin(), m_vecAcct.end());
+    }
+
+    m_iStmt = 0;
+    flushAcct();
+    flushFlow();
+    flushGLLink();
+
+    pthread_mutex_lock(&s_retryMutex);
+    s_pipeStat.lFlush++;
+    s_pipeStat.lStmt += m_iStmt;
+    pthread_mutex_unlock(&s_retryMutex);
+
+    //持有行锁时领取序号，同一账户的变更在日志中保持提交顺序
+    if(ptrLog->enabled() && (!m_vecChangeAcct.empty() || !m_vecChangeFlow.empty()))
+    {
+        if(m_lChange < 0)
+        {
+            m_lChange = ptrLog->reserve();
+        }
+
+        //记录随事务写入发件箱，提交后未落盘时重启可补写
+        CCoreChange change;
+        change.vecAcct = m_vecChangeAcct;
+        change.vecFlow = m_vecChangeFlow;
+        CCoreChangeLog::saveOutbox(m_ptrSql, m_lChange, change);
+    }
+}
+
+//事务提交后处理
+void CCorePipeline::afterCommit()
+{
+    int iFail = 0;
+
+    //总账流水提交后才能计入汇总
+    try
+    {
+        CCoreGLFlow::instance()->add(m_vecGLFlow, m_vecGLStamp);
+    }
+    catch(CException& e)
+    {
+        iFail++;
+    }
+    m_vecGLFlow.clear();
+    m_vecGLStamp.clear();
+
+    //日汇总只计已提交的流水
+    try
+    {
+        CCoreFlowStat::instance()->add(m_vecStat);
+    }
+    catch(CException& e)
+    {
+        iFail++;
+    }
+    m_vecStat.clear();
+
+    //延迟窗口内本线程的读走主库
+    CCoreReplicaRouter::markWrite();
 
-    //保存流水
-    m_flow.saveFlow();
-}
+    //提交后写变更日志
+    if(m_lChange >= 0)
+    {
+        CCoreChange change;
+        change.vecAcct.swap(m_vecChangeAcct);
+        change.vecFlow.swap(m_vecChangeFlow);
+        LONG lChange = m_lChange;
+        m_lChange = -1;
+        try
+        {
+            CCoreChangeLog::instance()->append(lChange, change);
+        }
+        catch(CException& e)
+        {
+            iFail++;
+        }
+    }
 
+    if(iFail > 0)
+    {
+        pthread_mutex_lock(&s_retryMutex);
+        s_lAfterCommitFail += iFail;
+        pthread_mutex_unlock(&s_retryMutex);
+    }
+}
 
-//设置对手方账户
-void CCoreAcct::setCounter(const LONG uid, const string uin)
+//提交后处理出错的次数
+LONG CCorePipeline::afterCommitFail()
 {
-    m_flow.Fcounter_uid = uid;
-    m_flow.Fcounter_uin = uin;
+    pthread_mutex_lock(&s_retryMutex);
+    LONG lFail = s_lAfterCommitFail;
+    pthread_mutex_unlock(&s_retryMutex);
+    return lFail;
 }
 
-//设置凭证参数
-void CCoreAcct::setProofInfo(const CCoreProof& proof)
+//获取写入统计
+void CCorePipeline::getStat(Stat& stat)
 {
-    Fproof_id = proof.Flistid;
-    m_flow.Flistid = proof.Flistid;
-    m_flow.Fsubject = proof.Fsubject;
-    m_flow.Fmemo = proof.Fmemo;
-    m_flow.Ftrade_memo = proof.Ftrade_memo;
+    pthread_mutex_lock(&s_retryMutex);
+    stat = s_pipeStat;
+    pthread_mutex_unlock(&s_retryMutex);
 }
 
- //创建账户
-void CCoreAcct::createAcct()
+//批量更新账户
+void CCorePipeline::flushAcct()
 {
-    char szSql[MAX_SQL_LEN] = {0};
+    if(m_vecAcct.empty()) return;
 
-    if(Facct_sign.empty()) Facct_sign = genAcctSign();
-
-    int iLen = snprintf(szSql, sizeof(szSql) - 1,
-        "INSERT INTO isp_os_core.t_account "
-        "(Fuid,Fsymbol,Fcur_type,Fledger_type,Fbalance_type,Fbalance,Fcon,Ftransit,Facct_state,Fuin,"
-        "Fname,Fip,Fmemo,Fmodify_time,Fcreate_time,Fbalance_time,Frecord_mode,Facct_sign,Fproof_id) "
-        "VALUES (%lld,%d,'%s',%d,%d,%lld,%lld,%lld,%d,'%s','%s','%s','%s','%s','%s','%s',%d,'%s','%s')", 
-        Fuid, Fsymbol, Fcur_type.c_str(), Fledger_type, Fbalance_type, Fbalance, Fcon, Ftransit, Facct_state, 
-        Fuin.c_str(), m_ptrSql->EscapeStr(Fname).c_str(), Fip.c_str(), m_ptrSql->EscapeStr(Fmemo).c_str(), 
-        Fmodify_time.c_str(), Fcreate_time.c_str(), Fbalance_time.c_str(), Frecord_mode, Facct_sign.c_str(), 
-        Fproof_id.c_str());
+    if(m_bBatch)
+    {
+        updateAcct(0, m_vecAcct.size());
+    }
+    else
+    {
+        for(size_t i = 0; i < m_vecAcct.size(); ++i)
+        {
+            updateAcct(i, i + 1);
+        }
+    }
 
-    m_ptrSql->Query(szSql, iLen);
+    m_vecAcct.clear();
+    m_mapAcct.clear();
 }
 
-//生成行签名
-string CCoreAcct::genAcctSign(bool bCreAcct)
+//一条UPDATE更新m_vecAcct[iBegin, iEnd)
+void CCorePipeline::updateAcct(const size_t iBegin, const size_t iEnd)
 {
-    char szSrc[MAX_MSG_LEN] = {0};
-    snprintf(szSrc, sizeof(szSrc), 
-        "%lld:%s:%d:%s:%d:%d:%lld:%lld|acct",
-        Fuid, Fuin.c_str(), Fsymbol, Fcur_type.c_str(), Fledger_type, Fbalance_type,
-        bCreAcct? 0: Fbalance,
-        bCreAcct? 0: Fcon);
-
-    return GenerateDigest(szSrc);
-}
+    char szItem[MAX_MSG_LEN] = {0};
+    string strBalance, strCon, strSign, strProof, strStamp, strStampUs, strUid;
 
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        const AcctUpdate& update = m_vecAcct[i];
+
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN %lld", update.Fuid, update.Fbalance);
+        strBalance += szItem;
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN %lld", update.Fuid, update.Fcon);
+        strCon += szItem;
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN '%s'", update.Fuid, update.Facct_sign.c_str());
+        strSign += szItem;
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN '%s'", update.Fuid, update.Fproof_id.c_str());
+        strProof += szItem;
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN %d", update.Fuid, update.Ftimestamp);
+        strStamp += szItem;
+        snprintf(szItem, sizeof(szItem), " WHEN %lld THEN %d", update.Fuid, update.Ftimestamp_us);
+        strStampUs += szItem;
+        snprintf(szItem, sizeof(szItem), "%s%lld", i == iBegin? "": ",", update.Fuid);
+        strUid += szItem;
+    }
 
-/*****************
- * 核心流水类 *
-******************/
+    string strSql = 
+        "UPDATE isp_os_core.t_account "
+        "SET Fbalance = CASE Fuid" + strBalance + " END, "
+        "Fcon = CASE Fuid" + strCon + " END, "
+        "Facct_sign = CASE Fuid" + strSign + " END, "
+        "Fproof_id = CASE Fuid" + strProof + " END, "
+        "Fmodify_time = now(), Fbalance_time = now(), "
+        "Ftimestamp = CASE Fuid" + strStamp + " END, "
+        "Ftimestamp_us = CASE Fuid" + strStampUs + " END "
+        "WHERE Fuid IN (" + strUid + ")";
 
-// 构造函数
-CCoreFlow::CCoreFlow()
-{  
-    //DB参数初始化
-    Fuid = 0;
-    Ftype = 0;
-    Faction_type = 0;
-    Fsubject = 0;
-    Fcounter_uid = 0;
-    Fbalance = 0;
-    Fcon = 0;
-    Fpaynum = 0;
-    Fconnum = 0;
-    Flabel = 0;
-    Ftimestamp = 0;
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+    m_iStmt++;
 
-    //私有变量初始化
-    m_ptrSql = getCoreDBHandle();
+    if((int)(iEnd - iBegin) != m_ptrSql->AffectedRows())
+    {
+        throw CException(ERR_DB_AFFECT_ROW, "pipeline updateAcct failed: affected row not match", __FILE__, __LINE__);
+    }
 }
 
-//析构函数
-CCoreFlow::~CCoreFlow()
+//批量写流水
+void CCorePipeline::flushFlow()
 {
-    m_ptrSql = NULL;
+    if(m_iFlow == 0) return;
+
+    if(m_bBatch)
+    {
+        string strSql = CCoreFlow::sqlInsert() + m_strFlow;
+        m_ptrSql->Query(strSql.c_str(), strSql.length());
+        m_iStmt++;
+    }
+    else
+    {
+        //逐条写，下一条的起点前是分隔的逗号
+        for(size_t i = 0; i < m_vecFlowPos.size(); ++i)
+        {
+            size_t iEnd = (i + 1 < m_vecFlowPos.size())? m_vecFlowPos[i + 1] - 1: m_strFlow.length();
+            string strSql = CCoreFlow::sqlInsert() + m_strFlow.substr(m_vecFlowPos[i], iEnd - m_vecFlowPos[i]);
+            m_ptrSql->Query(strSql.c_str(), strSql.length());
+            m_iStmt++;
+        }
+    }
+
+    m_strFlow = "";
+    m_iFlow = 0;
+    m_vecFlowPos.clear();
 }
 
-//保存流水
-void CCoreFlow::saveFlow()
+//写总账流水汇总关联，与总账更新同一事务，重启后据此恢复未写出的汇总
+void CCorePipeline::flushGLLink()
 {
-    char szSql[MAX_SQL_LEN] = {0};
-
-    int iLen = snprintf(szSql, sizeof(szSql) - 1,
-        "INSERT INTO isp_os_core.t_flow "
-        "(Fcur_type,Flistid,Fuid,Fuin,Flist_source,Ftype,Faction_type,Fsubject,"
-        "Fcounter_uid,Fcounter_uin,Fbalance,Fcon,Fpaynum,Fconnum,Fip,Fmemo,Ftrade_memo,"
-        "Fmodify_time,Fcreate_time,Frollback_time,Fexplain,Flabel,Ftimestamp) "
-        "VALUES ('%s','%s',%lld,'%s','%s',%d,%d,%d,%lld,'%s',%lld,%lld,%lld,%lld,"
-        "'%s','%s','%s','%s','%s','%s','%s',%d,%d)",
-        Fcur_type.c_str(), Flistid.c_str(), Fuid, Fuin.c_str(), Flist_source.c_str(),
-        Ftype, Faction_type, Fsubject, Fcounter_uid, Fcounter_uin.c_str(), Fbalance, 
-        Fcon, Fpaynum, Fconnum, Fip.c_str(), m_ptrSql->EscapeStr(Fmemo).c_str(), 
-        m_ptrSql->EscapeStr(Ftrade_memo).c_str(), Fmodify_time.c_str(), Fcreate_time.c_str(), 
-        Frollback_time.c_str(), Fexplain.c_str(), Flabel, Ftimestamp);
+    if(m_vecGLFlow.empty()) return;
 
-    m_ptrSql->Query(szSql, iLen);
+    string strSql = CCoreGLFlow::instance()->sqlLink(m_vecGLFlow, m_vecGLStamp);
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+    m_iStmt++;
 }
 
 
@@ -791,7 +2230,7 @@ CCoreProof::CCoreProof()
     clear();
 
     //私有变量初始化
-    m_ptrSql = getCoreDBHandle();
+    m_ptrSql = getCoreLeaseHandle();
 }
 
 //析构函数
@@ -800,6 +2239,53 @@ CCoreProof::~CCoreProof()
     m_ptrSql = NULL;
 }
 
+//是否合法标识
+bool CCoreProof::isIdent(const char* ptrStr, const size_t iLen, const size_t iMaxLen, const bool bAlnumOnly)
+{
+    if(0 == iLen || iLen > iMaxLen) return false;
+
+    for(size_t i = 0; i < iLen; ++i)
+    {
+        char c = ptrStr[i];
+        if((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) continue;
+        if(!bAlnumOnly && (c == '_' || c == '-' || c == '.' || c == '@' || c == ':')) continue;
+        return false;
+    }
+    return true;
+}
+
+//校验标识类字段，可选的uin（附加账户、未用的总账）允许为空
+void CCoreProof::checkParam() const
+{
+    const string* arrOptional[] =
+    {
+        &Foutter_prove, &Fip, &Fdebit_uin, &Fdebit_ex_uin, &Fcredit_uin, &Fcredit_ex_uin,
+        &Fdebit_gl_uin, &Fdebit_exgl_uin, &Fcredit_gl_uin, &Fcredit_exgl_uin
+    };
+
+    bool bOk = isIdent(Flistid.data(), Flistid.length(), MAX_ID_LEN)
+        && isIdent(Fcur_type.data(), Fcur_type.length(), MAX_CUR_LEN, true)
+        && Fmemo.length() <= MAX_MEMO_LEN
+        && Ftrade_memo.length() <= MAX_MEMO_LEN;
+
+    for(size_t i = 0; bOk && i < sizeof(arrOptional) / sizeof(arrOptional[0]); ++i)
+    {
+        const string& str = *arrOptional[i];
+        bOk = str.empty() || isIdent(str.data(), str.length(), MAX_ID_LEN);
+    }
+    for(size_t i = 0; bOk && i < Flegs.size(); ++i)
+    {
+        const CCoreProofLeg& leg = Flegs[i];
+        bOk = (leg.Fuin.empty() || isIdent(leg.Fuin.data(), leg.Fuin.length(), MAX_ID_LEN))
+            && (leg.Fgl_uin.empty() || isIdent(leg.Fgl_uin.data(), leg.Fgl_uin.length(), MAX_ID_LEN));
+    }
+
+    if(!bOk)
+    {
+        throw CException(ERR_CORE_BAD_PARAM, "core proof: illegal listid, cur_type, uin or memo", __FILE__, __LINE__);
+    }
+}
+
 //清理函数
 void CCoreProof::clear()
 {
@@ -838,10 +2324,104 @@ void CCoreProof::clear()
     Fcredit_exgl_uin = "";
     Fcredit_exgl_uid = 0;
     Fproof_sign = "";
+    Fcon_remain = 0;
+    Fsub_seq = 0;
+    Fsub_amount = 0;
+    Fleg_num = 0;
+    Flegs.clear();
+}
+
+//SELECT字段列表，与parseRow一一对应
+const char* CCoreProof::sqlSelect()
+{
+    return "Flistid,Fcur_type,Fsubject,Foutter_prove,Ftype,Fstate,Frecord_state,Fip,Fmemo,Ftrade_memo,"
+        "Fcreate_time,Fmodify_time,Ftotalnum,Frolenum,Fdebit_uid,Fdebit_uin,Fdebit_amount,Fdebit_ex_uid,"
+        "Fdebit_ex_uin,Fdebit_ex_amount,Fcredit_uid,Fcredit_uin,Fcredit_amount,Fcredit_ex_uid,"
+        "Fcredit_ex_uin,Fcredit_ex_amount,Fdebit_gl_uid,Fdebit_gl_uin,Fdebit_exgl_uid,Fdebit_exgl_uin,"
+        "Fcredit_gl_uid,Fcredit_gl_uin,Fcredit_exgl_uid,Fcredit_exgl_uin,Fproof_sign,Fcon_remain,Fleg_num";
+}
+
+//解析查询结果行
+void CCoreProof::parseRow(MYSQL_ROW row)
+{
+    Flistid = row[0]? row[0]: "";
+    Fcur_type = row[1]? row[1]: "";
+    Fsubject = row[2]? atoi(row[2]): 0;
+    Foutter_prove = row[3]? row[3]: "";
+    Ftype = row[4]? atoi(row[4]): 0;
+    Fstate = row[5]? atoi(row[5]): 0;
+    Frecord_state = row[6]? atoi(row[6]): 0;
+    Fip = row[7]? row[7]: "";
+    Fmemo = row[8]? row[8]: "";
+    Ftrade_memo = row[9]? row[9]: "";
+    Fcreate_time = row[10]? row[10]: "";
+    Fmodify_time = row[11]? row[11]: "";
+    Ftotalnum = row[12]? atoll(row[12]): 0;
+    Frolenum = row[13]? atoi(row[13]): 0;
+    Fdebit_uid = row[14]? atoll(row[14]): 0;
+    Fdebit_uin = row[15]? row[15]: "";
+    Fdebit_amount = row[16]? atoll(row[16]): 0;
+    Fdebit_ex_uid = row[17]? atoll(row[17]): 0;
+    Fdebit_ex_uin = row[18]? row[18]: "";
+    Fdebit_ex_amount = row[19]? atoll(row[19]): 0;
+    Fcredit_uid = row[20]? atoll(row[20]): 0;
+    Fcredit_uin = row[21]? row[21]: "";
+    Fcredit_amount = row[22]? atoll(row[22]): 0;
+    Fcredit_ex_uid = row[23]? atoll(row[23]): 0;
+    Fcredit_ex_uin = row[24]? row[24]: "";
+    Fcredit_ex_amount = row[25]? atoll(row[25]): 0;
+    Fdebit_gl_uid = row[26]? atoll(row[26]): 0;
+    Fdebit_gl_uin = row[27]? row[27]: "";
+    Fdebit_exgl_uid = row[28]? atoll(row[28]): 0;
+    Fdebit_exgl_uin = row[29]? row[29]: "";
+    Fcredit_gl_uid = row[30]? atoll(row[30]): 0;
+    Fcredit_gl_uin = row[31]? row[31]: "";
+    Fcredit_exgl_uid = row[32]? atoll(row[32]): 0;
+    Fcredit_exgl_uin = row[33]? row[33]: "";
+    Fproof_sign = row[34]? row[34]: "";
+    Fcon_remain = row[35]? atoll(row[35]): 0;
+    Fleg_num = row[36]? atoi(row[36]): 0;
+
+    //老的冻结凭证没有记剩余冻结金额
+    if(Ftype == TYPE_freeze && Fstate == STATE_after && Fcon_remain == 0)
+    {
+        Fcon_remain = Fdebit_amount;
+    }
 }
 
 //查询凭证
 bool CCoreProof::queryProof(bool bLock)
+{
+    //非加锁读先走从库，没找到或还未终态时以主库为准
+    CCoreReplicaRouter* ptrRouter = CCoreReplicaRouter::instance();
+    if(!bLock && ptrRouter->enabled())
+    {
+        CCoreReadLease read(m_ptrSql);
+        if(read.handle())
+        {
+            bool bHit = false;
+            try
+            {
+                bHit = selectProof(read.handle(), false) && Fstate == STATE_after;
+            }
+            catch(CException& e)
+            {
+                read.setSuspect();
+            }
+            ptrRouter->count(true, !bHit);
+            if(bHit) return true;
+        }
+        else
+        {
+            ptrRouter->count(false, false);
+        }
+    }
+
+    return selectProof(m_ptrSql, bLock);
+}
+
+//在指定连接上查询凭证
+bool CCoreProof::selectProof(CMySQL* ptrSql, bool bLock)
 {
     char szSql[MAX_SQL_LEN] = {0};
     MYSQL_RES* pRes = NULL;
@@ -849,17 +2429,13 @@ bool CCoreProof::queryProof(bool bLock)
     try
     {
         int iLen = snprintf(szSql, sizeof(szSql),
-            "SELECT Flistid,Fcur_type,Fsubject,Foutter_prove,Ftype,Fstate,Frecord_state,Fip,Fmemo,Ftrade_memo,"
-            "Fcreate_time,Fmodify_time,Ftotalnum,Frolenum,Fdebit_uid,Fdebit_uin,Fdebit_amount,Fdebit_ex_uid,"
-            "Fdebit_ex_uin,Fdebit_ex_amount,Fcredit_uid,Fcredit_uin,Fcredit_amount,Fcredit_ex_uid,"
-            "Fcredit_ex_uin,Fcredit_ex_amount,Fdebit_gl_uid,Fdebit_gl_uin,Fdebit_exgl_uid,Fdebit_exgl_uin,"
-            "Fcredit_gl_uid,Fcredit_gl_uin,Fcredit_exgl_uid,Fcredit_exgl_uin,Fproof_sign "
+            "SELECT %s "
             "FROM isp_os_core.t_proof "
             "WHERE Flistid = '%s' %s",
-            Flistid.c_str(), bLock? "FOR UPDATE": "");
+            sqlSelect(), Flistid.c_str(), bLock? "FOR UPDATE": "");
 
-        m_ptrSql->Query(szSql, iLen);
-        pRes = m_ptrSql->FetchResult();
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
         int iRow = mysql_num_rows(pRes);
 
         if(0 == iRow)
@@ -868,6 +2444,7 @@ bool CCoreProof::queryProof(bool bLock)
             {
                 throw CException(ERR_DB_NONE_ROW, "queryProof: result num is 0!", __FILE__, __LINE__);
             }
+            mysql_free_result(pRes);
             return false;
         }
 
@@ -878,43 +2455,16 @@ bool CCoreProof::queryProof(bool bLock)
 
         MYSQL_ROW row = mysql_fetch_row(pRes);
 
-        Flistid = row[0]? row[0]: "";
-        Fcur_type = row[1]? row[1]: "";
-        Fsubject = row[2]? atoi(row[2]): 0;
-        Foutter_prove = row[3]? row[3]: "";
-        Ftype = row[4]? atoi(row[4]): 0;
-        Fstate = row[5]? atoi(row[5]): 0;
-        Frecord_state = row[6]? atoi(row[6]): 0;
-        Fip = row[7]? row[7]: "";
-        Fmemo = row[8]? row[8]: "";
-        Ftrade_memo = row[9]? row[9]: "";
-        Fcreate_time = row[10]? row[10]: "";
-        Fmodify_time = row[11]? row[11]: "";
-        Ftotalnum = row[12]? atoll(row[12]): 0;
-        Frolenum = row[13]? atoi(row[13]): 0;
-        Fdebit_uid = row[14]? atoll(row[14]): 0;
-        Fdebit_uin = row[15]? row[15]: "";
-        Fdebit_amount = row[16]? atoll(row[16]): 0;
-        Fdebit_ex_uid = row[17]? atoll(row[17]): 0;
-        Fdebit_ex_uin = row[18]? row[18]: "";
-        Fdebit_ex_amount = row[19]? atoll(row[19]): 0;
-        Fcredit_uid = row[20]? atoll(row[20]): 0;
-        Fcredit_uin = row[21]? row[21]: "";
-        Fcredit_amount = row[22]? atoll(row[22]): 0;
-        Fcredit_ex_uid = row[23]? atoll(row[23]): 0;
-        Fcredit_ex_uin = row[24]? row[24]: "";
-        Fcredit_ex_amount = row[25]? atoll(row[25]): 0;
-        Fdebit_gl_uid = row[26]? atoll(row[26]): 0;
-        Fdebit_gl_uin = row[27]? row[27]: "";
-        Fdebit_exgl_uid = row[28]? atoll(row[28]): 0;
-        Fdebit_exgl_uin = row[29]? row[29]: "";
-        Fcredit_gl_uid = row[30]? atoll(row[30]): 0;
-        Fcredit_gl_uin = row[31]? row[31]: "";
-        Fcredit_exgl_uid = row[32]? atoll(row[32]): 0;
-        Fcredit_exgl_uin = row[33]? row[33]: "";
-        Fproof_sign = row[34]? row[34]: "";
+        parseRow(row);
 
         mysql_free_result(pRes);
+        pRes = NULL;
+
+        //多方凭证加载分录
+        if(Fleg_num > 0)
+        {
+            queryLegs();
+        }
     
         return true;
     }
@@ -933,6 +2483,7 @@ void CCoreProof::saveProof()
 {
     char szSql[MAX_SQL_LEN] = {0};
     
+    Fleg_num = Flegs.size();
     if(Fproof_sign.empty()) genProofSign();
 
     int iLen = snprintf(szSql, sizeof(szSql) - 1,
@@ -941,16 +2492,34 @@ void CCoreProof::saveProof()
         "Fcreate_time,Fmodify_time,Ftotalnum,Frolenum,Fdebit_uid,Fdebit_uin,Fdebit_amount,"
         "Fdebit_ex_uid,Fdebit_ex_uin,Fdebit_ex_amount,Fcredit_uid,Fcredit_uin,Fcredit_amount,"
         "Fcredit_ex_uid,Fcredit_ex_uin,Fcredit_ex_amount,Fdebit_gl_uid,Fdebit_gl_uin,Fdebit_exgl_uid,"
-        "Fdebit_exgl_uin,Fcredit_gl_uid,Fcredit_gl_uin,Fcredit_exgl_uid,Fcredit_exgl_uin,Fproof_sign) "
+        "Fdebit_exgl_uin,Fcredit_gl_uid,Fcredit_gl_uin,Fcredit_exgl_uid,Fcredit_exgl_uin,Fproof_sign,Fcon_remain,Fleg_num) "
         "VALUES ('%s','%s',%d,'%s',%d,%d,%d,'%s','%s','%s','%s','%s',%lld,%d,%lld,'%s',%lld,%lld,'%s',"
-        "%lld,%lld,'%s',%lld,%lld,'%s',%lld,%lld,'%s',%lld,'%s',%lld,'%s',%lld,'%s','%s')", 
+        "%lld,%lld,'%s',%lld,%lld,'%s',%lld,%lld,'%s',%lld,'%s',%lld,'%s',%lld,'%s','%s',%lld,%d)", 
         Flistid.c_str(), Fcur_type.c_str(), Fsubject, Foutter_prove.c_str(), Ftype, Fstate, Frecord_state, 
         Fip.c_str(), m_ptrSql->EscapeStr(Fmemo).c_str(), m_ptrSql->EscapeStr(Ftrade_memo).c_str(),
         Fcreate_time.c_str(), Fmodify_time.c_str(), Ftotalnum, Frolenum, Fdebit_uid, Fdebit_uin.c_str(), 
         Fdebit_amount, Fdebit_ex_uid, Fdebit_ex_uin.c_str(), Fdebit_ex_amount, Fcredit_uid, Fcredit_uin.c_str(), 
         Fcredit_amount, Fcredit_ex_uid, Fcredit_ex_uin.c_str(), Fcredit_ex_amount, Fdebit_gl_uid, 
         Fdebit_gl_uin.c_str(), Fdebit_exgl_uid, Fdebit_exgl_uin.c_str(), Fcredit_gl_uid, Fcredit_gl_uin.c_str(), 
-        Fcredit_exgl_uid, Fcredit_exgl_uin.c_str(), Fproof_sign.c_str());
+        Fcredit_exgl_uid, Fcredit_exgl_uin.c_str(), Fproof_sign.c_str(), Fcon_remain, Fleg_num);
+
+    //多方凭证的凭证和分录一起写入
+    if(Fleg_num > 0)
+    {
+        try
+        {
+            m_ptrSql->Begin();
+            m_ptrSql->Query(szSql, iLen);
+            saveLegs();
+            m_ptrSql->Commit();
+        }
+        catch(CException& e)
+        {
+            m_ptrSql->Rollback();
+            throw;
+        }
+        return;
+    }
 
     m_ptrSql->Query(szSql, iLen);
 }
@@ -960,12 +2529,16 @@ void CCoreProof::complete()
 {
     char szSql[MAX_SQL_LEN] = {0};
 
+    //冻结完成时记下剩余冻结金额，供分次解冻扣减
+    Fcon_remain = (Ftype == TYPE_freeze)? Fdebit_amount: 0;
+
     int iLen = snprintf(szSql, sizeof(szSql) - 1,
         "UPDATE isp_os_core.t_proof "
-        "SET Fstate = %d, Fmodify_time = now() "
+        "SET Fstate = %d, Fcon_remain = %lld, Fmodify_time = now() "
         "WHERE Flistid = '%s' AND Fstate = %d "
         "AND Frecord_state = 1",
         CCoreProof::STATE_after,
+        Fcon_remain,
         Flistid.c_str(),
         CCoreProof::STATE_before);
 
@@ -977,29 +2550,207 @@ void CCoreProof::complete()
     }
 }
 
-//修改凭证类型，重置凭证状态
-void CCoreProof::reset()
+//已完成的冻结凭证直接流转为解冻完成
+void CCoreProof::transit(const int iToType)
 {
     char szSql[MAX_SQL_LEN] = {0};
-    genProofSign();
 
     int iLen = snprintf(szSql, sizeof(szSql) - 1,
         "UPDATE isp_os_core.t_proof "
-        "SET Ftype = %d, Fstate = %d, "
-        "Fproof_sign = '%s', Fmodify_time = now() "
-        "WHERE Flistid = '%s' AND Fstate = %d "
+        "SET Ftype = %d, Fcon_remain = 0, Fmodify_time = now() "
+        "WHERE Flistid = '%s' AND Ftype = %d AND Fstate = %d "
         "AND Frecord_state = 1",
-        Ftype,
-        CCoreProof::STATE_before,
-        Fproof_sign.c_str(),
+        iToType,
         Flistid.c_str(),
+        CCoreProof::TYPE_freeze,
         CCoreProof::STATE_after);
 
     m_ptrSql->Query(szSql, iLen);
 
     if(1 != m_ptrSql->AffectedRows())
     {
-        throw CException(ERR_DB_AFFECT_ROW, "updateProofState failed: affected row != 1", __FILE__, __LINE__);
+        throw CException(ERR_DB_AFFECT_ROW, "transitProof failed: affected row != 1", __FILE__, __LINE__);
+    }
+
+    Ftype = iToType;
+    Fstate = CCoreProof::STATE_after;
+    Fcon_remain = 0;
+}
+
+//查询子凭证
+bool CCoreProof::querySub(int& iType, LONG& lAmount)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Ftype,Famount FROM isp_os_core.t_proof_sub "
+        "WHERE Flistid = '%s' AND Fseq = %d",
+        Flistid.c_str(), Fsub_seq);
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    if(NULL == row)
+    {
+        mysql_free_result(pRes);
+        return false;
+    }
+
+    iType = row[0]? atoi(row[0]): 0;
+    lAmount = row[1]? atoll(row[1]): 0;
+    mysql_free_result(pRes);
+
+    return true;
+}
+
+//创建子凭证
+void CCoreProof::saveSub()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT INTO isp_os_core.t_proof_sub "
+        "(Flistid,Fseq,Ftype,Famount,Fcreate_time,Fmodify_time) "
+        "VALUES ('%s',%d,%d,%lld,now(),now())",
+        Flistid.c_str(), Fsub_seq, Ftype, Fsub_amount);
+
+    m_ptrSql->Query(szSql, iLen);
+}
+
+//记录记账失败，事务已回滚，单独提交
+void CCoreProof::saveReject(const int iError)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT INTO isp_os_core.t_proof_reject (Flistid,Ferror,Fcreate_time) "
+        "VALUES ('%s',%d,now()) ON DUPLICATE KEY UPDATE Ferror = VALUES(Ferror)",
+        Flistid.c_str(), iError);
+
+    try
+    {
+        m_ptrSql->Query(szSql, iLen);
+    }
+    catch(CException& e)
+    {
+        //记录失败时凭证可能被恢复任务推进，与没有应答就中断的情形相同
+    }
+}
+
+//分次解冻，扣减剩余冻结金额
+void CCoreProof::unfreezePart(const LONG lAmount)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    LONG lRemain = Fcon_remain - lAmount;
+
+    //扣完后按最后一次的解冻类型完成凭证，否则仍为冻结完成
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "UPDATE isp_os_core.t_proof "
+        "SET Ftype = %d, Fcon_remain = %lld, Fmodify_time = now() "
+        "WHERE Flistid = '%s' AND Ftype = %d AND Fstate = %d "
+        "AND Frecord_state = 1",
+        lRemain == 0? Ftype: (int)CCoreProof::TYPE_freeze,
+        lRemain,
+        Flistid.c_str(),
+        CCoreProof::TYPE_freeze,
+        CCoreProof::STATE_after);
+
+    m_ptrSql->Query(szSql, iLen);
+
+    if(1 != m_ptrSql->AffectedRows())
+    {
+        throw CException(ERR_DB_AFFECT_ROW, "unfreezePart failed: affected row != 1", __FILE__, __LINE__);
+    }
+
+    Fcon_remain = lRemain;
+}
+
+//查询分录
+void CCoreProof::queryLegs()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fseq,Fdirection,Fuid,Fuin,Fgl_uid,Fgl_uin,Famount "
+        "FROM isp_os_core.t_proof_leg "
+        "WHERE Flistid = '%s' ORDER BY Fseq",
+        Flistid.c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    Flegs.clear();
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        CCoreProofLeg leg;
+        leg.Fseq = row[0]? atoi(row[0]): 0;
+        leg.Fdirection = row[1]? atoi(row[1]): 0;
+        leg.Fuid = row[2]? atoll(row[2]): 0;
+        leg.Fuin = row[3]? row[3]: "";
+        leg.Fgl_uid = row[4]? atoll(row[4]): 0;
+        leg.Fgl_uin = row[5]? row[5]: "";
+        leg.Famount = row[6]? atoll(row[6]): 0;
+        Flegs.push_back(leg);
+    }
+    mysql_free_result(pRes);
+
+    if((int)Flegs.size() != Fleg_num)
+    {
+        throw CException(ERR_DB_MULTI_ROW, "queryLegs: leg num not match", __FILE__, __LINE__);
+    }
+}
+
+//批量创建分录
+void CCoreProof::saveLegs()
+{
+    char szRow[MAX_SQL_LEN] = {0};
+    string strSql = 
+        "INSERT INTO isp_os_core.t_proof_leg "
+        "(Flistid,Fseq,Fdirection,Fuid,Fuin,Fgl_uid,Fgl_uin,Famount,Fcreate_time) VALUES ";
+
+    for(size_t i = 0; i < Flegs.size(); ++i)
+    {
+        const CCoreProofLeg& leg = Flegs[i];
+        snprintf(szRow, sizeof(szRow) - 1, "%s('%s',%d,%d,%lld,'%s',%lld,'%s',%lld,now())",
+            i == 0? "": ",",
+            Flistid.c_str(), leg.Fseq, leg.Fdirection, leg.Fuid, leg.Fuin.c_str(),
+            leg.Fgl_uid, leg.Fgl_uin.c_str(), leg.Famount);
+        strSql += szRow;
+    }
+
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+}
+
+//校验分录方向和借贷平衡
+void CCoreProof::checkLegs() const
+{
+    LONG lDebit = 0, lCredit = 0;
+    int iDebit = 0, iCredit = 0;
+    for(size_t i = 0; i < Flegs.size(); ++i)
+    {
+        if(Flegs[i].Fdirection == OP_debit)
+        {
+            lDebit += Flegs[i].Famount;
+            iDebit++;
+        }
+        else if(Flegs[i].Fdirection == OP_credit)
+        {
+            lCredit += Flegs[i].Famount;
+            iCredit++;
+        }
+        else
+        {
+            throw CException(ERR_BAD_BRANCH, "core proof: wrong leg direction", __FILE__, __LINE__);
+        }
+    }
+
+    if(lDebit != lCredit || 0 == iDebit || 0 == iCredit)
+    {
+        throw CException(ERR_PARARM_DIFFER, "core proof: legs not balanced", __FILE__, __LINE__);
     }
 }
 
@@ -1014,5 +2765,21 @@ void CCoreProof::genProofSign()
         Fcredit_ex_amount,Fdebit_gl_uid,Fdebit_gl_uin.c_str(),Fdebit_exgl_uid,Fdebit_exgl_uin.c_str(),Fcredit_gl_uid,
         Fcredit_gl_uin.c_str(),Fcredit_exgl_uid,Fcredit_exgl_uin.c_str(),Fsubject);
 
+    //多方凭证签名覆盖全部分录，普通凭证签名不变
+    if(!Flegs.empty())
+    {
+        string strSrc = szSrc;
+        for(size_t i = 0; i < Flegs.size(); ++i)
+        {
+            const CCoreProofLeg& leg = Flegs[i];
+            snprintf(szSrc, sizeof(szSrc), ":%d:%d:%lld:%s:%lld:%s:%lld",
+                leg.Fseq, leg.Fdirection, leg.Fuid, leg.Fuin.c_str(),
+                leg.Fgl_uid, leg.Fgl_uin.c_str(), leg.Famount);
+            strSrc += szSrc;
+        }
+        Fproof_sign = GenerateDigest(strSrc.c_str());
+        return;
+    }
+
     Fproof_sign = GenerateDigest(szSrc);
 }
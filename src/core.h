@@ -3,11 +3,57 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include "exception.h"
 #include "sqlapi.h"
+#include "coredbpool.h"
+#include "corecurrency.h"
+#include "coreshard.h"
+#include "coreglflow.h"
+#include "corechangelog.h"
+#include "coreflowstat.h"
+#include "corereplica.h"
+#include "coreclock.h"
+#include "coreadmission.h"
+#include "corehot.h"
+
+/*
+ * 记账动作
+ */
+enum POST_OP
+{
+    OP_none = 0,
+    OP_debit = 1,
+    OP_credit = 2,
+    OP_freeze = 3,
+    OP_unfreeze = 4
+};
+
+/*
+ * 凭证分录，多方凭证的每一方一条
+ * 存isp_os_core.t_proof_leg(Flistid, Fseq, Fdirection, Fuid, Fuin, Fgl_uid, Fgl_uin, Famount, Fcreate_time)，主键(Flistid, Fseq)
+ * 凭证的分录数记在t_proof.Fleg_num，上线前先在各分区执行：
+ *   ALTER TABLE isp_os_core.t_proof ADD COLUMN Fleg_num INT NOT NULL DEFAULT 0;
+ */
+struct CCoreProofLeg
+{
+    int Fseq;
+    int Fdirection; //OP_debit/OP_credit
+    LONG Fuid;
+    string Fuin;
+    LONG Fgl_uid;
+    string Fgl_uin;
+    LONG Famount;
+};
 
 /*
  * 核心凭证类
+ * 分次解冻依赖的表结构，上线前先在各分区执行：
+ *   ALTER TABLE isp_os_core.t_proof ADD COLUMN Fcon_remain BIGINT NOT NULL DEFAULT 0;
+ *   isp_os_core.t_proof_sub(Flistid, Fseq, Ftype, Famount, Fcreate_time, Fmodify_time)，主键(Flistid, Fseq)
+ * 存量已完成冻结凭证的Fcon_remain为0，读出时按Fdebit_amount补齐，无需回填
+ * 记账失败（已应答调用方失败）的凭证在isp_os_core.t_proof_reject(Flistid主键, Ferror, Fcreate_time)记一行，
+ * 滞留凭证恢复跳过这些凭证，只推进没有应答就中断的
  */
 class CCoreProof
 {
@@ -38,18 +84,69 @@ public:
     //查询凭证
     bool queryProof(bool bLock = false);
 
+    //解析查询结果行
+    void parseRow(MYSQL_ROW row);
+
+    //SELECT字段列表，与parseRow一一对应
+    static const char* sqlSelect();
+
     //创建凭证
     void saveProof();
 
     //凭证置为已使用
     void complete();
 
-    //修改凭证类型，重置凭证状态
-    void reset();
+    //已完成的冻结凭证直接流转为解冻完成，与记账同一事务
+    void transit(const int iToType);
+
+    //查询子凭证（分次解冻），返回是否存在
+    bool querySub(int& iType, LONG& lAmount);
+
+    //创建子凭证
+    void saveSub();
+
+    //记录记账失败，自身出错时忽略
+    void saveReject(const int iError);
+
+    //分次解冻，扣减剩余冻结金额，扣完后凭证流转为解冻完成
+    void unfreezePart(const LONG lAmount);
+
+    //查询分录
+    void queryLegs();
+
+    //批量创建分录
+    void saveLegs();
+
+    //校验分录方向和借贷平衡，不合法抛异常
+    void checkLegs() const;
 
     //生成行签名
     void genProofSign();
 
+    //校验标识类字段的字符集和长度，这些字段不转义直接拼进SQL，不合法抛ERR_CORE_BAD_PARAM
+    void checkParam() const;
+
+    //是否合法标识：非空，不超过iMaxLen，只含字母数字和bAlnumOnly为false时的_-.@:
+    static bool isIdent(const char* ptrStr, const size_t iLen, const size_t iMaxLen, const bool bAlnumOnly = false);
+
+    //字段长度上限
+    enum
+    {
+        MAX_ID_LEN = 64,    //凭证号、外部单号、uin、ip
+        MAX_CUR_LEN = 8,    //币种
+        MAX_MEMO_LEN = 255  //备注
+    };
+
+    //切换数据库句柄（事务租约）
+    void setDBHandle(CMySQL* ptrSql) { m_ptrSql = ptrSql; }
+
+    //改用租约的连接，租约结束时句柄置空
+    void setDBHandle(CCoreDBLease& lease) { m_ptrSql = lease.handle(); lease.bind(m_ptrSql); }
+
+protected:
+    //在指定连接上查询凭证
+    bool selectProof(CMySQL* ptrSql, bool bLock);
+
 public:
     /*
      * 对外数据库字段
@@ -90,6 +187,21 @@ public:
     LONG Fcredit_exgl_uid;
     string Fcredit_exgl_uin;
     string Fproof_sign;
+    LONG Fcon_remain; //剩余冻结金额
+    int Fleg_num; //多方凭证分录数，0为普通凭证
+
+    /*
+     * 请求参数，不入t_proof
+     * Fsub_seq > 0 时为分次解冻，子凭证键(Flistid, Fsub_seq)存isp_os_core.t_proof_sub
+     */
+    int Fsub_seq;
+    LONG Fsub_amount;
+
+    /*
+     * 多方凭证分录，非空时替代固定的借贷/附加账户字段
+     * 目前只支持直接记账
+     */
+    vector<CCoreProofLeg> Flegs;
     
 protected:
     CMySQL* m_ptrSql; //数据库句柄
@@ -118,6 +230,18 @@ public:
     //创建流水
     void saveFlow();
 
+    //流水VALUES子句，批量写入时拼接
+    string sqlValues();
+
+    //INSERT语句头，后接一个或多个VALUES子句
+    static const char* sqlInsert();
+
+    //精简流水开关：开启后只写分录数值列，备注等凭证级文本只存t_proof，由CCoreFlowReader关联读出
+    //开启前t_flow中不写的列须先加默认值（列类型不变），严格模式下否则插入失败：
+    //  Faction_type DEFAULT 0，Fmemo/Ftrade_memo/Fexplain DEFAULT ''，Fmodify_time/Frollback_time允许NULL或有默认值
+    static void setCompact(const bool bCompact) { m_bCompact = bCompact; }
+    static bool compact() { return m_bCompact; }
+
 public:
     /*
      * 对外数据库字段
@@ -149,8 +273,20 @@ public:
     
 protected:
     CMySQL* m_ptrSql; //数据库句柄
+
+    static bool m_bCompact; //精简流水模式
 };
 
+class CCorePipeline;
+
+/*
+ * 记账动作特征
+ * FROZEN：是否操作冻结余额，冻结类发生额为负（冲销）时不操作账户
+ */
+template <int OP> struct CLegOp { enum { FROZEN = 0 }; };
+template <> struct CLegOp<OP_freeze> { enum { FROZEN = 1 }; };
+template <> struct CLegOp<OP_unfreeze> { enum { FROZEN = 1 }; };
+
 /*
  * 核心账户类
  */
@@ -172,7 +308,7 @@ public:
 
     //构造函数
     CCoreAcct();
-    CCoreAcct(const LONG uid);
+    CCoreAcct(const LONG uid, CCorePipeline* ptrPipe = NULL);
 
     //析构函数
     ~CCoreAcct();
@@ -180,9 +316,21 @@ public:
     //创建账户
     void createAcct();
 
+    //账户VALUES子句，批量开户时拼接
+    string sqlValues();
+
+    //INSERT语句头，后接一个或多个VALUES子句
+    static const char* sqlInsert();
+
     //获取账户信息
     bool queryAcctInfo(bool bLock = false);
 
+    //解析查询结果行
+    void parseRow(MYSQL_ROW row);
+
+    //SELECT字段列表，与parseRow一一对应
+    static const char* sqlSelect();
+
     //记借方
     void debit(const LONG lAmount);
 
@@ -195,6 +343,9 @@ public:
     //解冻余额
     void unfreeze(const LONG lAmount);
 
+    //按记账动作变动余额，每种动作×余额方向展开为一份直线代码
+    template <int OP> void post(const LONG lAmount);
+
     //设置对手方账户
     void setCounter(const LONG uid, const string uin);
 
@@ -204,6 +355,13 @@ public:
     //生成账户签名
     string genAcctSign(bool bCreAcct = false);
 
+    //标记为总账账户，开启总账流水汇总时不逐笔写流水
+    void setGL(const bool bGL) { m_bGL = bGL; }
+
+protected:
+    //在指定连接上查询账户
+    bool selectAcct(CMySQL* ptrSql, bool bLock);
+
 public:
     /*
      * 对外数据库字段
@@ -234,23 +392,180 @@ public:
 protected:
     //参数初始化
     void init();
-    //对账户余额进行变动
-    void process();
+    //对账户余额进行变动，FLOW为流水类型
+    template <int FLOW> void process();
     //检查金额
-    void checkAmount();
+    template <int FLOW> void checkAmount();
     //准备更新
-    void prepareUpdate();
+    template <int FLOW> void prepareUpdate();
     //更新账户余额
     void updateAcct();
+    //填充流水
+    void fillFlow();
     //记录流水
     void createFlow();
 
 protected:
     CMySQL* m_ptrSql; //数据库句柄
+    CCorePipeline* m_ptrPipe; //批量写，为空时逐条写入
+    bool m_bGL; //是否总账账户
     CCoreFlow m_flow;
     bool bSync; //是否同步账户信息
 };
 
+//空动作
+template <> inline void CCoreAcct::post<OP_none>(const LONG lAmount)
+{
+}
+
+/*
+ * 核心记账批量写
+ * 同一事务内的账户更新和流水先在内存中合并，提交前一次写入，
+ * 把逐条UPDATE/INSERT的往返压缩为两次
+ * setBatch(false)改回每个账户一条UPDATE、每条流水一条INSERT，只用于压测对比：
+ * 同一负载（如CCoreLoadGen）分别在两种模式下跑，比较吞吐、时延和getStat()的每事务写语句数
+ */
+class CCorePipeline
+{
+public:
+    //写入统计
+    struct Stat
+    {
+        LONG lFlush; //批量写入次数（事务数）
+        LONG lStmt;  //账户、流水、总账关联的写语句数
+    };
+
+    //回退点，批内单张凭证失败时撤销它登记的更新和流水
+    struct Mark
+    {
+        vector<CCoreChangeAcct> vecAcct;
+        map<LONG, size_t> mapAcct;
+        size_t iFlowLen;
+        int iFlow;
+        size_t iGLFlow;
+        size_t iChangeFlow;
+        size_t iStat;
+    };
+
+    //构造函数
+    CCorePipeline();
+
+    //析构函数
+    ~CCorePipeline();
+
+    //登记账户更新，同一账户多次变动只保留最终状态
+    void addAcct(const CCoreAcct& acct);
+
+    //登记流水
+    void addFlow(CCoreFlow& flow);
+
+    //登记总账流水，提交后交给总账流水汇总，stamp为总账账户本次更新的时间戳
+    void addGLFlow(const CCoreFlow& flow, const CCoreStamp& stamp);
+
+    //批量写入
+    void flush();
+
+    //事务提交后处理，记账已提交不能再报失败，出错只计数不抛出
+    void afterCommit();
+
+    //提交后处理出错的次数
+    static LONG afterCommitFail();
+
+    //开启/关闭批量写，默认开启
+    static void setBatch(const bool bBatch) { m_bBatch = bBatch; }
+
+    //获取写入统计
+    static void getStat(Stat& stat);
+
+    //本事务的时间戳，首次调用时取一次时钟，各分录共用
+    const CCoreStamp& stamp();
+
+    //记录回退点
+    void mark(Mark& mark) const;
+
+    //回退到回退点，flush之前使用
+    void rollback(const Mark& mark);
+
+protected:
+    //账户最终状态，与变更日志记录同构
+    typedef CCoreChangeAcct AcctUpdate;
+
+    //批量更新账户
+    void flushAcct();
+    //一条UPDATE更新m_vecAcct[iBegin, iEnd)
+    void updateAcct(const size_t iBegin, const size_t iEnd);
+    //批量写流水
+    void flushFlow();
+    //写总账流水汇总关联
+    void flushGLLink();
+    //登记日汇总增量
+    void addStat(const CCoreFlow& flow);
+
+protected:
+    CMySQL* m_ptrSql; //数据库句柄
+    vector<AcctUpdate> m_vecAcct;
+    map<LONG, size_t> m_mapAcct; //uid到m_vecAcct下标
+    string m_strFlow; //已拼好的流水VALUES
+    int m_iFlow;
+    vector<size_t> m_vecFlowPos; //各条流水VALUES在m_strFlow中的起点
+    int m_iStmt; //本事务的写语句数
+    vector<CCoreFlow> m_vecGLFlow; //待汇总的总账流水
+    vector<CCoreStamp> m_vecGLStamp; //待汇总的总账流水对应的账户时间戳
+    vector<CCoreChangeAcct> m_vecChangeAcct; //待写变更日志的账户最终状态
+    vector<CCoreChangeFlow> m_vecChangeFlow; //待写变更日志的流水
+    vector<CCoreFlowStat::Delta> m_vecStat; //待计入日汇总的流水
+    LONG m_lChange; //变更日志序号，-1为未领取
+    CCoreStamp m_stamp; //本事务时间戳，iSec为0时未取
+    static bool m_bBatch;
+};
+
+/*
+ * 核心账户加锁器
+ * 凭证涉及的账户按uid全局排序后依次加锁，反向转账不会互相死锁
+ */
+class CCoreLockMgr
+{
+public:
+    //登记待加锁账户
+    void add(CCoreAcct& acct);
+
+    //按uid顺序加锁，strCur非空时账户币种必须与之一致
+    void lock(const string& strCur = "");
+
+protected:
+    vector<CCoreAcct*> m_vecAcct;
+};
+
+/*
+ * 凭证记账规则，每种凭证类型一个特化，新增凭证类型只需增加规则
+ * DEBIT_OP1/DEBIT_OP2：借方（含总账）依次执行的动作
+ * CREDIT_OP1/CREDIT_OP2：贷方（含总账）依次执行的动作
+ * EXTEND：是否处理附加账户
+ */
+template <int TYPE> struct CPostRule;
+
+template <> struct CPostRule<CCoreProof::TYPE_direct>
+{
+    enum { DEBIT_OP1 = OP_debit, DEBIT_OP2 = OP_none, CREDIT_OP1 = OP_credit, CREDIT_OP2 = OP_none, EXTEND = 1 };
+};
+
+template <> struct CPostRule<CCoreProof::TYPE_freeze>
+{
+    enum { DEBIT_OP1 = OP_freeze, DEBIT_OP2 = OP_none, CREDIT_OP1 = OP_freeze, CREDIT_OP2 = OP_none, EXTEND = 0 };
+};
+
+//成功解冻：解冻并操作可用余额
+template <> struct CPostRule<CCoreProof::TYPE_suc_unfreeze>
+{
+    enum { DEBIT_OP1 = OP_unfreeze, DEBIT_OP2 = OP_debit, CREDIT_OP1 = OP_unfreeze, CREDIT_OP2 = OP_credit, EXTEND = 0 };
+};
+
+//失败解冻：仅解冻
+template <> struct CPostRule<CCoreProof::TYPE_fail_unfreeze>
+{
+    enum { DEBIT_OP1 = OP_unfreeze, DEBIT_OP2 = OP_none, CREDIT_OP1 = OP_unfreeze, CREDIT_OP2 = OP_none, EXTEND = 0 };
+};
+
 /*
  * 核心对外接口类
  */
@@ -263,55 +578,181 @@ public:
     //析构函数
     ~CCore();
 
+    //死锁重试统计
+    struct RetryStat
+    {
+        LONG lDeadlock;     //死锁次数
+        LONG lLockTimeout;  //锁等待超时次数
+        LONG lRetry;        //重试次数
+        LONG lGiveUp;       //重试耗尽次数
+    };
+
+    //获取死锁重试统计
+    static void getRetryStat(RetryStat& stat);
+
+    //设置最大重试次数
+    static void setMaxRetry(const int iRetry) { m_iMaxRetry = iRetry; }
+
     //入口函数
     template <typename T> void callCore(const T& st) throw(CException)
     {
+        //使用订单信息填充凭证，标识类字段不转义入库，先校验
+        fillProof(st, m_proof);
+        m_proof.checkParam();
+
+        //准入控制，过载时快速拒绝
+        vector<LONG> vecAcct, vecGL;
+        admitKeys(vecAcct, vecGL);
+        CCoreAdmit admit(vecAcct, vecGL);
+
         try
         {
-            //使用订单信息填充凭证
-            fillProof(st, m_proof);
+            //按凭证所在分片（未分片时按币种）租用连接，本次记账涉及的对象共用
+            //连接池耗尽的ERR_CORE_BUSY也要计入准入的过载判断
+            CCoreDBLease lease(routePool());
+            m_ptrSql = lease.handle();
+            lease.bind(m_ptrSql);
+            m_proof.setDBHandle(lease);
+
+            m_iReqType = m_proof.Ftype;
+            m_iFromType = 0;
+
+            //请求签名在查询前算好，重入时直接比较，不再把请求重新填一遍
+            m_proof.genProofSign();
+            const string strReqSign = m_proof.Fproof_sign;
+
             //凭证是否已存在
             if(!m_proof.queryProof())
             {
+                //分次解冻必须基于已有的冻结凭证
+                if(m_proof.Fsub_seq > 0)
+                {
+                    throw CException(ERR_DB_NONE_ROW, "core proof: partial unfreeze without freeze proof", __FILE__, __LINE__);
+                }
+                //跨币种凭证和不平的多方凭证在落库前拒绝，不留下无法记账的凭证
+                checkCurrency();
+                if(!m_proof.Flegs.empty()) m_proof.checkLegs();
                 //不存在则保存凭证
                 m_proof.saveProof();
             }
             else
             {   
                 //存在则检查关键参数是否一致
-                CCoreProof req_proof;
-                fillProof(st, req_proof);
-                checkProof(req_proof);
+                checkProof(strReqSign, m_iReqType);
             }
 
-            //根据凭证记账
-            dealProof();
+            //根据凭证记账，失败时留下记录，恢复任务不再推进已应答失败的凭证；
+            //在途的跨分片凭证恢复任务一定会推进，不留失败记录
+            try
+            {
+                dealProof();
+            }
+            catch(CException& e)
+            {
+                if(e.error() != ERR_ALREADY_SUCCESS && !shardInFlight()) m_proof.saveReject(e.error());
+                throw;
+            }
         }
         catch(CException& e)
         {
-            if(e.error() != ERR_ALREADY_SUCCESS) throw;
+            if(e.error() != ERR_ALREADY_SUCCESS)
+            {
+                if(isOverload(e)) admit.setOverload();
+                throw;
+            }
         }
     }
+
+    //推进在途的跨分片凭证，不在途返回false
+    bool recoverProof(const CCoreProof& proof);
+
+    //按已保存的凭证重走记账，用于恢复滞留凭证
+    void redriveProof(const CCoreProof& proof);
+
+    //热点队列的领头线程调用：在本连接的一个事务内处理一批凭证，逐张填写结果
+    void dealHotBatch(const vector<CCoreHotJob*>& vecJob);
     
 protected:
-    //比较凭证的关键参数
-    void checkProof(CCoreProof& proof);
+    //多方凭证合并后的一笔记账
+    struct MergedLeg
+    {
+        size_t iAcct;
+        size_t iCounter;
+        int iOp;
+        LONG lAmount;
+    };
+
+    //跨分片凭证拆到各分片的一笔记账
+    struct ShardLeg
+    {
+        int iShard;
+        LONG lUid;
+        bool bGL;
+        int iOp;
+        LONG lCounterUid;
+        string strCounterUin;
+        LONG lAmount;
+    };
+
+    //比较凭证的关键参数，strReqSign为请求凭证的签名
+    void checkProof(const string& strReqSign, const int req_type);
     //流转凭证状态
     void checkProofState(const int req_type);
-    //根据凭证类型记账
+    //记账，死锁或锁超时时整体重试
     void dealProof();
-    //直接处理
-    void dealDirect();
-    //处理冻结
-    void dealFreeze();
-    //处理成功解冻（解冻并操作可用余额）
-    void dealSucUnfreeze();
-    //处理失败解冻（仅解冻）
-    void dealFailUnfreeze();
+    //根据凭证类型记账
+    void dealByType();
+    //锁单并复核状态流转
+    void lockProof();
+    //凭证置为已使用
+    void completeProof();
+    //是否锁冲突（死锁、锁等待超时）
+    bool isLockConflict(const CException& e, RetryStat& stat);
+    //按凭证记账规则处理
+    template <int TYPE> void dealPosting();
+    //执行一条记账分录
+    template <int OP1, int OP2> void postLeg(CCoreAcct& acct, const CCoreAcct& counter, const LONG lAmount);
+    //按凭证记账规则分次解冻
+    template <int TYPE> void dealPartUnfreeze();
+    //多方凭证记账
+    void dealMultiLeg();
+    //凭证所在分片或币种的连接池
+    CCoreDBPool* routePool();
+    //准入控制用的账户和总账uid，准入未开启时为空
+    void admitKeys(vector<LONG>& vecAcct, vector<LONG>& vecGL);
+    //凭证涉及的账户币种须与凭证一致，保存凭证前调用，币种按(分区, uid)进程内缓存；跨分片的分录由checkShardPart校验
+    void checkCurrency();
+    //是否过载信号（锁冲突、资源繁忙）
+    bool isOverload(const CException& e);
+    //直接记账凭证的各条分录，附加账户只在有发生额时列出
+    void directLegs(vector<ShardLeg>& vecLeg);
+    //凭证涉及的热点账户，不走热点队列时返回0
+    LONG hotAcct();
+    //执行一批热点凭证的事务
+    void runHotBatch(const vector<CCoreHotJob*>& vecJob);
+    //在批内账户上执行本凭证的分录，mapSaved记下变动前的账户
+    void postHot(const vector<ShardLeg>& vecLeg, map<LONG, CCoreAcct*>& mapAcct, map<LONG, CCoreAcct>& mapSaved);
+    //是否只影响单张凭证的业务错误
+    static bool isJobError(const int iError);
+    //按分片拆分凭证，vecShard首个为协调分片，返回涉及的分片数
+    size_t splitShard(vector<ShardLeg>& vecLeg, vector<int>& vecShard);
+    //跨分片记账
+    void dealCrossShard(const vector<ShardLeg>& vecLeg, const vector<int>& vecShard);
+    //校验后续分片上的分录不会失败，任何分片提交前调用
+    void checkShardPart(const int iShard, const vector<ShardLeg>& vecLeg);
+    //执行一个分片上的记账，已执行过返回false
+    bool dealShardPart(const int iShard, const vector<ShardLeg>& vecLeg);
+    //分片是否已执行
+    bool queryShardPart(const int iShard);
+    //是否在途的跨分片凭证（协调分片已提交），查不清时按在途处理
+    bool shardInFlight();
 
 protected:
     CMySQL* m_ptrSql; 
     CCoreProof m_proof;
+    int m_iReqType; //请求的凭证类型
+    int m_iFromType; //需要在记账事务内流转的原凭证类型，0为不流转
+    static int m_iMaxRetry; //死锁最大重试次数
 };
 
 #endif
\ No newline at end of file
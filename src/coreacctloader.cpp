@@ -0,0 +1,155 @@
+#include "coreacctloader.h"
+#include "corethread.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//跳过前lCount个账户
+void CCoreAcctSource::skip(const LONG lCount)
+{
+    CCoreAcct acct;
+    for(LONG i = 0; i < lCount && next(acct); ++i)
+    {
+    }
+}
+
+//并行生成账户签名
+static void signAcctRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    vector<CCoreAcct>& vecAcct = *(vector<CCoreAcct>*)ptrCtx;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        if(vecAcct[i].Facct_sign.empty())
+        {
+            vecAcct[i].Facct_sign = vecAcct[i].genAcctSign();
+        }
+    }
+}
+
+/*****************
+ * 批量开户 *
+******************/
+
+// 构造函数
+CCoreAcctLoader::CCoreAcctLoader()
+{
+    m_lDone = 0;
+    m_lDup = 0;
+
+    m_ptrSql = getCoreLeaseHandle();
+    m_iThreads = coreCpuNum();
+    m_iChunk = 10000;
+    m_iRowsPerStmt = 500;
+    m_iDupMode = DUP_skip;
+}
+
+//析构函数
+CCoreAcctLoader::~CCoreAcctLoader()
+{
+    m_ptrSql = NULL;
+}
+
+//执行开户任务
+void CCoreAcctLoader::run(CCoreAcctSource& source, const string& strJob)
+{
+    //续传
+    queryProgress(strJob);
+    source.skip(m_lDone);
+
+    vector<CCoreAcct> vecAcct;
+    vecAcct.reserve(m_iChunk);
+
+    bool bMore = true;
+    while(bMore)
+    {
+        vecAcct.clear();
+
+        CCoreAcct acct;
+        while((int)vecAcct.size() < m_iChunk && (bMore = source.next(acct)))
+        {
+            vecAcct.push_back(acct);
+            acct = CCoreAcct();
+        }
+
+        if(vecAcct.empty()) break;
+
+        //签名是纯CPU计算，按核并行
+        coreParallelFor(m_iThreads, vecAcct.size(), signAcctRange, &vecAcct);
+
+        //一块账户和进度同一事务，中断后整块重做
+        try
+        {
+            m_ptrSql->Begin();
+            insertChunk(vecAcct);
+            m_lDone += vecAcct.size();
+            saveProgress(strJob);
+            m_ptrSql->Commit();
+        }
+        catch(CException& e)
+        {
+            m_ptrSql->Rollback();
+            throw;
+        }
+    }
+}
+
+//写入一块账户
+void CCoreAcctLoader::insertChunk(vector<CCoreAcct>& vecAcct)
+{
+    for(size_t iBegin = 0; iBegin < vecAcct.size(); iBegin += m_iRowsPerStmt)
+    {
+        size_t iEnd = iBegin + m_iRowsPerStmt < vecAcct.size()? iBegin + m_iRowsPerStmt: vecAcct.size();
+
+        string strSql = CCoreAcct::sqlInsert();
+        for(size_t i = iBegin; i < iEnd; ++i)
+        {
+            if(i > iBegin) strSql += ",";
+            strSql += vecAcct[i].sqlValues();
+        }
+
+        //已存在的uid原样保留，影响行数为0
+        if(m_iDupMode == DUP_skip)
+        {
+            strSql += " ON DUPLICATE KEY UPDATE Fuid = Fuid";
+        }
+
+        m_ptrSql->Query(strSql.c_str(), strSql.length());
+
+        m_lDup += (iEnd - iBegin) - m_ptrSql->AffectedRows();
+    }
+}
+
+//查询任务进度
+void CCoreAcctLoader::queryProgress(const string& strJob)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Foffset,Fdup FROM isp_os_core.t_provision_progress "
+        "WHERE Fjob = '%s'",
+        m_ptrSql->EscapeStr(strJob).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    m_lDone = (row && row[0])? atoll(row[0]): 0;
+    m_lDup = (row && row[1])? atoll(row[1]): 0;
+    mysql_free_result(pRes);
+}
+
+//保存任务进度
+void CCoreAcctLoader::saveProgress(const string& strJob)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT INTO isp_os_core.t_provision_progress (Fjob,Foffset,Fdup,Fmodify_time) "
+        "VALUES ('%s',%lld,%lld,now()) "
+        "ON DUPLICATE KEY UPDATE Foffset = VALUES(Foffset), Fdup = VALUES(Fdup), Fmodify_time = now()",
+        m_ptrSql->EscapeStr(strJob).c_str(), m_lDone, m_lDup);
+
+    m_ptrSql->Query(szSql, iLen);
+}
@@ -0,0 +1,76 @@
+#ifndef _CORE_ACCT_LOADER_H_
+#define _CORE_ACCT_LOADER_H_
+
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+
+/*
+ * 开户数据源
+ * 按顺序逐个产出待开账户，断点续传时先跳过已处理的条数
+ */
+class CCoreAcctSource
+{
+public:
+    virtual ~CCoreAcctSource() {}
+
+    //取下一个账户，没有了返回false
+    virtual bool next(CCoreAcct& acct) = 0;
+
+    //跳过前lCount个账户
+    virtual void skip(const LONG lCount);
+};
+
+/*
+ * 批量开户
+ * 数据源按块读出，多线程并行生成账户签名，多行INSERT分批写入，
+ * 每块与进度在同一事务提交，中断后按isp_os_core.t_provision_progress续传
+ */
+class CCoreAcctLoader
+{
+public:
+    //重复uid处理
+    enum DUP_MODE
+    {
+        DUP_skip = 1,   //跳过已存在的uid并计数
+        DUP_fail = 2    //遇到已存在的uid报错
+    };
+
+    //构造函数
+    CCoreAcctLoader();
+
+    //析构函数
+    ~CCoreAcctLoader();
+
+    //执行开户任务，strJob为任务名，用于断点续传
+    void run(CCoreAcctSource& source, const string& strJob);
+
+    //设置参数
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setChunk(const int iChunk) { m_iChunk = iChunk; }
+    void setRowsPerStmt(const int iRows) { m_iRowsPerStmt = iRows; }
+    void setDupMode(const int iMode) { m_iDupMode = iMode; }
+
+public:
+    LONG m_lDone;   //已处理账户数（含续传前）
+    LONG m_lDup;    //跳过的重复uid数
+
+protected:
+    //查询任务进度
+    void queryProgress(const string& strJob);
+    //保存任务进度
+    void saveProgress(const string& strJob);
+    //写入一块账户
+    void insertChunk(vector<CCoreAcct>& vecAcct);
+
+protected:
+    CMySQL* m_ptrSql; //数据库句柄
+    int m_iThreads;
+    int m_iChunk;
+    int m_iRowsPerStmt;
+    int m_iDupMode;
+};
+
+#endif
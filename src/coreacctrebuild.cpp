@@ -0,0 +1,371 @@
+#include <set>
+#include <string.h>
+#include "coreacctrebuild.h"
+#include "coredbpool.h"
+#include "corethread.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//一个账户的最后一条流水
+struct LastFlow
+{
+    LONG lBalance;
+    LONG lCon;
+    bool bUsed; //是否匹配到了账户
+};
+
+/*****************
+ * 按流水重建账户余额 *
+******************/
+
+// 构造函数
+CCoreAcctRebuild::CCoreAcctRebuild()
+{
+    m_iThreads = coreCpuNum();
+    m_iChunk = 10000;
+    m_iRowsPerStmt = 500;
+    m_fnProgress = NULL;
+    m_ptrProgressCtx = NULL;
+    m_iProgressSec = 10;
+
+    m_lNext = 0;
+    m_lEnd = 0;
+    m_lStartUs = 0;
+    m_lLastReportUs = 0;
+    memset(&m_stat, 0, sizeof(m_stat));
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreAcctRebuild::~CCoreAcctRebuild()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//重建
+void CCoreAcctRebuild::run(const LONG lUidBegin, const LONG lUidEnd, Stat& stat)
+{
+    if(m_iThreads <= 0 || m_iChunk <= 0 || m_iRowsPerStmt <= 0)
+    {
+        throw CException(ERR_BAD_BRANCH, "acct rebuild: bad threads or chunk", __FILE__, __LINE__);
+    }
+    //没有连接池时各线程会退回同一个全局句柄
+    if(m_iThreads > 1 && !CCoreDBPool::instance()->inited())
+    {
+        throw CException(ERR_BAD_BRANCH, "acct rebuild: init db pool before running with threads", __FILE__, __LINE__);
+    }
+
+    m_lNext = lUidBegin;
+    m_lEnd = lUidEnd > 0? lUidEnd: queryMaxUid() + 1;
+    m_lStartUs = nowUs();
+    m_lLastReportUs = m_lStartUs;
+    memset(&m_stat, 0, sizeof(m_stat));
+    m_strError.clear();
+
+    vector<pthread_t> vecThread(m_iThreads);
+    int iStarted = 0;
+    for(; iStarted < m_iThreads; ++iStarted)
+    {
+        if(0 != pthread_create(&vecThread[iStarted], NULL, threadMain, this)) break;
+    }
+    for(int i = 0; i < iStarted; ++i)
+    {
+        pthread_join(vecThread[i], NULL);
+    }
+
+    if(iStarted < m_iThreads)
+    {
+        throw CException(ERR_BAD_BRANCH, "acct rebuild: create thread failed", __FILE__, __LINE__);
+    }
+    if(!m_strError.empty())
+    {
+        throw CException(ERR_BAD_BRANCH, "acct rebuild: " + m_strError, __FILE__, __LINE__);
+    }
+
+    stat = m_stat;
+    stat.lUs = nowUs() - m_lStartUs;
+    stat.dRowsPerSec = stat.lUs > 0? stat.lAcct * 1000000.0 / stat.lUs: 0;
+    if(m_fnProgress) m_fnProgress(stat, m_ptrProgressCtx);
+}
+
+//线程入口
+void* CCoreAcctRebuild::threadMain(void* ptrArg)
+{
+    CCoreAcctRebuild* ptrRebuild = (CCoreAcctRebuild*)ptrArg;
+
+    try
+    {
+        ptrRebuild->runWorker();
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_lock(&ptrRebuild->m_mutex);
+        if(ptrRebuild->m_strError.empty()) ptrRebuild->m_strError = e.what();
+        pthread_mutex_unlock(&ptrRebuild->m_mutex);
+    }
+    return NULL;
+}
+
+//工作线程：整个过程租用一个连接
+void CCoreAcctRebuild::runWorker()
+{
+    CCoreDBLease lease;
+    CMySQL* ptrSql = lease.handle();
+
+    LONG lBegin = 0, lEnd = 0;
+    while(nextChunk(lBegin, lEnd))
+    {
+        Stat stat;
+        memset(&stat, 0, sizeof(stat));
+        rebuildChunk(ptrSql, lBegin, lEnd, stat);
+        addStat(stat);
+    }
+}
+
+//领下一块
+bool CCoreAcctRebuild::nextChunk(LONG& lBegin, LONG& lEnd)
+{
+    pthread_mutex_lock(&m_mutex);
+    bool bOk = m_strError.empty() && m_lNext < m_lEnd;
+    if(bOk)
+    {
+        lBegin = m_lNext;
+        lEnd = m_lEnd - m_lNext > m_iChunk? m_lNext + m_iChunk: m_lEnd;
+        m_lNext = lEnd;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return bOk;
+}
+
+//处理一块：每个账户只取最后一条流水，取最大Fid走(Fuid, Fid)索引，只有一行结果回到本地
+void CCoreAcctRebuild::rebuildChunk(CMySQL* ptrSql, const LONG lBegin, const LONG lEnd, Stat& stat)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    map<LONG, LastFlow> mapLast;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT f.Fuid,f.Fbalance,f.Fcon "
+        "FROM isp_os_core.t_flow f "
+        "JOIN (SELECT Fuid,MAX(Fid) AS Fid FROM isp_os_core.t_flow "
+        "WHERE Fuid >= %lld AND Fuid < %lld GROUP BY Fuid) m ON f.Fid = m.Fid",
+        lBegin, lEnd);
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        LastFlow& last = mapLast[row[0]? atoll(row[0]): 0];
+        last.lBalance = row[1]? atoll(row[1]): 0;
+        last.lCon = row[2]? atoll(row[2]): 0;
+        last.bUsed = false;
+    }
+    mysql_free_result(pRes);
+
+    //总账汇总还有未写出的关联行时，最后一条汇总流水不是当前余额
+    set<LONG> setPending;
+    iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT DISTINCT Fuid FROM isp_os_core.t_flow_gl_link "
+        "WHERE Fuid >= %lld AND Fuid < %lld",
+        lBegin, lEnd);
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        setPending.insert(row[0]? atoll(row[0]): 0);
+    }
+    mysql_free_result(pRes);
+
+    iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT %s FROM isp_os_core.t_account "
+        "WHERE Fuid >= %lld AND Fuid < %lld",
+        CCoreAcct::sqlSelect(), lBegin, lEnd);
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+
+    vector<CCoreAcct> vecFix;
+    vector<Change> vecChange;
+    CCoreAcct acct;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        acct.parseRow(row);
+        stat.lAcct++;
+
+        map<LONG, LastFlow>::iterator it = mapLast.find(acct.Fuid);
+        if(it == mapLast.end())
+        {
+            stat.lNoFlow++;
+            continue;
+        }
+
+        LastFlow& last = it->second;
+        last.bUsed = true;
+        stat.lFlowAcct++;
+
+        //汇总流水每个时间桶的最后一行即桶末余额，但还有未写出的桶时对不上
+        if(setPending.find(acct.Fuid) != setPending.end())
+        {
+            stat.lGLAgg++;
+            continue;
+        }
+
+        Change change;
+        change.lUid = acct.Fuid;
+        change.lOldBalance = acct.Fbalance;
+        change.lNewBalance = last.lBalance;
+        change.lOldCon = acct.Fcon;
+        change.lNewCon = last.lCon;
+
+        //余额与流水一致时签名不符只能是行被改过，重新签名会把篡改洗白
+        if(acct.Fbalance == last.lBalance && acct.Fcon == last.lCon)
+        {
+            if(acct.Facct_sign != acct.genAcctSign())
+            {
+                change.iAction = Change::ACTION_tamper;
+                vecChange.push_back(change);
+                stat.lTamper++;
+            }
+            continue;
+        }
+
+        change.iAction = Change::ACTION_fix;
+        vecChange.push_back(change);
+
+        acct.Fbalance = last.lBalance;
+        acct.Fcon = last.lCon;
+        acct.Facct_sign = acct.genAcctSign();
+        vecFix.push_back(acct);
+    }
+    mysql_free_result(pRes);
+
+    for(map<LONG, LastFlow>::iterator it = mapLast.begin(); it != mapLast.end(); ++it)
+    {
+        if(!it->second.bUsed) stat.lOrphan++;
+    }
+
+    writeAcct(ptrSql, vecFix, vecChange);
+    stat.lFixed += vecFix.size();
+    stat.lChunk++;
+}
+
+//写回改过的账户，一块一个事务
+void CCoreAcctRebuild::writeAcct(CMySQL* ptrSql, vector<CCoreAcct>& vecAcct, const vector<Change>& vecChange)
+{
+    if(vecAcct.empty() && vecChange.empty()) return;
+
+    char szRow[MAX_MSG_LEN] = {0};
+
+    try
+    {
+        ptrSql->Begin();
+
+        for(size_t iBegin = 0; iBegin < vecChange.size(); iBegin += m_iRowsPerStmt)
+        {
+            size_t iEnd = iBegin + m_iRowsPerStmt < vecChange.size()? iBegin + m_iRowsPerStmt: vecChange.size();
+
+            string strSql = "INSERT INTO isp_os_core.t_acct_rebuild_log "
+                "(Fuid,Faction,Fold_balance,Fnew_balance,Fold_con,Fnew_con,Fcreate_time) VALUES ";
+            for(size_t i = iBegin; i < iEnd; ++i)
+            {
+                const Change& change = vecChange[i];
+                snprintf(szRow, sizeof(szRow), "%s(%lld,%d,%lld,%lld,%lld,%lld,now())",
+                    i > iBegin? ",": "", change.lUid, change.iAction,
+                    change.lOldBalance, change.lNewBalance, change.lOldCon, change.lNewCon);
+                strSql += szRow;
+            }
+
+            ptrSql->Query(strSql.c_str(), strSql.length());
+        }
+
+        for(size_t iBegin = 0; iBegin < vecAcct.size(); iBegin += m_iRowsPerStmt)
+        {
+            size_t iEnd = iBegin + m_iRowsPerStmt < vecAcct.size()? iBegin + m_iRowsPerStmt: vecAcct.size();
+
+            string strSql = CCoreAcct::sqlInsert();
+            for(size_t i = iBegin; i < iEnd; ++i)
+            {
+                if(i > iBegin) strSql += ",";
+                strSql += vecAcct[i].sqlValues();
+            }
+            strSql += " ON DUPLICATE KEY UPDATE Fbalance = VALUES(Fbalance), Fcon = VALUES(Fcon), "
+                "Facct_sign = VALUES(Facct_sign), Fmodify_time = now()";
+
+            ptrSql->Query(strSql.c_str(), strSql.length());
+        }
+
+        ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        ptrSql->Rollback();
+        throw;
+    }
+}
+
+//合并一块的统计，到时间则报告进度
+void CCoreAcctRebuild::addStat(const Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+
+    m_stat.lAcct += stat.lAcct;
+    m_stat.lFlowAcct += stat.lFlowAcct;
+    m_stat.lFixed += stat.lFixed;
+    m_stat.lTamper += stat.lTamper;
+    m_stat.lNoFlow += stat.lNoFlow;
+    m_stat.lGLAgg += stat.lGLAgg;
+    m_stat.lOrphan += stat.lOrphan;
+    m_stat.lChunk += stat.lChunk;
+
+    LONG lNow = nowUs();
+    if(m_fnProgress && lNow - m_lLastReportUs >= (LONG)m_iProgressSec * 1000000)
+    {
+        m_lLastReportUs = lNow;
+        m_stat.lUs = lNow - m_lStartUs;
+        m_stat.dRowsPerSec = m_stat.lUs > 0? m_stat.lAcct * 1000000.0 / m_stat.lUs: 0;
+        m_fnProgress(m_stat, m_ptrProgressCtx);
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//查询最大uid，账户表和流水表取大者，流水有而账户没有的uid也要计入
+LONG CCoreAcctRebuild::queryMaxUid()
+{
+    CMySQL* ptrSql = getCoreLeaseHandle();
+    MYSQL_RES* pRes = NULL;
+    LONG lMax = 0;
+
+    const char* arrSql[2] = {
+        "SELECT MAX(Fuid) FROM isp_os_core.t_account",
+        "SELECT MAX(Fuid) FROM isp_os_core.t_flow"
+    };
+
+    for(int i = 0; i < 2; ++i)
+    {
+        ptrSql->Query(arrSql[i], strlen(arrSql[i]));
+        pRes = ptrSql->FetchResult();
+
+        MYSQL_ROW row = mysql_fetch_row(pRes);
+        if(row && row[0] && atoll(row[0]) > lMax)
+        {
+            lMax = atoll(row[0]);
+        }
+        mysql_free_result(pRes);
+    }
+
+    return lMax;
+}
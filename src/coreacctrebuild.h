@@ -0,0 +1,115 @@
+#ifndef _CORE_ACCT_REBUILD_H_
+#define _CORE_ACCT_REBUILD_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+
+/*
+ * 按流水重建账户余额
+ * t_account余额损坏时，按Fuid区间把账户分成若干块，多个线程各租一个连接并行处理：
+ * 每块在库端取每个账户Fid最大的一条流水（流水自带变动后余额，不必逐条回放），
+ * 与t_account比较，余额或冻结余额不符的行改为流水余额并用genAcctSign重新签名，多行INSERT ... ON DUPLICATE KEY UPDATE写回；
+ * 余额一致而只有签名不符的行视为篡改，不改写，留给人工核查
+ * 改写和篡改的账户都记一行isp_os_core.t_acct_rebuild_log，与改写同一事务：
+ *   自增主键Fid，Fuid, Faction (1改写 2篡改), Fold_balance, Fnew_balance, Fold_con, Fnew_con, Fcreate_time
+ * 总账汇总流水的最后一行即桶末余额，与逐笔流水一样重建；t_flow_gl_link中还有未写出关联行的总账账户，
+ * 以及没有流水的账户（开户余额）保持原样，只计数
+ * 须在停止记账后运行，可重复执行，已正确的行不会再写；多线程时须先初始化默认连接池
+ */
+class CCoreAcctRebuild
+{
+public:
+    //重建统计
+    struct Stat
+    {
+        LONG lAcct;       //处理的账户数
+        LONG lFlowAcct;   //有流水的账户数
+        LONG lFixed;      //改写的账户数
+        LONG lTamper;     //余额一致但签名不符、未改写的账户数
+        LONG lNoFlow;     //没有流水、保持原样的账户数
+        LONG lGLAgg;      //总账汇总还有未写出的关联行、保持原样的账户数
+        LONG lOrphan;     //有流水但t_account中没有的uid数
+        LONG lChunk;      //完成的块数
+        LONG lUs;         //耗时
+        double dRowsPerSec; //每秒处理账户数
+    };
+
+    //进度回调，在工作线程中调用，调用期间持有内部锁
+    typedef void (*ProgressFunc)(const Stat& stat, void* ptrCtx);
+
+    //构造函数
+    CCoreAcctRebuild();
+
+    //析构函数
+    ~CCoreAcctRebuild();
+
+    //重建[lUidBegin, lUidEnd)内的账户，lUidEnd为0时到最大uid为止
+    void run(const LONG lUidBegin, const LONG lUidEnd, Stat& stat);
+
+    //设置参数
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setChunk(const int iUids) { m_iChunk = iUids; }
+    void setRowsPerStmt(const int iRows) { m_iRowsPerStmt = iRows; }
+    void setProgress(ProgressFunc fn, void* ptrCtx, const int iIntervalSec = 10)
+    {
+        m_fnProgress = fn;
+        m_ptrProgressCtx = ptrCtx;
+        m_iProgressSec = iIntervalSec;
+    }
+
+protected:
+    //写入t_acct_rebuild_log的一行
+    struct Change
+    {
+        enum ACTION
+        {
+            ACTION_fix = 1,
+            ACTION_tamper = 2
+        };
+
+        LONG lUid;
+        int iAction;
+        LONG lOldBalance;
+        LONG lNewBalance;
+        LONG lOldCon;
+        LONG lNewCon;
+    };
+
+    //线程入口
+    static void* threadMain(void* ptrArg);
+    //工作线程：领块、处理，直到领完
+    void runWorker();
+    //领下一块，领完返回false
+    bool nextChunk(LONG& lBegin, LONG& lEnd);
+    //处理一块
+    void rebuildChunk(CMySQL* ptrSql, const LONG lBegin, const LONG lEnd, Stat& stat);
+    //写回改过的账户，并记录改写和篡改的账户
+    void writeAcct(CMySQL* ptrSql, vector<CCoreAcct>& vecAcct, const vector<Change>& vecChange);
+    //合并一块的统计，到时间则报告进度
+    void addStat(const Stat& stat);
+    //查询最大uid
+    LONG queryMaxUid();
+
+protected:
+    int m_iThreads;
+    int m_iChunk;
+    int m_iRowsPerStmt;
+    ProgressFunc m_fnProgress;
+    void* m_ptrProgressCtx;
+    int m_iProgressSec;
+
+    //以下受m_mutex保护
+    LONG m_lNext;      //下一块的起始uid
+    LONG m_lEnd;
+    LONG m_lStartUs;
+    LONG m_lLastReportUs;
+    Stat m_stat;
+    string m_strError; //非空表示有线程异常退出，其余线程不再领块
+    pthread_mutex_t m_mutex;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/time.h>
+#include "coreadmission.h"
+#include "coreerror.h"
+#include "common.h"
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//去重，同一张凭证借贷总账可能是同一个uid
+static void uniqueUid(vector<LONG>& vecUid)
+{
+    sort(vecUid.begin(), vecUid.end());
+    vecUid.erase(unique(vecUid.begin(), vecUid.end()), vecUid.end());
+}
+
+/*****************
+ * 记账准入控制 *
+******************/
+
+// 构造函数
+CCoreAdmission::CCoreAdmission()
+{
+    m_bEnable = false;
+    m_iMinLimit = 4;
+    m_iMaxLimit = 256;
+    m_dLimit = 32;
+    m_lTargetUs = 50000;
+    m_iQueueMs = 200;
+    m_iAcctLimit = 4;
+    m_iGLLimit = 32;
+    m_dAvgUs = 0;
+    m_lLastDecreaseUs = 0;
+    memset(&m_stat, 0, sizeof(m_stat));
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+//析构函数
+CCoreAdmission::~CCoreAdmission()
+{
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局实例
+CCoreAdmission* CCoreAdmission::instance()
+{
+    static CCoreAdmission admission;
+    return &admission;
+}
+
+//设置全局上限范围
+void CCoreAdmission::setLimit(const int iMin, const int iMax)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_iMinLimit = iMin;
+    m_iMaxLimit = iMax;
+    m_dLimit = std::max((double)iMin, std::min(m_dLimit, (double)iMax));
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//是否可以放行
+bool CCoreAdmission::canAdmit(const vector<LONG>& vecAcct, const vector<LONG>& vecGL)
+{
+    if(m_stat.iInflight >= (int)m_dLimit) return false;
+
+    for(size_t i = 0; i < vecAcct.size(); ++i)
+    {
+        map<LONG, int>::iterator it = m_mapAcct.find(vecAcct[i]);
+        if(it != m_mapAcct.end() && it->second >= m_iAcctLimit) return false;
+    }
+
+    for(size_t i = 0; i < vecGL.size(); ++i)
+    {
+        map<LONG, int>::iterator it = m_mapGL.find(vecGL[i]);
+        if(it != m_mapGL.end() && it->second >= m_iGLLimit) return false;
+    }
+
+    return true;
+}
+
+//申请放行
+void CCoreAdmission::acquire(const vector<LONG>& vecAcct, const vector<LONG>& vecGL)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + m_iQueueMs / 1000;
+    deadline.tv_nsec = tv.tv_usec * 1000 + (m_iQueueMs % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+
+    if(!canAdmit(vecAcct, vecGL))
+    {
+        //前面排队的都要先做完，预计等待超过期限就不排了
+        double dExpectUs = (m_stat.iWaiting + 1) * m_dAvgUs / m_dLimit;
+        if(dExpectUs > m_iQueueMs * 1000.0)
+        {
+            m_stat.lReject++;
+            pthread_mutex_unlock(&m_mutex);
+            throw CException(ERR_CORE_BUSY, "core admission: overloaded", __FILE__, __LINE__);
+        }
+
+        m_stat.iWaiting++;
+        while(!canAdmit(vecAcct, vecGL))
+        {
+            if(ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+            {
+                m_stat.iWaiting--;
+                m_stat.lTimeout++;
+                pthread_mutex_unlock(&m_mutex);
+                throw CException(ERR_CORE_BUSY, "core admission: queue timeout", __FILE__, __LINE__);
+            }
+        }
+        m_stat.iWaiting--;
+    }
+
+    m_stat.iInflight++;
+    m_stat.lAdmit++;
+    for(size_t i = 0; i < vecAcct.size(); ++i)
+    {
+        m_mapAcct[vecAcct[i]]++;
+    }
+    for(size_t i = 0; i < vecGL.size(); ++i)
+    {
+        m_mapGL[vecGL[i]]++;
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//结束
+void CCoreAdmission::release(const vector<LONG>& vecAcct, const vector<LONG>& vecGL, const LONG lLatencyUs, const bool bOverload)
+{
+    pthread_mutex_lock(&m_mutex);
+
+    m_stat.iInflight--;
+    for(size_t i = 0; i < vecAcct.size(); ++i)
+    {
+        map<LONG, int>::iterator it = m_mapAcct.find(vecAcct[i]);
+        if(it != m_mapAcct.end() && --it->second <= 0) m_mapAcct.erase(it);
+    }
+    for(size_t i = 0; i < vecGL.size(); ++i)
+    {
+        map<LONG, int>::iterator it = m_mapGL.find(vecGL[i]);
+        if(it != m_mapGL.end() && --it->second <= 0) m_mapGL.erase(it);
+    }
+
+    adjust(lLatencyUs, bOverload);
+
+    //等待的可能是不同账户，全部唤醒各自检查
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//按结果调整上限
+void CCoreAdmission::adjust(const LONG lLatencyUs, const bool bOverload)
+{
+    m_dAvgUs = m_dAvgUs > 0? m_dAvgUs * 0.9 + lLatencyUs * 0.1: lLatencyUs;
+    m_stat.lAvgUs = (LONG)m_dAvgUs;
+
+    if(bOverload || lLatencyUs > m_lTargetUs)
+    {
+        //一个目标耗时内只收缩一次，避免同一波慢请求把上限压到底
+        LONG lNow = nowUs();
+        if(lNow - m_lLastDecreaseUs > m_lTargetUs)
+        {
+            m_dLimit = std::max((double)m_iMinLimit, m_dLimit * 0.8);
+            m_lLastDecreaseUs = lNow;
+        }
+    }
+    else
+    {
+        //每完成约一个上限数量的请求加一
+        m_dLimit = std::min((double)m_iMaxLimit, m_dLimit + 1.0 / m_dLimit);
+    }
+
+    m_stat.iLimit = (int)m_dLimit;
+}
+
+//获取统计
+void CCoreAdmission::getStat(Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    stat.iLimit = (int)m_dLimit;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*****************
+ * 准入凭据 *
+******************/
+
+// 构造函数
+CCoreAdmit::CCoreAdmit(const vector<LONG>& vecAcct, const vector<LONG>& vecGL)
+{
+    m_bAdmit = false;
+    m_bOverload = false;
+    m_lStartUs = 0;
+
+    CCoreAdmission* ptrAdmission = CCoreAdmission::instance();
+    if(!ptrAdmission->enabled()) return;
+
+    m_vecAcct = vecAcct;
+    m_vecGL = vecGL;
+    uniqueUid(m_vecAcct);
+    uniqueUid(m_vecGL);
+
+    ptrAdmission->acquire(m_vecAcct, m_vecGL);
+    m_bAdmit = true;
+    m_lStartUs = nowUs();
+}
+
+//析构函数
+CCoreAdmit::~CCoreAdmit()
+{
+    if(!m_bAdmit) return;
+
+    CCoreAdmission::instance()->release(m_vecAcct, m_vecGL, nowUs() - m_lStartUs, m_bOverload);
+}
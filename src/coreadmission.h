@@ -0,0 +1,115 @@
+#ifndef _CORE_ADMISSION_H_
+#define _CORE_ADMISSION_H_
+
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+
+/*
+ * 记账准入控制
+ * 全局并发上限按提交耗时自适应（AIMD）：耗时低于目标时每轮加一，超过目标或出现锁超时/连接池耗尽时乘性收缩；
+ * 同一账户、同一总账各有并发上限，热点账户排队而不是都挤进FOR UPDATE；
+ * 排队超过期限或预计排队时间超过期限时直接返回ERR_CORE_BUSY，由上游重试
+ * 默认关闭
+ */
+class CCoreAdmission
+{
+public:
+    //准入统计
+    struct Stat
+    {
+        LONG lAdmit;     //放行次数
+        LONG lReject;    //预计超时直接拒绝次数
+        LONG lTimeout;   //排队超时次数
+        LONG lAvgUs;     //平均记账耗时
+        int iInflight;   //在途数
+        int iWaiting;    //排队数
+        int iLimit;      //当前全局上限
+    };
+
+    //构造函数
+    CCoreAdmission();
+
+    //析构函数
+    ~CCoreAdmission();
+
+    //全局实例
+    static CCoreAdmission* instance();
+
+    //开启/关闭
+    void setMode(const bool bEnable) { m_bEnable = bEnable; }
+
+    //是否开启
+    bool enabled() const { return m_bEnable; }
+
+    //申请放行，vecAcct/vecGL为凭证涉及的普通账户和总账uid
+    void acquire(const vector<LONG>& vecAcct, const vector<LONG>& vecGL);
+
+    //结束，lLatencyUs为记账耗时，bOverload为是否遇到锁超时等过载信号
+    void release(const vector<LONG>& vecAcct, const vector<LONG>& vecGL, const LONG lLatencyUs, const bool bOverload);
+
+    //获取统计
+    void getStat(Stat& stat);
+
+    //设置参数
+    void setLimit(const int iMin, const int iMax);
+    void setTargetLatency(const int iMs) { m_lTargetUs = (LONG)iMs * 1000; }
+    void setQueueTimeout(const int iMs) { m_iQueueMs = iMs; }
+    void setAcctLimit(const int iLimit) { m_iAcctLimit = iLimit; }
+    void setGLLimit(const int iLimit) { m_iGLLimit = iLimit; }
+
+protected:
+    //是否可以放行
+    bool canAdmit(const vector<LONG>& vecAcct, const vector<LONG>& vecGL);
+    //按结果调整上限
+    void adjust(const LONG lLatencyUs, const bool bOverload);
+
+protected:
+    bool m_bEnable;
+    double m_dLimit;
+    int m_iMinLimit;
+    int m_iMaxLimit;
+    LONG m_lTargetUs;
+    int m_iQueueMs;
+    int m_iAcctLimit;
+    int m_iGLLimit;
+    double m_dAvgUs;         //耗时滑动平均
+    LONG m_lLastDecreaseUs;  //上次收缩时间，一个目标耗时内只收缩一次
+    map<LONG, int> m_mapAcct; //账户在途数
+    map<LONG, int> m_mapGL;   //总账在途数
+    Stat m_stat;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
+
+/*
+ * 准入凭据
+ * 构造时申请放行，析构时归还并上报耗时
+ */
+class CCoreAdmit
+{
+public:
+    //构造函数，准入未开启时不做任何事
+    CCoreAdmit(const vector<LONG>& vecAcct, const vector<LONG>& vecGL);
+
+    //析构函数
+    ~CCoreAdmit();
+
+    //记录过载信号
+    void setOverload() { m_bOverload = true; }
+
+private:
+    CCoreAdmit(const CCoreAdmit&);
+    CCoreAdmit& operator=(const CCoreAdmit&);
+
+private:
+    vector<LONG> m_vecAcct;
+    vector<LONG> m_vecGL;
+    bool m_bAdmit;
+    bool m_bOverload;
+    LONG m_lStartUs;
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include "corebatchcheck.h"
+#include "core.h"
+#include "error.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define CORE_BATCH_AVX2 1
+#else
+#define CORE_BATCH_AVX2 0
+#endif
+
+//标量掩码计算，返回不满足的分录数
+static size_t maskScalar(const LONG* ptrBalance, const LONG* ptrCon, const LONG* ptrAvailMask,
+    const LONG* ptrConMask, char* ptrBad, const size_t iBegin, const size_t n)
+{
+    size_t iBad = 0;
+
+    for(size_t i = iBegin; i < n; ++i)
+    {
+        //不分支：条件结果取0/-1后与掩码相与
+        LONG lAvail = -(LONG)(ptrBalance[i] - ptrCon[i] < 0) & ptrAvailMask[i];
+        LONG lCon = -(LONG)(ptrCon[i] < 0) & ptrConMask[i];
+        ptrBad[i] = (lAvail | lCon) != 0;
+        iBad += ptrBad[i];
+    }
+
+    return iBad;
+}
+
+#if CORE_BATCH_AVX2
+//AVX2掩码计算，每次4条分录
+__attribute__((target("avx2")))
+static size_t maskAvx2(const LONG* ptrBalance, const LONG* ptrCon, const LONG* ptrAvailMask,
+    const LONG* ptrConMask, char* ptrBad, const size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t iBad = 0;
+    size_t i = 0;
+
+    for(; i + 4 <= n; i += 4)
+    {
+        __m256i balance = _mm256_loadu_si256((const __m256i*)(ptrBalance + i));
+        __m256i con = _mm256_loadu_si256((const __m256i*)(ptrCon + i));
+        __m256i availMask = _mm256_loadu_si256((const __m256i*)(ptrAvailMask + i));
+        __m256i conMask = _mm256_loadu_si256((const __m256i*)(ptrConMask + i));
+
+        __m256i lackAvail = _mm256_and_si256(_mm256_cmpgt_epi64(zero, _mm256_sub_epi64(balance, con)), availMask);
+        __m256i lackCon = _mm256_and_si256(_mm256_cmpgt_epi64(zero, con), conMask);
+        int iBits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(lackAvail, lackCon)));
+
+        ptrBad[i] = iBits & 1;
+        ptrBad[i + 1] = (iBits >> 1) & 1;
+        ptrBad[i + 2] = (iBits >> 2) & 1;
+        ptrBad[i + 3] = (iBits >> 3) & 1;
+        iBad += __builtin_popcount(iBits);
+    }
+
+    return iBad + maskScalar(ptrBalance, ptrCon, ptrAvailMask, ptrConMask, ptrBad, i, n);
+}
+
+//CPU是否支持AVX2
+static bool cpuAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#else
+//CPU是否支持AVX2
+static bool cpuAvx2()
+{
+    return false;
+}
+#endif
+
+/*****************
+ * 批量记账余额预校验 *
+******************/
+
+bool CCoreBatchCheck::m_bAvx2 = cpuAvx2();
+
+// 构造函数
+CCoreBatchCheck::CCoreBatchCheck()
+{
+}
+
+//开关AVX2
+void CCoreBatchCheck::setAvx2(const bool bEnable)
+{
+    m_bAvx2 = bEnable && cpuAvx2();
+}
+
+//当前是否使用AVX2
+bool CCoreBatchCheck::avx2()
+{
+    return m_bAvx2;
+}
+
+//登记账户当前余额
+size_t CCoreBatchCheck::addAcct(const CCoreAcct& acct)
+{
+    m_vecBalance.push_back(acct.Fbalance);
+    m_vecCon.push_back(acct.Fcon);
+    m_vecCommon.push_back(acct.Fsymbol == CCoreAcct::SYMBOL_common);
+    m_vecBalanceType.push_back(acct.Fbalance_type);
+
+    return m_vecBalance.size() - 1;
+}
+
+//登记一条分录，换算规则与CLegFlowType、CCoreAcct::post一致
+void CCoreBatchCheck::addLeg(const size_t iAcct, const int iOp, const LONG lAmount)
+{
+    LONG lPay = 0;
+    LONG lConDelta = 0;
+    bool bCheckAvail = !m_vecCommon[iAcct];
+    bool bCheckCon = false;
+
+    switch(iOp)
+    {
+        case OP_debit:
+            lPay = m_vecBalanceType[iAcct] == CCoreAcct::BAlANCE_debit? lAmount: -lAmount;
+            break;
+        case OP_credit:
+            lPay = m_vecBalanceType[iAcct] == CCoreAcct::BAlANCE_debit? -lAmount: lAmount;
+            break;
+        case OP_freeze:
+            //冻结类金额为负（冲销时）不操作账户
+            lConDelta = lAmount < 0? 0: lAmount;
+            bCheckAvail = bCheckAvail && lAmount >= 0;
+            break;
+        case OP_unfreeze:
+            lConDelta = lAmount < 0? 0: -lAmount;
+            bCheckAvail = false;
+            bCheckCon = lAmount >= 0;
+            break;
+        default:
+            throw CException(ERR_BAD_BRANCH, "batch check: wrong op", __FILE__, __LINE__);
+    }
+
+    m_vecLegAcct.push_back(iAcct);
+    m_vecPay.push_back(lPay);
+    m_vecConDelta.push_back(lConDelta);
+    m_vecAvailMask.push_back(bCheckAvail? -1: 0);
+    m_vecConMask.push_back(bCheckCon? -1: 0);
+}
+
+//按登记顺序校验全部分录
+int CCoreBatchCheck::check(vector<char>* ptrBad)
+{
+    size_t n = m_vecLegAcct.size();
+    if(0 == n) return -1;
+
+    //同一账户的分录依次累加，得到每条分录记账后的余额
+    vector<LONG> vecBalance(m_vecBalance);
+    vector<LONG> vecCon(m_vecCon);
+    m_vecPostBalance.resize(n);
+    m_vecPostCon.resize(n);
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t iAcct = m_vecLegAcct[i];
+        vecBalance[iAcct] += m_vecPay[i];
+        vecCon[iAcct] += m_vecConDelta[i];
+        m_vecPostBalance[i] = vecBalance[iAcct];
+        m_vecPostCon[i] = vecCon[iAcct];
+    }
+
+    vector<char> vecBad;
+    vector<char>& bad = ptrBad? *ptrBad: vecBad;
+    bad.resize(n);
+
+    size_t iBad = 0;
+#if CORE_BATCH_AVX2
+    if(m_bAvx2)
+    {
+        iBad = maskAvx2(&m_vecPostBalance[0], &m_vecPostCon[0], &m_vecAvailMask[0], &m_vecConMask[0], &bad[0], n);
+    }
+    else
+#endif
+    {
+        iBad = maskScalar(&m_vecPostBalance[0], &m_vecPostCon[0], &m_vecAvailMask[0], &m_vecConMask[0], &bad[0], 0, n);
+    }
+
+    if(0 == iBad) return -1;
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(bad[i]) return i;
+    }
+    return -1;
+}
+
+//不满足的分录对应的错误码
+int CCoreBatchCheck::error(const size_t iLeg) const
+{
+    return m_vecConMask[iLeg]? ERR_LACK_CON: ERR_LACK_BALANCE;
+}
+
+//清空
+void CCoreBatchCheck::clear()
+{
+    m_vecBalance.clear();
+    m_vecCon.clear();
+    m_vecCommon.clear();
+    m_vecBalanceType.clear();
+    m_vecLegAcct.clear();
+    m_vecPay.clear();
+    m_vecConDelta.clear();
+    m_vecAvailMask.clear();
+    m_vecConMask.clear();
+}
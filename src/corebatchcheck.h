@@ -0,0 +1,66 @@
+#ifndef _CORE_BATCH_CHECK_H_
+#define _CORE_BATCH_CHECK_H_
+
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+
+class CCoreAcct;
+
+/*
+ * 批量记账余额预校验
+ * 结算、代发等一次对一组账户记大量分录时，逐条checkAmount要按Fsymbol、流水类型分支；
+ * 这里把账户余额和分录发生额摊成按列存放的数组，先按分录顺序算出每条分录记账后的余额、冻结余额，
+ * 再一次性算出违反掩码：非共有类账户出入款、冻结后可用余额为负，或解冻后冻结余额为负
+ * 掩码计算在支持AVX2的CPU上每次处理4条分录，否则走标量实现，两者结果一致
+ * 只做预校验，记账时CCoreAcct仍逐条校验
+ */
+class CCoreBatchCheck
+{
+public:
+    //构造函数
+    CCoreBatchCheck();
+
+    //登记账户当前余额，返回账户下标
+    size_t addAcct(const CCoreAcct& acct);
+
+    //登记一条分录，iOp为OP_debit/OP_credit/OP_freeze/OP_unfreeze，按账户余额方向换算为余额变动
+    void addLeg(const size_t iAcct, const int iOp, const LONG lAmount);
+
+    //按登记顺序校验全部分录，返回第一条不满足的分录下标，全部满足返回-1；ptrBad非空时逐条标记
+    int check(vector<char>* ptrBad = NULL);
+
+    //不满足的分录对应的错误码（ERR_LACK_BALANCE/ERR_LACK_CON）
+    int error(const size_t iLeg) const;
+
+    //清空
+    void clear();
+
+    //开关AVX2，关闭或CPU不支持时走标量实现
+    static void setAvx2(const bool bEnable);
+
+    //当前是否使用AVX2
+    static bool avx2();
+
+protected:
+    //账户，按列存放
+    vector<LONG> m_vecBalance;
+    vector<LONG> m_vecCon;
+    vector<char> m_vecCommon;
+    vector<int> m_vecBalanceType;
+
+    //分录，按列存放；掩码为-1时校验对应条件，0时不校验
+    vector<size_t> m_vecLegAcct;
+    vector<LONG> m_vecPay;       //余额变动
+    vector<LONG> m_vecConDelta;  //冻结余额变动
+    vector<LONG> m_vecAvailMask; //校验可用余额
+    vector<LONG> m_vecConMask;   //校验冻结余额
+
+    //分录记账后的余额、冻结余额
+    vector<LONG> m_vecPostBalance;
+    vector<LONG> m_vecPostCon;
+
+    static bool m_bAvx2;
+};
+
+#endif
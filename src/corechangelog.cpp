@@ -0,0 +1,825 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "corechangelog.h"
+#include "error.h"
+#include "coreerror.h"
+#include "common.h"
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//转义字段中的分隔符
+static void appendField(string& strOut, const string& strField)
+{
+    strOut += '\t';
+    for(size_t i = 0; i < strField.size(); ++i)
+    {
+        switch(strField[i])
+        {
+            case '\t': strOut += "\\t"; break;
+            case '\n': strOut += "\\n"; break;
+            case '\\': strOut += "\\\\"; break;
+            default: strOut += strField[i]; break;
+        }
+    }
+}
+
+//追加整数字段
+static void appendField(string& strOut, const LONG lField)
+{
+    char szBuf[32] = {0};
+    snprintf(szBuf, sizeof(szBuf), "\t%lld", lField);
+    strOut += szBuf;
+}
+
+//按分隔符切分一行并反转义
+static void splitLine(const string& strLine, vector<string>& vecField)
+{
+    vecField.clear();
+    vecField.push_back("");
+    for(size_t i = 0; i < strLine.size(); ++i)
+    {
+        char c = strLine[i];
+        if(c == '\t')
+        {
+            vecField.push_back("");
+        }
+        else if(c == '\\' && i + 1 < strLine.size())
+        {
+            char n = strLine[++i];
+            vecField.back() += (n == 't'? '\t': (n == 'n'? '\n': n));
+        }
+        else if(c != '\n')
+        {
+            vecField.back() += c;
+        }
+    }
+}
+
+/*****************
+ * 核心变更日志 *
+******************/
+
+// 构造函数
+CCoreChangeLog::CCoreChangeLog()
+{
+    m_bOpen = false;
+    m_ptrFile = NULL;
+    m_lSegBytes = 64 << 20;
+    m_lSegSize = 0;
+    m_bSync = false;
+    m_lNextReserve = 1;
+    m_lNextWrite = 1;
+    m_lSkip = 0;
+    m_lDrop = 0;
+
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreChangeLog::~CCoreChangeLog()
+{
+    close();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局日志
+CCoreChangeLog* CCoreChangeLog::instance()
+{
+    static CCoreChangeLog log;
+    return &log;
+}
+
+//打开日志目录
+void CCoreChangeLog::open(const string& strDir, const LONG lSegBytes, const bool bSync)
+{
+    pthread_mutex_lock(&m_mutex);
+
+    m_strDir = strDir;
+    m_lSegBytes = lSegBytes;
+    m_bSync = bSync;
+
+    vector<LONG> vecSeg;
+    listSegment(m_strDir, vecSeg);
+
+    try
+    {
+        if(vecSeg.empty())
+        {
+            m_lNextReserve = 1;
+            roll(1);
+        }
+        else
+        {
+            //从最后一段找出最大序号，接着续写
+            LONG lLast = vecSeg.back() - 1;
+            string strName = segmentName(m_strDir, vecSeg.back());
+            CCoreChangeReader reader(m_strDir, "");
+            reader.seek(vecSeg.back());
+            CCoreChange change;
+            while(reader.next(change))
+            {
+                lLast = change.lOffset;
+            }
+
+            //上次退出时写了一半的记录截掉，续写的记录才能被读到
+            struct stat st;
+            LONG lEnd = reader.position();
+            if(0 == stat(strName.c_str(), &st) && st.st_size > lEnd && 0 != truncate(strName.c_str(), lEnd))
+            {
+                throw CException(ERR_CORE_IO, "core change log: truncate " + strName + " failed", __FILE__, __LINE__);
+            }
+
+            m_ptrFile = fopen(strName.c_str(), "a");
+            if(NULL == m_ptrFile)
+            {
+                throw CException(ERR_CORE_IO, "core change log: open " + strName + " failed", __FILE__, __LINE__);
+            }
+            fseeko(m_ptrFile, 0, SEEK_END);
+            m_lSegSize = ftello(m_ptrFile);
+            m_strSegName = strName;
+            m_lNextReserve = lLast + 1;
+        }
+        m_lNextWrite = m_lNextReserve;
+        m_mapReady.clear();
+        m_mapReserve.clear();
+        m_bOpen = true;
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        throw;
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//关闭
+void CCoreChangeLog::close()
+{
+    pthread_mutex_lock(&m_mutex);
+    if(m_ptrFile)
+    {
+        fclose(m_ptrFile);
+        m_ptrFile = NULL;
+    }
+    m_bOpen = false;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//领取序号
+LONG CCoreChangeLog::reserve()
+{
+    pthread_mutex_lock(&m_mutex);
+    LONG lOffset = m_lNextReserve++;
+    m_mapReserve[lOffset] = nowUs();
+    pthread_mutex_unlock(&m_mutex);
+
+    return lOffset;
+}
+
+//提交后写入记录
+void CCoreChangeLog::append(const LONG lOffset, CCoreChange& change)
+{
+    change.lOffset = lOffset;
+    change.lCommitUs = nowUs();
+    string strRecord = encode(change);
+
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        m_mapReserve.erase(lOffset);
+        if(lOffset < m_lNextWrite)
+        {
+            //已被跳过的序号，持有的行锁刚释放，直接写出
+            write(lOffset, strRecord);
+        }
+        else
+        {
+            m_mapReady[lOffset] = strRecord;
+            drain();
+        }
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//作废序号
+void CCoreChangeLog::cancel(const LONG lOffset)
+{
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        m_mapReserve.erase(lOffset);
+        if(lOffset >= m_lNextWrite)
+        {
+            m_mapReady[lOffset] = "";
+            drain();
+        }
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//按序号顺序写出已就绪的记录，前面还有未提交的序号时先缓着
+void CCoreChangeLog::drain()
+{
+    while(m_lNextWrite < m_lNextReserve)
+    {
+        map<LONG, string>::iterator it = m_mapReady.find(m_lNextWrite);
+        if(it == m_mapReady.end())
+        {
+            //领取后迟迟不提交也不作废的序号跳过，不让它挡住后面的记录
+            map<LONG, LONG>::iterator itReserve = m_mapReserve.find(m_lNextWrite);
+            if(itReserve != m_mapReserve.end()
+                && nowUs() - itReserve->second < WAIT_US && m_mapReady.size() < MAX_READY)
+            {
+                break;
+            }
+            m_lSkip++;
+            m_lNextWrite++;
+            continue;
+        }
+
+        if(!it->second.empty())
+        {
+            try
+            {
+                write(it->first, it->second);
+            }
+            catch(CException& e)
+            {
+                //留着下次重试；积压过多时丢弃，由发件箱补写
+                if(m_mapReady.size() < MAX_READY) throw;
+                m_lDrop++;
+            }
+        }
+        m_mapReady.erase(it);
+        m_lNextWrite++;
+    }
+}
+
+//写入一条记录
+void CCoreChangeLog::write(const LONG lOffset, const string& strRecord)
+{
+    if(NULL == m_ptrFile)
+    {
+        reopen();
+    }
+
+    if(m_lSegSize > 0 && m_lSegSize + (LONG)strRecord.size() > m_lSegBytes)
+    {
+        //新分段打不开时继续写当前段，不影响已提交的记账
+        try
+        {
+            roll(lOffset);
+        }
+        catch(CException& e)
+        {
+        }
+    }
+
+    //整条记录一次写出，读端遇到不完整的记录会等下次再读
+    bool bOK = fwrite(strRecord.data(), 1, strRecord.size(), m_ptrFile) == strRecord.size();
+    bOK = 0 == fflush(m_ptrFile) && bOK;
+    if(bOK && m_bSync)
+    {
+        bOK = 0 == fsync(fileno(m_ptrFile));
+    }
+
+    if(!bOK)
+    {
+        //缓冲区里可能还留着半条记录，关掉文件，下次写之前截回写之前的长度
+        fclose(m_ptrFile);
+        m_ptrFile = NULL;
+        throw CException(ERR_CORE_IO, "core change log: write " + m_strSegName + " failed", __FILE__, __LINE__);
+    }
+    m_lSegSize += strRecord.size();
+}
+
+//写失败后重开当前段
+void CCoreChangeLog::reopen()
+{
+    if(0 != truncate(m_strSegName.c_str(), m_lSegSize))
+    {
+        throw CException(ERR_CORE_IO, "core change log: truncate " + m_strSegName + " failed", __FILE__, __LINE__);
+    }
+
+    m_ptrFile = fopen(m_strSegName.c_str(), "a");
+    if(NULL == m_ptrFile)
+    {
+        throw CException(ERR_CORE_IO, "core change log: open " + m_strSegName + " failed", __FILE__, __LINE__);
+    }
+}
+
+//打开新分段
+void CCoreChangeLog::roll(const LONG lStart)
+{
+    string strName = segmentName(m_strDir, lStart);
+
+    FILE* ptrFile = fopen(strName.c_str(), "a");
+    if(NULL == ptrFile)
+    {
+        throw CException(ERR_CORE_IO, "core change log: open " + strName + " failed", __FILE__, __LINE__);
+    }
+
+    if(m_ptrFile) fclose(m_ptrFile);
+    m_ptrFile = ptrFile;
+    m_strSegName = strName;
+    m_lSegSize = 0;
+}
+
+//从各分区的发件箱补写已提交未落盘的记录
+int CCoreChangeLog::recover(const vector<CCoreDBPool*>& vecPool)
+{
+    vector<CCoreDBPool*> vecPart = vecPool;
+    if(vecPart.empty()) vecPart.push_back(NULL);
+
+    char szSql[MAX_SQL_LEN] = {0};
+    string strIp = HOST_IP;
+    map<LONG, string> mapRecord;
+
+    pthread_mutex_lock(&m_mutex);
+    LONG lFrom = m_lNextWrite;
+    pthread_mutex_unlock(&m_mutex);
+
+    for(size_t i = 0; i < vecPart.size(); ++i)
+    {
+        CCoreDBLease lease(vecPart[i], true);
+        CMySQL* ptrSql = lease.handle();
+        MYSQL_RES* pRes = NULL;
+
+        int iLen = snprintf(szSql, sizeof(szSql),
+            "SELECT Foffset,Frecord FROM isp_os_core.t_change_outbox "
+            "WHERE Fip = '%s' AND Foffset >= %lld",
+            strIp.c_str(), lFrom);
+
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
+
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            mapRecord[row[0]? atoll(row[0]): 0] = row[1]? row[1]: "";
+        }
+        mysql_free_result(pRes);
+    }
+
+    //发件箱里的记录都已提交，按序号补写，中间缺的序号是回滚或未提交的
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        for(map<LONG, string>::const_iterator it = mapRecord.begin(); it != mapRecord.end(); ++it)
+        {
+            if(it->first < m_lNextWrite || it->second.empty()) continue;
+            write(it->first, it->second);
+            m_lNextWrite = it->first + 1;
+        }
+        if(m_lNextReserve < m_lNextWrite) m_lNextReserve = m_lNextWrite;
+        m_lNextWrite = m_lNextReserve;
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    for(size_t i = 0; i < vecPart.size(); ++i)
+    {
+        trim(vecPart[i]);
+    }
+
+    return mapRecord.size();
+}
+
+//已落盘的最大序号之后第一个还不能清理的序号
+LONG CCoreChangeLog::trimBound()
+{
+    pthread_mutex_lock(&m_mutex);
+    LONG lBound = m_lNextWrite;
+    //跳过的序号之后可能还会提交；领取后很久都没有结果的视为已丢失
+    LONG lNow = nowUs();
+    while(!m_mapReserve.empty() && lNow - m_mapReserve.begin()->second > 10LL * WAIT_US)
+    {
+        m_mapReserve.erase(m_mapReserve.begin());
+    }
+    if(!m_mapReserve.empty() && m_mapReserve.begin()->first < lBound)
+    {
+        lBound = m_mapReserve.begin()->first;
+    }
+    //未开同步落盘时先刷到磁盘，清理后主机掉电也不会丢
+    if(m_ptrFile && !m_bSync && 0 != fsync(fileno(m_ptrFile)))
+    {
+        lBound = 0;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return lBound;
+}
+
+//清理分区发件箱中已落盘的记录
+void CCoreChangeLog::trim(CCoreDBPool* ptrPool)
+{
+    LONG lBound = trimBound();
+    if(lBound <= 0) return;
+
+    CCoreDBLease lease(ptrPool, true);
+    CMySQL* ptrSql = lease.handle();
+    char szSql[MAX_SQL_LEN] = {0};
+    string strIp = HOST_IP;
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "DELETE FROM isp_os_core.t_change_outbox WHERE Fip = '%s' AND Foffset < %lld",
+        strIp.c_str(), lBound);
+
+    ptrSql->Query(szSql, iLen);
+}
+
+//事务内写发件箱
+void CCoreChangeLog::saveOutbox(CMySQL* ptrSql, const LONG lOffset, const CCoreChange& change)
+{
+    CCoreChange record = change;
+    record.lOffset = lOffset;
+    record.lCommitUs = nowUs();
+
+    char szHead[MAX_MSG_LEN] = {0};
+    string strIp = HOST_IP;
+    snprintf(szHead, sizeof(szHead) - 1,
+        "INSERT INTO isp_os_core.t_change_outbox (Fip,Foffset,Frecord,Fcreate_time) "
+        "VALUES ('%s',%lld,'", strIp.c_str(), lOffset);
+
+    //同一事务内多次flush时以最后一次的完整记录为准
+    string strSql = szHead;
+    strSql += ptrSql->EscapeStr(encode(record));
+    strSql += "',now()) ON DUPLICATE KEY UPDATE Frecord = VALUES(Frecord)";
+
+    ptrSql->Query(strSql.c_str(), strSql.length());
+}
+
+//跳过的序号数
+LONG CCoreChangeLog::skipped()
+{
+    pthread_mutex_lock(&m_mutex);
+    LONG lSkip = m_lSkip;
+    pthread_mutex_unlock(&m_mutex);
+    return lSkip;
+}
+
+//丢弃的记录数
+LONG CCoreChangeLog::dropped()
+{
+    pthread_mutex_lock(&m_mutex);
+    LONG lDrop = m_lDrop;
+    pthread_mutex_unlock(&m_mutex);
+    return lDrop;
+}
+
+//删除早于lOffset的分段
+void CCoreChangeLog::purge(const LONG lOffset)
+{
+    vector<LONG> vecSeg;
+    listSegment(m_strDir, vecSeg);
+
+    //下一段的起始序号不超过lOffset，说明本段全部早于lOffset
+    for(size_t i = 0; i + 1 < vecSeg.size() && vecSeg[i + 1] <= lOffset; ++i)
+    {
+        unlink(segmentName(m_strDir, vecSeg[i]).c_str());
+    }
+}
+
+//编码一条记录
+string CCoreChangeLog::encode(const CCoreChange& change)
+{
+    string strOut = "C";
+    appendField(strOut, change.lOffset);
+    appendField(strOut, change.lCommitUs);
+    appendField(strOut, (LONG)change.vecAcct.size());
+    appendField(strOut, (LONG)change.vecFlow.size());
+    strOut += '\n';
+
+    for(size_t i = 0; i < change.vecAcct.size(); ++i)
+    {
+        const CCoreChangeAcct& acct = change.vecAcct[i];
+        strOut += "A";
+        appendField(strOut, acct.Fuid);
+        appendField(strOut, acct.Fbalance);
+        appendField(strOut, acct.Fcon);
+        appendField(strOut, acct.Fproof_id);
+        appendField(strOut, acct.Ftimestamp);
+        appendField(strOut, acct.Ftimestamp_us);
+        appendField(strOut, acct.Facct_sign);
+        strOut += '\n';
+    }
+
+    for(size_t i = 0; i < change.vecFlow.size(); ++i)
+    {
+        const CCoreChangeFlow& flow = change.vecFlow[i];
+        strOut += "F";
+        appendField(strOut, flow.Fcur_type);
+        appendField(strOut, flow.Flistid);
+        appendField(strOut, flow.Fuid);
+        appendField(strOut, flow.Fuin);
+        appendField(strOut, flow.Ftype);
+        appendField(strOut, flow.Faction_type);
+        appendField(strOut, flow.Fsubject);
+        appendField(strOut, flow.Fcounter_uid);
+        appendField(strOut, flow.Fcounter_uin);
+        appendField(strOut, flow.Fbalance);
+        appendField(strOut, flow.Fcon);
+        appendField(strOut, flow.Fpaynum);
+        appendField(strOut, flow.Fconnum);
+        appendField(strOut, flow.Fmemo);
+        appendField(strOut, flow.Ftrade_memo);
+        appendField(strOut, flow.Fcreate_time);
+        appendField(strOut, flow.Ftimestamp);
+        strOut += '\n';
+    }
+
+    return strOut;
+}
+
+//列出分段
+void CCoreChangeLog::listSegment(const string& strDir, vector<LONG>& vecSeg)
+{
+    vecSeg.clear();
+
+    DIR* ptrDir = opendir(strDir.c_str());
+    if(NULL == ptrDir) return;
+
+    struct dirent* ptrEnt = NULL;
+    while((ptrEnt = readdir(ptrDir)) != NULL)
+    {
+        const char* szName = ptrEnt->d_name;
+        size_t iLen = strlen(szName);
+        if(iLen > 4 && strcmp(szName + iLen - 4, ".log") == 0 && szName[0] >= '0' && szName[0] <= '9')
+        {
+            vecSeg.push_back(atoll(szName));
+        }
+    }
+    closedir(ptrDir);
+
+    sort(vecSeg.begin(), vecSeg.end());
+}
+
+//分段文件名
+string CCoreChangeLog::segmentName(const string& strDir, const LONG lStart)
+{
+    char szName[64] = {0};
+    snprintf(szName, sizeof(szName), "/%020lld.log", lStart);
+    return strDir + szName;
+}
+
+/*****************
+ * 变更日志消费者 *
+******************/
+
+// 构造函数
+CCoreChangeReader::CCoreChangeReader(const string& strDir, const string& strConsumer)
+{
+    m_strDir = strDir;
+    m_strConsumer = strConsumer;
+    m_ptrFile = NULL;
+    m_lSegStart = 0;
+    m_lNext = 0;
+
+    if(m_strConsumer.empty()) return;
+
+    FILE* ptrFile = fopen((m_strDir + "/" + m_strConsumer + ".offset").c_str(), "r");
+    if(ptrFile)
+    {
+        long long lOffset = 0;
+        if(1 == fscanf(ptrFile, "%lld", &lOffset))
+        {
+            m_lNext = lOffset;
+        }
+        fclose(ptrFile);
+    }
+}
+
+//析构函数
+CCoreChangeReader::~CCoreChangeReader()
+{
+    if(m_ptrFile) fclose(m_ptrFile);
+}
+
+//从序号lOffset开始重放
+void CCoreChangeReader::seek(const LONG lOffset)
+{
+    if(m_ptrFile)
+    {
+        fclose(m_ptrFile);
+        m_ptrFile = NULL;
+    }
+    m_lNext = lOffset;
+}
+
+//读下一条记录
+bool CCoreChangeReader::next(CCoreChange& change)
+{
+    if(NULL == m_ptrFile && !openSegment(m_lNext)) return false;
+
+    bool bSealed = false;
+    while(true)
+    {
+        if(readRecord(change))
+        {
+            if(change.lOffset < m_lNext) continue;
+
+            m_lNext = change.lOffset + 1;
+            return true;
+        }
+
+        if(bSealed)
+        {
+            if(!nextSegment()) return false;
+            bSealed = false;
+            continue;
+        }
+
+        //出现下一段后本段不会再写入，再读一遍确认读完再切换
+        vector<LONG> vecSeg;
+        CCoreChangeLog::listSegment(m_strDir, vecSeg);
+        if(vecSeg.empty() || vecSeg.back() <= m_lSegStart) return false;
+        bSealed = true;
+    }
+}
+
+//提交消费位置
+void CCoreChangeReader::commit()
+{
+    string strName = m_strDir + "/" + m_strConsumer + ".offset";
+    string strTmp = strName + ".tmp";
+
+    FILE* ptrFile = fopen(strTmp.c_str(), "w");
+    if(NULL == ptrFile)
+    {
+        throw CException(ERR_BAD_BRANCH, "core change log: open " + strTmp + " failed", __FILE__, __LINE__);
+    }
+    fprintf(ptrFile, "%lld\n", m_lNext);
+    fflush(ptrFile);
+    fsync(fileno(ptrFile));
+    fclose(ptrFile);
+
+    //先写临时文件再改名，中途退出不会留下半个位置
+    if(0 != rename(strTmp.c_str(), strName.c_str()))
+    {
+        throw CException(ERR_BAD_BRANCH, "core change log: rename " + strTmp + " failed", __FILE__, __LINE__);
+    }
+}
+
+//打开包含lOffset的分段
+bool CCoreChangeReader::openSegment(const LONG lOffset)
+{
+    vector<LONG> vecSeg;
+    CCoreChangeLog::listSegment(m_strDir, vecSeg);
+    if(vecSeg.empty()) return false;
+
+    //起始序号不超过lOffset的最后一段；lOffset早于全部分段（已清理）时从第一段开始
+    size_t iSeg = 0;
+    for(size_t i = 0; i < vecSeg.size() && vecSeg[i] <= lOffset; ++i)
+    {
+        iSeg = i;
+    }
+
+    FILE* ptrFile = fopen(CCoreChangeLog::segmentName(m_strDir, vecSeg[iSeg]).c_str(), "r");
+    if(NULL == ptrFile) return false;
+
+    if(m_ptrFile) fclose(m_ptrFile);
+    m_ptrFile = ptrFile;
+    m_lSegStart = vecSeg[iSeg];
+    return true;
+}
+
+//切换到下一分段
+bool CCoreChangeReader::nextSegment()
+{
+    vector<LONG> vecSeg;
+    CCoreChangeLog::listSegment(m_strDir, vecSeg);
+
+    vector<LONG>::iterator it = upper_bound(vecSeg.begin(), vecSeg.end(), m_lSegStart);
+    if(it == vecSeg.end()) return false;
+
+    FILE* ptrFile = fopen(CCoreChangeLog::segmentName(m_strDir, *it).c_str(), "r");
+    if(NULL == ptrFile) return false;
+
+    fclose(m_ptrFile);
+    m_ptrFile = ptrFile;
+    m_lSegStart = *it;
+    return true;
+}
+
+//读一行，不完整时返回false
+static bool readLine(FILE* ptrFile, string& strLine)
+{
+    char* szBuf = NULL;
+    size_t iCap = 0;
+    ssize_t iLen = getline(&szBuf, &iCap, ptrFile);
+
+    bool bOK = iLen > 0 && szBuf[iLen - 1] == '\n';
+    if(bOK) strLine.assign(szBuf, iLen);
+    free(szBuf);
+
+    return bOK;
+}
+
+//读一条完整记录
+bool CCoreChangeReader::readRecord(CCoreChange& change)
+{
+    off_t lPos = ftello(m_ptrFile);
+    string strLine;
+    vector<string> vecField;
+
+    change.vecAcct.clear();
+    change.vecFlow.clear();
+
+    bool bOK = readLine(m_ptrFile, strLine);
+    if(bOK)
+    {
+        splitLine(strLine, vecField);
+        bOK = vecField.size() >= 5 && vecField[0] == "C";
+    }
+
+    if(bOK)
+    {
+        change.lOffset = atoll(vecField[1].c_str());
+        change.lCommitUs = atoll(vecField[2].c_str());
+        LONG lAcct = atoll(vecField[3].c_str());
+        LONG lFlow = atoll(vecField[4].c_str());
+
+        for(LONG i = 0; bOK && i < lAcct; ++i)
+        {
+            bOK = readLine(m_ptrFile, strLine);
+            if(!bOK) break;
+            splitLine(strLine, vecField);
+            bOK = vecField.size() >= 8;
+            if(!bOK) break;
+
+            CCoreChangeAcct acct;
+            acct.Fuid = atoll(vecField[1].c_str());
+            acct.Fbalance = atoll(vecField[2].c_str());
+            acct.Fcon = atoll(vecField[3].c_str());
+            acct.Fproof_id = vecField[4];
+            acct.Ftimestamp = atoi(vecField[5].c_str());
+            acct.Ftimestamp_us = atoi(vecField[6].c_str());
+            acct.Facct_sign = vecField[7];
+            change.vecAcct.push_back(acct);
+        }
+
+        for(LONG i = 0; bOK && i < lFlow; ++i)
+        {
+            bOK = readLine(m_ptrFile, strLine);
+            if(!bOK) break;
+            splitLine(strLine, vecField);
+            bOK = vecField.size() >= 18;
+            if(!bOK) break;
+
+            CCoreChangeFlow flow;
+            flow.Fcur_type = vecField[1];
+            flow.Flistid = vecField[2];
+            flow.Fuid = atoll(vecField[3].c_str());
+            flow.Fuin = vecField[4];
+            flow.Ftype = atoi(vecField[5].c_str());
+            flow.Faction_type = atoi(vecField[6].c_str());
+            flow.Fsubject = atoi(vecField[7].c_str());
+            flow.Fcounter_uid = atoll(vecField[8].c_str());
+            flow.Fcounter_uin = vecField[9];
+            flow.Fbalance = atoll(vecField[10].c_str());
+            flow.Fcon = atoll(vecField[11].c_str());
+            flow.Fpaynum = atoll(vecField[12].c_str());
+            flow.Fconnum = atoll(vecField[13].c_str());
+            flow.Fmemo = vecField[14];
+            flow.Ftrade_memo = vecField[15];
+            flow.Fcreate_time = vecField[16];
+            flow.Ftimestamp = atoi(vecField[17].c_str());
+            change.vecFlow.push_back(flow);
+        }
+    }
+
+    //不完整（写端还没写完）时退回，下次从这里重读
+    if(!bOK)
+    {
+        clearerr(m_ptrFile);
+        fseeko(m_ptrFile, lPos, SEEK_SET);
+    }
+
+    return bOK;
+}
@@ -0,0 +1,215 @@
+#ifndef _CORE_CHANGE_LOG_H_
+#define _CORE_CHANGE_LOG_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+/*
+ * 变更账户的最终状态
+ */
+struct CCoreChangeAcct
+{
+    LONG Fuid;
+    LONG Fbalance;
+    LONG Fcon;
+    string Fproof_id;
+    int Ftimestamp;
+    int Ftimestamp_us;
+    string Facct_sign;
+};
+
+/*
+ * 新增流水
+ */
+struct CCoreChangeFlow
+{
+    string Fcur_type;
+    string Flistid;
+    LONG Fuid;
+    string Fuin;
+    int Ftype;
+    int Faction_type;
+    int Fsubject;
+    LONG Fcounter_uid;
+    string Fcounter_uin;
+    LONG Fbalance;
+    LONG Fcon;
+    LONG Fpaynum;
+    LONG Fconnum;
+    string Fmemo;
+    string Ftrade_memo;
+    string Fcreate_time;
+    int Ftimestamp;
+};
+
+/*
+ * 一次提交的全部变更
+ */
+struct CCoreChange
+{
+    LONG lOffset;    //日志序号，单调递增，不保证连续
+    LONG lCommitUs;  //写入日志的时间
+    vector<CCoreChangeAcct> vecAcct;
+    vector<CCoreChangeFlow> vecFlow;
+};
+
+/*
+ * 核心变更日志
+ * 每次记账提交的账户更新和流水写成一条记录，追加到本地分段文件<序号>.log，
+ * 下游读日志代替轮询t_account/t_flow
+ * 序号在事务内（持有行锁时）领取，提交后按序号顺序落盘，同一账户的变更在日志中保持提交顺序；
+ * 事务回滚时领取的序号作废
+ * 总账流水开启汇总时不逐笔写t_flow，也不进日志
+ *
+ * 记录同时在记账事务内写入isp_os_core.t_change_outbox（发件箱），提交后、落盘前进程退出时，
+ * 重启后recover()从各分区的发件箱补写；已落盘的部分由trim()定期清理
+ * isp_os_core.t_change_outbox: 主键(Fip, Foffset)，Frecord MEDIUMTEXT，Fcreate_time
+ *
+ * 领取后迟迟不提交也不作废的序号（超过等待时间或积压过多）跳过，不再阻塞后面的记录，
+ * 它之后再提交时直接写出；写盘失败的记录留在内存中下次重试，积压过多时丢弃，由发件箱补写
+ */
+class CCoreChangeLog
+{
+public:
+    //构造函数
+    CCoreChangeLog();
+
+    //析构函数
+    ~CCoreChangeLog();
+
+    //全局日志
+    static CCoreChangeLog* instance();
+
+    //打开日志目录，接着已有的最后一段续写；lSegBytes为单段大小上限，bSync为每条记录落盘后fsync
+    void open(const string& strDir, const LONG lSegBytes = 64 << 20, const bool bSync = false);
+
+    //关闭
+    void close();
+
+    //是否启用
+    bool enabled() const { return m_bOpen; }
+
+    //领取序号，须在持有相关行锁时调用
+    LONG reserve();
+
+    //提交后写入记录
+    void append(const LONG lOffset, CCoreChange& change);
+
+    //作废序号
+    void cancel(const LONG lOffset);
+
+    //删除全部记录都早于lOffset的分段
+    void purge(const LONG lOffset);
+
+    //从各分区的发件箱补写已提交未落盘的记录，open之后、开始记账前调用；vecPool为空时用默认连接
+    int recover(const vector<CCoreDBPool*>& vecPool);
+
+    //清理分区发件箱中已落盘的记录
+    void trim(CCoreDBPool* ptrPool = NULL);
+
+    //事务内写发件箱，lOffset为已领取的序号
+    static void saveOutbox(CMySQL* ptrSql, const LONG lOffset, const CCoreChange& change);
+
+    //跳过的序号数、丢弃的记录数
+    LONG skipped();
+    LONG dropped();
+
+    //编码一条记录
+    static string encode(const CCoreChange& change);
+
+    //列出目录下的分段起始序号，升序
+    static void listSegment(const string& strDir, vector<LONG>& vecSeg);
+
+    //分段文件名
+    static string segmentName(const string& strDir, const LONG lStart);
+
+protected:
+    //按序号顺序写出已就绪的记录
+    void drain();
+    //写入一条记录，必要时切换分段
+    void write(const LONG lOffset, const string& strRecord);
+    //打开新分段
+    void roll(const LONG lStart);
+    //写失败后重开当前段，截掉写了一半的记录
+    void reopen();
+    //已落盘的最大序号之后第一个还不能清理的序号
+    LONG trimBound();
+
+protected:
+    enum
+    {
+        MAX_READY = 100000,          //m_mapReady积压上限
+        WAIT_US = 60000000           //序号领取后等待提交的最长时间（微秒）
+    };
+
+    string m_strDir;
+    string m_strSegName; //当前段文件名
+    bool m_bOpen;
+    FILE* m_ptrFile;
+    LONG m_lSegBytes;
+    LONG m_lSegSize;
+    bool m_bSync;
+    LONG m_lNextReserve; //下一个领取的序号
+    LONG m_lNextWrite;   //下一个待写出的序号
+    map<LONG, string> m_mapReady; //已提交或作废（空串）但还不能写出的记录
+    map<LONG, LONG> m_mapReserve; //已领取未提交的序号 -> 领取时间（微秒）
+    LONG m_lSkip;
+    LONG m_lDrop;
+    pthread_mutex_t m_mutex;
+};
+
+/*
+ * 变更日志消费者
+ * 消费位置存<目录>/<消费者名>.offset，重启后从上次提交的位置继续，也可seek到任意序号重放
+ */
+class CCoreChangeReader
+{
+public:
+    //构造函数，读取已提交的消费位置
+    CCoreChangeReader(const string& strDir, const string& strConsumer);
+
+    //析构函数
+    ~CCoreChangeReader();
+
+    //从序号lOffset开始重放
+    void seek(const LONG lOffset);
+
+    //读下一条记录，已读到末尾返回false，之后可再次调用等待新记录
+    bool next(CCoreChange& change);
+
+    //提交消费位置（最近一次next返回的记录之后）
+    void commit();
+
+    //下一条要读的序号
+    LONG offset() const { return m_lNext; }
+
+    //当前段内最后一条完整记录之后的位置
+    LONG position() const { return m_ptrFile? (LONG)ftello(m_ptrFile): 0; }
+
+protected:
+    //打开包含lOffset的分段
+    bool openSegment(const LONG lOffset);
+    //切换到下一分段
+    bool nextSegment();
+    //读一条完整记录，不完整时退回原位置
+    bool readRecord(CCoreChange& change);
+
+private:
+    CCoreChangeReader(const CCoreChangeReader&);
+    CCoreChangeReader& operator=(const CCoreChangeReader&);
+
+protected:
+    string m_strDir;
+    string m_strConsumer;
+    FILE* m_ptrFile;
+    LONG m_lSegStart;
+    LONG m_lNext;
+};
+
+#endif
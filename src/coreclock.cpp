@@ -0,0 +1,67 @@
+#include <time.h>
+#include "coreclock.h"
+#include "common.h"
+
+CCoreStamp CCoreClock::m_last = {0, 0};
+pthread_mutex_t CCoreClock::m_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*****************
+ * 核心时钟 *
+******************/
+
+//取一个单调递增的时间戳
+void CCoreClock::now(CCoreStamp& stamp)
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    stamp.iSec = tStamp.iTimeStamp;
+    stamp.iUs = tStamp.iTimeStampUs;
+
+    pthread_mutex_lock(&m_mutex);
+    if(!(m_last < stamp))
+    {
+        stamp = m_last;
+        next(stamp);
+    }
+    m_last = stamp;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//见到其他主机写入的时间戳
+void CCoreClock::observe(const CCoreStamp& stamp)
+{
+    pthread_mutex_lock(&m_mutex);
+    if(m_last < stamp)
+    {
+        m_last = stamp;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//紧随其后的时间戳
+void CCoreClock::next(CCoreStamp& stamp)
+{
+    if(++stamp.iUs >= 1000000)
+    {
+        stamp.iSec++;
+        stamp.iUs = 0;
+    }
+}
+
+//格式化时间
+const char* CCoreClock::format(const int iSec)
+{
+    static __thread int t_iSec = -1;
+    static __thread char t_szTime[32];
+
+    if(iSec != t_iSec)
+    {
+        time_t tTime = iSec;
+        struct tm tmTime;
+        localtime_r(&tTime, &tmTime);
+        strftime(t_szTime, sizeof(t_szTime), "%Y-%m-%d %H:%M:%S", &tmTime);
+        t_iSec = iSec;
+    }
+
+    return t_szTime;
+}
@@ -0,0 +1,47 @@
+#ifndef _CORE_CLOCK_H_
+#define _CORE_CLOCK_H_
+
+#include <pthread.h>
+#include <string>
+#include "exception.h"
+
+/*
+ * 记账时间戳 (Ftimestamp, Ftimestamp_us)
+ */
+struct CCoreStamp
+{
+    int iSec;
+    int iUs;
+
+    bool operator<(const CCoreStamp& other) const
+    {
+        return iSec != other.iSec? iSec < other.iSec: iUs < other.iUs;
+    }
+};
+
+/*
+ * 核心时钟
+ * 混合时间戳：取物理时间，但不小于本进程发出过和见到过的最大时间戳，
+ * 本机时钟回拨或其他主机时钟偏快时，时间戳仍然单调递增
+ */
+class CCoreClock
+{
+public:
+    //取一个单调递增的时间戳
+    static void now(CCoreStamp& stamp);
+
+    //见到其他主机写入的时间戳，之后发出的时间戳都比它大
+    static void observe(const CCoreStamp& stamp);
+
+    //紧随其后的时间戳
+    static void next(CCoreStamp& stamp);
+
+    //格式化为YYYY-MM-DD HH:MM:SS，同一秒只格式化一次，返回本线程的缓冲区
+    static const char* format(const int iSec);
+
+private:
+    static CCoreStamp m_last;
+    static pthread_mutex_t m_mutex;
+};
+
+#endif
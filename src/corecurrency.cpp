@@ -0,0 +1,94 @@
+#include "corecurrency.h"
+#include "coreerror.h"
+
+/*****************
+ * 币种分区路由 *
+******************/
+
+// 构造函数
+CCoreCurRouter::CCoreCurRouter()
+{
+    m_bStrict = false;
+    pthread_rwlock_init(&m_lock, NULL);
+}
+
+//析构函数
+CCoreCurRouter::~CCoreCurRouter()
+{
+    for(map<string, CCoreDBPool*>::iterator it = m_mapPool.begin(); it != m_mapPool.end(); ++it)
+    {
+        delete it->second;
+    }
+    m_mapPool.clear();
+
+    pthread_rwlock_destroy(&m_lock);
+}
+
+//全局路由
+CCoreCurRouter* CCoreCurRouter::instance()
+{
+    static CCoreCurRouter router;
+    return &router;
+}
+
+//配置币种分区
+void CCoreCurRouter::addCurrency(const string& strCur, CoreDBFactory factory, const int iMaxSize, const int iWarmUp)
+{
+    //预热可能较慢，放在锁外；初始化完成后才放进路由表，route()不会拿到未初始化的连接池
+    CCoreDBPool* ptrPool = new CCoreDBPool();
+    try
+    {
+        ptrPool->init(factory, iMaxSize, iWarmUp);
+    }
+    catch(CException& e)
+    {
+        delete ptrPool;
+        throw;
+    }
+
+    pthread_rwlock_wrlock(&m_lock);
+    if(m_mapPool.find(strCur) != m_mapPool.end())
+    {
+        pthread_rwlock_unlock(&m_lock);
+        delete ptrPool;
+        throw CException(ERR_BAD_BRANCH, "core currency: partition already added for " + strCur, __FILE__, __LINE__);
+    }
+    m_mapPool[strCur] = ptrPool;
+    pthread_rwlock_unlock(&m_lock);
+}
+
+//查找币种对应的连接池
+CCoreDBPool* CCoreCurRouter::route(const string& strCur)
+{
+    CCoreDBPool* ptrPool = NULL;
+
+    pthread_rwlock_rdlock(&m_lock);
+    map<string, CCoreDBPool*>::iterator it = m_mapPool.find(strCur);
+    if(it != m_mapPool.end())
+    {
+        ptrPool = it->second;
+    }
+    pthread_rwlock_unlock(&m_lock);
+
+    if(ptrPool) return ptrPool;
+
+    if(m_bStrict)
+    {
+        throw CException(ERR_CORE_NO_ROUTE, "core currency: no partition for " + strCur, __FILE__, __LINE__);
+    }
+
+    return CCoreDBPool::instance();
+}
+
+//获取各币种连接池统计
+void CCoreCurRouter::getStat(map<string, CCoreDBPool::Stat>& mapStat)
+{
+    mapStat.clear();
+
+    pthread_rwlock_rdlock(&m_lock);
+    for(map<string, CCoreDBPool*>::iterator it = m_mapPool.begin(); it != m_mapPool.end(); ++it)
+    {
+        it->second->getStat(mapStat[it->first]);
+    }
+    pthread_rwlock_unlock(&m_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef _CORE_CURRENCY_H_
+#define _CORE_CURRENCY_H_
+
+#include <pthread.h>
+#include <string>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+/*
+ * 币种分区路由
+ * 每个Fcur_type对应一个独立的数据库实例和连接池，实例内库表结构不变（isp_os_core），
+ * 记账按凭证币种租用对应连接池的连接，某个币种的突发流量只会占满自己的连接池
+ * 未配置的币种走默认连接池，严格模式下直接拒绝
+ */
+class CCoreCurRouter
+{
+public:
+    //构造函数
+    CCoreCurRouter();
+
+    //析构函数
+    ~CCoreCurRouter();
+
+    //全局路由
+    static CCoreCurRouter* instance();
+
+    //配置币种分区，iMaxSize为该币种的最大并发记账数（连接数）；同一币种只能配置一次
+    void addCurrency(const string& strCur, CoreDBFactory factory, const int iMaxSize, const int iWarmUp = 0);
+
+    //查找币种对应的连接池
+    CCoreDBPool* route(const string& strCur);
+
+    //获取各币种连接池统计
+    void getStat(map<string, CCoreDBPool::Stat>& mapStat);
+
+    //严格模式：未配置的币种报错，不走默认连接池
+    void setStrict(const bool bStrict) { m_bStrict = bStrict; }
+
+private:
+    CCoreCurRouter(const CCoreCurRouter&);
+    CCoreCurRouter& operator=(const CCoreCurRouter&);
+
+protected:
+    map<string, CCoreDBPool*> m_mapPool;
+    bool m_bStrict;
+    pthread_rwlock_t m_lock;
+};
+
+#endif
@@ -0,0 +1,311 @@
+#include <exception>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "coredbpool.h"
+#include "coreerror.h"
+#include "dbcomm.h"
+#include "common.h"
+
+//当前线程租约连接及其所属连接池
+static __thread CMySQL* t_ptrLeaseSql = NULL;
+static __thread CCoreDBPool* t_ptrLeasePool = NULL;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//当前线程的租约连接
+CMySQL* getCoreLeaseHandle()
+{
+    return t_ptrLeaseSql? t_ptrLeaseSql: getCoreDBHandle();
+}
+
+//当前线程的租约连接所属连接池
+CCoreDBPool* getCoreLeasePool()
+{
+    return t_ptrLeasePool? t_ptrLeasePool: CCoreDBPool::instance();
+}
+
+/*****************
+ * 核心数据库连接池 *
+******************/
+
+// 构造函数
+CCoreDBPool::CCoreDBPool()
+{
+    m_factory = NULL;
+    m_iMaxSize = 0;
+    m_iWaitMs = 1000;
+    m_iIdleCheck = 30;
+    memset(&m_stat, 0, sizeof(m_stat));
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+//析构函数
+CCoreDBPool::~CCoreDBPool()
+{
+    for(size_t i = 0; i < m_vecSlot.size(); ++i)
+    {
+        delete m_vecSlot[i].ptrSql;
+    }
+    m_vecSlot.clear();
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//默认连接池
+CCoreDBPool* CCoreDBPool::instance()
+{
+    static CCoreDBPool pool;
+    return &pool;
+}
+
+//初始化并预热连接
+void CCoreDBPool::init(CoreDBFactory factory, const int iMaxSize, const int iWarmUp)
+{
+    pthread_mutex_lock(&m_mutex);
+
+    m_factory = factory;
+    m_iMaxSize = iMaxSize;
+    m_vecSlot.reserve(iMaxSize); //槽位不再搬迁，锁外可以持有槽引用
+
+    try
+    {
+        //预热，启动时就把连接建好
+        for(int i = (int)m_vecSlot.size(); i < iWarmUp && i < iMaxSize; ++i)
+        {
+            Slot slot;
+            slot.ptrSql = m_factory();
+            slot.owner = 0;
+            slot.bBusy = false;
+            slot.bSuspect = false;
+            slot.tLastUse = time(NULL);
+            m_vecSlot.push_back(slot);
+        }
+    }
+    catch(CException& e)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        throw;
+    }
+
+    m_stat.iSize = m_vecSlot.size();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//查找可用连接槽
+int CCoreDBPool::pickSlot()
+{
+    pthread_t self = pthread_self();
+    int iIdle = -1;
+
+    //优先线程上次用过的连接
+    for(size_t i = 0; i < m_vecSlot.size(); ++i)
+    {
+        if(m_vecSlot[i].bBusy) continue;
+        if(pthread_equal(m_vecSlot[i].owner, self)) return i;
+        if(iIdle < 0) iIdle = i;
+    }
+
+    if(iIdle >= 0) return iIdle;
+
+    //没有空闲的则扩容
+    if((int)m_vecSlot.size() < m_iMaxSize)
+    {
+        Slot slot;
+        slot.ptrSql = NULL;
+        slot.owner = 0;
+        slot.bBusy = false;
+        slot.bSuspect = true; //取出时再建连接，不在锁内阻塞
+        slot.tLastUse = 0;
+        m_vecSlot.push_back(slot);
+        m_stat.iSize = m_vecSlot.size();
+        return m_vecSlot.size() - 1;
+    }
+
+    return -1;
+}
+
+//租用连接
+CMySQL* CCoreDBPool::acquire()
+{
+    LONG lStart = nowUs();
+    int iSlot = -1;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + m_iWaitMs / 1000;
+    deadline.tv_nsec = tv.tv_usec * 1000 + (m_iWaitMs % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    while((iSlot = pickSlot()) < 0)
+    {
+        if(ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+        {
+            m_stat.lTimeout++;
+            pthread_mutex_unlock(&m_mutex);
+            throw CException(ERR_CORE_BUSY, "core db pool: wait timeout", __FILE__, __LINE__);
+        }
+    }
+    m_vecSlot[iSlot].bBusy = true;
+    m_vecSlot[iSlot].owner = pthread_self();
+    m_stat.iBusy++;
+    pthread_mutex_unlock(&m_mutex);
+
+    //探活在锁外做，慢连接不阻塞其他线程
+    Slot& slot = m_vecSlot[iSlot];
+    if(!checkSlot(slot))
+    {
+        pthread_mutex_lock(&m_mutex);
+        slot.bBusy = false;
+        slot.bSuspect = true;
+        m_stat.iBusy--;
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+        throw CException(ERR_CORE_BUSY, "core db pool: connect failed", __FILE__, __LINE__);
+    }
+
+    LONG lWait = nowUs() - lStart;
+    pthread_mutex_lock(&m_mutex);
+    m_stat.lAcquire++;
+    m_stat.lWaitUs += lWait;
+    if(lWait > m_stat.lMaxWaitUs) m_stat.lMaxWaitUs = lWait;
+    pthread_mutex_unlock(&m_mutex);
+
+    return slot.ptrSql;
+}
+
+//取出前探活，失败则重建
+bool CCoreDBPool::checkSlot(Slot& slot)
+{
+    if(slot.ptrSql && !slot.bSuspect && time(NULL) - slot.tLastUse < m_iIdleCheck)
+    {
+        return true;
+    }
+
+    if(slot.ptrSql)
+    {
+        try
+        {
+            slot.ptrSql->Query("SELECT 1", 8);
+            mysql_free_result(slot.ptrSql->FetchResult());
+            slot.bSuspect = false;
+            return true;
+        }
+        catch(CException& e)
+        {
+            delete slot.ptrSql;
+            slot.ptrSql = NULL;
+        }
+    }
+
+    try
+    {
+        slot.ptrSql = m_factory();
+        slot.bSuspect = false;
+        return true;
+    }
+    catch(CException& e)
+    {
+        slot.ptrSql = NULL;
+        return false;
+    }
+}
+
+//归还连接
+void CCoreDBPool::release(CMySQL* ptrSql, const LONG lLeaseUs, const bool bSuspect)
+{
+    pthread_mutex_lock(&m_mutex);
+    for(size_t i = 0; i < m_vecSlot.size(); ++i)
+    {
+        if(m_vecSlot[i].ptrSql != ptrSql) continue;
+
+        m_vecSlot[i].bBusy = false;
+        m_vecSlot[i].bSuspect = bSuspect;
+        m_vecSlot[i].tLastUse = time(NULL);
+        m_stat.iBusy--;
+        m_stat.lLeaseUs += lLeaseUs;
+        if(lLeaseUs > m_stat.lMaxLeaseUs) m_stat.lMaxLeaseUs = lLeaseUs;
+        break;
+    }
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//获取统计
+void CCoreDBPool::getStat(Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*****************
+ * 事务级连接租约 *
+******************/
+
+// 构造函数
+CCoreDBLease::CCoreDBLease(CCoreDBPool* ptrPool, const bool bSwitch)
+{
+    m_ptrPool = ptrPool? ptrPool: CCoreDBPool::instance();
+    m_ptrPrev = t_ptrLeaseSql;
+    m_ptrPrevPool = t_ptrLeasePool;
+    m_lStartUs = 0;
+
+    //只有默认连接池可以退回外层连接或全局句柄，指定的分区连接池不能用别的库的连接顶替
+    bool bDefault = (m_ptrPool == CCoreDBPool::instance());
+    if(!bDefault && !m_ptrPool->inited())
+    {
+        throw CException(ERR_CORE_NO_ROUTE, "core db lease: partition pool not inited", __FILE__, __LINE__);
+    }
+    if(!bDefault && m_ptrPrev && !bSwitch && m_ptrPool != m_ptrPrevPool)
+    {
+        throw CException(ERR_BAD_BRANCH, "core db lease: nested lease on another pool without switch", __FILE__, __LINE__);
+    }
+
+    //嵌套租约复用外层连接；默认连接池未启用时沿用全局句柄
+    if((m_ptrPrev && !bSwitch) || !m_ptrPool->inited())
+    {
+        m_ptrPool = NULL;
+        m_ptrSql = getCoreLeaseHandle();
+        return;
+    }
+
+    m_ptrSql = m_ptrPool->acquire();
+    m_lStartUs = nowUs();
+    t_ptrLeaseSql = m_ptrSql;
+    t_ptrLeasePool = m_ptrPool;
+}
+
+//析构函数
+CCoreDBLease::~CCoreDBLease()
+{
+    if(NULL == m_ptrPool) return;
+
+    t_ptrLeaseSql = m_ptrPrev;
+    t_ptrLeasePool = m_ptrPrevPool;
+
+    //嵌套复用外层连接时不置空，外层租约归还时再置空
+    for(size_t i = 0; i < m_vecBind.size(); ++i)
+    {
+        if(*m_vecBind[i] == m_ptrSql) *m_vecBind[i] = NULL;
+    }
+
+    //异常退出时连接状态未知，下次取出前探活
+    m_ptrPool->release(m_ptrSql, nowUs() - m_lStartUs, std::uncaught_exception());
+}
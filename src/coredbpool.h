@@ -0,0 +1,130 @@
+#ifndef _CORE_DB_POOL_H_
+#define _CORE_DB_POOL_H_
+
+#include <pthread.h>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+
+//连接创建函数，返回new出来的连接，由连接池负责delete
+typedef CMySQL* (*CoreDBFactory)();
+
+/*
+ * 核心数据库连接池
+ * 线程亲和：优先把线程上次用过的连接还给它
+ * 健康检查：空闲过久或上次异常归还的连接取出前先探活
+ */
+class CCoreDBPool
+{
+public:
+    //连接池统计
+    struct Stat
+    {
+        LONG lAcquire;     //租用次数
+        LONG lTimeout;     //等待超时次数
+        LONG lWaitUs;      //累计等待时间
+        LONG lMaxWaitUs;   //最大等待时间
+        LONG lLeaseUs;     //累计租用时间
+        LONG lMaxLeaseUs;  //最大租用时间
+        int iSize;         //当前连接数
+        int iBusy;         //使用中连接数
+    };
+
+    //构造函数
+    CCoreDBPool();
+
+    //析构函数
+    ~CCoreDBPool();
+
+    //默认连接池
+    static CCoreDBPool* instance();
+
+    //初始化并预热iWarmUp个连接
+    void init(CoreDBFactory factory, const int iMaxSize, const int iWarmUp = 0);
+
+    //是否已初始化，未初始化时租约退回到getCoreDBHandle()
+    bool inited() const { return m_factory != NULL; }
+
+    //租用连接
+    CMySQL* acquire();
+
+    //归还连接，bSuspect：异常时归还，下次取出前探活
+    void release(CMySQL* ptrSql, const LONG lLeaseUs, const bool bSuspect = false);
+
+    //获取统计
+    void getStat(Stat& stat);
+
+    //设置参数
+    void setWaitTimeout(const int iMs) { m_iWaitMs = iMs; }
+    void setIdleCheck(const int iSec) { m_iIdleCheck = iSec; }
+
+protected:
+    //连接槽
+    struct Slot
+    {
+        CMySQL* ptrSql;
+        pthread_t owner;   //最近使用的线程
+        bool bBusy;
+        bool bSuspect;
+        time_t tLastUse;
+    };
+
+    //取出前探活，失败则重建
+    bool checkSlot(Slot& slot);
+    //查找可用连接槽，返回下标，无可用返回-1
+    int pickSlot();
+
+protected:
+    CoreDBFactory m_factory;
+    vector<Slot> m_vecSlot;
+    int m_iMaxSize;
+    int m_iWaitMs;
+    int m_iIdleCheck;
+    Stat m_stat;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
+
+/*
+ * 事务级连接租约
+ * 生命周期内本线程创建的CCore*对象共用租到的连接，可嵌套，嵌套时复用外层连接
+ * bSwitch为true时不复用，从ptrPool另租一个连接（跨分片），析构时切回外层连接
+ * 只有默认连接池可以退回外层连接或全局句柄：指定的连接池未初始化抛ERR_CORE_NO_ROUTE，
+ * 不切换的嵌套租约指定了与外层不同的连接池抛ERR_BAD_BRANCH
+ * 通过bind()登记的句柄成员在连接归还时置空，租约结束后误用会直接失败，不会用到别的线程的连接
+ */
+class CCoreDBLease
+{
+public:
+    //构造函数
+    CCoreDBLease(CCoreDBPool* ptrPool = NULL, const bool bSwitch = false);
+
+    //析构函数
+    ~CCoreDBLease();
+
+    //租到的连接
+    CMySQL* handle() { return m_ptrSql; }
+
+    //登记保存了本连接的句柄成员，归还连接时置空
+    void bind(CMySQL*& ptrRef) { m_vecBind.push_back(&ptrRef); }
+
+private:
+    CCoreDBLease(const CCoreDBLease&);
+    CCoreDBLease& operator=(const CCoreDBLease&);
+
+private:
+    CCoreDBPool* m_ptrPool;
+    CMySQL* m_ptrSql;
+    CMySQL* m_ptrPrev;
+    CCoreDBPool* m_ptrPrevPool;
+    LONG m_lStartUs;
+    std::vector<CMySQL**> m_vecBind;
+};
+
+//当前线程的租约连接，无租约时退回getCoreDBHandle()
+CMySQL* getCoreLeaseHandle();
+
+//当前线程的租约连接所属连接池，无租约时为默认连接池
+CCoreDBPool* getCoreLeasePool();
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _CORE_ERROR_H_
+#define _CORE_ERROR_H_
+
+#include "error.h"
+
+/*
+ * 核心模块扩展错误码
+ * 公共错误码见error.h，这里只放核心内部新增的，取值避开公共段
+ */
+enum CORE_ERROR
+{
+    ERR_CORE_BUSY = 91001,      //资源繁忙（连接池耗尽、过载），可重试
+    ERR_CORE_CROSS_CUR = 91002, //凭证涉及的账户币种不一致
+    ERR_CORE_NO_ROUTE = 91003,  //币种没有配置分区
+    ERR_CORE_BAD_WIRE = 91004,  //二进制凭证报文格式错误
+    ERR_CORE_IO = 91005,        //本地套接字或文件读写失败
+    ERR_CORE_SHARD_UNSAFE = 91006, //跨分片凭证在后续分片上可能失败，不受理
+    ERR_CORE_BAD_PARAM = 91007   //凭证字段含非法字符或超长
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "coreflowreader.h"
+#include "coreshard.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+/*****************
+ * 流水读取类 *
+******************/
+
+// 构造函数
+CCoreFlowReader::CCoreFlowReader(CCoreDBPool* ptrPool)
+{
+    m_ptrPool = ptrPool;
+}
+
+//析构函数
+CCoreFlowReader::~CCoreFlowReader()
+{
+    m_ptrPool = NULL;
+}
+
+//账户流水所在分区
+CCoreDBPool* CCoreFlowReader::routeUid(const LONG uid)
+{
+    if(m_ptrPool) return m_ptrPool;
+
+    CCoreShardRouter* ptrRouter = CCoreShardRouter::instance();
+    if(ptrRouter->enabled())
+    {
+        return ptrRouter->pool(ptrRouter->shardOf(uid));
+    }
+
+    return NULL;
+}
+
+//按账户分页读取流水，走(Fuid, Fid)索引
+LONG CCoreFlowReader::queryByUid(const LONG uid, const LONG lAfterFid, const int iLimit, vector<CCoreFlow>& vecFlow)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT %s FROM isp_os_core.t_flow f "
+        "LEFT JOIN isp_os_core.t_proof p ON p.Flistid = f.Flistid "
+        "WHERE f.Fuid = %lld AND f.Fid > %lld ORDER BY f.Fid LIMIT %d",
+        sqlSelect(), uid, lAfterFid, iLimit);
+
+    LONG lMaxFid = query(routeUid(uid), szSql, iLen, vecFlow);
+
+    return lMaxFid > lAfterFid? lMaxFid: lAfterFid;
+}
+
+//读取一张凭证的全部流水
+void CCoreFlowReader::queryByListid(const string& strListid, vector<CCoreFlow>& vecFlow)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    CMySQL* ptrSql = getCoreLeaseHandle();
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT %s FROM isp_os_core.t_flow f "
+        "LEFT JOIN isp_os_core.t_proof p ON p.Flistid = f.Flistid "
+        "WHERE f.Flistid = '%s' ORDER BY f.Fid",
+        sqlSelect(), ptrSql->EscapeStr(strListid).c_str());
+
+    query(m_ptrPool, szSql, iLen, vecFlow);
+}
+
+//查询字段：流水自身有备注（完整模式写入）时优先取流水的
+const char* CCoreFlowReader::sqlSelect()
+{
+    return "f.Fid,f.Fcur_type,f.Flistid,f.Fuid,f.Fuin,f.Flist_source,f.Ftype,f.Faction_type,f.Fsubject,"
+        "f.Fcounter_uid,f.Fcounter_uin,f.Fbalance,f.Fcon,f.Fpaynum,f.Fconnum,f.Fip,"
+        "IF(f.Fmemo IS NULL OR f.Fmemo = '', IFNULL(p.Fmemo, ''), f.Fmemo),"
+        "IF(f.Ftrade_memo IS NULL OR f.Ftrade_memo = '', IFNULL(p.Ftrade_memo, ''), f.Ftrade_memo),"
+        "IF(f.Fmodify_time > f.Fcreate_time, f.Fmodify_time, f.Fcreate_time),"
+        "f.Fcreate_time,f.Frollback_time,f.Fexplain,f.Flabel,f.Ftimestamp";
+}
+
+//解析一行
+LONG CCoreFlowReader::parseRow(MYSQL_ROW row, CCoreFlow& flow)
+{
+    flow.Fcur_type = row[1]? row[1]: "";
+    flow.Flistid = row[2]? row[2]: "";
+    flow.Fuid = row[3]? atoll(row[3]): 0;
+    flow.Fuin = row[4]? row[4]: "";
+    flow.Flist_source = row[5]? row[5]: "";
+    flow.Ftype = row[6]? atoi(row[6]): 0;
+    flow.Faction_type = row[7]? atoi(row[7]): 0;
+    flow.Fsubject = row[8]? atoi(row[8]): 0;
+    flow.Fcounter_uid = row[9]? atoll(row[9]): 0;
+    flow.Fcounter_uin = row[10]? row[10]: "";
+    flow.Fbalance = row[11]? atoll(row[11]): 0;
+    flow.Fcon = row[12]? atoll(row[12]): 0;
+    flow.Fpaynum = row[13]? atoll(row[13]): 0;
+    flow.Fconnum = row[14]? atoll(row[14]): 0;
+    flow.Fip = row[15]? row[15]: "";
+    flow.Fmemo = row[16]? row[16]: "";
+    flow.Ftrade_memo = row[17]? row[17]: "";
+    flow.Fmodify_time = row[18]? row[18]: "";
+    flow.Fcreate_time = row[19]? row[19]: "";
+    flow.Frollback_time = row[20]? row[20]: "";
+    flow.Fexplain = row[21]? row[21]: "";
+    flow.Flabel = row[22]? atoi(row[22]): 0;
+    flow.Ftimestamp = row[23]? atoi(row[23]): 0;
+
+    return row[0]? atoll(row[0]): 0;
+}
+
+//执行查询并解析
+LONG CCoreFlowReader::query(CCoreDBPool* ptrPool, const char* szSql, const int iLen, vector<CCoreFlow>& vecFlow)
+{
+    MYSQL_RES* pRes = NULL;
+    LONG lMaxFid = 0;
+
+    //没有指定分区时沿用当前租约连接
+    CCoreDBLease lease(ptrPool, NULL != ptrPool);
+    CMySQL* ptrSql = ptrPool? lease.handle(): getCoreLeaseHandle();
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        vecFlow.push_back(CCoreFlow());
+        LONG lFid = parseRow(row, vecFlow.back());
+        if(lFid > lMaxFid) lMaxFid = lFid;
+    }
+    mysql_free_result(pRes);
+
+    return lMaxFid;
+}
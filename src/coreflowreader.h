@@ -0,0 +1,51 @@
+#ifndef _CORE_FLOW_READER_H_
+#define _CORE_FLOW_READER_H_
+
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+
+/*
+ * 流水读取类
+ * 精简流水模式（CCoreFlow::setCompact）下t_flow只存分录数值列，备注等凭证级文本只在t_proof存一份；
+ * 这里按Flistid关联t_proof补齐Fmemo、Ftrade_memo，Fmodify_time为空时取Fcreate_time，
+ * 两种模式写下的流水读出结果一致，下游按流水取备注都应经由这里
+ * 跨分片凭证在非凭证所在分片上的分录、总账汇总流水没有对应t_proof，备注为空；
+ * 分次解冻的流水取原凭证的备注
+ * 读在流水所在分区上执行：构造时指定的分区连接池；未指定时按账户分片路由，
+ * 不分片（或按凭证号读）时用调用方当前的租约连接，按币种分区的调用方应先租好该币种的连接或传入连接池
+ */
+class CCoreFlowReader
+{
+public:
+    //构造函数，ptrPool为流水所在分区的连接池
+    CCoreFlowReader(CCoreDBPool* ptrPool = NULL);
+
+    //析构函数
+    ~CCoreFlowReader();
+
+    //按账户分页读取Fid > lAfterFid的流水，返回本页最大Fid，没有时返回lAfterFid
+    LONG queryByUid(const LONG uid, const LONG lAfterFid, const int iLimit, vector<CCoreFlow>& vecFlow);
+
+    //读取一张凭证的全部流水
+    void queryByListid(const string& strListid, vector<CCoreFlow>& vecFlow);
+
+    //查询字段，配合parseRow使用，流水表别名f、凭证表别名p
+    static const char* sqlSelect();
+
+    //解析一行，返回该行Fid
+    static LONG parseRow(MYSQL_ROW row, CCoreFlow& flow);
+
+protected:
+    //账户流水所在分区，NULL表示用当前租约连接
+    CCoreDBPool* routeUid(const LONG uid);
+    //在分区上执行查询并解析，返回最大Fid
+    LONG query(CCoreDBPool* ptrPool, const char* szSql, const int iLen, vector<CCoreFlow>& vecFlow);
+
+protected:
+    CCoreDBPool* m_ptrPool; //流水所在分区，NULL为按账户路由
+};
+
+#endif
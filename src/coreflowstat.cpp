@@ -0,0 +1,382 @@
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "coreflowstat.h"
+#include "core.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+/*****************
+ * 流水日汇总 *
+******************/
+
+//汇总键比较
+bool CCoreFlowStat::Key::operator<(const Key& other) const
+{
+    if(ptrPool != other.ptrPool) return ptrPool < other.ptrPool;
+    if(iDay != other.iDay) return iDay < other.iDay;
+    if(iSubject != other.iSubject) return iSubject < other.iSubject;
+    if(iType != other.iType) return iType < other.iType;
+    return strCurType < other.strCurType;
+}
+
+// 构造函数
+CCoreFlowStat::CCoreFlowStat()
+{
+    m_bEnable = false;
+    m_lBatchSeq = 0;
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreFlowStat::~CCoreFlowStat()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局实例
+CCoreFlowStat* CCoreFlowStat::instance()
+{
+    static CCoreFlowStat flowStat;
+    return &flowStat;
+}
+
+//流水转为增量
+void CCoreFlowStat::toDelta(const CCoreFlow& flow, Delta& delta)
+{
+    //同一天的流水连续到来，缓存当天的起止时间，免去逐笔localtime
+    static __thread time_t t_tDayBegin = 0;
+    static __thread time_t t_tDayEnd = 0;
+    static __thread int t_iDay = 0;
+
+    time_t tTime = flow.Ftimestamp;
+    if(tTime < t_tDayBegin || tTime >= t_tDayEnd)
+    {
+        struct tm tmDay;
+        localtime_r(&tTime, &tmDay);
+        t_iDay = (tmDay.tm_year + 1900) * 10000 + (tmDay.tm_mon + 1) * 100 + tmDay.tm_mday;
+
+        tmDay.tm_hour = 0;
+        tmDay.tm_min = 0;
+        tmDay.tm_sec = 0;
+        t_tDayBegin = mktime(&tmDay);
+        tmDay.tm_mday += 1;
+        t_tDayEnd = mktime(&tmDay);
+    }
+
+    delta.strCurType = flow.Fcur_type;
+    delta.iSubject = flow.Fsubject;
+    delta.iDay = t_iDay;
+    delta.iType = flow.Ftype;
+    delta.lPaynum = flow.Fpaynum;
+    delta.lConnum = flow.Fconnum;
+    delta.ptrPool = getCoreLeasePool();
+}
+
+//累加已提交的流水增量
+void CCoreFlowStat::add(const vector<Delta>& vecDelta)
+{
+    if(vecDelta.empty()) return;
+
+    pthread_mutex_lock(&m_mutex);
+    for(size_t i = 0; i < vecDelta.size(); ++i)
+    {
+        const Delta& delta = vecDelta[i];
+
+        Key key;
+        key.ptrPool = delta.ptrPool;
+        key.strCurType = delta.strCurType;
+        key.iSubject = delta.iSubject;
+        key.iDay = delta.iDay;
+        key.iType = delta.iType;
+
+        map<Key, Sum>::iterator it = m_mapSum.find(key);
+        if(it == m_mapSum.end())
+        {
+            Sum sum = {0, 0, 0};
+            it = m_mapSum.insert(make_pair(key, sum)).first;
+        }
+
+        it->second.lCount++;
+        it->second.lPaynum += delta.lPaynum;
+        it->second.lConnum += delta.lConnum;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//生成批次号：主机、进程、进程内序号，需持锁
+string CCoreFlowStat::genBatchId()
+{
+    static const LONG s_lStart = time(NULL);
+
+    char szId[128] = {0};
+    string strIp = HOST_IP;
+    snprintf(szId, sizeof(szId), "%s_%d_%lld_%lld", strIp.c_str(), (int)getpid(), s_lStart, ++m_lBatchSeq);
+    return szId;
+}
+
+//写出全部累加值和上次未确认的批次
+int CCoreFlowStat::flush()
+{
+    vector<Batch> vecBatch;
+    map<Key, Sum> mapOut;
+
+    //锁内只摘出累加值并分好批次，写库在锁外
+    pthread_mutex_lock(&m_mutex);
+    mapOut.swap(m_mapSum);
+    vecBatch.swap(m_vecPending);
+    for(map<Key, Sum>::const_iterator it = mapOut.begin(); it != mapOut.end(); ++it)
+    {
+        //待重试的批次已有批次号，内容不能再变，新增量另起批次
+        if(vecBatch.empty() || vecBatch.back().ptrPool != it->first.ptrPool || !vecBatch.back().strId.empty())
+        {
+            vecBatch.push_back(Batch());
+            vecBatch.back().ptrPool = it->first.ptrPool;
+        }
+        vecBatch.back().mapSum.insert(*it);
+    }
+    for(size_t i = 0; i < vecBatch.size(); ++i)
+    {
+        if(vecBatch[i].strId.empty()) vecBatch[i].strId = genBatchId();
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    int iOut = 0;
+    int iError = 0;
+    string strError;
+
+    for(size_t i = 0; i < vecBatch.size(); ++i)
+    {
+        try
+        {
+            writeBatch(vecBatch[i]);
+            iOut += vecBatch[i].mapSum.size();
+        }
+        catch(CException& e)
+        {
+            //结果未知，原批次留着下次用同一批次号重试
+            pthread_mutex_lock(&m_mutex);
+            m_vecPending.push_back(vecBatch[i]);
+            pthread_mutex_unlock(&m_mutex);
+
+            if(0 == iError)
+            {
+                iError = e.error();
+                strError = e.what();
+            }
+        }
+    }
+
+    if(iError != 0)
+    {
+        throw CException(iError, strError, __FILE__, __LINE__);
+    }
+
+    return iOut;
+}
+
+//在批次所在分区写出
+void CCoreFlowStat::writeBatch(const Batch& batch)
+{
+    CCoreDBLease lease(batch.ptrPool, true);
+    CMySQL* ptrSql = lease.handle();
+    char szRow[MAX_MSG_LEN] = {0};
+
+    try
+    {
+        ptrSql->Begin();
+
+        //批次号与累加同一事务，登记过说明上次超时其实已经生效
+        string strSql = "INSERT IGNORE INTO isp_os_core.t_flow_daily_flush (Fflush_id,Fcreate_time) VALUES ('"
+            + ptrSql->EscapeStr(batch.strId) + "',now())";
+        ptrSql->Query(strSql.c_str(), strSql.length());
+        if(0 == ptrSql->AffectedRows())
+        {
+            ptrSql->Rollback();
+            return;
+        }
+
+        strSql = "INSERT INTO isp_os_core.t_flow_daily "
+            "(Fsubject,Fcur_type,Fday,Ftype,Fcount,Fpaynum,Fconnum,Fmodify_time) VALUES ";
+
+        for(map<Key, Sum>::const_iterator it = batch.mapSum.begin(); it != batch.mapSum.end(); ++it)
+        {
+            snprintf(szRow, sizeof(szRow) - 1, "%s(%d,'%s',%d,%d,%lld,%lld,%lld,now())",
+                it == batch.mapSum.begin()? "": ",",
+                it->first.iSubject, ptrSql->EscapeStr(it->first.strCurType).c_str(), it->first.iDay, it->first.iType,
+                it->second.lCount, it->second.lPaynum, it->second.lConnum);
+            strSql += szRow;
+        }
+
+        //增量累加，多进程各自写同一行互不覆盖
+        strSql += " ON DUPLICATE KEY UPDATE Fcount = Fcount + VALUES(Fcount), "
+            "Fpaynum = Fpaynum + VALUES(Fpaynum), Fconnum = Fconnum + VALUES(Fconnum), Fmodify_time = now()";
+
+        ptrSql->Query(strSql.c_str(), strSql.length());
+        ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        ptrSql->Rollback();
+        throw;
+    }
+}
+
+//查询涉及的分区
+void CCoreFlowStat::queryPools(const string& strCurType, vector<CCoreDBPool*>& vecPool)
+{
+    vecPool.clear();
+
+    CCoreShardRouter* ptrShard = CCoreShardRouter::instance();
+    if(ptrShard->enabled())
+    {
+        vector<int> vecShard;
+        ptrShard->getShards(vecShard);
+        for(size_t i = 0; i < vecShard.size(); ++i)
+        {
+            vecPool.push_back(ptrShard->pool(vecShard[i]));
+        }
+        return;
+    }
+
+    CCoreCurRouter* ptrCur = CCoreCurRouter::instance();
+    if(!strCurType.empty())
+    {
+        vecPool.push_back(ptrCur->route(strCurType));
+        return;
+    }
+
+    //不限币种时默认分区加各币种分区
+    map<string, CCoreDBPool::Stat> mapStat;
+    ptrCur->getStat(mapStat);
+    vecPool.push_back(CCoreDBPool::instance());
+    for(map<string, CCoreDBPool::Stat>::iterator it = mapStat.begin(); it != mapStat.end(); ++it)
+    {
+        CCoreDBPool* ptrPool = ptrCur->route(it->first);
+        if(find(vecPool.begin(), vecPool.end(), ptrPool) == vecPool.end()) vecPool.push_back(ptrPool);
+    }
+}
+
+//查询日汇总
+void CCoreFlowStat::query(const int iSubject, const string& strCurType, const int iFromDay, const int iToDay, vector<Row>& vecRow)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    char szCur[128] = {0};
+    map<Key, Sum> mapRow;
+
+    vecRow.clear();
+
+    vector<CCoreDBPool*> vecPool;
+    queryPools(strCurType, vecPool);
+
+    for(size_t i = 0; i < vecPool.size(); ++i)
+    {
+        CCoreDBLease lease(vecPool[i], true);
+        CMySQL* ptrSql = lease.handle();
+        MYSQL_RES* pRes = NULL;
+
+        if(!strCurType.empty())
+        {
+            snprintf(szCur, sizeof(szCur) - 1, "AND Fcur_type = '%s' ", ptrSql->EscapeStr(strCurType).c_str());
+        }
+
+        int iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "SELECT Fcur_type,Fsubject,Fday,Ftype,Fcount,Fpaynum,Fconnum "
+            "FROM isp_os_core.t_flow_daily "
+            "WHERE Fsubject = %d %sAND Fday BETWEEN %d AND %d",
+            iSubject, szCur, iFromDay, iToDay);
+
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
+
+        //各分区同一天同一键的行相加
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            Key key;
+            key.ptrPool = NULL;
+            key.strCurType = row[0]? row[0]: "";
+            key.iSubject = row[1]? atoi(row[1]): 0;
+            key.iDay = row[2]? atoi(row[2]): 0;
+            key.iType = row[3]? atoi(row[3]): 0;
+
+            map<Key, Sum>::iterator it = mapRow.find(key);
+            if(it == mapRow.end())
+            {
+                Sum sum = {0, 0, 0};
+                it = mapRow.insert(make_pair(key, sum)).first;
+            }
+            it->second.lCount += row[4]? atoll(row[4]): 0;
+            it->second.lPaynum += row[5]? atoll(row[5]): 0;
+            it->second.lConnum += row[6]? atoll(row[6]): 0;
+        }
+        mysql_free_result(pRes);
+    }
+
+    //Key按日期排序
+    for(map<Key, Sum>::const_iterator it = mapRow.begin(); it != mapRow.end(); ++it)
+    {
+        Row stat;
+        stat.strCurType = it->first.strCurType;
+        stat.iSubject = it->first.iSubject;
+        stat.iDay = it->first.iDay;
+        stat.iType = it->first.iType;
+        stat.lCount = it->second.lCount;
+        stat.lPaynum = it->second.lPaynum;
+        stat.lConnum = it->second.lConnum;
+        vecRow.push_back(stat);
+    }
+}
+
+//按t_flow重算分区上iDay的日汇总并覆盖
+int CCoreFlowStat::rebuild(const int iDay, CCoreDBPool* ptrPool)
+{
+    struct tm tmDay;
+    memset(&tmDay, 0, sizeof(tmDay));
+    tmDay.tm_year = iDay / 10000 - 1900;
+    tmDay.tm_mon = iDay / 100 % 100 - 1;
+    tmDay.tm_mday = iDay % 100;
+    tmDay.tm_isdst = -1;
+    time_t tBegin = mktime(&tmDay);
+    tmDay.tm_mday += 1;
+    tmDay.tm_isdst = -1;
+    time_t tEnd = mktime(&tmDay);
+
+    CCoreDBLease lease(ptrPool, true);
+    CMySQL* ptrSql = lease.handle();
+    char szSql[MAX_SQL_LEN] = {0};
+    int iRow = 0;
+
+    try
+    {
+        ptrSql->Begin();
+
+        int iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "DELETE FROM isp_os_core.t_flow_daily WHERE Fday = %d", iDay);
+        ptrSql->Query(szSql, iLen);
+
+        //与toDelta一致按Ftimestamp的本地日期归属；总账汇总流水的笔数记在Fexplain（count=N），
+        //金额是时间桶内的净额，重算后总账科目的金额为净额，与逐笔累加的不同
+        iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "INSERT INTO isp_os_core.t_flow_daily "
+            "(Fsubject,Fcur_type,Fday,Ftype,Fcount,Fpaynum,Fconnum,Fmodify_time) "
+            "SELECT Fsubject,Fcur_type,%d,Ftype,"
+            "SUM(IF(Flist_source = 'gl_agg', CAST(SUBSTRING(Fexplain, 7) AS UNSIGNED), 1)),"
+            "SUM(Fpaynum),SUM(Fconnum),now() "
+            "FROM isp_os_core.t_flow WHERE Ftimestamp >= %lld AND Ftimestamp < %lld "
+            "GROUP BY Fsubject,Fcur_type,Ftype",
+            iDay, (LONG)tBegin, (LONG)tEnd);
+        ptrSql->Query(szSql, iLen);
+        iRow = ptrSql->AffectedRows();
+
+        ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        ptrSql->Rollback();
+        throw;
+    }
+
+    return iRow;
+}
@@ -0,0 +1,126 @@
+#ifndef _CORE_FLOW_STAT_H_
+#define _CORE_FLOW_STAT_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+class CCoreFlow;
+
+/*
+ * 流水日汇总
+ * 提交后的流水按 (科目, 币种, 日期, 流水类型) 在内存中累加笔数、Fpaynum、Fconnum，
+ * 定期以累加方式upsert到isp_os_core.t_flow_daily，报表按天读汇总表，不再扫t_flow
+ * 总账流水按逐笔计入，不受总账流水汇总开关影响
+ *
+ * 增量按记账时的分区（租约连接池）分开累加，写到流水所在分区；查询合并各分区的结果
+ * 每次写出带一个批次号，与累加在同一事务内登记到isp_os_core.t_flow_daily_flush（Fflush_id主键、Fcreate_time，旧记录可按Fcreate_time清理）；
+ * 超时等结果未知的批次原样保留，下次用同一批次号重试，已生效的不会重复累加
+ * 进程异常退出时内存中未写出的增量丢失，事后用rebuild()按t_flow重算已结束的日期
+ */
+class CCoreFlowStat
+{
+public:
+    //一笔流水的增量
+    struct Delta
+    {
+        string strCurType;
+        int iSubject;
+        int iDay; //yyyymmdd
+        int iType;
+        LONG lPaynum;
+        LONG lConnum;
+        CCoreDBPool* ptrPool; //流水所在分区
+    };
+
+    //汇总表的一行
+    struct Row
+    {
+        string strCurType;
+        int iSubject;
+        int iDay;
+        int iType;
+        LONG lCount;
+        LONG lPaynum;
+        LONG lConnum;
+    };
+
+    //构造函数
+    CCoreFlowStat();
+
+    //析构函数
+    ~CCoreFlowStat();
+
+    //全局实例
+    static CCoreFlowStat* instance();
+
+    //开启/关闭汇总
+    void setMode(const bool bEnable) { m_bEnable = bEnable; }
+
+    //是否开启汇总
+    bool enabled() const { return m_bEnable; }
+
+    //流水转为增量
+    static void toDelta(const CCoreFlow& flow, Delta& delta);
+
+    //累加已提交的流水增量
+    void add(const vector<Delta>& vecDelta);
+
+    //写出全部累加值和上次未确认的批次，返回写出的行数
+    int flush();
+
+    //查询[iFromDay, iToDay]的日汇总，strCurType为空时不限币种，各分区的结果合并
+    static void query(const int iSubject, const string& strCurType, const int iFromDay, const int iToDay, vector<Row>& vecRow);
+
+    //按t_flow重算分区上iDay的日汇总并覆盖，须在该日结束、各进程都已flush后调用，返回写入的行数
+    static int rebuild(const int iDay, CCoreDBPool* ptrPool = NULL);
+
+protected:
+    //汇总键
+    struct Key
+    {
+        CCoreDBPool* ptrPool;
+        string strCurType;
+        int iSubject;
+        int iDay;
+        int iType;
+
+        bool operator<(const Key& other) const;
+    };
+
+    //汇总值
+    struct Sum
+    {
+        LONG lCount;
+        LONG lPaynum;
+        LONG lConnum;
+    };
+
+    //一次写出的批次，同一分区
+    struct Batch
+    {
+        string strId;
+        CCoreDBPool* ptrPool;
+        map<Key, Sum> mapSum;
+    };
+
+    //生成批次号
+    string genBatchId();
+    //在批次所在分区写出，批次号已登记过时不再累加
+    static void writeBatch(const Batch& batch);
+    //查询涉及的分区
+    static void queryPools(const string& strCurType, vector<CCoreDBPool*>& vecPool);
+
+protected:
+    bool m_bEnable;
+    map<Key, Sum> m_mapSum;
+    vector<Batch> m_vecPending; //结果未知、待重试的批次
+    LONG m_lBatchSeq;
+    pthread_mutex_t m_mutex;
+};
+
+#endif
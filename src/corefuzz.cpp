@@ -0,0 +1,791 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "corefuzz.h"
+#include "coreacctloader.h"
+#include "coreerror.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+using namespace CCoreWire;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//uid转字符串
+static string uidStr(const LONG uid)
+{
+    char szBuf[32] = {0};
+    snprintf(szBuf, sizeof(szBuf), "%lld", uid);
+    return szBuf;
+}
+
+//随机金额[1, lMax]
+static LONG randAmount(unsigned int& iSeed, const LONG lMax)
+{
+    return 1 + (LONG)rand_r(&iSeed) % (lMax > 0? lMax: 1);
+}
+
+/*
+ * 模糊测试开户数据源：普通账户为负债类贷方余额，备付金和总账为共有类，余额均为0
+ */
+class CFuzzAcctSource : public CCoreAcctSource
+{
+public:
+    CFuzzAcctSource(const LONG lBegin, const LONG lCommon, const LONG lEnd, const string& strCur)
+        : m_lNext(lBegin), m_lCommon(lCommon), m_lEnd(lEnd), m_strCur(strCur)
+    {
+        m_strTime = getSysTime();
+    }
+
+    //取下一个账户
+    virtual bool next(CCoreAcct& acct)
+    {
+        if(m_lNext >= m_lEnd) return false;
+
+        acct = CCoreAcct();
+        acct.Fuid = m_lNext;
+        acct.Fuin = uidStr(m_lNext);
+        acct.Fname = "fuzz";
+        acct.Fsymbol = m_lNext < m_lCommon? CCoreAcct::SYMBOL_liabilities: CCoreAcct::SYMBOL_common;
+        acct.Fcur_type = m_strCur;
+        acct.Fbalance_type = CCoreAcct::BAlANCE_credit;
+        acct.Fip = "127.0.0.1";
+        acct.Fmemo = "fuzz";
+        acct.Fcreate_time = m_strTime;
+        acct.Fmodify_time = m_strTime;
+        acct.Fbalance_time = m_strTime;
+        m_lNext++;
+
+        return true;
+    }
+
+private:
+    LONG m_lNext;
+    LONG m_lCommon;
+    LONG m_lEnd;
+    string m_strCur;
+    string m_strTime;
+};
+
+/*****************
+ * 记账模糊测试 *
+******************/
+
+// 构造函数
+CCoreFuzz::CCoreFuzz()
+{
+    m_iSeed = 1;
+    m_iThreads = 8;
+    m_iCount = 2000;
+    m_lUidBegin = 0;
+    m_iAccts = 16;
+    m_lMaxAmount = 1000;
+    m_strCur = "CNY";
+    m_iModes = 0;
+    m_iHotCount = 0;
+    m_iHotWaitUs = 0;
+    m_lFundUid = 0;
+    m_lDebitGL = 0;
+    m_lCreditGL = 0;
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreFuzz::~CCoreFuzz()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//开户
+void CCoreFuzz::setup()
+{
+    if(m_lUidBegin <= 0 || m_iAccts < 3)
+    {
+        throw CException(ERR_BAD_BRANCH, "core fuzz: bad uid begin or too few accounts", __FILE__, __LINE__);
+    }
+
+    m_lFundUid = m_lUidBegin + m_iAccts;
+    m_lDebitGL = m_lFundUid + 1;
+    m_lCreditGL = m_lFundUid + 2;
+
+    //账户要从0开始，已存在说明与别的测试撞了号段
+    CFuzzAcctSource source(m_lUidBegin, m_lFundUid, m_lCreditGL + 1, m_strCur);
+    CCoreAcctLoader loader;
+    loader.setDupMode(CCoreAcctLoader::DUP_fail);
+    loader.run(source, "fuzz:" + uidStr(m_lUidBegin) + ":" + uidStr(nowUs()));
+}
+
+//执行并核对，运行期间打开设置的模式
+bool CCoreFuzz::run(Stat& stat)
+{
+    if(0 == m_lFundUid || m_iThreads <= 0)
+    {
+        throw CException(ERR_BAD_BRANCH, "core fuzz: call setup first", __FILE__, __LINE__);
+    }
+
+    int iOpened = openModes();
+    bool bOk = false;
+    try
+    {
+        bOk = runChecked(stat);
+    }
+    catch(CException& e)
+    {
+        closeModes(iOpened);
+        throw;
+    }
+    closeModes(iOpened);
+
+    return bOk;
+}
+
+//打开本次运行的模式，已经打开的不动
+int CCoreFuzz::openModes()
+{
+    int iOpened = 0;
+
+    if((m_iModes & MODE_hot) && !CCoreHotAcct::instance()->enabled())
+    {
+        CCoreHotAcct::instance()->getThreshold(m_iHotCount, m_iHotWaitUs);
+        CCoreHotAcct::instance()->setThreshold(20, 1000);
+        CCoreHotAcct::instance()->setMode(true);
+        iOpened |= MODE_hot;
+    }
+    if((m_iModes & MODE_admission) && !CCoreAdmission::instance()->enabled())
+    {
+        CCoreAdmission::instance()->setMode(true);
+        iOpened |= MODE_admission;
+    }
+    if((m_iModes & MODE_gl_agg) && !CCoreGLFlow::instance()->enabled())
+    {
+        CCoreGLFlow::instance()->setMode(true, 1);
+        iOpened |= MODE_gl_agg;
+    }
+    if((m_iModes & MODE_compact) && !CCoreFlow::compact())
+    {
+        CCoreFlow::setCompact(true);
+        iOpened |= MODE_compact;
+    }
+
+    return iOpened;
+}
+
+//关回openModes打开的模式
+void CCoreFuzz::closeModes(const int iOpened)
+{
+    if(iOpened & MODE_hot)
+    {
+        CCoreHotAcct::instance()->setMode(false);
+        CCoreHotAcct::instance()->setThreshold(m_iHotCount, m_iHotWaitUs);
+    }
+    if(iOpened & MODE_admission) CCoreAdmission::instance()->setMode(false);
+    if(iOpened & MODE_gl_agg) CCoreGLFlow::instance()->setMode(false);
+    if(iOpened & MODE_compact) CCoreFlow::setCompact(false);
+}
+
+//执行并核对
+bool CCoreFuzz::runChecked(Stat& stat)
+{
+
+    char szBuf[64] = {0};
+    snprintf(szBuf, sizeof(szBuf), "FZ%u_%lld_", m_iSeed, nowUs() % 1000000000LL);
+    m_strPrefix = szBuf;
+
+    m_vecViolation.clear();
+    m_vecSent.clear();
+    m_vecFrozen.clear();
+    m_mapSubSeq.clear();
+    m_mapOk.clear();
+    m_setUnfreezeOk.clear();
+
+    vector<Worker> vecWorker(m_iThreads);
+    vector<pthread_t> vecThread(m_iThreads);
+
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        vecWorker[i].ptrFuzz = this;
+        vecWorker[i].iIndex = i;
+        vecWorker[i].iSeed = m_iSeed ^ (i * 2654435761u);
+        vecWorker[i].lOk = 0;
+        vecWorker[i].lFail = 0;
+        vecWorker[i].lReentry = 0;
+        vecWorker[i].lConflict = 0;
+        if(0 != pthread_create(&vecThread[i], NULL, threadMain, &vecWorker[i]))
+        {
+            throw CException(ERR_BAD_BRANCH, "core fuzz: create thread failed", __FILE__, __LINE__);
+        }
+    }
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        pthread_join(vecThread[i], NULL);
+    }
+
+    memset(&stat, 0, sizeof(stat));
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        if(!vecWorker[i].strError.empty())
+        {
+            throw CException(ERR_BAD_BRANCH, "core fuzz: " + vecWorker[i].strError, __FILE__, __LINE__);
+        }
+        stat.lOk += vecWorker[i].lOk;
+        stat.lFail += vecWorker[i].lFail;
+        stat.lReentry += vecWorker[i].lReentry;
+        stat.lConflict += vecWorker[i].lConflict;
+    }
+    stat.lSent = stat.lOk + stat.lFail;
+
+    //汇总的总账流水全部写出后再核对
+    if(CCoreGLFlow::instance()->enabled())
+    {
+        CCoreGLFlow::instance()->flush(true);
+    }
+
+    //差分核对
+    checkExpect();
+
+    //不变式
+    CCoreInvariant invariant;
+    vector<LONG> vecGL;
+    vecGL.push_back(m_lDebitGL);
+    vecGL.push_back(m_lCreditGL);
+    invariant.setUidRange(m_lUidBegin, m_lCreditGL + 1);
+    invariant.setListidPrefix(m_strPrefix);
+    invariant.setGLUids(vecGL);
+    invariant.setFromZero(true);
+    invariant.checkAll();
+    m_vecViolation.insert(m_vecViolation.end(), invariant.m_vecViolation.begin(), invariant.m_vecViolation.end());
+
+    stat.iViolation = m_vecViolation.size();
+    return m_vecViolation.empty();
+}
+
+//线程入口
+void* CCoreFuzz::threadMain(void* ptrArg)
+{
+    Worker& worker = *(Worker*)ptrArg;
+
+    try
+    {
+        worker.ptrFuzz->runWorker(worker);
+    }
+    catch(CException& e)
+    {
+        worker.strError = e.what();
+    }
+    return NULL;
+}
+
+//一个线程的测试：开头几笔先给账户入备付金，之后按权重随机
+void CCoreFuzz::runWorker(Worker& worker)
+{
+    //各种请求的权重，与KIND一一对应
+    static const int arrWeight[KIND_NUM] = {5, 30, 5, 20, 12, 10, 12, 6, 8, 8};
+
+    int iTotal = 0;
+    for(int i = 0; i < KIND_NUM; ++i)
+    {
+        iTotal += arrWeight[i];
+    }
+
+    for(int iSeq = 0; iSeq < m_iCount; ++iSeq)
+    {
+        int iKind = KIND_fund;
+        if(iSeq >= 4)
+        {
+            int iPick = rand_r(&worker.iSeed) % iTotal;
+            for(iKind = 0; iPick >= arrWeight[iKind]; ++iKind)
+            {
+                iPick -= arrWeight[iKind];
+            }
+        }
+
+        Req req;
+        if(!genRequest(worker, iKind, iSeq, req)) continue;
+
+        int iError = callCore(req);
+        record(worker, iKind, req, iError);
+    }
+}
+
+//生成一个请求
+bool CCoreFuzz::genRequest(Worker& worker, const int iKind, const int iSeq, Req& req)
+{
+    char szListid[64] = {0};
+    snprintf(szListid, sizeof(szListid), "%s%02d%08d", m_strPrefix.c_str(), worker.iIndex, iSeq);
+
+    LONG lDebit = randUid(worker.iSeed);
+    LONG lCredit = m_lUidBegin + (lDebit - m_lUidBegin + 1 + rand_r(&worker.iSeed) % (m_iAccts - 1)) % m_iAccts;
+
+    switch(iKind)
+    {
+        case KIND_fund:
+        {
+            fillReq(req, szListid, CCoreProof::TYPE_direct, m_lFundUid, lCredit,
+                randAmount(worker.iSeed, m_lMaxAmount * 10));
+            return true;
+        }
+        case KIND_direct:
+        {
+            //一成请求金额放大，大概率余额不足
+            LONG lAmount = randAmount(worker.iSeed, m_lMaxAmount);
+            if(rand_r(&worker.iSeed) % 10 == 0) lAmount *= 100;
+            fillReq(req, szListid, CCoreProof::TYPE_direct, lDebit, lCredit, lAmount);
+            return true;
+        }
+        case KIND_multi:
+        {
+            //一借两贷
+            LONG lOther = m_lUidBegin + (lCredit - m_lUidBegin + 1) % m_iAccts;
+            if(lOther == lDebit) lOther = m_lUidBegin + (lOther - m_lUidBegin + 1) % m_iAccts;
+
+            LONG arrUid[3] = {lDebit, lCredit, lOther};
+            LONG arrAmount[3] = {0, randAmount(worker.iSeed, m_lMaxAmount), randAmount(worker.iSeed, m_lMaxAmount)};
+            arrAmount[0] = arrAmount[1] + arrAmount[2];
+
+            fillReq(req, szListid, CCoreProof::TYPE_direct, 0, 0, 0);
+            req.arrInt[I_rolenum] = 3;
+            req.arrLong[L_totalnum] = arrAmount[0];
+            for(int i = 0; i < 3; ++i)
+            {
+                CCoreProofLeg leg;
+                leg.Fseq = i + 1;
+                leg.Fdirection = i == 0? OP_debit: OP_credit;
+                leg.Fuid = arrUid[i];
+                leg.Fuin = uidStr(arrUid[i]);
+                leg.Fgl_uid = i == 0? m_lDebitGL: m_lCreditGL;
+                leg.Fgl_uin = uidStr(leg.Fgl_uid);
+                leg.Famount = arrAmount[i];
+                req.vecLeg.push_back(leg);
+            }
+            return true;
+        }
+        case KIND_shared:
+        {
+            //附加借方、附加贷方各取一个普通账户，四个总账位置都是同一个账户
+            LONG lDebitEx = randUid(worker.iSeed);
+            LONG lCreditEx = randUid(worker.iSeed);
+            LONG lAmount = randAmount(worker.iSeed, m_lMaxAmount);
+            LONG lExAmount = randAmount(worker.iSeed, m_lMaxAmount);
+
+            fillReq(req, szListid, CCoreProof::TYPE_direct, lDebit, lCredit, lAmount);
+            req.arrLong[L_totalnum] = lAmount + lExAmount;
+            req.arrLong[L_debit_ex_uid] = lDebitEx;
+            req.arrLong[L_debit_ex_amount] = lExAmount;
+            req.arrLong[L_credit_ex_uid] = lCreditEx;
+            req.arrLong[L_credit_ex_amount] = lExAmount;
+            req.arrLong[L_credit_gl_uid] = m_lDebitGL;
+            req.arrLong[L_debit_exgl_uid] = m_lDebitGL;
+            req.arrLong[L_credit_exgl_uid] = m_lDebitGL;
+            req.arrStr[S_debit_ex_uin] = uidStr(lDebitEx);
+            req.arrStr[S_credit_ex_uin] = uidStr(lCreditEx);
+            req.arrStr[S_credit_gl_uin] = uidStr(m_lDebitGL);
+            req.arrStr[S_debit_exgl_uin] = uidStr(m_lDebitGL);
+            req.arrStr[S_credit_exgl_uin] = uidStr(m_lDebitGL);
+            return true;
+        }
+        case KIND_ex:
+        {
+            //同一账户在借方和附加借方、贷方和附加贷方各出现一次
+            LONG lAmount = randAmount(worker.iSeed, m_lMaxAmount);
+            LONG lExAmount = randAmount(worker.iSeed, m_lMaxAmount);
+
+            fillReq(req, szListid, CCoreProof::TYPE_direct, lDebit, lCredit, lAmount);
+            req.arrLong[L_totalnum] = lAmount + lExAmount;
+            req.arrLong[L_debit_ex_uid] = lDebit;
+            req.arrLong[L_debit_ex_amount] = lExAmount;
+            req.arrLong[L_credit_ex_uid] = lCredit;
+            req.arrLong[L_credit_ex_amount] = lExAmount;
+            req.arrLong[L_debit_exgl_uid] = m_lDebitGL;
+            req.arrLong[L_credit_exgl_uid] = m_lCreditGL;
+            req.arrStr[S_debit_ex_uin] = uidStr(lDebit);
+            req.arrStr[S_credit_ex_uin] = uidStr(lCredit);
+            req.arrStr[S_debit_exgl_uin] = uidStr(m_lDebitGL);
+            req.arrStr[S_credit_exgl_uin] = uidStr(m_lCreditGL);
+            return true;
+        }
+        case KIND_freeze:
+        {
+            fillReq(req, szListid, CCoreProof::TYPE_freeze, lDebit, lCredit, randAmount(worker.iSeed, m_lMaxAmount));
+            return true;
+        }
+        case KIND_unfreeze:
+        case KIND_part:
+        {
+            //挑一张冻结成功的凭证，可能别的线程也在解冻它
+            pthread_mutex_lock(&m_mutex);
+            if(m_vecFrozen.empty())
+            {
+                pthread_mutex_unlock(&m_mutex);
+                return false;
+            }
+            const string strListid = m_vecFrozen[rand_r(&worker.iSeed) % m_vecFrozen.size()];
+            req = m_mapOk[strListid];
+
+            if(iKind == KIND_part)
+            {
+                //两成沿用已有序号（重入或改参），其余取新序号
+                int& iSubSeq = m_mapSubSeq[strListid];
+                if(iSubSeq > 0 && rand_r(&worker.iSeed) % 5 == 0)
+                {
+                    req.arrInt[I_sub_seq] = 1 + rand_r(&worker.iSeed) % iSubSeq;
+                }
+                else
+                {
+                    req.arrInt[I_sub_seq] = ++iSubSeq;
+                }
+                req.arrLong[L_sub_amount] = randAmount(worker.iSeed, req.arrLong[L_debit_amount] / 3 + 1);
+            }
+            pthread_mutex_unlock(&m_mutex);
+
+            req.arrInt[I_type] = rand_r(&worker.iSeed) % 2 == 0? CCoreProof::TYPE_suc_unfreeze: CCoreProof::TYPE_fail_unfreeze;
+            return true;
+        }
+        case KIND_reentry:
+        case KIND_conflict:
+        {
+            pthread_mutex_lock(&m_mutex);
+            if(m_vecSent.empty())
+            {
+                pthread_mutex_unlock(&m_mutex);
+                return false;
+            }
+            req = m_vecSent[rand_r(&worker.iSeed) % m_vecSent.size()];
+
+            //改参重入只对确定已落库的普通凭证做，否则改参后的请求可能合法地首次成功
+            bool bOk = iKind == KIND_reentry
+                || (m_mapOk.count(req.arrStr[S_listid]) > 0 && req.vecLeg.empty() && req.arrInt[I_sub_seq] == 0
+                    && sameReq(m_mapOk[req.arrStr[S_listid]], req));
+            pthread_mutex_unlock(&m_mutex);
+
+            if(!bOk) return false;
+
+            if(iKind == KIND_conflict)
+            {
+                req.arrLong[L_totalnum]++;
+                req.arrLong[L_debit_amount]++;
+                req.arrLong[L_credit_amount]++;
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//发送请求：编码后按服务端的方式解析，在本进程调用
+int CCoreFuzz::callCore(const Req& req)
+{
+    string strReq;
+    CCoreWireCodec::encodeRequest(req.arrInt, req.arrLong, req.arrStr, req.vecLeg, strReq);
+
+    try
+    {
+        CCoreWireView view;
+        view.parse(strReq.data(), strReq.length());
+
+        CCore core;
+        core.callCore(view);
+    }
+    catch(CException& e)
+    {
+        return e.error();
+    }
+
+    return 0;
+}
+
+//记录应答，同时检查应答本身：改参重入不能成功，已成功的直接记账原样重入不能报余额不足或参数不一致
+void CCoreFuzz::record(Worker& worker, const int iKind, const Req& req, const int iError)
+{
+    const string& strListid = req.arrStr[S_listid];
+    int iType = req.arrInt[I_type];
+    int iSubSeq = req.arrInt[I_sub_seq];
+
+    if(0 == iError) worker.lOk++;
+    else worker.lFail++;
+    if(iKind == KIND_reentry) worker.lReentry++;
+    if(iKind == KIND_conflict) worker.lConflict++;
+
+    pthread_mutex_lock(&m_mutex);
+
+    if(iKind != KIND_reentry && iKind != KIND_conflict)
+    {
+        //留足重入样本，满了随机替换
+        if(m_vecSent.size() < 10000)
+        {
+            m_vecSent.push_back(req);
+        }
+        else
+        {
+            m_vecSent[rand_r(&worker.iSeed) % m_vecSent.size()] = req;
+        }
+    }
+
+    if(0 == iError)
+    {
+        if(iKind == KIND_conflict)
+        {
+            addViolation("conflict_accepted", strListid, "reentry with changed amount succeeded");
+        }
+        else if(iSubSeq > 0 || iType == CCoreProof::TYPE_direct || iType == CCoreProof::TYPE_freeze)
+        {
+            //同一凭证（子凭证）只能以一份参数成功
+            string strKey = strListid;
+            if(iSubSeq > 0) strKey += "#" + uidStr(iSubSeq);
+
+            map<string, Req>::iterator it = m_mapOk.find(strKey);
+            if(it == m_mapOk.end())
+            {
+                m_mapOk[strKey] = req;
+                if(iType == CCoreProof::TYPE_freeze) m_vecFrozen.push_back(strListid);
+            }
+            else if(!sameReq(it->second, req))
+            {
+                addViolation("reentry_differ_accepted", strKey, "same key succeeded with different params");
+            }
+        }
+        else
+        {
+            m_setUnfreezeOk.insert(strListid + "#" + uidStr(iType));
+        }
+    }
+    else if(iKind == KIND_reentry && iType == CCoreProof::TYPE_direct
+        && (iError == ERR_LACK_BALANCE || iError == ERR_PARARM_DIFFER))
+    {
+        map<string, Req>::iterator it = m_mapOk.find(strListid);
+        if(it != m_mapOk.end() && sameReq(it->second, req))
+        {
+            char szDetail[64] = {0};
+            snprintf(szDetail, sizeof(szDetail), "reentry of success got error %d", iError);
+            addViolation("reentry_failed", strListid, szDetail);
+        }
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//按成功的请求推算各账户余额并与t_account比较
+void CCoreFuzz::checkExpect()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    map<LONG, pair<LONG, LONG> > mapExpect;
+
+    for(LONG uid = m_lUidBegin; uid <= m_lCreditGL; ++uid)
+    {
+        mapExpect[uid] = make_pair(0LL, 0LL);
+    }
+
+    //直接记账、冻结、分次解冻：应答成功即生效，且只生效一次
+    for(map<string, Req>::iterator it = m_mapOk.begin(); it != m_mapOk.end(); ++it)
+    {
+        const Req& req = it->second;
+        if(req.arrInt[I_sub_seq] > 0)
+        {
+            applyReq(req, req.arrInt[I_type], req.arrLong[L_sub_amount], req.arrLong[L_sub_amount], mapExpect);
+        }
+        else
+        {
+            applyReq(req, req.arrInt[I_type], req.arrLong[L_debit_amount], req.arrLong[L_credit_amount], mapExpect);
+        }
+    }
+
+    //整笔解冻：成功、失败解冻竞争时后到的也可能应答成功，以凭证最终类型为准，并核对该类型确实应答过成功
+    for(size_t i = 0; i < m_vecFrozen.size(); ++i)
+    {
+        const string& strListid = m_vecFrozen[i];
+        const Req& req = m_mapOk[strListid];
+
+        CCoreProof proof;
+        proof.Flistid = strListid;
+        if(!proof.queryProof())
+        {
+            addViolation("proof_missing", strListid, "freeze succeeded but proof not found");
+            continue;
+        }
+
+        bool bPart = false;
+        for(int iSeq = 1; iSeq <= m_mapSubSeq[strListid]; ++iSeq)
+        {
+            if(m_mapOk.count(strListid + "#" + uidStr(iSeq)) > 0) bPart = true;
+        }
+
+        bool bSucOk = m_setUnfreezeOk.count(strListid + "#" + uidStr(CCoreProof::TYPE_suc_unfreeze)) > 0;
+        bool bFailOk = m_setUnfreezeOk.count(strListid + "#" + uidStr(CCoreProof::TYPE_fail_unfreeze)) > 0;
+
+        if(proof.Ftype == CCoreProof::TYPE_freeze)
+        {
+            if(bSucOk || bFailOk)
+            {
+                addViolation("unfreeze_lost", strListid, "unfreeze succeeded but proof still frozen");
+            }
+        }
+        else if(!bPart)
+        {
+            if((proof.Ftype == CCoreProof::TYPE_suc_unfreeze && !bSucOk)
+                || (proof.Ftype == CCoreProof::TYPE_fail_unfreeze && !bFailOk))
+            {
+                addViolation("unfreeze_unreported", strListid, "proof unfrozen but no such request succeeded");
+            }
+            applyReq(req, proof.Ftype, req.arrLong[L_debit_amount], req.arrLong[L_credit_amount], mapExpect);
+        }
+    }
+
+    CMySQL* ptrSql = getCoreLeaseHandle();
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fuid,Fbalance,Fcon FROM isp_os_core.t_account "
+        "WHERE Fuid >= %lld AND Fuid <= %lld",
+        m_lUidBegin, m_lCreditGL);
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        LONG uid = row[0]? atoll(row[0]): 0;
+        LONG lBalance = row[1]? atoll(row[1]): 0;
+        LONG lCon = row[2]? atoll(row[2]): 0;
+
+        const pair<LONG, LONG>& expect = mapExpect[uid];
+        if(expect.first != lBalance || expect.second != lCon)
+        {
+            snprintf(szSql, sizeof(szSql), "expect %lld/%lld, acct %lld/%lld",
+                expect.first, expect.second, lBalance, lCon);
+            addViolation("expect_balance", uidStr(uid), szSql);
+        }
+    }
+    mysql_free_result(pRes);
+}
+
+//请求对账户的影响，账户均为贷方余额：记借方减余额，记贷方加余额
+void CCoreFuzz::applyReq(const Req& req, const int iType, const LONG lDebit, const LONG lCredit,
+    map<LONG, pair<LONG, LONG> >& mapExpect)
+{
+    if(!req.vecLeg.empty())
+    {
+        for(size_t i = 0; i < req.vecLeg.size(); ++i)
+        {
+            const CCoreProofLeg& leg = req.vecLeg[i];
+            LONG lAmount = leg.Fdirection == OP_debit? -leg.Famount: leg.Famount;
+            mapExpect[leg.Fuid].first += lAmount;
+            mapExpect[leg.Fgl_uid].first += lAmount;
+        }
+        return;
+    }
+
+    LONG arrUid[4] = {req.arrLong[L_debit_uid], req.arrLong[L_debit_gl_uid],
+        req.arrLong[L_credit_uid], req.arrLong[L_credit_gl_uid]};
+
+    for(int i = 0; i < 4; ++i)
+    {
+        bool bDebit = i < 2;
+        LONG lAmount = bDebit? lDebit: lCredit;
+        pair<LONG, LONG>& expect = mapExpect[arrUid[i]];
+
+        if(iType == CCoreProof::TYPE_freeze)
+        {
+            if(lAmount > 0) expect.second += lAmount;
+            continue;
+        }
+
+        if(iType == CCoreProof::TYPE_suc_unfreeze || iType == CCoreProof::TYPE_fail_unfreeze)
+        {
+            if(lAmount > 0) expect.second -= lAmount;
+            if(iType == CCoreProof::TYPE_fail_unfreeze) continue;
+        }
+
+        expect.first += bDebit? -lAmount: lAmount;
+    }
+
+    //附加账户只在直接记账时生效
+    if(iType == CCoreProof::TYPE_direct)
+    {
+        LONG lDebitEx = req.arrLong[L_debit_ex_amount];
+        LONG lCreditEx = req.arrLong[L_credit_ex_amount];
+        if(lDebitEx != 0)
+        {
+            mapExpect[req.arrLong[L_debit_ex_uid]].first -= lDebitEx;
+            mapExpect[req.arrLong[L_debit_exgl_uid]].first -= lDebitEx;
+        }
+        if(lCreditEx != 0)
+        {
+            mapExpect[req.arrLong[L_credit_ex_uid]].first += lCreditEx;
+            mapExpect[req.arrLong[L_credit_exgl_uid]].first += lCreditEx;
+        }
+    }
+}
+
+//清空请求
+void CCoreFuzz::clearReq(Req& req)
+{
+    memset(req.arrInt, 0, sizeof(req.arrInt));
+    memset(req.arrLong, 0, sizeof(req.arrLong));
+    for(int i = 0; i < S_NUM; ++i)
+    {
+        req.arrStr[i].clear();
+    }
+    req.vecLeg.clear();
+}
+
+//两个请求是否相同，按编码结果比较
+bool CCoreFuzz::sameReq(const Req& req1, const Req& req2)
+{
+    string str1, str2;
+    CCoreWireCodec::encodeRequest(req1.arrInt, req1.arrLong, req1.arrStr, req1.vecLeg, str1);
+    CCoreWireCodec::encodeRequest(req2.arrInt, req2.arrLong, req2.arrStr, req2.vecLeg, str2);
+    return str1 == str2;
+}
+
+//填写一个普通凭证请求，借贷金额相同，借贷双方挂各自的总账
+void CCoreFuzz::fillReq(Req& req, const string& strListid, const int iType,
+    const LONG lDebit, const LONG lCredit, const LONG lAmount)
+{
+    clearReq(req);
+
+    req.arrInt[I_type] = iType;
+    req.arrInt[I_rolenum] = 2;
+
+    req.arrLong[L_totalnum] = lAmount;
+    req.arrLong[L_debit_uid] = lDebit;
+    req.arrLong[L_debit_amount] = lAmount;
+    req.arrLong[L_credit_uid] = lCredit;
+    req.arrLong[L_credit_amount] = lAmount;
+    req.arrLong[L_debit_gl_uid] = m_lDebitGL;
+    req.arrLong[L_credit_gl_uid] = m_lCreditGL;
+
+    req.arrStr[S_listid] = strListid;
+    req.arrStr[S_outter_prove] = strListid;
+    req.arrStr[S_cur_type] = m_strCur;
+    req.arrStr[S_ip] = "127.0.0.1";
+    req.arrStr[S_memo] = "fuzz";
+    req.arrStr[S_debit_uin] = uidStr(lDebit);
+    req.arrStr[S_credit_uin] = uidStr(lCredit);
+    req.arrStr[S_debit_gl_uin] = uidStr(m_lDebitGL);
+    req.arrStr[S_credit_gl_uin] = uidStr(m_lCreditGL);
+}
+
+//随机普通账户
+LONG CCoreFuzz::randUid(unsigned int& iSeed)
+{
+    return m_lUidBegin + rand_r(&iSeed) % m_iAccts;
+}
+
+//记录一条问题
+void CCoreFuzz::addViolation(const string& strRule, const string& strKey, const string& strDetail)
+{
+    CCoreInvariant::Violation violation;
+    violation.strRule = strRule;
+    violation.strKey = strKey;
+    violation.strDetail = strDetail;
+    m_vecViolation.push_back(violation);
+}
@@ -0,0 +1,173 @@
+#ifndef _CORE_FUZZ_H_
+#define _CORE_FUZZ_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+#include "corewire.h"
+#include "coreinvariant.h"
+
+/*
+ * 记账模糊测试
+ * 多个线程按种子随机生成直接记账、多方记账、冻结、成功/失败解冻、分次解冻、原样重入、改参重入，
+ * 以及带附加账户且借贷双方共用总账的直接记账（同一uid在一张凭证中出现多次），
+ * 同一批凭证号在线程间共享，解冻与解冻、重入与首发互相竞争；请求走CCoreWire编码后在进程内调用CCore::callCore
+ * 结束后做两类核对：
+ *   差分：按各请求的应答（成功/失败）推算每个账户应有的余额和冻结余额，与t_account比较
+ *   不变式：CCoreInvariant检查借贷平衡、不透支、流水回放、行签名
+ * setModes()可让本次运行走热点合并、准入控制、总账流水汇总、精简流水等快路径，运行期间打开、结束后关回；
+ * 账户由setup()新开，余额从0开始，须连在测试库上运行；
+ * 请求由种子决定，线程交错每次不同，发现问题时记下种子和凭证号前缀用于排查
+ */
+class CCoreFuzz
+{
+public:
+    //运行模式，可组合
+    enum MODE
+    {
+        MODE_hot = 1,        //热点账户合并记账，阈值调低，共用账户很快成为热点
+        MODE_admission = 2,  //准入控制，被拒绝的请求按失败计
+        MODE_gl_agg = 4,     //总账流水汇总，核对前写出全部汇总
+        MODE_compact = 8     //精简流水
+    };
+
+    //运行结果
+    struct Stat
+    {
+        LONG lSent;      //发出的请求数
+        LONG lOk;        //成功数
+        LONG lFail;      //失败数（余额不足、参数不一致等）
+        LONG lReentry;   //原样重入数
+        LONG lConflict;  //改参重入数
+        int iViolation;  //发现的问题数
+    };
+
+    //构造函数
+    CCoreFuzz();
+
+    //析构函数
+    ~CCoreFuzz();
+
+    //开户：[lUidBegin, lUidBegin + iAccts)为普通账户，其后依次为备付金（共有类）、借方总账、贷方总账
+    void setup();
+
+    //执行并核对，返回是否没有发现问题
+    bool run(Stat& stat);
+
+    //本次运行的凭证号前缀
+    const string& prefix() const { return m_strPrefix; }
+
+    //设置参数
+    void setSeed(const unsigned int iSeed) { m_iSeed = iSeed; }
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setCount(const int iPerThread) { m_iCount = iPerThread; }
+    void setUidBegin(const LONG lUidBegin) { m_lUidBegin = lUidBegin; }
+    void setAccts(const int iAccts) { m_iAccts = iAccts; }
+    void setMaxAmount(const LONG lAmount) { m_lMaxAmount = lAmount; }
+    void setCurType(const string& strCur) { m_strCur = strCur; }
+    void setModes(const int iModes) { m_iModes = iModes; }
+
+public:
+    vector<CCoreInvariant::Violation> m_vecViolation; //本次发现
+
+protected:
+    //请求种类
+    enum KIND
+    {
+        KIND_fund = 0,     //备付金入账
+        KIND_direct,       //直接记账
+        KIND_multi,        //多方记账
+        KIND_freeze,       //冻结
+        KIND_unfreeze,     //整笔成功/失败解冻
+        KIND_part,         //分次解冻
+        KIND_reentry,      //原样重入
+        KIND_conflict,     //改参重入
+        KIND_shared,       //借贷及附加分录共用一个总账的直接记账
+        KIND_ex,           //附加借方、附加贷方与主账户相同的直接记账，总账各自独立
+        KIND_NUM
+    };
+
+    //一个请求
+    struct Req
+    {
+        int arrInt[CCoreWire::I_NUM];
+        LONG arrLong[CCoreWire::L_NUM];
+        string arrStr[CCoreWire::S_NUM];
+        vector<CCoreProofLeg> vecLeg;
+    };
+
+    //一个测试线程
+    struct Worker
+    {
+        CCoreFuzz* ptrFuzz;
+        int iIndex;
+        unsigned int iSeed;
+        LONG lOk;
+        LONG lFail;
+        LONG lReentry;
+        LONG lConflict;
+        string strError; //非空表示线程异常退出
+    };
+
+    //打开本次运行的模式，返回本次打开的模式，结束后只关回这些
+    int openModes();
+    //关回openModes打开的模式，恢复改过的参数
+    void closeModes(const int iOpened);
+    //执行并核对
+    bool runChecked(Stat& stat);
+    //线程入口
+    static void* threadMain(void* ptrArg);
+    //一个线程的测试
+    void runWorker(Worker& worker);
+    //生成一个请求，返回false表示条件不满足（如还没有可解冻的凭证）
+    bool genRequest(Worker& worker, const int iKind, const int iSeq, Req& req);
+    //发送请求，返回错误码
+    int callCore(const Req& req);
+    //记录应答
+    void record(Worker& worker, const int iKind, const Req& req, const int iError);
+    //按成功的请求推算各账户余额并与t_account比较
+    void checkExpect();
+    //请求对账户的影响
+    void applyReq(const Req& req, const int iType, const LONG lDebit, const LONG lCredit, map<LONG, pair<LONG, LONG> >& mapExpect);
+    //清空请求
+    static void clearReq(Req& req);
+    //两个请求是否相同
+    static bool sameReq(const Req& req1, const Req& req2);
+    //填写一个普通凭证请求
+    void fillReq(Req& req, const string& strListid, const int iType, const LONG lDebit, const LONG lCredit, const LONG lAmount);
+    //随机普通账户
+    LONG randUid(unsigned int& iSeed);
+    //记录一条问题
+    void addViolation(const string& strRule, const string& strKey, const string& strDetail);
+
+protected:
+    unsigned int m_iSeed;
+    int m_iThreads;
+    int m_iCount;
+    LONG m_lUidBegin;
+    int m_iAccts;
+    LONG m_lMaxAmount;
+    string m_strCur;
+    int m_iModes;
+    int m_iHotCount;      //打开热点模式前的阈值，关闭时恢复
+    int m_iHotWaitUs;
+    LONG m_lFundUid;      //备付金账户
+    LONG m_lDebitGL;      //借方总账
+    LONG m_lCreditGL;     //贷方总账
+    string m_strPrefix;   //本次运行的凭证号前缀
+
+    //以下受m_mutex保护
+    vector<Req> m_vecSent;               //发出过的请求，重入时从中挑选
+    vector<string> m_vecFrozen;          //冻结成功的凭证号
+    map<string, int> m_mapSubSeq;        //各冻结凭证已用到的分次解冻序号
+    map<string, Req> m_mapOk;            //成功的直接记账、冻结（Flistid）和分次解冻（Flistid#Fsub_seq）
+    set<string> m_setUnfreezeOk;         //应答成功的整笔解冻（Flistid#Ftype）
+    pthread_mutex_t m_mutex;
+};
+
+#endif
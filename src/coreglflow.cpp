@@ -0,0 +1,378 @@
+#include "coreglflow.h"
+#include "core.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+/*****************
+ * 总账流水汇总 *
+******************/
+
+//汇总键比较
+bool CCoreGLFlow::Key::operator<(const Key& other) const
+{
+    if(lUid != other.lUid) return lUid < other.lUid;
+    return iBucket < other.iBucket;
+}
+
+// 构造函数
+CCoreGLFlow::CCoreGLFlow()
+{
+    m_bEnable = false;
+    m_iBucket = 60;
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreGLFlow::~CCoreGLFlow()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局实例
+CCoreGLFlow* CCoreGLFlow::instance()
+{
+    static CCoreGLFlow glFlow;
+    return &glFlow;
+}
+
+//开启/关闭汇总
+void CCoreGLFlow::setMode(const bool bEnable, const int iBucket)
+{
+    m_iBucket = iBucket > 0? iBucket: 60;
+    m_bEnable = bEnable;
+}
+
+//一笔总账流水转为汇总键和汇总值
+void CCoreGLFlow::toItem(const CCoreFlow& flow, const CCoreStamp& stamp, Key& key, Sum& item) const
+{
+    key.lUid = flow.Fuid;
+    key.iBucket = bucket(flow.Ftimestamp);
+
+    item.strCurType = flow.Fcur_type;
+    item.strUin = flow.Fuin;
+    item.iSubject = flow.Fsubject;
+    item.iCount = 1;
+    item.lBalanceNet = 0;
+    item.lConNet = 0;
+    item.lBalance = flow.Fbalance;
+    item.lCon = flow.Fcon;
+    item.stamp = stamp;
+
+    if(flow.Ftype == CCoreFlow::TYPE_in) item.lBalanceNet = flow.Fpaynum;
+    else if(flow.Ftype == CCoreFlow::TYPE_out) item.lBalanceNet = -flow.Fpaynum;
+    else if(flow.Ftype == CCoreFlow::TYPE_freeze) item.lConNet = flow.Fconnum;
+    else if(flow.Ftype == CCoreFlow::TYPE_unfreeze) item.lConNet = -flow.Fconnum;
+}
+
+//把一笔变动并入汇总
+void CCoreGLFlow::merge(map<Key, Sum>& mapSum, const Key& key, const Sum& item)
+{
+    map<Key, Sum>::iterator it = mapSum.find(key);
+    if(it == mapSum.end())
+    {
+        mapSum.insert(make_pair(key, item));
+        return;
+    }
+
+    merge(it->second, item);
+}
+
+//把一笔变动并入汇总值
+void CCoreGLFlow::merge(Sum& sum, const Sum& item)
+{
+    sum.iCount += item.iCount;
+    sum.lBalanceNet += item.lBalanceNet;
+    sum.lConNet += item.lConNet;
+
+    //同一总账的账户时间戳严格递增，时间戳最大的一笔即最后提交的一笔
+    if(sum.stamp < item.stamp)
+    {
+        sum.iSubject = item.iSubject;
+        sum.lBalance = item.lBalance;
+        sum.lCon = item.lCon;
+        sum.stamp = item.stamp;
+    }
+}
+
+//累加已提交的总账流水
+void CCoreGLFlow::add(const vector<CCoreFlow>& vecFlow, const vector<CCoreStamp>& vecStamp)
+{
+    if(vecFlow.empty()) return;
+
+    pthread_mutex_lock(&m_mutex);
+    for(size_t i = 0; i < vecFlow.size(); ++i)
+    {
+        Key key;
+        Sum item;
+        toItem(vecFlow[i], vecStamp[i], key, item);
+        merge(m_mapSum, key, item);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//记账事务内写关联行的语句
+string CCoreGLFlow::sqlLink(const vector<CCoreFlow>& vecFlow, const vector<CCoreStamp>& vecStamp) const
+{
+    if(vecFlow.empty()) return "";
+
+    //同一凭证对同一总账的多笔变动先合并，每个 (凭证, 汇总键) 一行
+    map<pair<string, Key>, Sum> mapLink;
+    for(size_t i = 0; i < vecFlow.size(); ++i)
+    {
+        Key key;
+        Sum item;
+        toItem(vecFlow[i], vecStamp[i], key, item);
+
+        map<pair<string, Key>, Sum>::iterator it = mapLink.find(make_pair(vecFlow[i].Flistid, key));
+        if(it == mapLink.end())
+        {
+            mapLink.insert(make_pair(make_pair(vecFlow[i].Flistid, key), item));
+        }
+        else
+        {
+            merge(it->second, item);
+        }
+    }
+
+    char szRow[MAX_MSG_LEN] = {0};
+    string strIp = HOST_IP;
+    string strSql =
+        "INSERT INTO isp_os_core.t_flow_gl_link "
+        "(Flistid,Fuid,Fsubject,Fcur_type,Fuin,Fbucket,Fcount,Fpaynum,Fconnum,"
+        "Fbalance,Fcon,Ftimestamp,Ftimestamp_us,Fip,Fcreate_time) VALUES ";
+
+    for(map<pair<string, Key>, Sum>::const_iterator it = mapLink.begin(); it != mapLink.end(); ++it)
+    {
+        const Key& key = it->first.second;
+        const Sum& sum = it->second;
+
+        snprintf(szRow, sizeof(szRow) - 1,
+            "%s('%s',%lld,%d,'%s','%s',%d,%d,%lld,%lld,%lld,%lld,%d,%d,'%s',now())",
+            it == mapLink.begin()? "": ",",
+            it->first.first.c_str(), key.lUid, sum.iSubject,
+            sum.strCurType.c_str(), sum.strUin.c_str(), key.iBucket, sum.iCount,
+            sum.lBalanceNet, sum.lConNet, sum.lBalance, sum.lCon,
+            sum.stamp.iSec, sum.stamp.iUs, strIp.c_str());
+        strSql += szRow;
+    }
+
+    return strSql;
+}
+
+//汇总键所在分区
+CCoreDBPool* CCoreGLFlow::route(const Key& key, const Sum& sum)
+{
+    CCoreShardRouter* ptrRouter = CCoreShardRouter::instance();
+    if(ptrRouter->enabled())
+    {
+        return ptrRouter->pool(ptrRouter->shardOf(key.lUid, true));
+    }
+
+    return CCoreCurRouter::instance()->route(sum.strCurType);
+}
+
+//写出同一分区的汇总流水，并删除对应的关联行
+void CCoreGLFlow::write(CCoreDBPool* ptrPool, const map<Key, Sum>& mapOut)
+{
+    CCoreDBLease lease(ptrPool, true);
+    CMySQL* ptrSql = lease.handle();
+
+    string strValues;
+    string strNow = getSysTime();
+    string strIp = HOST_IP;
+    char szListid[64] = {0};
+    char szExplain[32] = {0};
+    char szSql[MAX_SQL_LEN] = {0};
+
+    try
+    {
+        ptrSql->Begin();
+
+        for(map<Key, Sum>::const_iterator it = mapOut.begin(); it != mapOut.end(); ++it)
+        {
+            const Sum& sum = it->second;
+
+            CCoreFlow flow;
+            flow.Fcur_type = sum.strCurType;
+            snprintf(szListid, sizeof(szListid), "gl%d_%d", it->first.iBucket, sum.iSubject);
+            flow.Flistid = szListid;
+            flow.Fuid = it->first.lUid;
+            flow.Fuin = sum.strUin;
+            flow.Flist_source = "gl_agg";
+            flow.Fsubject = sum.iSubject;
+            flow.Fip = HOST_IP;
+            flow.Fcreate_time = strNow;
+            flow.Fmodify_time = strNow;
+            flow.Ftimestamp = sum.stamp.iSec;
+
+            //余额净变动一行，冻结余额有净变动时再一行；先写的一行冻结余额取桶初值，回放逐行可对上
+            bool bBalance = (sum.lBalanceNet != 0 || 0 == sum.lConNet);
+            if(bBalance)
+            {
+                flow.Ftype = sum.lBalanceNet >= 0? CCoreFlow::TYPE_in: CCoreFlow::TYPE_out;
+                flow.Fpaynum = sum.lBalanceNet >= 0? sum.lBalanceNet: -sum.lBalanceNet;
+                flow.Fconnum = 0;
+                flow.Fbalance = sum.lBalance;
+                flow.Fcon = sum.lCon - sum.lConNet;
+                snprintf(szExplain, sizeof(szExplain), "count=%d", sum.iCount);
+                flow.Fexplain = szExplain;
+
+                if(!strValues.empty()) strValues += ",";
+                strValues += flow.sqlValues();
+            }
+            if(sum.lConNet != 0)
+            {
+                flow.Ftype = sum.lConNet > 0? CCoreFlow::TYPE_freeze: CCoreFlow::TYPE_unfreeze;
+                flow.Fpaynum = 0;
+                flow.Fconnum = sum.lConNet > 0? sum.lConNet: -sum.lConNet;
+                flow.Fbalance = sum.lBalance;
+                flow.Fcon = sum.lCon;
+                snprintf(szExplain, sizeof(szExplain), "count=%d", bBalance? 0: sum.iCount);
+                flow.Fexplain = szExplain;
+
+                if(!strValues.empty()) strValues += ",";
+                strValues += flow.sqlValues();
+            }
+
+            int iLen = snprintf(szSql, sizeof(szSql) - 1,
+                "DELETE FROM isp_os_core.t_flow_gl_link "
+                "WHERE Fip = '%s' AND Fuid = %lld AND Fbucket = %d",
+                strIp.c_str(), it->first.lUid, it->first.iBucket);
+            ptrSql->Query(szSql, iLen);
+        }
+
+        string strSql = CCoreFlow::sqlInsert() + strValues;
+        ptrSql->Query(strSql.c_str(), strSql.length());
+
+        ptrSql->Commit();
+    }
+    catch(CException& e)
+    {
+        ptrSql->Rollback();
+        throw;
+    }
+}
+
+//写出已结束的时间桶
+int CCoreGLFlow::flush(const bool bAll)
+{
+    map<Key, Sum> mapOut;
+    int iNow = genCurTimeStamp();
+
+    //锁内只摘出待写的桶，写库在锁外
+    //桶结束后再等一个桶长，落在桶内但提交较慢的事务已经计入
+    pthread_mutex_lock(&m_mutex);
+    for(map<Key, Sum>::iterator it = m_mapSum.begin(); it != m_mapSum.end(); )
+    {
+        if(bAll || it->first.iBucket + 2 * m_iBucket <= iNow)
+        {
+            mapOut.insert(*it);
+            m_mapSum.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(mapOut.empty()) return 0;
+
+    //按总账账户所在分区分组写出
+    map<CCoreDBPool*, map<Key, Sum> > mapPart;
+    for(map<Key, Sum>::const_iterator it = mapOut.begin(); it != mapOut.end(); ++it)
+    {
+        mapPart[route(it->first, it->second)].insert(*it);
+    }
+
+    int iOut = 0;
+    int iError = 0;
+    string strError;
+
+    for(map<CCoreDBPool*, map<Key, Sum> >::const_iterator itPart = mapPart.begin(); itPart != mapPart.end(); ++itPart)
+    {
+        try
+        {
+            write(itPart->first, itPart->second);
+            iOut += itPart->second.size();
+        }
+        catch(CException& e)
+        {
+            //写失败放回去，下次一起写
+            pthread_mutex_lock(&m_mutex);
+            for(map<Key, Sum>::const_iterator it = itPart->second.begin(); it != itPart->second.end(); ++it)
+            {
+                merge(m_mapSum, it->first, it->second);
+            }
+            pthread_mutex_unlock(&m_mutex);
+
+            if(0 == iError)
+            {
+                iError = e.error();
+                strError = e.what();
+            }
+        }
+    }
+
+    //其他分区照常写出，之后报告首个失败
+    if(iError != 0)
+    {
+        throw CException(iError, strError, __FILE__, __LINE__);
+    }
+
+    return iOut;
+}
+
+//载入分区上本机未写出的关联行
+int CCoreGLFlow::recover(CCoreDBPool* ptrPool)
+{
+    CCoreDBLease lease(ptrPool, true);
+    CMySQL* ptrSql = lease.handle();
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    map<Key, Sum> mapLoad;
+    string strIp = HOST_IP;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fuid,Fbucket,Fsubject,Fcur_type,Fuin,Fcount,Fpaynum,Fconnum,"
+        "Fbalance,Fcon,Ftimestamp,Ftimestamp_us "
+        "FROM isp_os_core.t_flow_gl_link WHERE Fip = '%s'",
+        strIp.c_str());
+
+    ptrSql->Query(szSql, iLen);
+    pRes = ptrSql->FetchResult();
+    int iRow = mysql_num_rows(pRes);
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        Key key;
+        key.lUid = row[0]? atoll(row[0]): 0;
+        key.iBucket = row[1]? atoi(row[1]): 0;
+
+        Sum item;
+        item.iSubject = row[2]? atoi(row[2]): 0;
+        item.strCurType = row[3]? row[3]: "";
+        item.strUin = row[4]? row[4]: "";
+        item.iCount = row[5]? atoi(row[5]): 0;
+        item.lBalanceNet = row[6]? atoll(row[6]): 0;
+        item.lConNet = row[7]? atoll(row[7]): 0;
+        item.lBalance = row[8]? atoll(row[8]): 0;
+        item.lCon = row[9]? atoll(row[9]): 0;
+        item.stamp.iSec = row[10]? atoi(row[10]): 0;
+        item.stamp.iUs = row[11]? atoi(row[11]): 0;
+
+        merge(mapLoad, key, item);
+    }
+    mysql_free_result(pRes);
+
+    pthread_mutex_lock(&m_mutex);
+    for(map<Key, Sum>::const_iterator it = mapLoad.begin(); it != mapLoad.end(); ++it)
+    {
+        merge(m_mapSum, it->first, it->second);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return iRow;
+}
@@ -0,0 +1,112 @@
+#ifndef _CORE_GL_FLOW_H_
+#define _CORE_GL_FLOW_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coreclock.h"
+#include "coredbpool.h"
+
+class CCoreFlow;
+
+/*
+ * 总账流水汇总
+ * 开启后总账账户不再逐笔写t_flow，提交后的总账变动按 (总账uid, 时间桶) 在内存中累加余额和冻结余额的净变动，
+ * 定期写出汇总流水（Flist_source = 'gl_agg'），写到总账账户所在的分区（分片或币种连接池）：
+ * 余额净变动一行（TYPE_in/TYPE_out，Fpaynum为净额绝对值），冻结余额有净变动时再写一行（TYPE_freeze/TYPE_unfreeze），
+ * 两行在同一语句内按此顺序插入，变动后余额为逐行累计的结果，最后一行即桶末余额，
+ * 按Fid回放t_flow仍能得到Fbalance、Fcon（快照和按时间点查询可用，停止记账并写出后可按最后一条流水重建余额）
+ * 桶末余额按账户时间戳 (Ftimestamp, Ftimestamp_us) 取最后一笔，总账行锁下它与提交顺序一致；
+ * 科目取桶内最后一笔的科目，笔数记在Fexplain（count=N），按科目、类型的逐笔金额只在t_flow_daily中
+ * 同一桶须在后一个桶之前写出：桶结束后再等一个桶长才写，提交晚于此的变动会另起一条，回放将不一致
+ *
+ * 每张凭证在记账事务内把本凭证的总账变动按汇总键预汇总后写入isp_os_core.t_flow_gl_link，
+ * 与总账账户同库；汇总流水写出时在同一事务内删除对应的关联行，
+ * 进程重启后用recover()把剩余的关联行重新载入内存，未落地的汇总不会丢失
+ *
+ * isp_os_core.t_flow_gl_link: 主键(Flistid, Fuid)，索引(Fip, Fuid, Fbucket)
+ *   Fcur_type, Fuin, Fsubject, Fbucket, Fcount, Fpaynum, Fconnum, Fbalance, Fcon, Ftimestamp, Ftimestamp_us, Fip, Fcreate_time
+ *   Fpaynum、Fconnum为余额、冻结余额的净变动，可为负；Fsubject、Fbalance、Fcon为本凭证最后一笔的科目和变动后余额
+ * 关联行按Fip区分写入进程，同一主机只跑一个记账进程
+ */
+class CCoreGLFlow
+{
+public:
+    //构造函数
+    CCoreGLFlow();
+
+    //析构函数
+    ~CCoreGLFlow();
+
+    //全局实例
+    static CCoreGLFlow* instance();
+
+    //开启/关闭汇总，iBucket为时间桶长度（秒）
+    void setMode(const bool bEnable, const int iBucket = 60);
+
+    //是否开启汇总
+    bool enabled() const { return m_bEnable; }
+
+    //流水所在时间桶
+    int bucket(const int iTimestamp) const { return iTimestamp / m_iBucket * m_iBucket; }
+
+    //累加已提交的总账流水，vecStamp[i]为vecFlow[i]对应的账户时间戳
+    void add(const vector<CCoreFlow>& vecFlow, const vector<CCoreStamp>& vecStamp);
+
+    //写出已结束的时间桶，bAll为true时写出全部，返回写出的 (总账uid, 时间桶) 数
+    int flush(const bool bAll = false);
+
+    //载入分区上本机未写出的关联行，进程启动、开始记账前对每个分区调用一次，返回载入的行数
+    int recover(CCoreDBPool* ptrPool = NULL);
+
+    //记账事务内写关联行的语句，vecFlow为空时返回空串
+    string sqlLink(const vector<CCoreFlow>& vecFlow, const vector<CCoreStamp>& vecStamp) const;
+
+protected:
+    //汇总键
+    struct Key
+    {
+        LONG lUid;
+        int iBucket;
+
+        bool operator<(const Key& other) const;
+    };
+
+    //汇总值
+    struct Sum
+    {
+        string strCurType;
+        string strUin;
+        int iSubject;  //最后一笔的科目
+        int iCount;
+        LONG lBalanceNet; //余额净变动
+        LONG lConNet;     //冻结余额净变动
+        LONG lBalance; //最后一笔变动后余额
+        LONG lCon;
+        CCoreStamp stamp; //最后一笔的账户时间戳
+    };
+
+    //一笔总账流水转为汇总键和汇总值
+    void toItem(const CCoreFlow& flow, const CCoreStamp& stamp, Key& key, Sum& item) const;
+
+    //把一笔变动并入汇总
+    static void merge(map<Key, Sum>& mapSum, const Key& key, const Sum& item);
+    static void merge(Sum& sum, const Sum& item);
+
+    //汇总键所在分区
+    static CCoreDBPool* route(const Key& key, const Sum& sum);
+
+    //写出同一分区的汇总流水，并删除对应的关联行
+    static void write(CCoreDBPool* ptrPool, const map<Key, Sum>& mapOut);
+
+protected:
+    bool m_bEnable;
+    int m_iBucket;
+    map<Key, Sum> m_mapSum;
+    pthread_mutex_t m_mutex;
+};
+
+#endif
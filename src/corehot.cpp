@@ -0,0 +1,268 @@
+#include <string.h>
+#include <set>
+#include "corehot.h"
+#include "core.h"
+#include "coreerror.h"
+#include "common.h"
+
+//当前秒
+static int nowSec()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return tStamp.iTimeStamp;
+}
+
+/*****************
+ * 热点账户识别与合并记账 *
+******************/
+
+// 构造函数
+CCoreHotAcct::CCoreHotAcct()
+{
+    m_bEnable = false;
+    m_iHotCount = 200;
+    m_lHotWaitUs = 5000;
+    m_iBatch = 64;
+    m_iMaxTrack = 100000;
+    memset(&m_stat, 0, sizeof(m_stat));
+
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreHotAcct::~CCoreHotAcct()
+{
+    for(map<LONG, Queue>::iterator it = m_mapQueue.begin(); it != m_mapQueue.end(); ++it)
+    {
+        pthread_cond_destroy(&it->second.cond);
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局实例
+CCoreHotAcct* CCoreHotAcct::instance()
+{
+    static CCoreHotAcct hot;
+    return &hot;
+}
+
+//取账户热度并滚动到当前秒
+CCoreHotAcct::Heat& CCoreHotAcct::heat(const LONG uid, const int iSec)
+{
+    map<LONG, Heat>::iterator it = m_mapHeat.find(uid);
+    if(it == m_mapHeat.end())
+    {
+        Heat heat = {iSec, 0, 0, 0, 0};
+        it = m_mapHeat.insert(make_pair(uid, heat)).first;
+    }
+
+    Heat& heat = it->second;
+    if(heat.iSec != iSec)
+    {
+        //中间隔了整秒没有记账，上一秒按0算
+        bool bPrev = (heat.iSec + 1 == iSec);
+        heat.iLastCount = bPrev? heat.iCount: 0;
+        heat.lLastWaitUs = bPrev? heat.lWaitUs: 0;
+        heat.iSec = iSec;
+        heat.iCount = 0;
+        heat.lWaitUs = 0;
+    }
+    return heat;
+}
+
+//次数取当前秒和上一秒的较大者，升温不用等满一秒；锁等待只看上一秒的平均
+bool CCoreHotAcct::judge(const Heat& heat) const
+{
+    int iCount = heat.iCount > heat.iLastCount? heat.iCount: heat.iLastCount;
+    if(iCount >= m_iHotCount) return true;
+
+    return heat.iLastCount > 0 && heat.lLastWaitUs / heat.iLastCount >= m_lHotWaitUs;
+}
+
+//淘汰两秒内没有记账的账户
+void CCoreHotAcct::prune(const int iSec)
+{
+    map<LONG, Heat>::iterator it = m_mapHeat.begin();
+    while(it != m_mapHeat.end())
+    {
+        if(it->second.iSec < iSec - 1)
+        {
+            m_mapHeat.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+//记录一次记账
+bool CCoreHotAcct::touch(const LONG uid)
+{
+    int iSec = nowSec();
+
+    pthread_mutex_lock(&m_mutex);
+    Heat& h = heat(uid, iSec);
+    h.iCount++;
+    bool bHot = judge(h);
+    if((int)m_mapHeat.size() > m_iMaxTrack) prune(iSec);
+    pthread_mutex_unlock(&m_mutex);
+
+    return bHot;
+}
+
+//记录一次加锁等待
+void CCoreHotAcct::addWait(const LONG uid, const LONG lWaitUs)
+{
+    int iSec = nowSec();
+
+    pthread_mutex_lock(&m_mutex);
+    heat(uid, iSec).lWaitUs += lWaitUs;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//是否热点
+bool CCoreHotAcct::isHot(const LONG uid)
+{
+    bool bHot = false;
+    int iSec = nowSec();
+
+    pthread_mutex_lock(&m_mutex);
+    if(m_mapHeat.find(uid) != m_mapHeat.end())
+    {
+        bHot = judge(heat(uid, iSec));
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return bHot;
+}
+
+/*
+ * 提交到热点队列
+ * 队列没有领头线程时自己做领头，否则等待；领头线程完成自己的凭证后交出，
+ * 剩下的凭证由被唤醒的等待线程接着处理，不会有线程一直替别人干活
+ */
+void CCoreHotAcct::submit(const LONG uid, const string& strListid, CCore& core)
+{
+    CCoreHotJob job;
+    job.ptrCore = &core;
+    job.strListid = strListid;
+    job.bDone = false;
+    job.iError = 0;
+
+    pthread_mutex_lock(&m_mutex);
+
+    //条件变量在map节点上初始化，节点地址不变
+    map<LONG, Queue>::iterator it = m_mapQueue.find(uid);
+    if(it == m_mapQueue.end())
+    {
+        it = m_mapQueue.insert(make_pair(uid, Queue())).first;
+        it->second.bBusy = false;
+        it->second.iRef = 0;
+        pthread_cond_init(&it->second.cond, NULL);
+    }
+
+    Queue& queue = it->second;
+    queue.iRef++;
+    queue.deqJob.push_back(&job);
+
+    while(!job.bDone)
+    {
+        if(!queue.bBusy)
+        {
+            lead(queue, job, core);
+        }
+        else
+        {
+            pthread_cond_wait(&queue.cond, &m_mutex);
+        }
+    }
+
+    //没有线程再用时删除，热点账户的队列随热度消失
+    if(0 == --queue.iRef)
+    {
+        pthread_cond_destroy(&queue.cond);
+        m_mapQueue.erase(it);
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+
+    if(job.iError != 0)
+    {
+        throw CException(job.iError, job.strMsg, __FILE__, __LINE__);
+    }
+}
+
+//作为领头线程处理队列，持锁进入和返回，处理时释放锁
+void CCoreHotAcct::lead(Queue& queue, CCoreHotJob& job, CCore& core)
+{
+    queue.bBusy = true;
+
+    while(!job.bDone)
+    {
+        //调用方重试会让同一凭证号排队两次，同一批内都看到未使用状态会重复记账；
+        //重复的留在队列里进下一批，那时前一张已提交，锁单即得ERR_ALREADY_SUCCESS
+        vector<CCoreHotJob*> vecJob;
+        set<string> setListid;
+        deque<CCoreHotJob*>::iterator it = queue.deqJob.begin();
+        while(it != queue.deqJob.end() && (int)vecJob.size() < m_iBatch)
+        {
+            if(setListid.insert((*it)->strListid).second)
+            {
+                vecJob.push_back(*it);
+                it = queue.deqJob.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+        try
+        {
+            core.dealHotBatch(vecJob);
+        }
+        catch(...)
+        {
+            for(size_t i = 0; i < vecJob.size(); ++i)
+            {
+                vecJob[i]->iError = ERR_CORE_BUSY;
+                vecJob[i]->strMsg = "core hot: batch aborted";
+            }
+        }
+        pthread_mutex_lock(&m_mutex);
+
+        m_stat.lBatch++;
+        m_stat.lJob += vecJob.size();
+        if((int)vecJob.size() > m_stat.iMaxBatch) m_stat.iMaxBatch = vecJob.size();
+        for(size_t i = 0; i < vecJob.size(); ++i)
+        {
+            if(vecJob[i]->iError != 0 && vecJob[i]->iError != ERR_ALREADY_SUCCESS) m_stat.lFail++;
+            vecJob[i]->bDone = true;
+        }
+
+        //每批做完就唤醒，已完成的等待线程不必等领头线程的凭证
+        pthread_cond_broadcast(&queue.cond);
+    }
+
+    //交出领头，剩下的凭证由被唤醒的等待线程接着处理
+    queue.bBusy = false;
+    pthread_cond_broadcast(&queue.cond);
+}
+
+//获取统计
+void CCoreHotAcct::getStat(Stat& stat)
+{
+    int iSec = nowSec();
+
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    stat.iHot = 0;
+    for(map<LONG, Heat>::iterator it = m_mapHeat.begin(); it != m_mapHeat.end(); ++it)
+    {
+        if(judge(heat(it->first, iSec))) stat.iHot++;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
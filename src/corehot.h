@@ -0,0 +1,124 @@
+#ifndef _CORE_HOT_H_
+#define _CORE_HOT_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include "exception.h"
+#include "sqlapi.h"
+
+class CCore;
+
+/*
+ * 热点队列中的一张凭证
+ * 领头线程处理后填写结果，iError为0表示记账成功
+ */
+struct CCoreHotJob
+{
+    CCore* ptrCore;
+    string strListid; //凭证号，同一批内不重复
+    bool bDone;
+    int iError;
+    string strMsg;
+};
+
+/*
+ * 热点账户识别与合并记账
+ * 按秒统计普通账户的记账次数和加锁等待，上一秒次数或平均锁等待超过阈值即为热点；
+ * 涉及热点账户的直接记账凭证进入该账户的进程内队列，由一个领头线程每次取一批，
+ * 在一个事务内锁一次账户、合并为一次UPDATE、多条流水一起写入，其余线程等待结果
+ * 总账不参与识别，默认关闭
+ */
+class CCoreHotAcct
+{
+public:
+    //热点统计
+    struct Stat
+    {
+        LONG lBatch;     //合并记账批数
+        LONG lJob;       //经热点队列记账的凭证数
+        LONG lFail;      //批内单张失败数
+        int iHot;        //当前热点账户数
+        int iMaxBatch;   //最大批大小
+    };
+
+    //构造函数
+    CCoreHotAcct();
+
+    //析构函数
+    ~CCoreHotAcct();
+
+    //全局实例
+    static CCoreHotAcct* instance();
+
+    //开启/关闭
+    void setMode(const bool bEnable) { m_bEnable = bEnable; }
+
+    //是否开启
+    bool enabled() const { return m_bEnable; }
+
+    //记录一次记账，返回账户是否热点
+    bool touch(const LONG uid);
+
+    //记录一次加锁等待
+    void addWait(const LONG uid, const LONG lWaitUs);
+
+    //是否热点，不计数
+    bool isHot(const LONG uid);
+
+    //提交到uid的热点队列，处理完返回，失败时按原错误码抛出
+    void submit(const LONG uid, const string& strListid, CCore& core);
+
+    //获取统计
+    void getStat(Stat& stat);
+
+    //设置参数
+    void setThreshold(const int iCountPerSec, const int iWaitUs) { m_iHotCount = iCountPerSec; m_lHotWaitUs = iWaitUs; }
+    void getThreshold(int& iCountPerSec, int& iWaitUs) const { iCountPerSec = m_iHotCount; iWaitUs = m_lHotWaitUs; }
+    void setBatch(const int iBatch) { m_iBatch = iBatch; }
+    void setMaxTrack(const int iMaxTrack) { m_iMaxTrack = iMaxTrack; }
+
+protected:
+    //账户热度，按秒分桶，保留当前秒和上一秒
+    struct Heat
+    {
+        int iSec;
+        int iCount;
+        int iLastCount;
+        LONG lWaitUs;
+        LONG lLastWaitUs;
+    };
+
+    //一个热点账户的等待队列
+    struct Queue
+    {
+        deque<CCoreHotJob*> deqJob;
+        bool bBusy; //已有领头线程
+        int iRef;   //在队列上提交、等待的线程数，为0才能删除
+        pthread_cond_t cond; //只唤醒本账户的等待线程
+    };
+
+    //取账户热度并滚动到当前秒，需持锁
+    Heat& heat(const LONG uid, const int iSec);
+    //按当前秒和上一秒的统计判断热点，需持锁
+    bool judge(const Heat& heat) const;
+    //淘汰不活跃的账户，需持锁
+    void prune(const int iSec);
+    //作为领头线程处理队列，直到自己的凭证完成
+    void lead(Queue& queue, CCoreHotJob& job, CCore& core);
+
+protected:
+    bool m_bEnable;
+    int m_iHotCount;
+    LONG m_lHotWaitUs;
+    int m_iBatch;
+    int m_iMaxTrack;
+    map<LONG, Heat> m_mapHeat;
+    map<LONG, Queue> m_mapQueue;
+    Stat m_stat;
+    pthread_mutex_t m_mutex;
+};
+
+#endif
@@ -0,0 +1,531 @@
+#include "coreinvariant.h"
+#include "corethread.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//一批待校验签名的账户
+struct InvAcctBatch
+{
+    vector<CCoreAcct>* ptrAcct;
+    vector<char> vecBad;
+};
+
+//一批待校验签名的凭证
+struct InvProofBatch
+{
+    vector<CCoreProof>* ptrProof;
+    vector<char> vecBad;
+};
+
+//并行校验账户签名
+static void verifyAcctRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    InvAcctBatch& batch = *(InvAcctBatch*)ptrCtx;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        CCoreAcct& acct = (*batch.ptrAcct)[i];
+        batch.vecBad[i] = (acct.Facct_sign != acct.genAcctSign());
+    }
+}
+
+//并行校验凭证签名
+static void verifyProofRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    InvProofBatch& batch = *(InvProofBatch*)ptrCtx;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        CCoreProof& proof = (*batch.ptrProof)[i];
+        string strSign = proof.Fproof_sign;
+        proof.genProofSign();
+        batch.vecBad[i] = (strSign != proof.Fproof_sign);
+        proof.Fproof_sign = strSign;
+    }
+}
+
+//一个账户的流水回放状态
+struct InvReplay
+{
+    const CCoreAcct* ptrAcct;
+    LONG lBalance;
+    LONG lCon;
+    bool bStarted;
+};
+
+//流水对余额、冻结余额的变动
+static void flowDelta(const int iType, const LONG lPaynum, const LONG lConnum, LONG& lBalance, LONG& lCon)
+{
+    lBalance = 0;
+    lCon = 0;
+
+    if(iType == CCoreFlow::TYPE_in)
+    {
+        lBalance = lPaynum;
+    }
+    else if(iType == CCoreFlow::TYPE_out)
+    {
+        lBalance = -lPaynum;
+    }
+    else if(iType == CCoreFlow::TYPE_freeze)
+    {
+        lCon = lConnum;
+    }
+    else if(iType == CCoreFlow::TYPE_unfreeze)
+    {
+        lCon = -lConnum;
+    }
+}
+
+/*****************
+ * 账务不变式检查 *
+******************/
+
+// 构造函数
+CCoreInvariant::CCoreInvariant()
+{
+    m_ptrSql = getCoreLeaseHandle();
+    m_lUidBegin = 0;
+    m_lUidEnd = 0;
+    m_bFromZero = false;
+    m_iThreads = coreCpuNum();
+    m_iBatch = 1000;
+}
+
+//析构函数
+CCoreInvariant::~CCoreInvariant()
+{
+    m_ptrSql = NULL;
+}
+
+//全部检查
+bool CCoreInvariant::checkAll()
+{
+    checkAcct();
+    checkProof();
+
+    return m_vecViolation.empty();
+}
+
+//记录一条违反
+void CCoreInvariant::addViolation(const string& strRule, const string& strKey, const string& strDetail)
+{
+    Violation violation;
+    violation.strRule = strRule;
+    violation.strKey = strKey;
+    violation.strDetail = strDetail;
+    m_vecViolation.push_back(violation);
+}
+
+//检查账户及其流水
+LONG CCoreInvariant::checkAcct()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    char szKey[32] = {0};
+    LONG lTotal = 0;
+    LONG lLastUid = m_lUidBegin - 1;
+
+    while(true)
+    {
+        vector<CCoreAcct> vecAcct;
+        MYSQL_RES* pRes = NULL;
+        int iLen = 0;
+
+        if(m_lUidEnd > 0)
+        {
+            iLen = snprintf(szSql, sizeof(szSql),
+                "SELECT %s FROM isp_os_core.t_account "
+                "WHERE Fuid > %lld AND Fuid < %lld ORDER BY Fuid LIMIT %d",
+                CCoreAcct::sqlSelect(), lLastUid, m_lUidEnd, m_iBatch);
+        }
+        else
+        {
+            iLen = snprintf(szSql, sizeof(szSql),
+                "SELECT %s FROM isp_os_core.t_account "
+                "WHERE Fuid > %lld ORDER BY Fuid LIMIT %d",
+                CCoreAcct::sqlSelect(), lLastUid, m_iBatch);
+        }
+
+        m_ptrSql->Query(szSql, iLen);
+        pRes = m_ptrSql->FetchResult();
+
+        vecAcct.reserve(mysql_num_rows(pRes));
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            vecAcct.push_back(CCoreAcct());
+            vecAcct.back().parseRow(row);
+        }
+        mysql_free_result(pRes);
+
+        if(vecAcct.empty()) break;
+
+        //行签名
+        InvAcctBatch batch;
+        batch.ptrAcct = &vecAcct;
+        batch.vecBad.assign(vecAcct.size(), 0);
+        coreParallelFor(m_iThreads, vecAcct.size(), verifyAcctRange, &batch);
+
+        for(size_t i = 0; i < vecAcct.size(); ++i)
+        {
+            const CCoreAcct& acct = vecAcct[i];
+            snprintf(szKey, sizeof(szKey), "%lld", acct.Fuid);
+
+            if(batch.vecBad[i])
+            {
+                addViolation("acct_sign", szKey, "Facct_sign not match");
+            }
+            if(acct.Fcon < 0)
+            {
+                addViolation("con_negative", szKey, "Fcon < 0");
+            }
+            if(acct.Fsymbol != CCoreAcct::SYMBOL_common && acct.Fbalance - acct.Fcon < 0)
+            {
+                addViolation("overdrawn", szKey, "Fbalance - Fcon < 0");
+            }
+        }
+
+        replayFlow(vecAcct);
+
+        lLastUid = vecAcct.back().Fuid;
+        lTotal += vecAcct.size();
+
+        if((int)vecAcct.size() < m_iBatch) break;
+    }
+
+    return lTotal;
+}
+
+//回放一批账户的流水：每条流水的变动后余额等于上一条加本条发生额，最后一条等于账户余额
+void CCoreInvariant::replayFlow(const vector<CCoreAcct>& vecAcct)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    char szKey[32] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    //总账流水汇总开启时未写出的桶不在t_flow，回放与账户余额对不上
+    bool bSkipGL = CCoreGLFlow::instance()->enabled();
+
+    map<LONG, InvReplay> mapReplay;
+    for(size_t i = 0; i < vecAcct.size(); ++i)
+    {
+        if(bSkipGL && isGL(vecAcct[i].Fuid)) continue;
+
+        InvReplay& replay = mapReplay[vecAcct[i].Fuid];
+        replay.ptrAcct = &vecAcct[i];
+        replay.lBalance = 0;
+        replay.lCon = 0;
+        replay.bStarted = m_bFromZero;
+    }
+    if(mapReplay.empty()) return;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fid,Fuid,Ftype,Fpaynum,Fconnum,Fbalance,Fcon "
+        "FROM isp_os_core.t_flow "
+        "WHERE Fuid >= %lld AND Fuid <= %lld "
+        "ORDER BY Fuid,Fid",
+        vecAcct.front().Fuid, vecAcct.back().Fuid);
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        LONG lUid = row[1]? atoll(row[1]): 0;
+        map<LONG, InvReplay>::iterator it = mapReplay.find(lUid);
+        if(it == mapReplay.end()) continue;
+
+        InvReplay& replay = it->second;
+        LONG lFid = row[0]? atoll(row[0]): 0;
+        int iType = row[2]? atoi(row[2]): 0;
+        LONG lPaynum = row[3]? atoll(row[3]): 0;
+        LONG lConnum = row[4]? atoll(row[4]): 0;
+        LONG lBalance = row[5]? atoll(row[5]): 0;
+        LONG lCon = row[6]? atoll(row[6]): 0;
+
+        LONG lDeltaBalance = 0;
+        LONG lDeltaCon = 0;
+        flowDelta(iType, lPaynum, lConnum, lDeltaBalance, lDeltaCon);
+
+        //不从0回放时以第一条流水的变动前余额为起点
+        if(!replay.bStarted)
+        {
+            replay.lBalance = lBalance - lDeltaBalance;
+            replay.lCon = lCon - lDeltaCon;
+            replay.bStarted = true;
+        }
+
+        replay.lBalance += lDeltaBalance;
+        replay.lCon += lDeltaCon;
+
+        snprintf(szKey, sizeof(szKey), "%lld", lUid);
+        snprintf(szSql, sizeof(szSql), "Fid %lld", lFid);
+
+        if(replay.lBalance != lBalance || replay.lCon != lCon)
+        {
+            addViolation("flow_replay", szKey, szSql);
+            //以流水记录为准继续，避免一处不符连带后面全部报错
+            replay.lBalance = lBalance;
+            replay.lCon = lCon;
+        }
+
+        //记账过程中任何时刻都不能透支
+        if(lCon < 0)
+        {
+            addViolation("flow_con_negative", szKey, szSql);
+        }
+        if(replay.ptrAcct->Fsymbol != CCoreAcct::SYMBOL_common && lBalance - lCon < 0)
+        {
+            addViolation("flow_overdrawn", szKey, szSql);
+        }
+    }
+    mysql_free_result(pRes);
+
+    for(map<LONG, InvReplay>::iterator it = mapReplay.begin(); it != mapReplay.end(); ++it)
+    {
+        const InvReplay& replay = it->second;
+        if(!replay.bStarted) continue;
+
+        if(replay.lBalance != replay.ptrAcct->Fbalance || replay.lCon != replay.ptrAcct->Fcon)
+        {
+            snprintf(szKey, sizeof(szKey), "%lld", it->first);
+            snprintf(szSql, sizeof(szSql), "replay %lld/%lld, acct %lld/%lld",
+                replay.lBalance, replay.lCon, replay.ptrAcct->Fbalance, replay.ptrAcct->Fcon);
+            addViolation("acct_replay", szKey, szSql);
+        }
+    }
+}
+
+//检查凭证及其流水
+LONG CCoreInvariant::checkProof()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    LONG lTotal = 0;
+    string strLastListid = m_strPrefix;
+    string strPrefix = m_ptrSql->EscapeStr(m_strPrefix);
+
+    while(true)
+    {
+        vector<CCoreProof> vecProof;
+        MYSQL_RES* pRes = NULL;
+
+        int iLen = snprintf(szSql, sizeof(szSql),
+            "SELECT %s FROM isp_os_core.t_proof "
+            "WHERE Flistid > '%s' AND Flistid LIKE '%s%%' ORDER BY Flistid LIMIT %d",
+            CCoreProof::sqlSelect(), m_ptrSql->EscapeStr(strLastListid).c_str(),
+            strPrefix.c_str(), m_iBatch);
+
+        m_ptrSql->Query(szSql, iLen);
+        pRes = m_ptrSql->FetchResult();
+
+        vecProof.reserve(mysql_num_rows(pRes));
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            vecProof.push_back(CCoreProof());
+            vecProof.back().parseRow(row);
+        }
+        mysql_free_result(pRes);
+
+        if(vecProof.empty()) break;
+
+        //多方凭证签名覆盖分录，分录要先读出来
+        for(size_t i = 0; i < vecProof.size(); ++i)
+        {
+            if(vecProof[i].Fleg_num > 0) vecProof[i].queryLegs();
+        }
+
+        InvProofBatch batch;
+        batch.ptrProof = &vecProof;
+        batch.vecBad.assign(vecProof.size(), 0);
+        coreParallelFor(m_iThreads, vecProof.size(), verifyProofRange, &batch);
+
+        for(size_t i = 0; i < vecProof.size(); ++i)
+        {
+            if(batch.vecBad[i]) addViolation("proof_sign", vecProof[i].Flistid, "Fproof_sign not match");
+        }
+
+        checkProofFlow(vecProof);
+
+        strLastListid = vecProof.back().Flistid;
+        lTotal += vecProof.size();
+
+        if((int)vecProof.size() < m_iBatch) break;
+    }
+
+    return lTotal;
+}
+
+//核对一批凭证的流水，按借贷两侧的账户归集
+void CCoreInvariant::checkProofFlow(const vector<CCoreProof>& vecProof)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    //账户属于哪一侧：1借方，2贷方，4总账，其他为同一账户出现在多处（无法归集，不核对两侧）
+    map<string, map<LONG, int> > mapSide;
+    map<string, ProofFlow> mapFlow;
+
+    for(size_t i = 0; i < vecProof.size(); ++i)
+    {
+        const CCoreProof& proof = vecProof[i];
+        map<LONG, int>& side = mapSide[proof.Flistid];
+
+        if(proof.Fleg_num > 0)
+        {
+            for(size_t j = 0; j < proof.Flegs.size(); ++j)
+            {
+                side[proof.Flegs[j].Fuid] |= (proof.Flegs[j].Fdirection == OP_debit)? 1: 2;
+                side[proof.Flegs[j].Fgl_uid] |= 4;
+            }
+        }
+        else
+        {
+            side[proof.Fdebit_uid] |= 1;
+            side[proof.Fcredit_uid] |= 2;
+            if(proof.Fdebit_ex_amount != 0) side[proof.Fdebit_ex_uid] |= 1;
+            if(proof.Fcredit_ex_amount != 0) side[proof.Fcredit_ex_uid] |= 2;
+            side[proof.Fdebit_gl_uid] |= 4;
+            side[proof.Fcredit_gl_uid] |= 4;
+            if(proof.Fdebit_ex_amount != 0) side[proof.Fdebit_exgl_uid] |= 4;
+            if(proof.Fcredit_ex_amount != 0) side[proof.Fcredit_exgl_uid] |= 4;
+        }
+
+        ProofFlow& flow = mapFlow[proof.Flistid];
+        flow.lDebitPay = 0;
+        flow.lCreditPay = 0;
+        flow.lDebitCon = 0;
+        flow.lCreditCon = 0;
+        flow.iFlow = 0;
+        flow.bMixed = false;
+        for(map<LONG, int>::const_iterator it = side.begin(); it != side.end(); ++it)
+        {
+            if(it->second != 1 && it->second != 2 && it->second != 4) flow.bMixed = true;
+        }
+    }
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Flistid,Fuid,Ftype,Fpaynum,Fconnum "
+        "FROM isp_os_core.t_flow "
+        "WHERE Flistid >= '%s' AND Flistid <= '%s'",
+        m_ptrSql->EscapeStr(vecProof.front().Flistid).c_str(),
+        m_ptrSql->EscapeStr(vecProof.back().Flistid).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        string strListid = row[0]? row[0]: "";
+        map<string, ProofFlow>::iterator it = mapFlow.find(strListid);
+        if(it == mapFlow.end()) continue;
+
+        ProofFlow& flow = it->second;
+        flow.iFlow++;
+
+        LONG lUid = row[1]? atoll(row[1]): 0;
+        if(isGL(lUid)) continue;
+
+        int iType = row[2]? atoi(row[2]): 0;
+        LONG lPaynum = row[3]? atoll(row[3]): 0;
+        LONG lConnum = row[4]? atoll(row[4]): 0;
+
+        LONG lDeltaBalance = 0;
+        LONG lDeltaCon = 0;
+        flowDelta(iType, lPaynum, lConnum, lDeltaBalance, lDeltaCon);
+
+        int iSide = mapSide[strListid][lUid];
+        if(iSide == 1)
+        {
+            flow.lDebitPay += lPaynum;
+            flow.lDebitCon += lDeltaCon;
+        }
+        else if(iSide == 2)
+        {
+            flow.lCreditPay += lPaynum;
+            flow.lCreditCon += lDeltaCon;
+        }
+        else if(iSide == 0)
+        {
+            addViolation("flow_stray", strListid, "flow on account not in proof");
+        }
+    }
+    mysql_free_result(pRes);
+
+    for(size_t i = 0; i < vecProof.size(); ++i)
+    {
+        checkOneProof(vecProof[i], mapFlow[vecProof[i].Flistid]);
+    }
+}
+
+//核对一张凭证
+void CCoreInvariant::checkOneProof(const CCoreProof& proof, const ProofFlow& flow)
+{
+    char szDetail[MAX_MSG_LEN] = {0};
+
+    //未完成的凭证（含失败重入前）不能留下任何流水
+    if(proof.Fstate != CCoreProof::STATE_after)
+    {
+        if(flow.iFlow > 0)
+        {
+            snprintf(szDetail, sizeof(szDetail), "%d flows before complete", flow.iFlow);
+            addViolation("partial_effect", proof.Flistid, szDetail);
+        }
+        return;
+    }
+
+    //凭证借贷金额
+    LONG lDebit = proof.Fdebit_amount + proof.Fdebit_ex_amount;
+    LONG lCredit = proof.Fcredit_amount + proof.Fcredit_ex_amount;
+    if(proof.Fleg_num > 0)
+    {
+        lDebit = lCredit = 0;
+        for(size_t i = 0; i < proof.Flegs.size(); ++i)
+        {
+            if(proof.Flegs[i].Fdirection == OP_debit) lDebit += proof.Flegs[i].Famount;
+            else lCredit += proof.Flegs[i].Famount;
+        }
+    }
+
+    if(proof.Ftype == CCoreProof::TYPE_direct)
+    {
+        if(lDebit != lCredit)
+        {
+            snprintf(szDetail, sizeof(szDetail), "debit %lld, credit %lld", lDebit, lCredit);
+            addViolation("proof_unbalanced", proof.Flistid, szDetail);
+        }
+        if(!flow.bMixed && (flow.lDebitPay != lDebit || flow.lCreditPay != lCredit))
+        {
+            snprintf(szDetail, sizeof(szDetail), "flow debit %lld, credit %lld, proof %lld/%lld",
+                flow.lDebitPay, flow.lCreditPay, lDebit, lCredit);
+            addViolation("flow_not_match", proof.Flistid, szDetail);
+        }
+        return;
+    }
+
+    //两侧有同一账户时只核对凭证本身
+    if(flow.bMixed) return;
+
+    //冻结类凭证：两侧解冻入账的金额相同
+    if(proof.Fdebit_amount == proof.Fcredit_amount && flow.lDebitPay != flow.lCreditPay)
+    {
+        snprintf(szDetail, sizeof(szDetail), "flow debit %lld, credit %lld", flow.lDebitPay, flow.lCreditPay);
+        addViolation("flow_unbalanced", proof.Flistid, szDetail);
+    }
+
+    //剩余冻结金额：冻结完成时等于借方净冻结，解冻完成后两侧净冻结为0
+    if(proof.Ftype == CCoreProof::TYPE_freeze && proof.Fdebit_amount > 0 && flow.lDebitCon != proof.Fcon_remain)
+    {
+        snprintf(szDetail, sizeof(szDetail), "debit frozen %lld, Fcon_remain %lld", flow.lDebitCon, proof.Fcon_remain);
+        addViolation("con_remain", proof.Flistid, szDetail);
+    }
+    if(proof.Ftype != CCoreProof::TYPE_freeze
+        && ((proof.Fdebit_amount > 0 && flow.lDebitCon != 0) || (proof.Fcredit_amount > 0 && flow.lCreditCon != 0)))
+    {
+        snprintf(szDetail, sizeof(szDetail), "frozen left debit %lld, credit %lld", flow.lDebitCon, flow.lCreditCon);
+        addViolation("con_remain", proof.Flistid, szDetail);
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef _CORE_INVARIANT_H_
+#define _CORE_INVARIANT_H_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+
+/*
+ * 账务不变式检查
+ * 按Fuid/Flistid分批读t_account、t_proof、t_flow，逐项核对：
+ *   账户：Fcon不为负，非共有类账户可用余额不为负（每条流水的变动后余额也要满足），
+ *         按Fid顺序回放流水与流水记录的变动后余额一致，最后一条与t_account一致，行签名正确
+ *   凭证：直接记账借贷相等，借贷两侧流水发生额与凭证一致，
+ *         冻结类凭证剩余冻结金额与流水一致，未完成的凭证没有流水，行签名正确
+ * 用于压测、模糊测试后核对账务，须在没有记账进行时运行；
+ * 跨分片在途凭证须先恢复完再检查
+ */
+class CCoreInvariant
+{
+public:
+    //违反的不变式
+    struct Violation
+    {
+        string strRule;   //规则名
+        string strKey;    //Fuid或Flistid
+        string strDetail; //说明
+    };
+
+    //构造函数
+    CCoreInvariant();
+
+    //析构函数
+    ~CCoreInvariant();
+
+    //检查账户及其流水，返回检查的账户数
+    LONG checkAcct();
+
+    //检查凭证及其流水，返回检查的凭证数
+    LONG checkProof();
+
+    //全部检查，返回是否没有违反
+    bool checkAll();
+
+    //记录一条违反
+    void addViolation(const string& strRule, const string& strKey, const string& strDetail);
+
+    //设置检查范围，lEnd为0不限上界
+    void setUidRange(const LONG lBegin, const LONG lEnd) { m_lUidBegin = lBegin; m_lUidEnd = lEnd; }
+    void setListidPrefix(const string& strPrefix) { m_strPrefix = strPrefix; }
+
+    //总账账户不参与凭证借贷两侧核对，开启总账流水汇总时也不回放流水
+    void setGLUids(const vector<LONG>& vecUid) { m_setGL.clear(); m_setGL.insert(vecUid.begin(), vecUid.end()); }
+
+    //账户开户余额为0，回放从0开始；否则以第一条流水的变动前余额为起点
+    void setFromZero(const bool bFromZero) { m_bFromZero = bFromZero; }
+
+    //设置参数
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setBatch(const int iBatch) { m_iBatch = iBatch; }
+
+public:
+    vector<Violation> m_vecViolation; //本次发现
+
+protected:
+    //一个凭证在流水中的借贷两侧合计
+    struct ProofFlow
+    {
+        LONG lDebitPay;   //借方发生额
+        LONG lCreditPay;  //贷方发生额
+        LONG lDebitCon;   //借方净冻结
+        LONG lCreditCon;  //贷方净冻结
+        int iFlow;        //流水条数
+        bool bMixed;      //同一账户出现在多处，无法按侧归集
+    };
+
+    //回放一批账户的流水
+    void replayFlow(const vector<CCoreAcct>& vecAcct);
+    //核对一批凭证的流水
+    void checkProofFlow(const vector<CCoreProof>& vecProof);
+    //核对一张凭证
+    void checkOneProof(const CCoreProof& proof, const ProofFlow& flow);
+    //是否总账账户
+    bool isGL(const LONG uid) const { return m_setGL.count(uid) > 0; }
+
+protected:
+    CMySQL* m_ptrSql; //数据库句柄
+    LONG m_lUidBegin;
+    LONG m_lUidEnd;
+    string m_strPrefix;
+    set<LONG> m_setGL;
+    bool m_bFromZero;
+    int m_iThreads;
+    int m_iBatch;
+};
+
+#endif
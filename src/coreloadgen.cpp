@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include "coreloadgen.h"
+#include "corewire.h"
+#include "core.h"
+#include "coreerror.h"
+#include "common.h"
+
+using namespace CCoreWire;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+/*****************
+ * 记账服务压测客户端 *
+******************/
+
+// 构造函数
+CCoreLoadGen::CCoreLoadGen()
+{
+    m_iThreads = 8;
+    m_iDepth = 8;
+    m_iCount = 10000;
+    m_lUidBegin = 0;
+    m_lUidEnd = 0;
+    m_lDebitGL = 0;
+    m_lCreditGL = 0;
+    m_lAmount = 1;
+    m_strCur = "CNY";
+    m_iSubject = 0;
+    m_lRunId = 0;
+}
+
+//执行压测
+void CCoreLoadGen::run(Stat& stat)
+{
+    if(m_lUidEnd - m_lUidBegin < 2 || m_iThreads <= 0 || m_iDepth <= 0)
+    {
+        throw CException(ERR_BAD_BRANCH, "core loadgen: bad uid range or threads", __FILE__, __LINE__);
+    }
+
+    m_lRunId = nowUs() ^ getpid();
+
+    vector<Worker> vecWorker(m_iThreads);
+    vector<pthread_t> vecThread(m_iThreads);
+    LONG lStartUs = nowUs();
+
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        vecWorker[i].ptrGen = this;
+        vecWorker[i].iIndex = i;
+        vecWorker[i].lOk = 0;
+        vecWorker[i].lFail = 0;
+        if(0 != pthread_create(&vecThread[i], NULL, threadMain, &vecWorker[i]))
+        {
+            throw CException(ERR_BAD_BRANCH, "core loadgen: create thread failed", __FILE__, __LINE__);
+        }
+    }
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        pthread_join(vecThread[i], NULL);
+    }
+
+    memset(&stat, 0, sizeof(stat));
+    stat.lUs = nowUs() - lStartUs;
+
+    vector<LONG> vecLatency;
+    for(int i = 0; i < m_iThreads; ++i)
+    {
+        if(!vecWorker[i].strError.empty())
+        {
+            throw CException(ERR_CORE_IO, "core loadgen: " + vecWorker[i].strError, __FILE__, __LINE__);
+        }
+        stat.lOk += vecWorker[i].lOk;
+        stat.lFail += vecWorker[i].lFail;
+        vecLatency.insert(vecLatency.end(), vecWorker[i].vecLatency.begin(), vecWorker[i].vecLatency.end());
+    }
+    stat.lSent = stat.lOk + stat.lFail;
+
+    if(!vecLatency.empty())
+    {
+        sort(vecLatency.begin(), vecLatency.end());
+        stat.lP50Us = vecLatency[vecLatency.size() / 2];
+        stat.lP99Us = vecLatency[vecLatency.size() * 99 / 100];
+        stat.lMaxUs = vecLatency.back();
+    }
+    stat.dTps = stat.lUs > 0? stat.lOk * 1000000.0 / stat.lUs: 0;
+}
+
+//线程入口
+void* CCoreLoadGen::threadMain(void* ptrArg)
+{
+    Worker& worker = *(Worker*)ptrArg;
+
+    try
+    {
+        worker.ptrGen->runWorker(worker);
+    }
+    catch(CException& e)
+    {
+        worker.strError = e.what();
+    }
+    return NULL;
+}
+
+//一个线程的压测：保持iDepth个在途请求，应答按发送顺序返回
+void CCoreLoadGen::runWorker(Worker& worker)
+{
+    CCoreWireClient client;
+    client.open(m_strAddr);
+
+    unsigned int iSeed = (unsigned int)m_lRunId ^ (worker.iIndex * 2654435761u);
+    deque<LONG> deqStart;
+    string strReq;
+    string strResp;
+    int iSent = 0;
+
+    worker.vecLatency.reserve(m_iCount);
+
+    while(iSent < m_iCount || !deqStart.empty())
+    {
+        //补满流水线，一次写出
+        strReq.clear();
+        while(iSent < m_iCount && (int)deqStart.size() < m_iDepth)
+        {
+            genRequest(worker, iSent, iSeed, strReq);
+            deqStart.push_back(nowUs());
+            iSent++;
+        }
+        if(!strReq.empty())
+        {
+            CCoreWireClient::writeAll(client.fd(), strReq.data(), strReq.length());
+        }
+
+        if(!CCoreWireClient::readFrame(client.fd(), KIND_response, strResp))
+        {
+            throw CException(ERR_CORE_IO, "core loadgen: closed by server", __FILE__, __LINE__);
+        }
+
+        int iError = 0;
+        string strMsg;
+        CCoreWireCodec::parseResult(strResp.data(), strResp.length(), iError, strMsg);
+
+        worker.vecLatency.push_back(nowUs() - deqStart.front());
+        deqStart.pop_front();
+        if(0 == iError)
+        {
+            worker.lOk++;
+        }
+        else
+        {
+            worker.lFail++;
+        }
+    }
+}
+
+//生成第iSeq个请求，借贷双方随机且不同
+void CCoreLoadGen::genRequest(Worker& worker, const int iSeq, unsigned int& iSeed, string& strReq)
+{
+    char szBuf[64] = {0};
+    LONG lRange = m_lUidEnd - m_lUidBegin;
+    LONG lDebit = m_lUidBegin + rand_r(&iSeed) % lRange;
+    LONG lCredit = m_lUidBegin + (lDebit - m_lUidBegin + 1 + rand_r(&iSeed) % (lRange - 1)) % lRange;
+
+    int arrInt[I_NUM] = {0};
+    LONG arrLong[L_NUM] = {0};
+    string arrStr[S_NUM];
+
+    arrInt[I_subject] = m_iSubject;
+    arrInt[I_type] = CCoreProof::TYPE_direct;
+    arrInt[I_rolenum] = 2;
+
+    arrLong[L_totalnum] = m_lAmount;
+    arrLong[L_debit_uid] = lDebit;
+    arrLong[L_debit_amount] = m_lAmount;
+    arrLong[L_credit_uid] = lCredit;
+    arrLong[L_credit_amount] = m_lAmount;
+    arrLong[L_debit_gl_uid] = m_lDebitGL;
+    arrLong[L_credit_gl_uid] = m_lCreditGL;
+
+    snprintf(szBuf, sizeof(szBuf), "LG%lld%03d%09d", m_lRunId % 1000000000LL, worker.iIndex, iSeq);
+    arrStr[S_listid] = szBuf;
+    arrStr[S_outter_prove] = szBuf;
+    arrStr[S_cur_type] = m_strCur;
+    arrStr[S_ip] = "127.0.0.1";
+    arrStr[S_memo] = "loadgen";
+
+    snprintf(szBuf, sizeof(szBuf), "%lld", lDebit);
+    arrStr[S_debit_uin] = szBuf;
+    snprintf(szBuf, sizeof(szBuf), "%lld", lCredit);
+    arrStr[S_credit_uin] = szBuf;
+    snprintf(szBuf, sizeof(szBuf), "%lld", m_lDebitGL);
+    arrStr[S_debit_gl_uin] = szBuf;
+    snprintf(szBuf, sizeof(szBuf), "%lld", m_lCreditGL);
+    arrStr[S_credit_gl_uin] = szBuf;
+
+    CCoreWireCodec::encodeRequest(arrInt, arrLong, arrStr, vector<CCoreProofLeg>(), strReq);
+}
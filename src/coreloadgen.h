@@ -0,0 +1,84 @@
+#ifndef _CORE_LOAD_GEN_H_
+#define _CORE_LOAD_GEN_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+
+/*
+ * 记账服务压测客户端
+ * 多个线程各开一个连接，按流水线深度连续发送直接记账凭证，统计端到端吞吐和时延
+ * 借贷账户在[lUidBegin, lUidEnd)内随机挑选，总账固定，账户需预先开好（可用CCoreAcctLoader）
+ * 对比批量写：服务端分别以CCorePipeline::setBatch(false)/setBatch(true)启动，用相同参数各跑一次，
+ * 比较dTps、lP50Us，以及服务端CCorePipeline::getStat()的lStmt/lFlush（每事务写语句数）
+ */
+class CCoreLoadGen
+{
+public:
+    //压测结果
+    struct Stat
+    {
+        LONG lSent;     //发出的请求数
+        LONG lOk;       //成功数
+        LONG lFail;     //失败数（含余额不足等业务错误）
+        LONG lUs;       //总耗时
+        LONG lP50Us;    //时延中位数
+        LONG lP99Us;    //99分位时延
+        LONG lMaxUs;    //最大时延
+        double dTps;    //每秒成功笔数
+    };
+
+    //构造函数
+    CCoreLoadGen();
+
+    //执行压测，出错（如连接失败）抛异常
+    void run(Stat& stat);
+
+    //设置参数
+    void setAddr(const string& strAddr) { m_strAddr = strAddr; }
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setPipeline(const int iDepth) { m_iDepth = iDepth; }
+    void setCount(const int iPerThread) { m_iCount = iPerThread; }
+    void setUidRange(const LONG lBegin, const LONG lEnd) { m_lUidBegin = lBegin; m_lUidEnd = lEnd; }
+    void setGL(const LONG lDebitGL, const LONG lCreditGL) { m_lDebitGL = lDebitGL; m_lCreditGL = lCreditGL; }
+    void setAmount(const LONG lAmount) { m_lAmount = lAmount; }
+    void setCurType(const string& strCur) { m_strCur = strCur; }
+    void setSubject(const int iSubject) { m_iSubject = iSubject; }
+
+protected:
+    //一个压测线程的结果
+    struct Worker
+    {
+        CCoreLoadGen* ptrGen;
+        int iIndex;
+        LONG lOk;
+        LONG lFail;
+        vector<LONG> vecLatency;
+        string strError; //非空表示线程异常退出
+    };
+
+    //线程入口
+    static void* threadMain(void* ptrArg);
+    //一个线程的压测
+    void runWorker(Worker& worker);
+    //生成第iSeq个请求
+    void genRequest(Worker& worker, const int iSeq, unsigned int& iSeed, string& strReq);
+
+protected:
+    string m_strAddr;
+    int m_iThreads;
+    int m_iDepth;
+    int m_iCount;
+    LONG m_lUidBegin;
+    LONG m_lUidEnd;
+    LONG m_lDebitGL;
+    LONG m_lCreditGL;
+    LONG m_lAmount;
+    string m_strCur;
+    int m_iSubject;
+    LONG m_lRunId; //本次压测标识，拼进Flistid避免与上次重复
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include <unistd.h>
+#include <string.h>
+#include "corerecovery.h"
+#include "corethread.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//一批待推进的凭证
+struct RedriveBatch
+{
+    CCoreRecovery* ptrRecovery;
+    vector<CCoreProof>* ptrProof;
+};
+
+/*****************
+ * 滞留凭证恢复 *
+******************/
+
+// 构造函数
+CCoreRecovery::CCoreRecovery()
+{
+    memset(&m_stat, 0, sizeof(m_stat));
+    m_iTimeout = 60;
+    m_iBatch = 100;
+    m_iThreads = 4;
+    m_iMaxAttempt = 5;
+    m_iPauseMs = 100;
+    m_iIntervalSec = 10;
+    m_bStop = false;
+    m_bRunning = false;
+
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreRecovery::~CCoreRecovery()
+{
+    stop();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//扫描全部扫描源一轮
+LONG CCoreRecovery::runOnce()
+{
+    //没有连接池时各线程会退回同一个全局句柄
+    if(m_iThreads > 1 && !CCoreDBPool::instance()->inited())
+    {
+        throw CException(ERR_BAD_BRANCH, "core recovery: init db pool before running with threads", __FILE__, __LINE__);
+    }
+
+    LONG lStartUs = nowUs();
+    LONG lBacklog = 0;
+    LONG lOldestSec = 0;
+
+    pthread_mutex_lock(&m_mutex);
+    LONG lRedrive = m_stat.lRedrive;
+    m_setSeen.clear();
+    pthread_mutex_unlock(&m_mutex);
+
+    if(m_vecSource.empty())
+    {
+        scanSource(NULL, lBacklog, lOldestSec);
+    }
+    for(size_t i = 0; i < m_vecSource.size() && !m_bStop; ++i)
+    {
+        scanSource(m_vecSource[i], lBacklog, lOldestSec);
+    }
+
+    pthread_mutex_lock(&m_mutex);
+
+    //已经不再滞留的凭证不再跟踪
+    for(map<string, int>::iterator it = m_mapFail.begin(); it != m_mapFail.end(); )
+    {
+        if(m_setSeen.find(it->first) == m_setSeen.end())
+        {
+            m_mapFail.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    m_stat.lGiveUp = 0;
+    for(map<string, int>::iterator it = m_mapFail.begin(); it != m_mapFail.end(); ++it)
+    {
+        if(it->second >= m_iMaxAttempt) m_stat.lGiveUp++;
+    }
+
+    m_stat.lPass++;
+    m_stat.lBacklog = lBacklog;
+    m_stat.lOldestSec = lOldestSec;
+    m_stat.lPassUs = nowUs() - lStartUs;
+    lRedrive = m_stat.lRedrive - lRedrive;
+
+    pthread_mutex_unlock(&m_mutex);
+
+    return lRedrive;
+}
+
+//扫描一个扫描源，按(Fcreate_time, Flistid)游标分批
+void CCoreRecovery::scanSource(CCoreDBPool* ptrPool, LONG& lBacklog, LONG& lOldestSec)
+{
+    CCoreDBLease lease(ptrPool, ptrPool != NULL);
+    CMySQL* ptrSql = lease.handle();
+
+    char szSql[MAX_SQL_LEN] = {0};
+    string strLastTime;
+    string strLastListid;
+
+    while(!m_bStop)
+    {
+        MYSQL_RES* pRes = NULL;
+
+        int iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "SELECT TIMESTAMPDIFF(SECOND, Fcreate_time, now()),%s "
+            "FROM isp_os_core.t_proof "
+            "WHERE Fstate = %d AND Frecord_state = 1 "
+            "AND Fcreate_time < DATE_SUB(now(), INTERVAL %d SECOND) "
+            "AND (Fcreate_time > '%s' OR (Fcreate_time = '%s' AND Flistid > '%s')) "
+            "AND NOT EXISTS (SELECT 1 FROM isp_os_core.t_proof_reject r WHERE r.Flistid = t_proof.Flistid) "
+            "ORDER BY Fcreate_time, Flistid LIMIT %d",
+            CCoreProof::sqlSelect(),
+            CCoreProof::STATE_before,
+            m_iTimeout,
+            ptrSql->EscapeStr(strLastTime).c_str(),
+            ptrSql->EscapeStr(strLastTime).c_str(),
+            ptrSql->EscapeStr(strLastListid).c_str(),
+            m_iBatch);
+
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
+
+        vector<CCoreProof> vecProof;
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            LONG lAgeSec = row[0]? atoll(row[0]): 0;
+            if(lAgeSec > lOldestSec) lOldestSec = lAgeSec;
+
+            vecProof.push_back(CCoreProof());
+            vecProof.back().parseRow(row + 1);
+        }
+        mysql_free_result(pRes);
+
+        if(vecProof.empty()) break;
+
+        lBacklog += vecProof.size();
+        strLastTime = vecProof.back().Fcreate_time;
+        strLastListid = vecProof.back().Flistid;
+
+        //多方凭证的分录在扫描连接上读出，推进时按分录路由
+        for(size_t i = 0; i < vecProof.size(); ++i)
+        {
+            if(vecProof[i].Fleg_num > 0)
+            {
+                vecProof[i].setDBHandle(ptrSql);
+                vecProof[i].queryLegs();
+            }
+        }
+
+        redriveBatch(vecProof);
+
+        if((int)vecProof.size() < m_iBatch) break;
+
+        //批间停顿，摊开恢复压力
+        usleep(m_iPauseMs * 1000);
+    }
+}
+
+//推进一批凭证，跳过失败次数达到上限的
+void CCoreRecovery::redriveBatch(vector<CCoreProof>& vecProof)
+{
+    vector<CCoreProof> vecTodo;
+
+    pthread_mutex_lock(&m_mutex);
+    for(size_t i = 0; i < vecProof.size(); ++i)
+    {
+        m_setSeen.insert(vecProof[i].Flistid);
+
+        map<string, int>::iterator it = m_mapFail.find(vecProof[i].Flistid);
+        if(it != m_mapFail.end() && it->second >= m_iMaxAttempt) continue;
+
+        vecTodo.push_back(vecProof[i]);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    RedriveBatch batch = {this, &vecTodo};
+    coreParallelFor(m_iThreads, vecTodo.size(), redriveRange, &batch);
+}
+
+//并行推进，每个线程按凭证路由租用自己的连接
+void CCoreRecovery::redriveRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    RedriveBatch& batch = *(RedriveBatch*)ptrCtx;
+    vector<CCoreProof>& vecProof = *batch.ptrProof;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        bool bOK = true;
+        try
+        {
+            CCore core;
+            core.redriveProof(vecProof[i]);
+        }
+        catch(CException& e)
+        {
+            bOK = false;
+        }
+        batch.ptrRecovery->onResult(vecProof[i].Flistid, bOK);
+    }
+}
+
+//记录推进结果
+void CCoreRecovery::onResult(const string& strListid, const bool bOK)
+{
+    pthread_mutex_lock(&m_mutex);
+    if(bOK)
+    {
+        m_stat.lRedrive++;
+        m_mapFail.erase(strListid);
+    }
+    else
+    {
+        m_stat.lFail++;
+        m_mapFail[strListid]++;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//获取统计
+void CCoreRecovery::getStat(Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//后台线程
+void* CCoreRecovery::threadMain(void* ptrArg)
+{
+    CCoreRecovery* ptrThis = (CCoreRecovery*)ptrArg;
+
+    while(!ptrThis->m_bStop)
+    {
+        try
+        {
+            ptrThis->runOnce();
+        }
+        catch(CException& e)
+        {
+            //扫描失败（如连接断开）下一轮重试
+        }
+
+        for(int i = 0; i < ptrThis->m_iIntervalSec * 10 && !ptrThis->m_bStop; ++i)
+        {
+            usleep(100000);
+        }
+    }
+
+    return NULL;
+}
+
+//启动后台线程
+void CCoreRecovery::start(const int iIntervalSec)
+{
+    if(m_bRunning) return;
+    if(m_iThreads > 1 && !CCoreDBPool::instance()->inited())
+    {
+        throw CException(ERR_BAD_BRANCH, "core recovery: init db pool before running with threads", __FILE__, __LINE__);
+    }
+
+    m_iIntervalSec = iIntervalSec;
+    m_bStop = false;
+    if(0 != pthread_create(&m_thread, NULL, threadMain, this))
+    {
+        throw CException(ERR_BAD_BRANCH, "core recovery: create thread failed", __FILE__, __LINE__);
+    }
+    m_bRunning = true;
+}
+
+//停止后台线程
+void CCoreRecovery::stop()
+{
+    if(!m_bRunning) return;
+
+    m_bStop = true;
+    pthread_join(m_thread, NULL);
+    m_bRunning = false;
+}
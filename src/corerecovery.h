@@ -0,0 +1,94 @@
+#ifndef _CORE_RECOVERY_H_
+#define _CORE_RECOVERY_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+#include "core.h"
+
+/*
+ * 滞留凭证恢复
+ * 进程在saveProof与记账提交之间退出时，凭证停在STATE_before，
+ * 后台按(Fstate, Fcreate_time)索引区间扫描超时凭证，分批有限并发地重走dealProof，
+ * 记账失败已应答调用方的凭证（t_proof_reject有记录）不是滞留，不推进，否则会记下调用方认为已拒绝的账；
+ * 把恢复成本摊到平时，而不是集中在上游重试时
+ * 连续失败达到上限的凭证本进程不再推进，等上游处理
+ */
+class CCoreRecovery
+{
+public:
+    //恢复统计
+    struct Stat
+    {
+        LONG lPass;        //完成的扫描轮数
+        LONG lBacklog;     //上一轮发现的超时凭证数
+        LONG lOldestSec;   //上一轮最老凭证的滞留秒数
+        LONG lRedrive;     //累计推进成功数
+        LONG lFail;        //累计推进失败数
+        LONG lGiveUp;      //当前放弃推进的凭证数
+        LONG lPassUs;      //上一轮耗时
+    };
+
+    //构造函数
+    CCoreRecovery();
+
+    //析构函数
+    ~CCoreRecovery();
+
+    //添加扫描源，分片或分币种部署时每个实例一个；不添加时扫描当前连接
+    void addSource(CCoreDBPool* ptrPool) { m_vecSource.push_back(ptrPool); }
+
+    //扫描全部扫描源一轮，返回推进成功数
+    LONG runOnce();
+
+    //启动后台线程，每轮间隔iIntervalSec秒
+    void start(const int iIntervalSec);
+
+    //停止后台线程
+    void stop();
+
+    //获取统计
+    void getStat(Stat& stat);
+
+    //设置参数，并发推进（iThreads > 1）必须先初始化默认连接池
+    void setTimeout(const int iSec) { m_iTimeout = iSec; }
+    void setBatch(const int iBatch) { m_iBatch = iBatch; }
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setMaxAttempt(const int iAttempt) { m_iMaxAttempt = iAttempt; }
+    void setBatchPause(const int iMs) { m_iPauseMs = iMs; }
+
+protected:
+    //扫描一个扫描源
+    void scanSource(CCoreDBPool* ptrPool, LONG& lBacklog, LONG& lOldestSec);
+    //推进一批凭证
+    void redriveBatch(vector<CCoreProof>& vecProof);
+    //记录推进结果
+    void onResult(const string& strListid, const bool bOK);
+    //并行推进[iBegin, iEnd)
+    static void redriveRange(void* ptrCtx, size_t iBegin, size_t iEnd);
+    //后台线程
+    static void* threadMain(void* ptrArg);
+
+protected:
+    vector<CCoreDBPool*> m_vecSource;
+    map<string, int> m_mapFail;   //凭证连续失败次数
+    set<string> m_setSeen;        //本轮扫到的凭证
+    Stat m_stat;
+    int m_iTimeout;
+    int m_iBatch;
+    int m_iThreads;
+    int m_iMaxAttempt;
+    int m_iPauseMs;
+    int m_iIntervalSec;
+    volatile bool m_bStop;
+    bool m_bRunning;
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+};
+
+#endif
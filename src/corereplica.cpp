@@ -0,0 +1,259 @@
+#include <exception>
+#include <string.h>
+#include "corereplica.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//本线程最近一次提交写入的时间
+static __thread LONG t_lWriteUs = 0;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+/*****************
+ * 从库读路由 *
+******************/
+
+// 构造函数
+CCoreReplicaRouter::CCoreReplicaRouter()
+{
+    m_lMaxLagUs = 1000000;
+    m_iNext = 0;
+    memset(&m_stat, 0, sizeof(m_stat));
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+//析构函数
+CCoreReplicaRouter::~CCoreReplicaRouter()
+{
+    for(map<CCoreDBPool*, vector<Replica> >::iterator it = m_mapReplica.begin(); it != m_mapReplica.end(); ++it)
+    {
+        for(size_t i = 0; i < it->second.size(); ++i)
+        {
+            delete it->second[i].ptrPool;
+        }
+    }
+    m_mapReplica.clear();
+
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//全局路由
+CCoreReplicaRouter* CCoreReplicaRouter::instance()
+{
+    static CCoreReplicaRouter router;
+    return &router;
+}
+
+//添加从库
+void CCoreReplicaRouter::addReplica(CoreDBFactory factory, const int iMaxSize, const int iWarmUp, CCoreDBPool* ptrPrimary)
+{
+    Replica replica;
+    replica.ptrPool = new CCoreDBPool();
+    replica.lLagUs = 0;
+    replica.lMeasureUs = 0;
+
+    try
+    {
+        replica.ptrPool->init(factory, iMaxSize, iWarmUp);
+    }
+    catch(CException& e)
+    {
+        delete replica.ptrPool;
+        throw;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_mapReplica[ptrPrimary? ptrPrimary: CCoreDBPool::instance()].push_back(replica);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//是否配置了从库
+bool CCoreReplicaRouter::enabled()
+{
+    pthread_mutex_lock(&m_mutex);
+    bool bEnabled = !m_mapReplica.empty();
+    pthread_mutex_unlock(&m_mutex);
+
+    return bEnabled;
+}
+
+//选一个延迟在上限内的从库
+CCoreDBPool* CCoreReplicaRouter::pick(CCoreDBPool* ptrPrimary)
+{
+    LONG lNow = nowUs();
+
+    //读自己的写
+    if(t_lWriteUs > 0 && lNow - t_lWriteUs < m_lMaxLagUs) return NULL;
+
+    CCoreDBPool* ptrPool = NULL;
+
+    pthread_mutex_lock(&m_mutex);
+    map<CCoreDBPool*, vector<Replica> >::iterator it = m_mapReplica.find(ptrPrimary);
+    if(it != m_mapReplica.end())
+    {
+        vector<Replica>& vecReplica = it->second;
+        for(size_t i = 0; i < vecReplica.size() && NULL == ptrPool; ++i)
+        {
+            Replica& replica = vecReplica[(m_iNext + i) % vecReplica.size()];
+
+            //距上次测量的时间也算进延迟，测量停了从库自然下线
+            if(replica.lMeasureUs > 0 && replica.lLagUs + (lNow - replica.lMeasureUs) <= m_lMaxLagUs)
+            {
+                ptrPool = replica.ptrPool;
+            }
+        }
+        m_iNext++;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return ptrPool;
+}
+
+//各主库写心跳，并测量其从库延迟
+void CCoreReplicaRouter::refreshLag()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    //锁内只取出主从对应关系，读写库在锁外；从库只增不删，下标不变
+    map<CCoreDBPool*, vector<CCoreDBPool*> > mapPool;
+    pthread_mutex_lock(&m_mutex);
+    for(map<CCoreDBPool*, vector<Replica> >::iterator it = m_mapReplica.begin(); it != m_mapReplica.end(); ++it)
+    {
+        for(size_t i = 0; i < it->second.size(); ++i)
+        {
+            mapPool[it->first].push_back(it->second[i].ptrPool);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    for(map<CCoreDBPool*, vector<CCoreDBPool*> >::iterator it = mapPool.begin(); it != mapPool.end(); ++it)
+    {
+        //心跳写在各自分区的主库，经复制到达它的从库
+        try
+        {
+            CCoreDBLease lease(it->first, true);
+            int iLen = snprintf(szSql, sizeof(szSql) - 1,
+                "REPLACE INTO isp_os_core.t_heartbeat (Fid,Fbeat_us) VALUES (1,%lld)", nowUs());
+            lease.handle()->Query(szSql, iLen);
+        }
+        catch(CException& e)
+        {
+            //主库写不了心跳，从库延迟测不准，停止测量后自然下线
+            continue;
+        }
+
+        for(size_t i = 0; i < it->second.size(); ++i)
+        {
+            LONG lBeatUs = 0;
+            bool bOK = false;
+
+            try
+            {
+                CCoreDBPool* ptrPool = it->second[i];
+                CMySQL* ptrSql = ptrPool->acquire();
+                LONG lStart = nowUs();
+                try
+                {
+                    const char* szQuery = "SELECT Fbeat_us FROM isp_os_core.t_heartbeat WHERE Fid = 1";
+                    ptrSql->Query(szQuery, strlen(szQuery));
+                    MYSQL_RES* pRes = ptrSql->FetchResult();
+                    MYSQL_ROW row = mysql_fetch_row(pRes);
+                    if(row && row[0])
+                    {
+                        lBeatUs = atoll(row[0]);
+                        bOK = true;
+                    }
+                    mysql_free_result(pRes);
+                }
+                catch(CException& e)
+                {
+                    ptrPool->release(ptrSql, nowUs() - lStart, true);
+                    throw;
+                }
+                ptrPool->release(ptrSql, nowUs() - lStart);
+            }
+            catch(CException& e)
+            {
+                //测量失败的从库不更新测量时间，超过上限后自动下线
+            }
+
+            if(!bOK) continue;
+
+            LONG lNow = nowUs();
+            pthread_mutex_lock(&m_mutex);
+            Replica& replica = m_mapReplica[it->first][i];
+            replica.lLagUs = lNow > lBeatUs? lNow - lBeatUs: 0;
+            replica.lMeasureUs = lNow;
+            pthread_mutex_unlock(&m_mutex);
+        }
+    }
+}
+
+//记下本线程刚提交过写入
+void CCoreReplicaRouter::markWrite()
+{
+    t_lWriteUs = nowUs();
+}
+
+//记录一次读
+void CCoreReplicaRouter::count(const bool bReplica, const bool bFallback)
+{
+    pthread_mutex_lock(&m_mutex);
+    if(!bReplica) m_stat.lPrimaryRead++;
+    else if(bFallback) m_stat.lFallback++;
+    else m_stat.lReplicaRead++;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//获取统计
+void CCoreReplicaRouter::getStat(Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*****************
+ * 从库读租约 *
+******************/
+
+// 构造函数
+CCoreReadLease::CCoreReadLease(CMySQL* ptrPrimarySql)
+{
+    m_ptrSql = NULL;
+    m_lStartUs = 0;
+    m_bSuspect = false;
+    m_ptrPool = NULL;
+
+    //不知道调用方的连接属于哪个分区时读主库
+    if(ptrPrimarySql != getCoreLeaseHandle()) return;
+
+    m_ptrPool = CCoreReplicaRouter::instance()->pick(getCoreLeasePool());
+    if(NULL == m_ptrPool) return;
+
+    //从库连接不上时读主库
+    try
+    {
+        m_ptrSql = m_ptrPool->acquire();
+        m_lStartUs = nowUs();
+    }
+    catch(CException& e)
+    {
+        m_ptrPool = NULL;
+    }
+}
+
+//析构函数
+CCoreReadLease::~CCoreReadLease()
+{
+    if(NULL == m_ptrPool) return;
+
+    m_ptrPool->release(m_ptrSql, nowUs() - m_lStartUs, m_bSuspect || std::uncaught_exception());
+}
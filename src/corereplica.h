@@ -0,0 +1,111 @@
+#ifndef _CORE_REPLICA_H_
+#define _CORE_REPLICA_H_
+
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+/*
+ * 从库读路由
+ * 非加锁的queryProof/queryAcctInfo先读从库，延迟超过上限的从库不参与；
+ * 本线程刚提交过记账时，延迟窗口内的读仍走主库（读自己的写）
+ * 延迟由refreshLag()通过心跳表isp_os_core.t_heartbeat测量，应以远小于延迟上限的间隔调用
+ * 从库按所属主库（分区连接池）登记，读只走当前租约所在分区的从库，心跳也按分区写、按分区测
+ * 配置和读写并发，m_mapReplica的读写都在m_mutex内
+ */
+class CCoreReplicaRouter
+{
+public:
+    //读路由统计
+    struct Stat
+    {
+        LONG lReplicaRead;  //从库读次数
+        LONG lFallback;     //从库未命中回主库次数
+        LONG lPrimaryRead;  //无可用从库直接读主库次数
+    };
+
+    //构造函数
+    CCoreReplicaRouter();
+
+    //析构函数
+    ~CCoreReplicaRouter();
+
+    //全局路由
+    static CCoreReplicaRouter* instance();
+
+    //添加从库，ptrPrimary为它复制的主库连接池，NULL为默认连接池
+    void addReplica(CoreDBFactory factory, const int iMaxSize, const int iWarmUp = 0, CCoreDBPool* ptrPrimary = NULL);
+
+    //设置延迟上限（秒）
+    void setMaxLag(const int iSec) { m_lMaxLagUs = (LONG)iSec * 1000000; }
+
+    //是否配置了从库
+    bool enabled();
+
+    //选一个主库为ptrPrimary、延迟在上限内的从库，没有或本线程需要读自己的写时返回NULL
+    CCoreDBPool* pick(CCoreDBPool* ptrPrimary);
+
+    //各主库写心跳，并测量其从库延迟
+    void refreshLag();
+
+    //记下本线程刚提交过写入
+    static void markWrite();
+
+    //记录一次读
+    void count(const bool bReplica, const bool bFallback);
+
+    //获取统计
+    void getStat(Stat& stat);
+
+protected:
+    //从库
+    struct Replica
+    {
+        CCoreDBPool* ptrPool;
+        LONG lLagUs;       //测得的延迟
+        LONG lMeasureUs;   //测量时间，未测过为0
+    };
+
+protected:
+    map<CCoreDBPool*, vector<Replica> > m_mapReplica; //主库 -> 从库，只增不删
+    LONG m_lMaxLagUs;
+    unsigned int m_iNext; //轮询下标
+    Stat m_stat;
+    pthread_mutex_t m_mutex;
+};
+
+/*
+ * 从库读租约
+ * ptrPrimarySql为调用方原本要读的主库连接，它是当前租约连接时从该分区的从库里挑一个；
+ * 有可用从库时租一个从库连接，否则handle()为NULL，调用方读主库
+ */
+class CCoreReadLease
+{
+public:
+    //构造函数
+    CCoreReadLease(CMySQL* ptrPrimarySql);
+
+    //析构函数
+    ~CCoreReadLease();
+
+    //从库连接
+    CMySQL* handle() { return m_ptrSql; }
+
+    //读失败，归还后探活
+    void setSuspect() { m_bSuspect = true; }
+
+private:
+    CCoreReadLease(const CCoreReadLease&);
+    CCoreReadLease& operator=(const CCoreReadLease&);
+
+private:
+    CCoreDBPool* m_ptrPool;
+    CMySQL* m_ptrSql;
+    LONG m_lStartUs;
+    bool m_bSuspect;
+};
+
+#endif
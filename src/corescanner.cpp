@@ -0,0 +1,270 @@
+#include <unistd.h>
+#include "corescanner.h"
+#include "corethread.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//一批待校验的账户
+struct AcctBatch
+{
+    vector<CCoreAcct> vecAcct;
+    vector<char> vecBad;
+};
+
+//一批待校验的凭证
+struct ProofBatch
+{
+    vector<CCoreProof> vecProof;
+    vector<char> vecBad;
+};
+
+//并行校验账户签名
+static void verifyAcctRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    AcctBatch& batch = *(AcctBatch*)ptrCtx;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        batch.vecBad[i] = (batch.vecAcct[i].Facct_sign != batch.vecAcct[i].genAcctSign());
+    }
+}
+
+//并行校验凭证签名
+static void verifyProofRange(void* ptrCtx, size_t iBegin, size_t iEnd)
+{
+    ProofBatch& batch = *(ProofBatch*)ptrCtx;
+
+    for(size_t i = iBegin; i < iEnd; ++i)
+    {
+        CCoreProof& proof = batch.vecProof[i];
+        string strSign = proof.Fproof_sign;
+        proof.genProofSign();
+        batch.vecBad[i] = (strSign != proof.Fproof_sign);
+        proof.Fproof_sign = strSign;
+    }
+}
+
+/*****************
+ * 行签名巡检 *
+******************/
+
+// 构造函数
+CCoreScanner::CCoreScanner()
+{
+    m_ptrSql = getCoreLeaseHandle();
+    m_iThreads = coreCpuNum();
+    m_iBatch = 5000;
+    m_iRowsPerSec = 0;
+}
+
+//析构函数
+CCoreScanner::~CCoreScanner()
+{
+    m_ptrSql = NULL;
+}
+
+//巡检账户表
+LONG CCoreScanner::scanAcct(const int iMaxBatch)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    LONG lStartUs = nowUs();
+    LONG lTotal = 0;
+    LONG lLastUid = atoll(queryProgress("acct").c_str());
+
+    for(int iBatch = 0; iMaxBatch == 0 || iBatch < iMaxBatch; ++iBatch)
+    {
+        AcctBatch batch;
+        MYSQL_RES* pRes = NULL;
+
+        int iLen = snprintf(szSql, sizeof(szSql),
+            "SELECT %s FROM isp_os_core.t_account "
+            "WHERE Fuid > %lld ORDER BY Fuid LIMIT %d",
+            CCoreAcct::sqlSelect(), lLastUid, m_iBatch);
+
+        m_ptrSql->Query(szSql, iLen);
+        pRes = m_ptrSql->FetchResult();
+
+        batch.vecAcct.reserve(mysql_num_rows(pRes));
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            batch.vecAcct.push_back(CCoreAcct());
+            batch.vecAcct.back().parseRow(row);
+        }
+        mysql_free_result(pRes);
+
+        if(batch.vecAcct.empty()) break;
+
+        batch.vecBad.assign(batch.vecAcct.size(), 0);
+        coreParallelFor(m_iThreads, batch.vecAcct.size(), verifyAcctRange, &batch);
+
+        vector<string> vecKey;
+        for(size_t i = 0; i < batch.vecAcct.size(); ++i)
+        {
+            if(!batch.vecBad[i]) continue;
+            snprintf(szSql, sizeof(szSql), "%lld", batch.vecAcct[i].Fuid);
+            vecKey.push_back(szSql);
+        }
+        saveFinding("t_account", vecKey);
+
+        lLastUid = batch.vecAcct.back().Fuid;
+        snprintf(szSql, sizeof(szSql), "%lld", lLastUid);
+        saveProgress("acct", szSql);
+
+        lTotal += batch.vecAcct.size();
+        throttle(lTotal, lStartUs);
+
+        if((int)batch.vecAcct.size() < m_iBatch) break;
+    }
+
+    return lTotal;
+}
+
+//巡检凭证表
+LONG CCoreScanner::scanProof(const int iMaxBatch)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    LONG lStartUs = nowUs();
+    LONG lTotal = 0;
+    string strLastListid = queryProgress("proof");
+
+    for(int iBatch = 0; iMaxBatch == 0 || iBatch < iMaxBatch; ++iBatch)
+    {
+        ProofBatch batch;
+        MYSQL_RES* pRes = NULL;
+
+        int iLen = snprintf(szSql, sizeof(szSql),
+            "SELECT %s FROM isp_os_core.t_proof "
+            "WHERE Flistid > '%s' ORDER BY Flistid LIMIT %d",
+            CCoreProof::sqlSelect(), m_ptrSql->EscapeStr(strLastListid).c_str(), m_iBatch);
+
+        m_ptrSql->Query(szSql, iLen);
+        pRes = m_ptrSql->FetchResult();
+
+        batch.vecProof.reserve(mysql_num_rows(pRes));
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            batch.vecProof.push_back(CCoreProof());
+            batch.vecProof.back().parseRow(row);
+        }
+        mysql_free_result(pRes);
+
+        if(batch.vecProof.empty()) break;
+
+        //多方凭证签名覆盖分录，分录要先读出来
+        for(size_t i = 0; i < batch.vecProof.size(); ++i)
+        {
+            if(batch.vecProof[i].Fleg_num > 0) batch.vecProof[i].queryLegs();
+        }
+
+        batch.vecBad.assign(batch.vecProof.size(), 0);
+        coreParallelFor(m_iThreads, batch.vecProof.size(), verifyProofRange, &batch);
+
+        vector<string> vecKey;
+        for(size_t i = 0; i < batch.vecProof.size(); ++i)
+        {
+            if(batch.vecBad[i]) vecKey.push_back(batch.vecProof[i].Flistid);
+        }
+        saveFinding("t_proof", vecKey);
+
+        strLastListid = batch.vecProof.back().Flistid;
+        saveProgress("proof", strLastListid);
+
+        lTotal += batch.vecProof.size();
+        throttle(lTotal, lStartUs);
+
+        if((int)batch.vecProof.size() < m_iBatch) break;
+    }
+
+    return lTotal;
+}
+
+//从头重新巡检
+void CCoreScanner::restart(const string& strTable)
+{
+    saveProgress(strTable, "");
+}
+
+//按读行预算限速
+void CCoreScanner::throttle(const LONG lRows, const LONG lStartUs)
+{
+    if(m_iRowsPerSec <= 0) return;
+
+    LONG lExpectUs = lRows * 1000000 / m_iRowsPerSec;
+    LONG lUsedUs = nowUs() - lStartUs;
+    if(lExpectUs > lUsedUs)
+    {
+        usleep(lExpectUs - lUsedUs);
+    }
+}
+
+//查询进度
+string CCoreScanner::queryProgress(const string& strTable)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    string strKey;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fkey FROM isp_os_core.t_scan_progress WHERE Fname = '%s'",
+        m_ptrSql->EscapeStr(strTable).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    if(row && row[0])
+    {
+        strKey = row[0];
+    }
+    mysql_free_result(pRes);
+
+    return strKey;
+}
+
+//保存进度
+void CCoreScanner::saveProgress(const string& strTable, const string& strKey)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT INTO isp_os_core.t_scan_progress (Fname,Fkey,Fmodify_time) "
+        "VALUES ('%s','%s',now()) "
+        "ON DUPLICATE KEY UPDATE Fkey = VALUES(Fkey), Fmodify_time = now()",
+        m_ptrSql->EscapeStr(strTable).c_str(), m_ptrSql->EscapeStr(strKey).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+}
+
+//记录发现
+void CCoreScanner::saveFinding(const string& strTable, const vector<string>& vecKey)
+{
+    if(vecKey.empty()) return;
+
+    char szRow[MAX_MSG_LEN] = {0};
+    string strSql = "INSERT INTO isp_os_core.t_scan_finding (Ftable,Fkey,Ferror,Fcreate_time) VALUES ";
+
+    for(size_t i = 0; i < vecKey.size(); ++i)
+    {
+        snprintf(szRow, sizeof(szRow) - 1, "%s('%s','%s',%d,now())",
+            i == 0? "": ",", strTable.c_str(), m_ptrSql->EscapeStr(vecKey[i]).c_str(), ERR_DB_TAMPER);
+        strSql += szRow;
+
+        Finding finding;
+        finding.strTable = strTable;
+        finding.strKey = vecKey[i];
+        m_vecFinding.push_back(finding);
+    }
+
+    m_ptrSql->Query(strSql.c_str(), strSql.length());
+}
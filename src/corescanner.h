@@ -0,0 +1,67 @@
+#ifndef _CORE_SCANNER_H_
+#define _CORE_SCANNER_H_
+
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+#include "core.h"
+
+/*
+ * 行签名巡检
+ * 按Fuid/Flistid区间分批读t_account、t_proof，多线程校验Facct_sign/Fproof_sign，
+ * 按读行预算限速，进度存isp_os_core.t_scan_progress，
+ * 签名不符的行记入isp_os_core.t_scan_finding（Ferror = ERR_DB_TAMPER）
+ * 只做非加锁读，可在线运行
+ */
+class CCoreScanner
+{
+public:
+    //巡检发现
+    struct Finding
+    {
+        string strTable;
+        string strKey;
+    };
+
+    //构造函数
+    CCoreScanner();
+
+    //析构函数
+    ~CCoreScanner();
+
+    //巡检账户表，返回本次扫描行数，iMaxBatch为本次最多扫描的批数，0为扫完
+    LONG scanAcct(const int iMaxBatch = 0);
+
+    //巡检凭证表
+    LONG scanProof(const int iMaxBatch = 0);
+
+    //从头重新巡检
+    void restart(const string& strTable);
+
+    //设置参数
+    void setThreads(const int iThreads) { m_iThreads = iThreads; }
+    void setBatch(const int iBatch) { m_iBatch = iBatch; }
+    void setReadBudget(const int iRowsPerSec) { m_iRowsPerSec = iRowsPerSec; }
+
+public:
+    vector<Finding> m_vecFinding; //本次发现
+
+protected:
+    //查询进度
+    string queryProgress(const string& strTable);
+    //保存进度
+    void saveProgress(const string& strTable, const string& strKey);
+    //记录发现
+    void saveFinding(const string& strTable, const vector<string>& vecKey);
+    //按读行预算限速
+    void throttle(const LONG lRows, const LONG lStartUs);
+
+protected:
+    CMySQL* m_ptrSql; //数据库句柄
+    int m_iThreads;
+    int m_iBatch;
+    int m_iRowsPerSec; //0为不限速
+};
+
+#endif
@@ -0,0 +1,600 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "coreserver.h"
+#include "corewire.h"
+#include "core.h"
+#include "coreerror.h"
+#include "common.h"
+
+//epoll中监听socket和唤醒管道的标识，连接从2开始编号
+static const LONG ID_listen = 0;
+static const LONG ID_wake = 1;
+
+//当前微秒时间
+static LONG nowUs()
+{
+    MicroTimeStamp tStamp;
+    getMicroTimeStamp(tStamp);
+    return (LONG)tStamp.iTimeStamp * 1000000 + tStamp.iTimeStampUs;
+}
+
+//设为非阻塞
+static void setNonBlock(const int iFd)
+{
+    fcntl(iFd, F_SETFL, fcntl(iFd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/*****************
+ * 记账服务 *
+******************/
+
+// 构造函数
+CCoreServer::CCoreServer()
+{
+    m_iListenFd = -1;
+    m_iEpollFd = -1;
+    m_arrWake[0] = -1;
+    m_arrWake[1] = -1;
+    m_iMaxPipeline = 64;
+    m_bUnix = false;
+    m_bAllowTcp = false;
+    m_bRunning = false;
+    m_bDraining = false;
+    m_bIoDrain = false;
+    m_bStop = false;
+    m_lDrainDeadlineUs = 0;
+    m_lNextConn = 2;
+    m_iInflight = 0;
+    memset(&m_stat, 0, sizeof(m_stat));
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+//析构函数
+CCoreServer::~CCoreServer()
+{
+    if(m_bRunning) drain(0);
+
+    if(m_iListenFd >= 0) close(m_iListenFd);
+    if(m_iEpollFd >= 0) close(m_iEpollFd);
+    if(m_arrWake[0] >= 0) close(m_arrWake[0]);
+    if(m_arrWake[1] >= 0) close(m_arrWake[1]);
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//监听地址
+void CCoreServer::listen(const string& strAddr)
+{
+    m_bUnix = !strAddr.empty() && strAddr[0] == '/';
+    if(!m_bUnix && !m_bAllowTcp)
+    {
+        throw CException(ERR_CORE_IO, "core server: tcp listen needs setAllowTcp", __FILE__, __LINE__);
+    }
+    if(m_setPeerUid.empty())
+    {
+        m_setPeerUid.insert(geteuid());
+    }
+
+    m_iListenFd = CCoreWireClient::openAddr(strAddr, true);
+    setNonBlock(m_iListenFd);
+}
+
+//启动IO线程和工作线程
+void CCoreServer::start(const int iWorkers, CoreDBFactory factory)
+{
+    if(m_bRunning) return;
+    if(m_iListenFd < 0)
+    {
+        throw CException(ERR_CORE_IO, "core server: listen first", __FILE__, __LINE__);
+    }
+
+    //每个工作线程同时只租一个连接
+    if(factory && !CCoreDBPool::instance()->inited())
+    {
+        CCoreDBPool::instance()->init(factory, iWorkers, iWorkers);
+    }
+
+    if(pipe(m_arrWake) != 0 || (m_iEpollFd = epoll_create(1024)) < 0)
+    {
+        throw CException(ERR_CORE_IO, string("core server: init failed: ") + strerror(errno), __FILE__, __LINE__);
+    }
+    setNonBlock(m_arrWake[0]);
+    setNonBlock(m_arrWake[1]);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ID_listen;
+    epoll_ctl(m_iEpollFd, EPOLL_CTL_ADD, m_iListenFd, &ev);
+    ev.data.u64 = ID_wake;
+    epoll_ctl(m_iEpollFd, EPOLL_CTL_ADD, m_arrWake[0], &ev);
+
+    m_bStop = false;
+    m_bDraining = false;
+    for(int i = 0; i < iWorkers; ++i)
+    {
+        pthread_t thread;
+        if(0 != pthread_create(&thread, NULL, workerMain, this))
+        {
+            throw CException(ERR_BAD_BRANCH, "core server: create worker failed", __FILE__, __LINE__);
+        }
+        m_vecWorker.push_back(thread);
+    }
+    if(0 != pthread_create(&m_ioThread, NULL, ioMain, this))
+    {
+        throw CException(ERR_BAD_BRANCH, "core server: create io thread failed", __FILE__, __LINE__);
+    }
+    m_bRunning = true;
+}
+
+//优雅退出
+void CCoreServer::drain(const int iTimeoutMs)
+{
+    if(!m_bRunning) return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_bDraining = true;
+    m_lDrainDeadlineUs = nowUs() + (LONG)iTimeoutMs * 1000;
+    pthread_mutex_unlock(&m_mutex);
+
+    if(write(m_arrWake[1], "d", 1) < 0)
+    {
+        //管道满时IO线程本来就会醒
+    }
+    pthread_join(m_ioThread, NULL);
+
+    //已交给工作线程的请求都做完再退出，凭证不会停在半途
+    pthread_mutex_lock(&m_mutex);
+    m_bStop = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    for(size_t i = 0; i < m_vecWorker.size(); ++i)
+    {
+        pthread_join(m_vecWorker[i], NULL);
+    }
+    m_vecWorker.clear();
+
+    //IO线程退出后完成的请求没有人收了
+    for(size_t i = 0; i < m_deqDone.size(); ++i)
+    {
+        delete m_deqDone[i];
+    }
+    m_deqDone.clear();
+    m_iInflight = 0;
+
+    m_bRunning = false;
+}
+
+//获取统计
+void CCoreServer::getStat(Stat& stat)
+{
+    pthread_mutex_lock(&m_mutex);
+    stat = m_stat;
+    stat.iInflight = m_iInflight;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//IO线程入口
+void* CCoreServer::ioMain(void* ptrArg)
+{
+    ((CCoreServer*)ptrArg)->ioLoop();
+    return NULL;
+}
+
+//工作线程入口
+void* CCoreServer::workerMain(void* ptrArg)
+{
+    ((CCoreServer*)ptrArg)->workerLoop();
+    return NULL;
+}
+
+//IO线程主循环
+void CCoreServer::ioLoop()
+{
+    struct epoll_event arrEvent[128];
+
+    while(true)
+    {
+        int iNum = epoll_wait(m_iEpollFd, arrEvent, sizeof(arrEvent) / sizeof(arrEvent[0]), 100);
+
+        for(int i = 0; i < iNum; ++i)
+        {
+            LONG lId = arrEvent[i].data.u64;
+            if(lId == ID_listen)
+            {
+                onAccept();
+                continue;
+            }
+            if(lId == ID_wake)
+            {
+                char szBuf[256];
+                while(read(m_arrWake[0], szBuf, sizeof(szBuf)) > 0)
+                {
+                }
+                continue;
+            }
+
+            map<LONG, Conn*>::iterator it = m_mapConn.find(lId);
+            if(it == m_mapConn.end()) continue;
+            if(arrEvent[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                onRead(*it->second);
+            }
+
+            //读的时候可能已关闭
+            it = m_mapConn.find(lId);
+            if(it != m_mapConn.end() && (arrEvent[i].events & EPOLLOUT))
+            {
+                flushOut(*it->second);
+            }
+        }
+
+        onDone();
+
+        pthread_mutex_lock(&m_mutex);
+        bool bDraining = m_bDraining;
+        LONG lDeadlineUs = m_lDrainDeadlineUs;
+        pthread_mutex_unlock(&m_mutex);
+
+        if(!bDraining) continue;
+
+        //进入退出流程：关监听，停止读请求
+        if(!m_bIoDrain)
+        {
+            m_bIoDrain = true;
+            epoll_ctl(m_iEpollFd, EPOLL_CTL_DEL, m_iListenFd, NULL);
+            close(m_iListenFd);
+            m_iListenFd = -1;
+            for(map<LONG, Conn*>::iterator it = m_mapConn.begin(); it != m_mapConn.end(); ++it)
+            {
+                updateEvents(*it->second);
+            }
+        }
+
+        if(drained() || nowUs() >= lDeadlineUs) break;
+    }
+
+    while(!m_mapConn.empty())
+    {
+        closeConn(*m_mapConn.begin()->second);
+    }
+}
+
+//工作线程主循环
+void CCoreServer::workerLoop()
+{
+    while(true)
+    {
+        pthread_mutex_lock(&m_mutex);
+        while(m_deqTask.empty() && !m_bStop)
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+        }
+        if(m_deqTask.empty())
+        {
+            pthread_mutex_unlock(&m_mutex);
+            break;
+        }
+        Task* ptrTask = m_deqTask.front();
+        m_deqTask.pop_front();
+        pthread_mutex_unlock(&m_mutex);
+
+        int iError = 0;
+        string strMsg;
+        try
+        {
+            CCoreWireView view;
+            view.parse(ptrTask->strReq.data(), ptrTask->strReq.length());
+
+            CCore core;
+            core.callCore(view);
+        }
+        catch(CException& e)
+        {
+            iError = e.error();
+            strMsg = e.what();
+        }
+        catch(...)
+        {
+            //其他异常（如内存不足）只让本请求失败，不能带走整个进程
+            iError = ERR_BAD_BRANCH;
+            strMsg = "core server: unexpected exception";
+        }
+
+        ptrTask->strResp.clear();
+        CCoreWireCodec::encodeResult(iError, strMsg, ptrTask->strResp);
+
+        pthread_mutex_lock(&m_mutex);
+        m_deqDone.push_back(ptrTask);
+        pthread_mutex_unlock(&m_mutex);
+
+        if(write(m_arrWake[1], "w", 1) < 0)
+        {
+            //管道满说明IO线程还没来得及读，不会漏掉
+        }
+    }
+}
+
+//接受新连接
+void CCoreServer::onAccept()
+{
+    while(true)
+    {
+        int iFd = accept(m_iListenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(!checkPeer(iFd))
+        {
+            close(iFd);
+            pthread_mutex_lock(&m_mutex);
+            m_stat.lReject++;
+            pthread_mutex_unlock(&m_mutex);
+            continue;
+        }
+        setNonBlock(iFd);
+
+        Conn* ptrConn = new Conn();
+        ptrConn->lId = m_lNextConn++;
+        ptrConn->iFd = iFd;
+        ptrConn->lNextSeq = 0;
+        ptrConn->lSendSeq = 0;
+        ptrConn->iInflight = 0;
+        ptrConn->bPeerClosed = false;
+        ptrConn->bRegistered = true;
+        ptrConn->iEvents = EPOLLIN;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = ptrConn->lId;
+        epoll_ctl(m_iEpollFd, EPOLL_CTL_ADD, iFd, &ev);
+        m_mapConn[ptrConn->lId] = ptrConn;
+
+        pthread_mutex_lock(&m_mutex);
+        m_stat.lAccept++;
+        m_stat.iConn = m_mapConn.size();
+        pthread_mutex_unlock(&m_mutex);
+    }
+}
+
+//Unix域套接字对端是否为允许的uid，ip:port监听时不检查
+bool CCoreServer::checkPeer(const int iFd)
+{
+    if(!m_bUnix) return true;
+
+    struct ucred cred;
+    socklen_t iLen = sizeof(cred);
+    if(getsockopt(iFd, SOL_SOCKET, SO_PEERCRED, &cred, &iLen) != 0) return false;
+
+    return m_setPeerUid.count(cred.uid) > 0;
+}
+
+//连接可读
+void CCoreServer::onRead(Conn& conn)
+{
+    char szBuf[65536];
+
+    //一次最多攒一个最大报文，水平触发下次再读
+    while(!conn.bPeerClosed && conn.strIn.length() < (size_t)CCoreWire::MAX_LEN)
+    {
+        ssize_t iRet = read(conn.iFd, szBuf, sizeof(szBuf));
+        if(iRet > 0)
+        {
+            conn.strIn.append(szBuf, iRet);
+            continue;
+        }
+        if(iRet < 0 && errno == EINTR) continue;
+        if(iRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        //对端关闭或出错，在途请求的应答尽力发出
+        conn.bPeerClosed = true;
+    }
+
+    if(!parseFrames(conn)) return;
+
+    if(conn.bPeerClosed && conn.iInflight == 0 && conn.strOut.empty())
+    {
+        closeConn(conn);
+        return;
+    }
+    updateEvents(conn);
+}
+
+//切出完整报文交给工作线程，报文头错误时关闭连接并返回false
+bool CCoreServer::parseFrames(Conn& conn)
+{
+    vector<Task*> vecTask;
+    size_t iPos = 0;
+
+    while(!m_bIoDrain && conn.iInflight < m_iMaxPipeline && conn.strIn.length() - iPos >= CCoreWire::HEAD_LEN)
+    {
+        size_t iLen = 0;
+        try
+        {
+            iLen = CCoreWireCodec::parseHead(conn.strIn.data() + iPos, CCoreWire::KIND_request);
+        }
+        catch(CException& e)
+        {
+            //报文边界已无法确定，只能断开
+            for(size_t i = 0; i < vecTask.size(); ++i) delete vecTask[i];
+            pthread_mutex_lock(&m_mutex);
+            m_stat.lBadFrame++;
+            pthread_mutex_unlock(&m_mutex);
+            closeConn(conn);
+            return false;
+        }
+        if(conn.strIn.length() - iPos < iLen) break;
+
+        Task* ptrTask = new Task();
+        ptrTask->lConn = conn.lId;
+        ptrTask->lSeq = conn.lNextSeq++;
+        ptrTask->strReq.assign(conn.strIn, iPos, iLen);
+        vecTask.push_back(ptrTask);
+
+        iPos += iLen;
+        conn.iInflight++;
+    }
+    conn.strIn.erase(0, iPos);
+
+    if(!vecTask.empty())
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_deqTask.insert(m_deqTask.end(), vecTask.begin(), vecTask.end());
+        m_iInflight += vecTask.size();
+        m_stat.lRequest += vecTask.size();
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+    }
+    return true;
+}
+
+//收取已处理的请求，按序号排好后发出
+void CCoreServer::onDone()
+{
+    deque<Task*> deqDone;
+    pthread_mutex_lock(&m_mutex);
+    deqDone.swap(m_deqDone);
+    pthread_mutex_unlock(&m_mutex);
+
+    if(deqDone.empty()) return;
+
+    set<LONG> setConn;
+    for(size_t i = 0; i < deqDone.size(); ++i)
+    {
+        Task* ptrTask = deqDone[i];
+        map<LONG, Conn*>::iterator it = m_mapConn.find(ptrTask->lConn);
+        if(it != m_mapConn.end())
+        {
+            Conn& conn = *it->second;
+            conn.mapDone[ptrTask->lSeq].swap(ptrTask->strResp);
+            conn.iInflight--;
+
+            map<LONG, string>::iterator itDone;
+            while((itDone = conn.mapDone.find(conn.lSendSeq)) != conn.mapDone.end())
+            {
+                conn.strOut += itDone->second;
+                conn.mapDone.erase(itDone);
+                conn.lSendSeq++;
+            }
+            setConn.insert(conn.lId);
+        }
+        delete ptrTask;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_iInflight -= deqDone.size();
+    m_stat.lDone += deqDone.size();
+    pthread_mutex_unlock(&m_mutex);
+
+    for(set<LONG>::iterator it = setConn.begin(); it != setConn.end(); ++it)
+    {
+        map<LONG, Conn*>::iterator itConn = m_mapConn.find(*it);
+        if(itConn == m_mapConn.end()) continue;
+
+        //在途数降下来后继续切已收到的请求
+        if(!parseFrames(*itConn->second)) continue;
+        flushOut(*itConn->second);
+    }
+}
+
+//尽量发出应答
+void CCoreServer::flushOut(Conn& conn)
+{
+    size_t iDone = 0;
+    while(iDone < conn.strOut.length())
+    {
+        ssize_t iRet = send(conn.iFd, conn.strOut.data() + iDone, conn.strOut.length() - iDone, MSG_NOSIGNAL);
+        if(iRet > 0)
+        {
+            iDone += iRet;
+            continue;
+        }
+        if(iRet < 0 && errno == EINTR) continue;
+        if(iRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !conn.bPeerClosed) break;
+
+        //写失败，或对端已关闭又发不出去
+        closeConn(conn);
+        return;
+    }
+    conn.strOut.erase(0, iDone);
+
+    if(conn.bPeerClosed && conn.iInflight == 0 && conn.strOut.empty())
+    {
+        closeConn(conn);
+        return;
+    }
+    updateEvents(conn);
+}
+
+//按连接状态更新epoll事件
+void CCoreServer::updateEvents(Conn& conn)
+{
+    //对端关闭后挂起事件会一直触发，移出epoll，应答完成时直接写
+    if(conn.bPeerClosed)
+    {
+        if(conn.bRegistered)
+        {
+            epoll_ctl(m_iEpollFd, EPOLL_CTL_DEL, conn.iFd, NULL);
+            conn.bRegistered = false;
+        }
+        return;
+    }
+
+    unsigned int iEvents = 0;
+    if(!m_bIoDrain && conn.iInflight < m_iMaxPipeline) iEvents |= EPOLLIN;
+    if(!conn.strOut.empty()) iEvents |= EPOLLOUT;
+    if(iEvents == conn.iEvents) return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = iEvents;
+    ev.data.u64 = conn.lId;
+    epoll_ctl(m_iEpollFd, EPOLL_CTL_MOD, conn.iFd, &ev);
+    conn.iEvents = iEvents;
+}
+
+//关闭连接，在途请求照常处理，应答丢弃
+void CCoreServer::closeConn(Conn& conn)
+{
+    if(conn.bRegistered)
+    {
+        epoll_ctl(m_iEpollFd, EPOLL_CTL_DEL, conn.iFd, NULL);
+    }
+    close(conn.iFd);
+
+    LONG lId = conn.lId;
+    delete m_mapConn[lId];
+    m_mapConn.erase(lId);
+
+    pthread_mutex_lock(&m_mutex);
+    m_stat.iConn = m_mapConn.size();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//是否已排空：没有在途请求，应答都已发出
+bool CCoreServer::drained()
+{
+    pthread_mutex_lock(&m_mutex);
+    int iInflight = m_iInflight;
+    pthread_mutex_unlock(&m_mutex);
+
+    if(iInflight > 0) return false;
+
+    for(map<LONG, Conn*>::iterator it = m_mapConn.begin(); it != m_mapConn.end(); ++it)
+    {
+        if(!it->second->strOut.empty()) return false;
+    }
+    return true;
+}
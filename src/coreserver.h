@@ -0,0 +1,144 @@
+#ifndef _CORE_SERVER_H_
+#define _CORE_SERVER_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <sys/types.h>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+/*
+ * 记账服务
+ * 一个IO线程用epoll收发CCoreWire报文，工作线程池调用CCore::callCore，
+ * 进程内所有记账共用一套连接池、热点队列和准入控制
+ * 同一连接可以连续发多个请求不等应答（流水线），请求并行处理，应答按请求顺序返回；
+ * 一个连接的在途请求达到上限时暂停读该连接
+ * 请求没有鉴权，只能由受信进程发来：默认只允许Unix域套接字，并按SO_PEERCRED只接受指定uid（默认本进程euid）的连接；
+ * ip:port须显式setAllowTcp，只应绑定在受信网络内
+ */
+class CCoreServer
+{
+public:
+    //服务统计
+    struct Stat
+    {
+        LONG lAccept;    //接受的连接数
+        LONG lRequest;   //收到的请求数
+        LONG lDone;      //已应答的请求数
+        LONG lBadFrame;  //报文头错误断开的连接数
+        LONG lReject;    //对端身份不符拒绝的连接数
+        int iConn;       //当前连接数
+        int iInflight;   //在途请求数
+    };
+
+    //构造函数
+    CCoreServer();
+
+    //析构函数
+    ~CCoreServer();
+
+    //监听地址，以/开头为Unix域套接字路径，否则为ip:port
+    void listen(const string& strAddr);
+
+    //启动IO线程和iWorkers个工作线程，factory非空时按工作线程数初始化默认连接池
+    void start(const int iWorkers, CoreDBFactory factory = NULL);
+
+    //优雅退出：不再接受连接和读取请求，在途请求处理完、应答发完后关闭，最多等iTimeoutMs
+    void drain(const int iTimeoutMs);
+
+    //获取统计
+    void getStat(Stat& stat);
+
+    //设置单连接在途请求上限
+    void setMaxPipeline(const int iMax) { m_iMaxPipeline = iMax; }
+
+    //允许监听ip:port，listen前调用
+    void setAllowTcp(const bool bAllow) { m_bAllowTcp = bAllow; }
+
+    //允许连接Unix域套接字的对端uid，可多次调用；未调用时只允许本进程euid
+    void addPeerUid(const uid_t iUid) { m_setPeerUid.insert(iUid); }
+
+protected:
+    //连接
+    struct Conn
+    {
+        LONG lId;
+        int iFd;
+        string strIn;
+        string strOut;
+        LONG lNextSeq;  //下一个请求的序号
+        LONG lSendSeq;  //下一个该发出的应答序号
+        map<LONG, string> mapDone; //已处理、等待按序发出的应答
+        int iInflight;
+        bool bPeerClosed;
+        bool bRegistered;     //是否在epoll中
+        unsigned int iEvents; //当前注册的epoll事件
+    };
+
+    //一个请求
+    struct Task
+    {
+        LONG lConn;
+        LONG lSeq;
+        string strReq;
+        string strResp;
+    };
+
+    //线程入口
+    static void* ioMain(void* ptrArg);
+    static void* workerMain(void* ptrArg);
+
+    //IO线程主循环
+    void ioLoop();
+    //工作线程主循环
+    void workerLoop();
+    //接受新连接
+    void onAccept();
+    //连接可读
+    void onRead(Conn& conn);
+    //收取已处理的请求
+    void onDone();
+    //切出完整报文交给工作线程，报文头错误时关闭连接并返回false
+    bool parseFrames(Conn& conn);
+    //尽量发出应答
+    void flushOut(Conn& conn);
+    //按连接状态更新epoll事件
+    void updateEvents(Conn& conn);
+    //关闭连接
+    void closeConn(Conn& conn);
+    //Unix域套接字对端是否为允许的uid
+    bool checkPeer(const int iFd);
+    //是否已排空
+    bool drained();
+
+protected:
+    int m_iListenFd;
+    int m_iEpollFd;
+    int m_arrWake[2]; //工作线程完成时唤醒IO线程
+    int m_iMaxPipeline;
+    bool m_bUnix;     //监听的是Unix域套接字
+    bool m_bAllowTcp;
+    set<uid_t> m_setPeerUid;
+    bool m_bRunning;
+    bool m_bDraining; //drain已调用，受m_mutex保护
+    bool m_bIoDrain;  //IO线程已进入退出流程，只在IO线程读写
+    bool m_bStop;
+    LONG m_lDrainDeadlineUs;
+    LONG m_lNextConn;
+    map<LONG, Conn*> m_mapConn;
+    deque<Task*> m_deqTask;
+    deque<Task*> m_deqDone;
+    int m_iInflight;
+    Stat m_stat;
+    pthread_t m_ioThread;
+    vector<pthread_t> m_vecWorker;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
+
+#endif
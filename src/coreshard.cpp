@@ -0,0 +1,212 @@
+#include "coreshard.h"
+#include "coreerror.h"
+#include "core.h"
+#include "common.h"
+
+/*****************
+ * 账户分片路由 *
+******************/
+
+// 构造函数
+CCoreShardRouter::CCoreShardRouter()
+{
+    m_iGLShard = 0;
+    pthread_rwlock_init(&m_lock, NULL);
+}
+
+//析构函数
+CCoreShardRouter::~CCoreShardRouter()
+{
+    for(map<int, CCoreDBPool*>::iterator it = m_mapPool.begin(); it != m_mapPool.end(); ++it)
+    {
+        delete it->second;
+    }
+    m_mapPool.clear();
+
+    pthread_rwlock_destroy(&m_lock);
+}
+
+//全局路由
+CCoreShardRouter* CCoreShardRouter::instance()
+{
+    static CCoreShardRouter router;
+    return &router;
+}
+
+//配置分片连接池
+void CCoreShardRouter::addShard(const int iShard, CoreDBFactory factory, const int iMaxSize, const int iWarmUp)
+{
+    //预热可能较慢，放在锁外；初始化完成后才放进路由表，pool()不会拿到未初始化的连接池
+    CCoreDBPool* ptrPool = new CCoreDBPool();
+    try
+    {
+        ptrPool->init(factory, iMaxSize, iWarmUp);
+    }
+    catch(CException& e)
+    {
+        delete ptrPool;
+        throw;
+    }
+
+    pthread_rwlock_wrlock(&m_lock);
+    if(m_mapPool.find(iShard) != m_mapPool.end())
+    {
+        pthread_rwlock_unlock(&m_lock);
+        delete ptrPool;
+
+        char szMsg[MAX_MSG_LEN] = {0};
+        snprintf(szMsg, sizeof(szMsg) - 1, "core shard: shard %d already added", iShard);
+        throw CException(ERR_BAD_BRANCH, szMsg, __FILE__, __LINE__);
+    }
+    m_mapPool[iShard] = ptrPool;
+    pthread_rwlock_unlock(&m_lock);
+}
+
+//配置分片表
+void CCoreShardRouter::setBucket(const vector<int>& vecBucket)
+{
+    pthread_rwlock_wrlock(&m_lock);
+    m_vecBucket = vecBucket;
+    pthread_rwlock_unlock(&m_lock);
+}
+
+//是否启用分片
+bool CCoreShardRouter::enabled()
+{
+    pthread_rwlock_rdlock(&m_lock);
+    bool bEnabled = !m_vecBucket.empty();
+    pthread_rwlock_unlock(&m_lock);
+
+    return bEnabled;
+}
+
+//账户所在分片
+int CCoreShardRouter::shardOf(const LONG uid, const bool bGL)
+{
+    if(bGL) return m_iGLShard;
+
+    pthread_rwlock_rdlock(&m_lock);
+    LONG lNum = m_vecBucket.size();
+    int iShard = lNum > 0? m_vecBucket[(uid % lNum + lNum) % lNum]: 0;
+    pthread_rwlock_unlock(&m_lock);
+
+    return iShard;
+}
+
+//分片连接池
+CCoreDBPool* CCoreShardRouter::pool(const int iShard)
+{
+    CCoreDBPool* ptrPool = NULL;
+
+    pthread_rwlock_rdlock(&m_lock);
+    map<int, CCoreDBPool*>::iterator it = m_mapPool.find(iShard);
+    if(it != m_mapPool.end())
+    {
+        ptrPool = it->second;
+    }
+    pthread_rwlock_unlock(&m_lock);
+
+    if(NULL == ptrPool)
+    {
+        char szMsg[MAX_MSG_LEN] = {0};
+        snprintf(szMsg, sizeof(szMsg) - 1, "core shard: shard %d not configured", iShard);
+        throw CException(ERR_CORE_NO_ROUTE, szMsg, __FILE__, __LINE__);
+    }
+
+    return ptrPool;
+}
+
+//已配置的分片号
+void CCoreShardRouter::getShards(vector<int>& vecShard)
+{
+    vecShard.clear();
+
+    pthread_rwlock_rdlock(&m_lock);
+    for(map<int, CCoreDBPool*>::iterator it = m_mapPool.begin(); it != m_mapPool.end(); ++it)
+    {
+        vecShard.push_back(it->first);
+    }
+    pthread_rwlock_unlock(&m_lock);
+}
+
+/*****************
+ * 跨分片凭证恢复 *
+******************/
+
+// 构造函数
+CCoreShardRecovery::CCoreShardRecovery()
+{
+    m_iFail = 0;
+    m_iTimeout = 60;
+    m_iBatch = 100;
+}
+
+//恢复分片上的在途凭证，按(Fcreate_time, Flistid)游标分批扫完
+int CCoreShardRecovery::run(const int iShard)
+{
+    CCoreDBLease lease(CCoreShardRouter::instance()->pool(iShard), true);
+    CMySQL* ptrSql = lease.handle();
+
+    char szSql[MAX_SQL_LEN] = {0};
+    string strLastTime;
+    string strLastListid;
+    int iDone = 0;
+    m_iFail = 0;
+
+    while(true)
+    {
+        MYSQL_RES* pRes = NULL;
+
+        //已应答失败的凭证一直是STATE_before，不排除会占满每一批
+        int iLen = snprintf(szSql, sizeof(szSql) - 1,
+            "SELECT %s FROM isp_os_core.t_proof "
+            "WHERE Fstate = %d AND Frecord_state = 1 AND Ftype = %d AND Fleg_num = 0 "
+            "AND Fcreate_time < DATE_SUB(now(), INTERVAL %d SECOND) "
+            "AND (Fcreate_time > '%s' OR (Fcreate_time = '%s' AND Flistid > '%s')) "
+            "AND NOT EXISTS (SELECT 1 FROM isp_os_core.t_proof_reject r WHERE r.Flistid = t_proof.Flistid) "
+            "ORDER BY Fcreate_time, Flistid LIMIT %d",
+            CCoreProof::sqlSelect(),
+            CCoreProof::STATE_before,
+            CCoreProof::TYPE_direct,
+            m_iTimeout,
+            ptrSql->EscapeStr(strLastTime).c_str(),
+            ptrSql->EscapeStr(strLastTime).c_str(),
+            ptrSql->EscapeStr(strLastListid).c_str(),
+            m_iBatch);
+
+        ptrSql->Query(szSql, iLen);
+        pRes = ptrSql->FetchResult();
+
+        vector<CCoreProof> vecProof;
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            vecProof.push_back(CCoreProof());
+            vecProof.back().parseRow(row);
+        }
+        mysql_free_result(pRes);
+
+        if(vecProof.empty()) break;
+
+        strLastTime = vecProof.back().Fcreate_time;
+        strLastListid = vecProof.back().Flistid;
+
+        for(size_t i = 0; i < vecProof.size(); ++i)
+        {
+            //单笔推进失败不影响其它凭证，下一轮再试
+            try
+            {
+                CCore core;
+                if(core.recoverProof(vecProof[i])) ++iDone;
+            }
+            catch(CException& e)
+            {
+                ++m_iFail;
+            }
+        }
+
+        if((int)vecProof.size() < m_iBatch) break;
+    }
+
+    return iDone;
+}
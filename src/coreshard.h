@@ -0,0 +1,87 @@
+#ifndef _CORE_SHARD_H_
+#define _CORE_SHARD_H_
+
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+#include "coredbpool.h"
+
+/*
+ * 账户分片路由
+ * 账户按Fuid分到多个MySQL实例，实例内库表结构不变（isp_os_core）
+ * 分片表：Fuid % 桶数 -> 分片号，迁移时改桶的归属即可；总账账户固定在总账分片
+ * 凭证存在借方账户所在分片（协调分片），跨分片凭证见CCore::dealCrossShard
+ */
+class CCoreShardRouter
+{
+public:
+    //构造函数
+    CCoreShardRouter();
+
+    //析构函数
+    ~CCoreShardRouter();
+
+    //全局路由
+    static CCoreShardRouter* instance();
+
+    //配置分片连接池，初始化成功后才生效，重复的分片号抛异常
+    void addShard(const int iShard, CoreDBFactory factory, const int iMaxSize, const int iWarmUp = 0);
+
+    //配置分片表，vecBucket[Fuid % vecBucket.size()]为账户所在分片
+    void setBucket(const vector<int>& vecBucket);
+
+    //总账账户所在分片
+    void setGLShard(const int iShard) { m_iGLShard = iShard; }
+
+    //是否启用分片
+    bool enabled();
+
+    //账户所在分片
+    int shardOf(const LONG uid, const bool bGL = false);
+
+    //分片连接池
+    CCoreDBPool* pool(const int iShard);
+
+    //已配置的分片号
+    void getShards(vector<int>& vecShard);
+
+private:
+    CCoreShardRouter(const CCoreShardRouter&);
+    CCoreShardRouter& operator=(const CCoreShardRouter&);
+
+protected:
+    map<int, CCoreDBPool*> m_mapPool;
+    vector<int> m_vecBucket;
+    int m_iGLShard;
+    pthread_rwlock_t m_lock;
+};
+
+/*
+ * 跨分片凭证恢复
+ * 按(Fcreate_time, Flistid)游标扫描分片上超时仍为STATE_before的凭证，跳过t_proof_reject中已应答失败的，
+ * 首个分片已提交的（在途）一律向前推进到全部分片完成，未提交的不动
+ */
+class CCoreShardRecovery
+{
+public:
+    //构造函数
+    CCoreShardRecovery();
+
+    //恢复分片iShard上的在途凭证，返回推进的凭证数
+    int run(const int iShard);
+
+    //设置参数
+    void setTimeout(const int iSec) { m_iTimeout = iSec; }
+    void setBatch(const int iBatch) { m_iBatch = iBatch; }
+
+public:
+    int m_iFail; //本轮推进失败的凭证数
+
+protected:
+    int m_iTimeout; //凭证创建多久后仍未完成视为在途
+    int m_iBatch;
+};
+
+#endif
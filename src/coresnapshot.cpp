@@ -0,0 +1,345 @@
+#include "coresnapshot.h"
+#include "core.h"
+#include "dbcomm.h"
+#include "error.h"
+#include "common.h"
+
+/*****************
+ * 账户余额快照类 *
+******************/
+
+// 构造函数
+CCoreSnapshot::CCoreSnapshot()
+{
+    //DB参数初始化
+    Fuid = 0;
+    Fbalance = 0;
+    Fcon = 0;
+    Fwatermark = 0;
+
+    //私有变量初始化
+    m_ptrSql = getCoreLeaseHandle();
+    m_iSettle = 10;
+}
+
+//析构函数
+CCoreSnapshot::~CCoreSnapshot()
+{
+    m_ptrSql = NULL;
+}
+
+//增量生成快照，返回本批处理的流水条数
+int CCoreSnapshot::build(const int iBatch)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    map<LONG, SnapRow> mapRow;
+    LONG lWatermark = 0;
+    int iRow = 0;
+
+    try
+    {
+        m_ptrSql->Begin();
+
+        //锁进度行，只锁快照自身的表
+        lWatermark = queryProgress();
+
+        //水位只能推进到最小的未沉淀Fid之前，否则跳过的小Fid不会再被纳入快照
+        LONG lUnsettled = queryUnsettled(lWatermark);
+        if(lUnsettled == lWatermark + 1)
+        {
+            m_ptrSql->Commit();
+            return 0;
+        }
+
+        //流水自带变动后余额，取每个账户在本批中的最后一条即可
+        int iLen = 0;
+        if(lUnsettled > 0)
+        {
+            iLen = snprintf(szSql, sizeof(szSql),
+                "SELECT Fid,Fuid,Fcur_type,Fbalance,Fcon,Fcreate_time "
+                "FROM isp_os_core.t_flow "
+                "WHERE Fid > %lld AND Fid < %lld "
+                "ORDER BY Fid LIMIT %d",
+                lWatermark, lUnsettled, iBatch);
+        }
+        else
+        {
+            iLen = snprintf(szSql, sizeof(szSql),
+                "SELECT Fid,Fuid,Fcur_type,Fbalance,Fcon,Fcreate_time "
+                "FROM isp_os_core.t_flow "
+                "WHERE Fid > %lld "
+                "ORDER BY Fid LIMIT %d",
+                lWatermark, iBatch);
+        }
+
+        m_ptrSql->Query(szSql, iLen);
+        pRes = m_ptrSql->FetchResult();
+        iRow = mysql_num_rows(pRes);
+
+        MYSQL_ROW row;
+        while((row = mysql_fetch_row(pRes)) != NULL)
+        {
+            SnapRow& snap = mapRow[row[1]? atoll(row[1]): 0];
+            snap.lWatermark = row[0]? atoll(row[0]): 0;
+            snap.strCurType = row[2]? row[2]: "";
+            snap.lBalance = row[3]? atoll(row[3]): 0;
+            snap.lCon = row[4]? atoll(row[4]): 0;
+            snap.strFlowTime = row[5]? row[5]: "";
+
+            if(snap.lWatermark > lWatermark) lWatermark = snap.lWatermark;
+        }
+        mysql_free_result(pRes);
+        pRes = NULL;
+
+        if(iRow > 0)
+        {
+            saveSnapshot(mapRow);
+            saveProgress(lWatermark);
+        }
+
+        m_ptrSql->Commit();
+        return iRow;
+    }
+    catch(CException& e)
+    {
+        if(pRes)
+        {
+            mysql_free_result(pRes);
+        }
+        m_ptrSql->Rollback();
+        throw;
+    }
+}
+
+//查询快照进度
+LONG CCoreSnapshot::queryProgress()
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    LONG lWatermark = 0;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fwatermark FROM isp_os_core.t_snapshot_progress "
+        "WHERE Fname = 'acct' FOR UPDATE");
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    if(row && row[0])
+    {
+        lWatermark = atoll(row[0]);
+    }
+    mysql_free_result(pRes);
+
+    return lWatermark;
+}
+
+//查询水位之后最小的未沉淀Fid，没有则返回0
+LONG CCoreSnapshot::queryUnsettled(const LONG lWatermark)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+    LONG lFid = 0;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT MIN(Fid) FROM isp_os_core.t_flow "
+        "WHERE Fid > %lld AND Fcreate_time >= DATE_SUB(now(), INTERVAL %d SECOND)",
+        lWatermark, m_iSettle);
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    if(row && row[0])
+    {
+        lFid = atoll(row[0]);
+    }
+    mysql_free_result(pRes);
+
+    return lFid;
+}
+
+//保存快照进度
+void CCoreSnapshot::saveProgress(const LONG lWatermark)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT INTO isp_os_core.t_snapshot_progress (Fname,Fwatermark,Fmodify_time) "
+        "VALUES ('acct',%lld,now()) "
+        "ON DUPLICATE KEY UPDATE Fwatermark = VALUES(Fwatermark), Fmodify_time = now()",
+        lWatermark);
+
+    m_ptrSql->Query(szSql, iLen);
+}
+
+//批量写入快照
+void CCoreSnapshot::saveSnapshot(const map<LONG, SnapRow>& mapRow)
+{
+    char szRow[MAX_MSG_LEN] = {0};
+    int iValue = 0;
+    string strSql =
+        "INSERT IGNORE INTO isp_os_core.t_acct_snapshot "
+        "(Fuid,Fcur_type,Fbalance,Fcon,Facct_sign,Fwatermark,Fflow_time,Fcreate_time) VALUES ";
+
+    for(map<LONG, SnapRow>::const_iterator it = mapRow.begin(); it != mapRow.end(); ++it)
+    {
+        //账户签名覆盖余额，需要账户静态信息
+        //单个账户缺失或被篡改只记录下来跳过，不阻塞其他账户的快照进度
+        CCoreAcct acct(it->first);
+        try
+        {
+            if(!acct.queryAcctInfo(false))
+            {
+                throw CException(ERR_DB_NONE_ROW, "snapshot: flow without account", __FILE__, __LINE__);
+            }
+        }
+        catch(CException& e)
+        {
+            if(e.error() != ERR_DB_NONE_ROW && e.error() != ERR_DB_TAMPER) throw;
+
+            saveSkip(it->first, it->second.lWatermark, e.error());
+            continue;
+        }
+        acct.Fbalance = it->second.lBalance;
+        acct.Fcon = it->second.lCon;
+
+        snprintf(szRow, sizeof(szRow), "%s(%lld,'%s',%lld,%lld,'%s',%lld,'%s',now())",
+            iValue++ == 0? "": ",",
+            it->first, it->second.strCurType.c_str(), it->second.lBalance, it->second.lCon,
+            acct.genAcctSign().c_str(), it->second.lWatermark, it->second.strFlowTime.c_str());
+        strSql += szRow;
+    }
+
+    if(iValue > 0)
+    {
+        m_ptrSql->Query(strSql.c_str(), strSql.length());
+    }
+}
+
+//记录未能生成快照的账户
+void CCoreSnapshot::saveSkip(const LONG uid, const LONG lWatermark, const int iError)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+
+    int iLen = snprintf(szSql, sizeof(szSql) - 1,
+        "INSERT IGNORE INTO isp_os_core.t_snapshot_skip (Fuid,Fwatermark,Ferror,Fcreate_time) "
+        "VALUES (%lld,%lld,%d,now())",
+        uid, lWatermark, iError);
+
+    m_ptrSql->Query(szSql, iLen);
+}
+
+//查询账户在指定时间点的余额
+bool CCoreSnapshot::queryAsOf(const LONG uid, const string& strTime)
+{
+    Fuid = uid;
+    Fcur_type = "";
+    Fbalance = 0;
+    Fcon = 0;
+    Facct_sign = "";
+    Fwatermark = 0;
+    Fflow_time = "";
+
+    //没有快照时从开户（余额为0）开始回放
+    bool bSnap = querySnapshot(strTime);
+    bool bFlow = replayFlow(strTime);
+
+    return bSnap || bFlow;
+}
+
+//查询不晚于指定时间点的最近快照
+bool CCoreSnapshot::querySnapshot(const string& strTime)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fcur_type,Fbalance,Fcon,Facct_sign,Fwatermark,Fflow_time "
+        "FROM isp_os_core.t_acct_snapshot "
+        "WHERE Fuid = %lld AND Fflow_time <= '%s' "
+        "ORDER BY Fwatermark DESC LIMIT 1",
+        Fuid, m_ptrSql->EscapeStr(strTime).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+
+    MYSQL_ROW row = mysql_fetch_row(pRes);
+    if(NULL == row)
+    {
+        mysql_free_result(pRes);
+        return false;
+    }
+
+    Fcur_type = row[0]? row[0]: "";
+    Fbalance = row[1]? atoll(row[1]): 0;
+    Fcon = row[2]? atoll(row[2]): 0;
+    Facct_sign = row[3]? row[3]: "";
+    Fwatermark = row[4]? atoll(row[4]): 0;
+    Fflow_time = row[5]? row[5]: "";
+    mysql_free_result(pRes);
+
+    return true;
+}
+
+//回放快照之后的流水
+bool CCoreSnapshot::replayFlow(const string& strTime)
+{
+    char szSql[MAX_SQL_LEN] = {0};
+    MYSQL_RES* pRes = NULL;
+
+    int iLen = snprintf(szSql, sizeof(szSql),
+        "SELECT Fid,Fcur_type,Ftype,Fpaynum,Fconnum,Fbalance,Fcon,Fcreate_time "
+        "FROM isp_os_core.t_flow "
+        "WHERE Fuid = %lld AND Fid > %lld AND Fcreate_time <= '%s' "
+        "ORDER BY Fid",
+        Fuid, Fwatermark, m_ptrSql->EscapeStr(strTime).c_str());
+
+    m_ptrSql->Query(szSql, iLen);
+    pRes = m_ptrSql->FetchResult();
+    int iRow = mysql_num_rows(pRes);
+
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(pRes)) != NULL)
+    {
+        int iType = row[2]? atoi(row[2]): 0;
+        LONG lPaynum = row[3]? atoll(row[3]): 0;
+        LONG lConnum = row[4]? atoll(row[4]): 0;
+
+        if(iType == CCoreFlow::TYPE_in)
+        {
+            Fbalance += lPaynum;
+        }
+        else if(iType == CCoreFlow::TYPE_out)
+        {
+            Fbalance -= lPaynum;
+        }
+        else if(iType == CCoreFlow::TYPE_freeze)
+        {
+            Fcon += lConnum;
+        }
+        else if(iType == CCoreFlow::TYPE_unfreeze)
+        {
+            Fcon -= lConnum;
+        }
+
+        //回放结果必须与流水记录的变动后余额一致
+        if(Fbalance != (row[5]? atoll(row[5]): 0) || Fcon != (row[6]? atoll(row[6]): 0))
+        {
+            mysql_free_result(pRes);
+            throw CException(ERR_DB_TAMPER, "snapshot: flow replay not match", __FILE__, __LINE__);
+        }
+
+        Fwatermark = row[0]? atoll(row[0]): 0;
+        Fcur_type = row[1]? row[1]: "";
+        Fflow_time = row[7]? row[7]: "";
+    }
+    mysql_free_result(pRes);
+
+    //回放过流水后快照签名失效
+    if(iRow > 0) Facct_sign = "";
+
+    return iRow > 0;
+}
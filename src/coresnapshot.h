@@ -0,0 +1,82 @@
+#ifndef _CORE_SNAPSHOT_H_
+#define _CORE_SNAPSHOT_H_
+
+#include <string>
+#include <map>
+#include "exception.h"
+#include "sqlapi.h"
+
+/*
+ * 账户余额快照类
+ * 按t_flow自增主键Fid（水位）增量生成 (Fuid, Fbalance, Fcon, Facct_sign, Fwatermark) 检查点，
+ * 时点余额查询只需加载最近快照并回放其后的流水
+ *
+ * isp_os_core.t_acct_snapshot: 主键(Fuid, Fwatermark)，索引(Fuid, Fflow_time)
+ * isp_os_core.t_snapshot_progress: 主键Fname，记录生成进度
+ * isp_os_core.t_snapshot_skip: 主键(Fuid, Fwatermark)，记录账户缺失或签名不符而未生成快照的账户
+ *
+ * 水位只推进到最小的未沉淀Fid之前；沉淀时间需大于最长事务耗时，否则未提交的小Fid仍可能被跳过
+ */
+class CCoreSnapshot
+{
+public:
+    //构造函数
+    CCoreSnapshot();
+
+    //析构函数
+    ~CCoreSnapshot();
+
+    //增量生成快照，返回本批处理的流水条数，不锁t_account
+    int build(const int iBatch = 10000);
+
+    //查询账户在指定时间点（YYYY-MM-DD HH:MM:SS）的余额
+    bool queryAsOf(const LONG uid, const string& strTime);
+
+    //设置流水沉淀时间，未沉淀的流水可能还有未提交的小Fid，暂不纳入快照
+    void setSettle(const int iSeconds) { m_iSettle = iSeconds; }
+
+public:
+    /*
+     * 对外数据库字段
+     * 方便第一，直接访问
+     */
+    LONG Fuid;
+    string Fcur_type;
+    LONG Fbalance;
+    LONG Fcon;
+    string Facct_sign;
+    LONG Fwatermark;
+    string Fflow_time;
+
+protected:
+    //单个账户在本批中的最后一条流水
+    struct SnapRow
+    {
+        string strCurType;
+        LONG lBalance;
+        LONG lCon;
+        LONG lWatermark;
+        string strFlowTime;
+    };
+
+    //查询快照进度（加锁，串行化生成任务）
+    LONG queryProgress();
+    //查询水位之后最小的未沉淀Fid，没有则返回0
+    LONG queryUnsettled(const LONG lWatermark);
+    //保存快照进度
+    void saveProgress(const LONG lWatermark);
+    //记录未能生成快照的账户
+    void saveSkip(const LONG uid, const LONG lWatermark, const int iError);
+    //批量写入快照
+    void saveSnapshot(const map<LONG, SnapRow>& mapRow);
+    //查询不晚于指定时间点的最近快照
+    bool querySnapshot(const string& strTime);
+    //回放快照之后的流水
+    bool replayFlow(const string& strTime);
+
+protected:
+    CMySQL* m_ptrSql; //数据库句柄
+    int m_iSettle; //流水沉淀时间（秒）
+};
+
+#endif
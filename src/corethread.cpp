@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "corethread.h"
+#include "error.h"
+
+//单个线程的任务
+struct CoreRangeTask
+{
+    CoreRangeFunc fn;
+    void* ptrCtx;
+    size_t iBegin;
+    size_t iEnd;
+    int iError;     //线程内异常的错误码，0为成功
+    string strError;
+};
+
+//线程入口
+static void* runRangeTask(void* ptrArg)
+{
+    CoreRangeTask* ptrTask = (CoreRangeTask*)ptrArg;
+
+    try
+    {
+        ptrTask->fn(ptrTask->ptrCtx, ptrTask->iBegin, ptrTask->iEnd);
+    }
+    catch(CException& e)
+    {
+        ptrTask->iError = e.error();
+        ptrTask->strError = e.what();
+    }
+    catch(std::exception& e)
+    {
+        //异常不能逃出线程入口，否则std::terminate带走整个进程
+        ptrTask->iError = ERR_BAD_BRANCH;
+        ptrTask->strError = string("core thread: ") + e.what();
+    }
+    catch(...)
+    {
+        ptrTask->iError = ERR_BAD_BRANCH;
+        ptrTask->strError = "core thread: unexpected exception";
+    }
+
+    return NULL;
+}
+
+//并行处理[0, n)
+void coreParallelFor(const int iThreads, const size_t n, CoreRangeFunc fn, void* ptrCtx)
+{
+    if(n == 0) return;
+
+    size_t iNum = iThreads > 1? iThreads: 1;
+    if(iNum > n) iNum = n;
+
+    //单线程直接在调用线程里做
+    if(iNum == 1)
+    {
+        fn(ptrCtx, 0, n);
+        return;
+    }
+
+    vector<CoreRangeTask> vecTask(iNum);
+    vector<pthread_t> vecThread(iNum);
+    vector<bool> vecStarted(iNum, false);
+    size_t iStep = (n + iNum - 1) / iNum;
+
+    for(size_t i = 0; i < iNum; ++i)
+    {
+        CoreRangeTask& task = vecTask[i];
+        task.fn = fn;
+        task.ptrCtx = ptrCtx;
+        task.iBegin = i * iStep;
+        task.iEnd = task.iBegin + iStep < n? task.iBegin + iStep: n;
+        task.iError = 0;
+
+        //建线程失败就在本线程补做
+        if(0 != pthread_create(&vecThread[i], NULL, runRangeTask, &task))
+        {
+            runRangeTask(&task);
+            continue;
+        }
+        vecStarted[i] = true;
+    }
+
+    for(size_t i = 0; i < iNum; ++i)
+    {
+        if(vecStarted[i])
+        {
+            pthread_join(vecThread[i], NULL);
+        }
+    }
+
+    for(size_t i = 0; i < iNum; ++i)
+    {
+        if(vecTask[i].iError != 0)
+        {
+            throw CException(vecTask[i].iError, vecTask[i].strError, __FILE__, __LINE__);
+        }
+    }
+}
+
+//在线CPU数
+int coreCpuNum()
+{
+    long lNum = sysconf(_SC_NPROCESSORS_ONLN);
+    return lNum > 0? (int)lNum: 1;
+}
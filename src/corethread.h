@@ -0,0 +1,19 @@
+#ifndef _CORE_THREAD_H_
+#define _CORE_THREAD_H_
+
+#include <stddef.h>
+#include "exception.h"
+
+//区间处理函数，在工作线程中处理[iBegin, iEnd)
+typedef void (*CoreRangeFunc)(void* ptrCtx, size_t iBegin, size_t iEnd);
+
+/*
+ * 并行处理[0, n)
+ * 按线程数切块，每块一个线程；任一线程抛出的异常在全部线程结束后作为CException重新抛出
+ */
+void coreParallelFor(const int iThreads, const size_t n, CoreRangeFunc fn, void* ptrCtx);
+
+//在线CPU数
+int coreCpuNum();
+
+#endif
@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "corewire.h"
+#include "core.h"
+#include "coreerror.h"
+#include "common.h"
+
+using namespace CCoreWire;
+
+//int32字段在凭证中的位置，与INT_FIELD一一对应
+static int CCoreProof::* const s_arrIntField[I_NUM] =
+{
+    &CCoreProof::Fsubject, &CCoreProof::Ftype, &CCoreProof::Frolenum, &CCoreProof::Fsub_seq
+};
+
+//int64字段，与LONG_FIELD一一对应
+static LONG CCoreProof::* const s_arrLongField[L_NUM] =
+{
+    &CCoreProof::Ftotalnum, &CCoreProof::Fdebit_uid, &CCoreProof::Fdebit_amount,
+    &CCoreProof::Fdebit_ex_uid, &CCoreProof::Fdebit_ex_amount,
+    &CCoreProof::Fcredit_uid, &CCoreProof::Fcredit_amount,
+    &CCoreProof::Fcredit_ex_uid, &CCoreProof::Fcredit_ex_amount,
+    &CCoreProof::Fdebit_gl_uid, &CCoreProof::Fdebit_exgl_uid,
+    &CCoreProof::Fcredit_gl_uid, &CCoreProof::Fcredit_exgl_uid, &CCoreProof::Fsub_amount
+};
+
+//字符串字段，与STR_FIELD一一对应
+static string CCoreProof::* const s_arrStrField[S_NUM] =
+{
+    &CCoreProof::Flistid, &CCoreProof::Fcur_type, &CCoreProof::Foutter_prove,
+    &CCoreProof::Fip, &CCoreProof::Fmemo, &CCoreProof::Ftrade_memo,
+    &CCoreProof::Fdebit_uin, &CCoreProof::Fdebit_ex_uin,
+    &CCoreProof::Fcredit_uin, &CCoreProof::Fcredit_ex_uin,
+    &CCoreProof::Fdebit_gl_uin, &CCoreProof::Fdebit_exgl_uin,
+    &CCoreProof::Fcredit_gl_uin, &CCoreProof::Fcredit_exgl_uin
+};
+
+//小端写入
+static void putInt(string& strOut, const unsigned long long lValue, const int iBytes)
+{
+    char szBuf[8];
+    for(int i = 0; i < iBytes; ++i)
+    {
+        szBuf[i] = (char)((lValue >> (8 * i)) & 0xff);
+    }
+    strOut.append(szBuf, iBytes);
+}
+
+//写入长度前缀的字符串
+static void putStr(string& strOut, const string& strValue)
+{
+    if(strValue.length() > 0xffff)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: string too long", __FILE__, __LINE__);
+    }
+    putInt(strOut, strValue.length(), 2);
+    strOut += strValue;
+}
+
+//小端读出
+static unsigned long long getInt(const char* ptrBuf, const int iBytes)
+{
+    unsigned long long lValue = 0;
+    for(int i = iBytes - 1; i >= 0; --i)
+    {
+        lValue = (lValue << 8) | (unsigned char)ptrBuf[i];
+    }
+    return lValue;
+}
+
+/*
+ * 报文读取游标，越界即格式错误
+ */
+class CWireReader
+{
+public:
+    CWireReader(const char* ptrBuf, const size_t iLen, const size_t iPos)
+        : m_ptrBuf(ptrBuf), m_iLen(iLen), m_iPos(iPos) {}
+
+    int i32() { need(4); m_iPos += 4; return (int)getInt(m_ptrBuf + m_iPos - 4, 4); }
+    LONG i64() { need(8); m_iPos += 8; return (LONG)getInt(m_ptrBuf + m_iPos - 8, 8); }
+    unsigned int u16() { need(2); m_iPos += 2; return (unsigned int)getInt(m_ptrBuf + m_iPos - 2, 2); }
+
+    void str(CCoreWireStr& value)
+    {
+        value.len = u16();
+        need(value.len);
+        value.ptr = m_ptrBuf + m_iPos;
+        m_iPos += value.len;
+    }
+
+private:
+    void need(const size_t iBytes)
+    {
+        if(m_iPos + iBytes > m_iLen)
+        {
+            throw CException(ERR_CORE_BAD_WIRE, "core wire: truncated message", __FILE__, __LINE__);
+        }
+    }
+
+private:
+    const char* m_ptrBuf;
+    size_t m_iLen;
+    size_t m_iPos;
+};
+
+//写报文头，报文总长先占位
+static void putHead(string& strOut, const int iKind)
+{
+    putInt(strOut, MAGIC, 2);
+    putInt(strOut, VERSION, 1);
+    putInt(strOut, iKind, 1);
+    putInt(strOut, 0, 4);
+}
+
+//回填报文总长
+static void fixLen(string& strOut, const size_t iStart)
+{
+    size_t iLen = strOut.length() - iStart;
+    if(iLen > MAX_LEN)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: message too long", __FILE__, __LINE__);
+    }
+    for(int i = 0; i < 4; ++i)
+    {
+        strOut[iStart + 4 + i] = (char)((iLen >> (8 * i)) & 0xff);
+    }
+}
+
+/*****************
+ * 凭证请求视图 *
+******************/
+
+// 构造函数
+CCoreWireView::CCoreWireView()
+{
+    m_iVersion = 0;
+    memset(m_arrInt, 0, sizeof(m_arrInt));
+    memset(m_arrLong, 0, sizeof(m_arrLong));
+    memset(m_arrStr, 0, sizeof(m_arrStr));
+}
+
+//解析请求报文
+void CCoreWireView::parse(const char* ptrBuf, const size_t iLen)
+{
+    if(iLen < HEAD_LEN)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: truncated head", __FILE__, __LINE__);
+    }
+
+    size_t iTotal = CCoreWireCodec::parseHead(ptrBuf, KIND_request);
+    if(iTotal > iLen)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: truncated message", __FILE__, __LINE__);
+    }
+    m_iVersion = (unsigned char)ptrBuf[2];
+
+    CWireReader reader(ptrBuf, iTotal, HEAD_LEN);
+    for(int i = 0; i < I_NUM; ++i)
+    {
+        m_arrInt[i] = reader.i32();
+    }
+    for(int i = 0; i < L_NUM; ++i)
+    {
+        m_arrLong[i] = reader.i64();
+    }
+    for(int i = 0; i < S_NUM; ++i)
+    {
+        reader.str(m_arrStr[i]);
+    }
+
+    m_vecLeg.resize(reader.u16());
+    for(size_t i = 0; i < m_vecLeg.size(); ++i)
+    {
+        CCoreWireLeg& leg = m_vecLeg[i];
+        leg.Fseq = reader.i32();
+        leg.Fdirection = reader.i32();
+        leg.Fuid = reader.i64();
+        leg.Fgl_uid = reader.i64();
+        leg.Famount = reader.i64();
+        reader.str(leg.Fuin);
+        reader.str(leg.Fgl_uin);
+    }
+}
+
+//报文中的标识是否合法，bOptional为true时允许为空
+static bool wireIdent(const CCoreWireStr& value, const bool bOptional, const size_t iMaxLen = CCoreProof::MAX_ID_LEN,
+    const bool bAlnumOnly = false)
+{
+    if(0 == value.len) return bOptional;
+    return CCoreProof::isIdent(value.ptr, value.len, iMaxLen, bAlnumOnly);
+}
+
+//校验报文中的字符串字段，任何字段进入凭证前拒绝非法字符和超长
+static void checkView(const CCoreWireView& view)
+{
+    bool bOk = wireIdent(view.getStr(S_listid), false)
+        && wireIdent(view.getStr(S_cur_type), false, CCoreProof::MAX_CUR_LEN, true)
+        && view.getStr(S_memo).len <= CCoreProof::MAX_MEMO_LEN
+        && view.getStr(S_trade_memo).len <= CCoreProof::MAX_MEMO_LEN;
+
+    const int arrOptional[] =
+    {
+        S_outter_prove, S_ip, S_debit_uin, S_debit_ex_uin, S_credit_uin, S_credit_ex_uin,
+        S_debit_gl_uin, S_debit_exgl_uin, S_credit_gl_uin, S_credit_exgl_uin
+    };
+    for(size_t i = 0; bOk && i < sizeof(arrOptional) / sizeof(arrOptional[0]); ++i)
+    {
+        bOk = wireIdent(view.getStr(arrOptional[i]), true);
+    }
+
+    const vector<CCoreWireLeg>& vecLeg = view.getLegs();
+    for(size_t i = 0; bOk && i < vecLeg.size(); ++i)
+    {
+        bOk = wireIdent(vecLeg[i].Fuin, true) && wireIdent(vecLeg[i].Fgl_uin, true);
+    }
+
+    if(!bOk)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: illegal listid, cur_type, uin or memo", __FILE__, __LINE__);
+    }
+}
+
+//用请求视图填充凭证，报文来自网络，先校验再填
+void fillProof(const CCoreWireView& view, CCoreProof& proof)
+{
+    checkView(view);
+
+    for(int i = 0; i < I_NUM; ++i)
+    {
+        proof.*s_arrIntField[i] = view.getInt(i);
+    }
+    for(int i = 0; i < L_NUM; ++i)
+    {
+        proof.*s_arrLongField[i] = view.getLong(i);
+    }
+    for(int i = 0; i < S_NUM; ++i)
+    {
+        const CCoreWireStr& value = view.getStr(i);
+        (proof.*s_arrStrField[i]).assign(value.ptr, value.len);
+    }
+
+    const vector<CCoreWireLeg>& vecLeg = view.getLegs();
+    proof.Flegs.resize(vecLeg.size());
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        CCoreProofLeg& leg = proof.Flegs[i];
+        leg.Fseq = vecLeg[i].Fseq;
+        leg.Fdirection = vecLeg[i].Fdirection;
+        leg.Fuid = vecLeg[i].Fuid;
+        leg.Fuin.assign(vecLeg[i].Fuin.ptr, vecLeg[i].Fuin.len);
+        leg.Fgl_uid = vecLeg[i].Fgl_uid;
+        leg.Fgl_uin.assign(vecLeg[i].Fgl_uin.ptr, vecLeg[i].Fgl_uin.len);
+        leg.Famount = vecLeg[i].Famount;
+    }
+
+    proof.Fstate = CCoreProof::STATE_before;
+    proof.Frecord_state = 1;
+    proof.Fcreate_time = getSysTime();
+    proof.Fmodify_time = proof.Fcreate_time;
+    proof.Fproof_sign = "";
+    proof.Fcon_remain = 0;
+}
+
+/*****************
+ * 编解码 *
+******************/
+
+//把凭证编码为请求报文
+void CCoreWireCodec::encodeProof(const CCoreProof& proof, string& strOut)
+{
+    int arrInt[I_NUM];
+    LONG arrLong[L_NUM];
+    string arrStr[S_NUM];
+
+    for(int i = 0; i < I_NUM; ++i)
+    {
+        arrInt[i] = proof.*s_arrIntField[i];
+    }
+    for(int i = 0; i < L_NUM; ++i)
+    {
+        arrLong[i] = proof.*s_arrLongField[i];
+    }
+    for(int i = 0; i < S_NUM; ++i)
+    {
+        arrStr[i] = proof.*s_arrStrField[i];
+    }
+
+    encodeRequest(arrInt, arrLong, arrStr, proof.Flegs, strOut);
+}
+
+//按字段数组编码请求报文
+void CCoreWireCodec::encodeRequest(const int* arrInt, const LONG* arrLong, const string* arrStr,
+    const vector<CCoreProofLeg>& vecLeg, string& strOut)
+{
+    size_t iStart = strOut.length();
+    putHead(strOut, KIND_request);
+
+    for(int i = 0; i < I_NUM; ++i)
+    {
+        putInt(strOut, (unsigned int)arrInt[i], 4);
+    }
+    for(int i = 0; i < L_NUM; ++i)
+    {
+        putInt(strOut, (unsigned long long)arrLong[i], 8);
+    }
+    for(int i = 0; i < S_NUM; ++i)
+    {
+        putStr(strOut, arrStr[i]);
+    }
+
+    if(vecLeg.size() > 0xffff)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: too many legs", __FILE__, __LINE__);
+    }
+    putInt(strOut, vecLeg.size(), 2);
+    for(size_t i = 0; i < vecLeg.size(); ++i)
+    {
+        const CCoreProofLeg& leg = vecLeg[i];
+        putInt(strOut, (unsigned int)leg.Fseq, 4);
+        putInt(strOut, (unsigned int)leg.Fdirection, 4);
+        putInt(strOut, (unsigned long long)leg.Fuid, 8);
+        putInt(strOut, (unsigned long long)leg.Fgl_uid, 8);
+        putInt(strOut, (unsigned long long)leg.Famount, 8);
+        putStr(strOut, leg.Fuin);
+        putStr(strOut, leg.Fgl_uin);
+    }
+
+    fixLen(strOut, iStart);
+}
+
+//编码应答报文
+void CCoreWireCodec::encodeResult(const int iError, const string& strMsg, string& strOut)
+{
+    size_t iStart = strOut.length();
+    putHead(strOut, KIND_response);
+    putInt(strOut, (unsigned int)iError, 4);
+    putStr(strOut, strMsg.length() > 0xffff? strMsg.substr(0, 0xffff): strMsg);
+    fixLen(strOut, iStart);
+}
+
+//解析应答报文
+void CCoreWireCodec::parseResult(const char* ptrBuf, const size_t iLen, int& iError, string& strMsg)
+{
+    if(iLen < HEAD_LEN)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: truncated head", __FILE__, __LINE__);
+    }
+
+    size_t iTotal = parseHead(ptrBuf, KIND_response);
+    if(iTotal > iLen)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: truncated message", __FILE__, __LINE__);
+    }
+
+    CWireReader reader(ptrBuf, iTotal, HEAD_LEN);
+    CCoreWireStr msg;
+    iError = reader.i32();
+    reader.str(msg);
+    strMsg.assign(msg.ptr, msg.len);
+}
+
+//读报文头
+size_t CCoreWireCodec::parseHead(const char* ptrBuf, const int iKind)
+{
+    if(getInt(ptrBuf, 2) != MAGIC)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: bad magic", __FILE__, __LINE__);
+    }
+    //高版本只在末尾追加，低版本解析器读它认识的部分
+    if((unsigned char)ptrBuf[2] < VERSION || (unsigned char)ptrBuf[3] != iKind)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: bad version or kind", __FILE__, __LINE__);
+    }
+
+    size_t iTotal = getInt(ptrBuf + 4, 4);
+    if(iTotal < HEAD_LEN || iTotal > MAX_LEN)
+    {
+        throw CException(ERR_CORE_BAD_WIRE, "core wire: bad length", __FILE__, __LINE__);
+    }
+    return iTotal;
+}
+
+/*****************
+ * 本地套接字客户端 *
+******************/
+
+// 构造函数
+CCoreWireClient::CCoreWireClient()
+{
+    m_iFd = -1;
+}
+
+//析构函数
+CCoreWireClient::~CCoreWireClient()
+{
+    close();
+}
+
+//连接记账服务
+void CCoreWireClient::open(const string& strAddr)
+{
+    close();
+    m_iFd = openAddr(strAddr, false);
+}
+
+//按地址建socket
+int CCoreWireClient::openAddr(const string& strAddr, const bool bListen)
+{
+    struct sockaddr_un unAddr;
+    struct sockaddr_in inAddr;
+    struct sockaddr* ptrAddr = NULL;
+    socklen_t iAddrLen = 0;
+    int iFamily = AF_UNIX;
+
+    if(!strAddr.empty() && strAddr[0] == '/')
+    {
+        memset(&unAddr, 0, sizeof(unAddr));
+        unAddr.sun_family = AF_UNIX;
+        if(strAddr.length() >= sizeof(unAddr.sun_path))
+        {
+            throw CException(ERR_CORE_IO, "core wire: socket path too long", __FILE__, __LINE__);
+        }
+        strncpy(unAddr.sun_path, strAddr.c_str(), sizeof(unAddr.sun_path) - 1);
+        ptrAddr = (struct sockaddr*)&unAddr;
+        iAddrLen = sizeof(unAddr);
+    }
+    else
+    {
+        size_t iPos = strAddr.rfind(':');
+        memset(&inAddr, 0, sizeof(inAddr));
+        inAddr.sin_family = AF_INET;
+        if(iPos == string::npos || inet_pton(AF_INET, strAddr.substr(0, iPos).c_str(), &inAddr.sin_addr) != 1)
+        {
+            throw CException(ERR_CORE_IO, "core wire: bad address " + strAddr, __FILE__, __LINE__);
+        }
+        inAddr.sin_port = htons(atoi(strAddr.c_str() + iPos + 1));
+        ptrAddr = (struct sockaddr*)&inAddr;
+        iAddrLen = sizeof(inAddr);
+        iFamily = AF_INET;
+    }
+
+    int iFd = socket(iFamily, SOCK_STREAM, 0);
+    int iRet = -1;
+    if(iFd >= 0 && bListen)
+    {
+        //重启时复用地址，Unix域套接字删掉残留的文件
+        int iOn = 1;
+        setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+        if(iFamily == AF_UNIX) unlink(strAddr.c_str());
+        iRet = bind(iFd, ptrAddr, iAddrLen);
+        if(0 == iRet) iRet = listen(iFd, 1024);
+    }
+    else if(iFd >= 0)
+    {
+        iRet = connect(iFd, ptrAddr, iAddrLen);
+        if(0 == iRet && iFamily == AF_INET)
+        {
+            int iOn = 1;
+            setsockopt(iFd, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn));
+        }
+    }
+
+    if(iRet != 0)
+    {
+        string strErr = strerror(errno);
+        if(iFd >= 0) ::close(iFd);
+        throw CException(ERR_CORE_IO, "core wire: open " + strAddr + " failed: " + strErr, __FILE__, __LINE__);
+    }
+    return iFd;
+}
+
+//关闭连接
+void CCoreWireClient::close()
+{
+    if(m_iFd >= 0)
+    {
+        ::close(m_iFd);
+        m_iFd = -1;
+    }
+}
+
+//发送一个请求报文并等待应答
+void CCoreWireClient::call(const string& strReq, int& iError, string& strMsg)
+{
+    if(m_iFd < 0)
+    {
+        throw CException(ERR_CORE_IO, "core wire: not connected", __FILE__, __LINE__);
+    }
+
+    string strResp;
+    try
+    {
+        writeAll(m_iFd, strReq.data(), strReq.length());
+        if(!readFrame(m_iFd, KIND_response, strResp))
+        {
+            throw CException(ERR_CORE_IO, "core wire: closed by peer", __FILE__, __LINE__);
+        }
+    }
+    catch(CException& e)
+    {
+        //读写到一半的连接不能再用
+        close();
+        throw;
+    }
+
+    CCoreWireCodec::parseResult(strResp.data(), strResp.length(), iError, strMsg);
+}
+
+//发送整块数据
+void CCoreWireClient::writeAll(const int iFd, const char* ptrBuf, const size_t iLen)
+{
+    size_t iDone = 0;
+    while(iDone < iLen)
+    {
+        ssize_t iRet = send(iFd, ptrBuf + iDone, iLen - iDone, MSG_NOSIGNAL);
+        if(iRet < 0 && errno == EINTR) continue;
+        if(iRet <= 0)
+        {
+            throw CException(ERR_CORE_IO, string("core wire: write failed: ") + strerror(errno), __FILE__, __LINE__);
+        }
+        iDone += iRet;
+    }
+}
+
+//读一个完整报文
+bool CCoreWireClient::readFrame(const int iFd, const int iKind, string& strFrame)
+{
+    strFrame.resize(HEAD_LEN);
+    size_t iNeed = HEAD_LEN;
+    size_t iDone = 0;
+
+    while(iDone < iNeed)
+    {
+        ssize_t iRet = read(iFd, &strFrame[iDone], iNeed - iDone);
+        if(iRet < 0 && errno == EINTR) continue;
+        if(iRet == 0 && iDone == 0) return false;
+        if(iRet <= 0)
+        {
+            throw CException(ERR_CORE_IO, "core wire: read failed or truncated", __FILE__, __LINE__);
+        }
+        iDone += iRet;
+
+        //报文头读全后得知总长
+        if(iDone == HEAD_LEN && iNeed == HEAD_LEN)
+        {
+            iNeed = CCoreWireCodec::parseHead(strFrame.data(), iKind);
+            strFrame.resize(iNeed);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,187 @@
+#ifndef _CORE_WIRE_H_
+#define _CORE_WIRE_H_
+
+#include <string>
+#include <vector>
+#include "exception.h"
+#include "sqlapi.h"
+
+class CCoreProof;
+struct CCoreProofLeg;
+
+/*
+ * 凭证二进制格式（第1版），整数一律小端
+ * 报文头8字节：uint16 魔数 'C''W'，uint8 版本，uint8 报文类型，uint32 报文总长（含报文头）
+ * 请求体：定长数值区（4个int32 + 14个int64，偏移固定），
+ *         14个字符串（uint16长度 + 字节，不带结尾0），
+ *         uint16分录数，每条分录 int32 Fseq, Fdirection, int64 Fuid, Fgl_uid, Famount, 字符串 Fuin, Fgl_uin
+ * 应答体：int32 错误码，字符串 错误信息
+ * 新版本只在末尾追加字段，解析时忽略多出的字节
+ */
+namespace CCoreWire
+{
+    enum
+    {
+        MAGIC = 0x5743,     //'C''W'
+        VERSION = 1,
+        HEAD_LEN = 8,
+        MAX_LEN = 1 << 20   //单个报文上限
+    };
+
+    //报文类型
+    enum KIND
+    {
+        KIND_request = 1,
+        KIND_response = 2
+    };
+
+    //int32字段
+    enum INT_FIELD
+    {
+        I_subject, I_type, I_rolenum, I_sub_seq,
+        I_NUM
+    };
+
+    //int64字段
+    enum LONG_FIELD
+    {
+        L_totalnum, L_debit_uid, L_debit_amount, L_debit_ex_uid, L_debit_ex_amount,
+        L_credit_uid, L_credit_amount, L_credit_ex_uid, L_credit_ex_amount,
+        L_debit_gl_uid, L_debit_exgl_uid, L_credit_gl_uid, L_credit_exgl_uid, L_sub_amount,
+        L_NUM
+    };
+
+    //字符串字段
+    enum STR_FIELD
+    {
+        S_listid, S_cur_type, S_outter_prove, S_ip, S_memo, S_trade_memo,
+        S_debit_uin, S_debit_ex_uin, S_credit_uin, S_credit_ex_uin,
+        S_debit_gl_uin, S_debit_exgl_uin, S_credit_gl_uin, S_credit_exgl_uin,
+        S_NUM
+    };
+}
+
+/*
+ * 报文中的一段字节，指向接收缓冲区，不拷贝
+ */
+struct CCoreWireStr
+{
+    const char* ptr;
+    unsigned int len;
+
+    string str() const { return string(ptr, len); }
+};
+
+/*
+ * 分录视图
+ */
+struct CCoreWireLeg
+{
+    int Fseq;
+    int Fdirection;
+    LONG Fuid;
+    LONG Fgl_uid;
+    LONG Famount;
+    CCoreWireStr Fuin;
+    CCoreWireStr Fgl_uin;
+};
+
+/*
+ * 凭证请求视图
+ * 解析时只校验长度并记下各字段位置，字符串指向原缓冲区，缓冲区须比视图活得长；
+ * 可直接交给CCore::callCore，由fillProof一次填入凭证
+ */
+class CCoreWireView
+{
+public:
+    //构造函数
+    CCoreWireView();
+
+    //解析请求报文，格式不对抛ERR_CORE_BAD_WIRE
+    void parse(const char* ptrBuf, const size_t iLen);
+
+    //字段
+    int getInt(const int iField) const { return m_arrInt[iField]; }
+    LONG getLong(const int iField) const { return m_arrLong[iField]; }
+    const CCoreWireStr& getStr(const int iField) const { return m_arrStr[iField]; }
+    const vector<CCoreWireLeg>& getLegs() const { return m_vecLeg; }
+    int version() const { return m_iVersion; }
+
+protected:
+    int m_iVersion;
+    int m_arrInt[CCoreWire::I_NUM];
+    LONG m_arrLong[CCoreWire::L_NUM];
+    CCoreWireStr m_arrStr[CCoreWire::S_NUM];
+    vector<CCoreWireLeg> m_vecLeg;
+};
+
+//用请求视图填充凭证，callCore按参数类型选用
+void fillProof(const CCoreWireView& view, CCoreProof& proof);
+
+/*
+ * 编解码
+ */
+class CCoreWireCodec
+{
+public:
+    //把凭证编码为请求报文，追加到strOut
+    static void encodeProof(const CCoreProof& proof, string& strOut);
+
+    //按字段数组编码请求报文，数组按INT_FIELD/LONG_FIELD/STR_FIELD排列，不依赖CCoreProof
+    static void encodeRequest(const int* arrInt, const LONG* arrLong, const string* arrStr,
+        const vector<CCoreProofLeg>& vecLeg, string& strOut);
+
+    //编码应答报文
+    static void encodeResult(const int iError, const string& strMsg, string& strOut);
+
+    //解析应答报文
+    static void parseResult(const char* ptrBuf, const size_t iLen, int& iError, string& strMsg);
+
+    //读报文头，返回报文总长，格式不对抛ERR_CORE_BAD_WIRE
+    static size_t parseHead(const char* ptrBuf, const int iKind);
+};
+
+/*
+ * 记账服务客户端
+ * 前端进程用它把编码好的凭证交给记账守护进程，同一连接上的应答按请求顺序返回
+ * 地址以/开头为Unix域套接字路径，否则为ip:port
+ */
+class CCoreWireClient
+{
+public:
+    //构造函数
+    CCoreWireClient();
+
+    //析构函数
+    ~CCoreWireClient();
+
+    //连接记账服务
+    void open(const string& strAddr);
+
+    //关闭连接
+    void close();
+
+    //发送一个请求报文并等待应答
+    void call(const string& strReq, int& iError, string& strMsg);
+
+    //连接句柄，流水线发送时直接读写
+    int fd() const { return m_iFd; }
+
+    //按地址建socket，bListen为true时绑定监听，否则连接
+    static int openAddr(const string& strAddr, const bool bListen);
+
+    //发送整块数据
+    static void writeAll(const int iFd, const char* ptrBuf, const size_t iLen);
+
+    //读一个完整报文，对端关闭返回false
+    static bool readFrame(const int iFd, const int iKind, string& strFrame);
+
+private:
+    CCoreWireClient(const CCoreWireClient&);
+    CCoreWireClient& operator=(const CCoreWireClient&);
+
+private:
+    int m_iFd;
+};
+
+#endif